@@ -17,96 +17,1436 @@
 
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/llist.h>
 #include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/prandom.h>
 #include <linux/proc_fs.h>
+#include <linux/sched/clock.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
 
 #include "page_alloc_bench.h"
 
 #define NAME "page_alloc_bench"
 
 /*
- * So we don't leak pages if userspace crashes, store them on a list. They're
- * per-CPU since that at least eliminates contention except when freeing remote
- * pages.
+ * Pages (and slab objects) allocated on behalf of userspace are tracked in
+ * per-CPU slot tables, so we don't leak them if userspace crashes and so that
+ * userspace can refer to them by ID. The ID encodes the CPU whose table the
+ * slot is in, and the slot index. The bookkeeping doesn't touch the page or
+ * take any locks:
+ *
+ * - The owning CPU allocates slots from its local free list, with preemption
+ *   disabled.
+ * - Other CPUs return slots to a lock-free llist, which the owner takes over
+ *   when its local list runs dry.
+ * - Slots are allocated in chunks, which are only freed at unload, so lookups
+ *   from any CPU are safe.
  */
-struct alloced_pages {
-	spinlock_t lock;
-	struct list_head pages;
+#define PAB_SLOT_CHUNK_SHIFT	14
+#define PAB_SLOT_CHUNK_SIZE	(1 << PAB_SLOT_CHUNK_SHIFT)
+#define PAB_SLOT_MAX_CHUNKS	1024
+#define PAB_ID_CPU_SHIFT	32
+
+struct pab_slot {
+	void *ptr; /* struct page or slab object, NULL if the slot is free. */
+	struct llist_node free_node;
+	u32 index;
+	u8 order; /* Size class for slab objects. */
+	u8 api; /* enum pab_alloc_api or enum pab_slab_api. */
+	bool slab;
 };
-static DEFINE_PER_CPU(struct alloced_pages, alloced_pages);
 
-/* Info about a page we allocated, stored at the beginning of that page*/
-struct alloced_page {
-	struct list_head node;
-	struct alloced_pages *aps;
-	int order;
+struct pab_slot_table {
+	struct llist_node *local_free; /* Only touched by the owner CPU. */
+	int nr_chunks; /* Written by the owner, read by anyone. */
+	struct pab_slot *chunks[PAB_SLOT_MAX_CHUNKS];
+	struct llist_head remote_free ____cacheline_aligned;
 };
+static struct pab_slot_table **pab_slot_tables; /* Indexed by CPU. */
 
-static void alloced_pages_init(void)
+static int pab_slot_tables_init(void)
 {
 	int cpu;
 
+	pab_slot_tables = kcalloc(nr_cpu_ids, sizeof(*pab_slot_tables), GFP_KERNEL);
+	if (!pab_slot_tables)
+		return -ENOMEM;
 	for_each_possible_cpu(cpu) {
-		struct alloced_pages *aps = per_cpu_ptr(&alloced_pages, cpu);
+		pab_slot_tables[cpu] = kvzalloc_node(sizeof(struct pab_slot_table),
+						     GFP_KERNEL, cpu_to_node(cpu));
+		if (!pab_slot_tables[cpu])
+			return -ENOMEM;
+		init_llist_head(&pab_slot_tables[cpu]->remote_free);
+	}
+	return 0;
+}
+
+/*
+ * Add a chunk of free slots to the current CPU's table. Called with preemption
+ * enabled, returns with it disabled (unless it fails) and the CPU in @cpu.
+ */
+static int pab_slot_table_grow(int *cpu)
+{
+	struct pab_slot_table *table;
+	struct pab_slot *chunk;
+	int i;
+
+	chunk = kvmalloc_node(PAB_SLOT_CHUNK_SIZE * sizeof(*chunk), GFP_KERNEL,
+			      cpu_to_node(raw_smp_processor_id()));
+	if (!chunk)
+		return -ENOMEM;
+
+	/* We might have moved CPU, that's fine, the chunk goes where we are now. */
+	*cpu = get_cpu();
+	table = pab_slot_tables[*cpu];
+	if (table->nr_chunks == PAB_SLOT_MAX_CHUNKS) {
+		put_cpu();
+		kvfree(chunk);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < PAB_SLOT_CHUNK_SIZE; i++) {
+		chunk[i].ptr = NULL;
+		chunk[i].index = (table->nr_chunks << PAB_SLOT_CHUNK_SHIFT) | i;
+		chunk[i].free_node.next = table->local_free;
+		table->local_free = &chunk[i].free_node;
+	}
+	table->chunks[table->nr_chunks] = chunk;
+	/* Publish the chunk to pab_slot_lookup(). */
+	smp_store_release(&table->nr_chunks, table->nr_chunks + 1);
+	return 0;
+}
+
+/* Take a free slot and store @ptr in it. Returns the ID or 0 on failure. */
+static unsigned long pab_slot_store(void *ptr, bool slab, int order, int api)
+{
+	struct pab_slot_table *table;
+	struct llist_node *node;
+	struct pab_slot *slot;
+	int cpu = get_cpu();
+
+	table = pab_slot_tables[cpu];
+	if (!table->local_free)
+		table->local_free = llist_del_all(&table->remote_free);
+	if (!table->local_free) {
+		put_cpu();
+		if (pab_slot_table_grow(&cpu))
+			return 0;
+		table = pab_slot_tables[cpu];
+	}
+
+	node = table->local_free;
+	table->local_free = node->next;
+	put_cpu();
+
+	slot = llist_entry(node, struct pab_slot, free_node);
+	slot->order = order;
+	slot->api = api;
+	slot->slab = slab;
+	WRITE_ONCE(slot->ptr, ptr);
+	return ((unsigned long)cpu << PAB_ID_CPU_SHIFT) | (slot->index + 1);
+}
 
-		spin_lock_init(&aps->lock);
-		INIT_LIST_HEAD(&aps->pages);
+static struct pab_slot *pab_slot_lookup(unsigned long id, int *cpu)
+{
+	struct pab_slot_table *table;
+	unsigned long index;
+
+	*cpu = id >> PAB_ID_CPU_SHIFT;
+	index = (id & ((1UL << PAB_ID_CPU_SHIFT) - 1)) - 1;
+	/* Only possible CPUs have tables, the mask can have holes. */
+	if (*cpu >= nr_cpu_ids || !cpu_possible(*cpu) ||
+	    index >= (PAB_SLOT_MAX_CHUNKS << PAB_SLOT_CHUNK_SHIFT))
+		return NULL;
+
+	table = pab_slot_tables[*cpu];
+	if ((index >> PAB_SLOT_CHUNK_SHIFT) >= smp_load_acquire(&table->nr_chunks))
+		return NULL;
+	return &table->chunks[index >> PAB_SLOT_CHUNK_SHIFT][index & (PAB_SLOT_CHUNK_SIZE - 1)];
+}
+
+/*
+ * Take the pointer out of the slot for @id and free the slot. Returns NULL if
+ * the ID is invalid, already freed or refers to the wrong kind of allocation.
+ */
+static void *pab_slot_remove(unsigned long id, bool slab, int *order, int *api)
+{
+	struct pab_slot *slot;
+	void *ptr;
+	int cpu;
+
+	slot = pab_slot_lookup(id, &cpu);
+	if (!slot)
+		return NULL;
+	/* Atomically claim the pointer, in case of racing double-frees. */
+	ptr = xchg(&slot->ptr, NULL);
+	if (!ptr)
+		return NULL;
+	if (slot->slab != slab) {
+		/* Nobody else can have claimed it meanwhile, put it back. */
+		WRITE_ONCE(slot->ptr, ptr);
+		return NULL;
+	}
+	*order = slot->order;
+	*api = slot->api;
+
+	if (get_cpu() == cpu) {
+		struct pab_slot_table *table = pab_slot_tables[cpu];
+
+		slot->free_node.next = table->local_free;
+		table->local_free = &slot->free_node;
+	} else {
+		llist_add(&slot->free_node, &pab_slot_tables[cpu]->remote_free);
 	}
+	put_cpu();
+	return ptr;
 }
 
-static struct alloced_page *alloced_page_get(struct page *page)
+/*
+ * Latency histograms. These are too big for the static per-CPU area so they're
+ * allocated separately, on the CPU's node. Each CPU only writes its own, with
+ * preemption disabled.
+ */
+struct pab_cpu_hists {
+	struct pab_hist hists[PAB_HIST_NR_KINDS][PAB_HIST_NR_ORDERS];
+} ____cacheline_aligned;
+static struct pab_cpu_hists **pab_hists; /* Indexed by CPU. */
+
+static int pab_hists_init(void)
 {
-	return (struct alloced_page *)page_to_virt(page);
+	int cpu;
+
+	pab_hists = kcalloc(nr_cpu_ids, sizeof(*pab_hists), GFP_KERNEL);
+	if (!pab_hists)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		pab_hists[cpu] = kvzalloc_node(sizeof(struct pab_cpu_hists),
+					       GFP_KERNEL, cpu_to_node(cpu));
+		if (!pab_hists[cpu])
+			return -ENOMEM;
+	}
+	return 0;
 }
 
+static void pab_hists_free(void)
+{
+	int cpu;
+
+	if (!pab_hists)
+		return;
+	for_each_possible_cpu(cpu)
+		kvfree(pab_hists[cpu]);
+	kfree(pab_hists);
+}
 
-static void alloced_page_store(struct page *page, int order)
+static int pab_hist_bucket(u64 ns)
 {
-	struct alloced_pages *aps;
-	struct alloced_page *ap = alloced_page_get(page);
+	int shift;
 
-	ap->order = order;
+	if (ns < (1 << PAB_HIST_SUB_BITS))
+		return ns;
+	if (ns >= (1ULL << PAB_HIST_MAX_SHIFT))
+		return PAB_HIST_NR_BUCKETS - 1;
+	shift = ilog2(ns) - PAB_HIST_SUB_BITS;
+	return ((shift + 1) << PAB_HIST_SUB_BITS) +
+		((ns >> shift) & ((1 << PAB_HIST_SUB_BITS) - 1));
+}
 
-	get_cpu();
+static void pab_hist_record(enum pab_hist_kind kind, unsigned int order, u64 ns)
+{
+	struct pab_hist *hist;
 
-	aps = this_cpu_ptr(&alloced_pages);
-	spin_lock(&aps->lock);
-	list_add(&ap->node, &aps->pages);
-	ap->aps = aps;
-	spin_unlock(&aps->lock);
+	if (order >= PAB_HIST_NR_ORDERS)
+		return;
 
+	hist = &pab_hists[get_cpu()]->hists[kind][order];
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[pab_hist_bucket(ns)]++;
 	put_cpu();
 }
 
-static void alloced_page_remove(struct alloced_page *ap)
+/* Add @src into @dst, where @src might be being updated concurrently. */
+static void pab_hist_add(struct pab_hist *dst, struct pab_hist *src)
+{
+	int i;
+
+	dst->count += READ_ONCE(src->count);
+	dst->sum_ns += READ_ONCE(src->sum_ns);
+	dst->max_ns = max(dst->max_ns, READ_ONCE(src->max_ns));
+	for (i = 0; i < PAB_HIST_NR_BUCKETS; i++)
+		dst->buckets[i] += READ_ONCE(src->buckets[i]);
+}
+
+static void pab_hists_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(pab_hists[cpu], 0, sizeof(*pab_hists[cpu]));
+}
+
+static long pab_ioctl_hist_read(struct pab_ioctl_hist_read __user *uioctl)
+{
+	struct pab_ioctl_hist_read ioctl;
+	struct pab_hist *hist;
+	long ret = 0;
+	int cpu;
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (ioctl.args.kind < 0 || ioctl.args.kind >= PAB_HIST_NR_KINDS ||
+	    ioctl.args.order < 0 || ioctl.args.order >= PAB_HIST_NR_ORDERS ||
+	    ioctl.args.cpu < -1 || ioctl.args.cpu >= (int)nr_cpu_ids)
+		return -EINVAL;
+
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct pab_hist *src;
+
+		if (ioctl.args.cpu != -1 && ioctl.args.cpu != cpu)
+			continue;
+		src = &pab_hists[cpu]->hists[ioctl.args.kind][ioctl.args.order];
+		pab_hist_add(hist, src);
+		if (ioctl.args.reset)
+			memset(src, 0, sizeof(*src));
+	}
+
+	if (copy_to_user(ioctl.args.hist, hist, sizeof(*hist)))
+		ret = -EFAULT;
+	kfree(hist);
+	return ret;
+}
+
+static int pab_alloc_args_check(const struct pab_alloc_args *args)
+{
+	/*
+	 * Orders past the histograms are past the buddy allocator's maximum
+	 * too (on default configs), where alloc_pages() would WARN.
+	 */
+	if (args->order < 0 || args->order >= PAB_HIST_NR_ORDERS ||
+	    args->gfp < 0 || args->gfp >= PAB_GFP_NR_PRESETS ||
+	    (args->gfp_flags & ~PAB_GFP_ALL_FLAGS) ||
+	    args->api < 0 || args->api >= PAB_API_NR ||
+	    args->touch < 0 || args->touch >= PAB_TOUCH_NR)
+		return -EINVAL;
+	if (args->api == PAB_API_ALLOC_PAGES_NODE && args->nid != NUMA_NO_NODE &&
+	    (args->nid < 0 || args->nid >= nr_node_ids || !node_online(args->nid)))
+		return -EINVAL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+	if (args->api == PAB_API_FOLIO_ALLOC)
+		return -EOPNOTSUPP;
+#endif
+	return 0;
+}
+
+static gfp_t pab_gfp_preset(int preset, unsigned int flags)
+{
+	gfp_t gfp;
+
+	switch (preset) {
+	case PAB_GFP_ATOMIC:
+		gfp = GFP_ATOMIC;
+		break;
+	case PAB_GFP_HIGHUSER_MOVABLE:
+		gfp = GFP_HIGHUSER_MOVABLE;
+		break;
+	default:
+		gfp = GFP_KERNEL;
+		break;
+	}
+	if (flags & PAB_GFP_THISNODE)
+		gfp |= __GFP_THISNODE;
+	if (flags & PAB_GFP_NORETRY)
+		gfp |= __GFP_NORETRY;
+	if (flags & PAB_GFP_NOWARN)
+		gfp |= __GFP_NOWARN;
+	if (flags & PAB_GFP_RETRY_MAYFAIL)
+		gfp |= __GFP_RETRY_MAYFAIL;
+	return gfp;
+}
+
+static gfp_t pab_gfp(const struct pab_alloc_args *args)
+{
+	gfp_t gfp = pab_gfp_preset(args->gfp, args->gfp_flags);
+
+	if (args->touch == PAB_TOUCH_ZERO)
+		gfp |= __GFP_ZERO;
+	return gfp;
+}
+
+/*
+ * The clock used for timing, an enum pab_clock. Each timed operation reads this
+ * once, so changing it while a measurement is in flight is harmless.
+ */
+static int pab_clock = PAB_CLOCK_KTIME;
+/* Calibrated by pab_clock_calibrate() at load. */
+static long pab_clock_overhead_ns[PAB_CLOCK_NR];
+static u64 pab_cycles_per_ms;
+
+static __always_inline u64 pab_clock_read(int clock)
+{
+	switch (clock) {
+	case PAB_CLOCK_LOCAL:
+		return local_clock();
+	case PAB_CLOCK_CYCLES:
+#ifdef CONFIG_X86
+		/* Serialized, so it isn't reordered around the operation. */
+		return rdtsc_ordered();
+#else
+		barrier();
+		return get_cycles();
+#endif
+	default:
+		return ktime_get_ns();
+	}
+}
+
+/* Convert a difference between two pab_clock_read() values to ns. */
+static __always_inline long pab_clock_ns(int clock, u64 delta)
+{
+	if (clock == PAB_CLOCK_CYCLES)
+		return div64_u64(delta * NSEC_PER_MSEC, pab_cycles_per_ms);
+	return delta;
+}
+
+/*
+ * Bracket a timed operation. local_clock() and the cycle counter can only be
+ * compared on one CPU, and the operations can sleep, so the task is kept on
+ * its CPU in between for those. Before 5.11 migrate_disable() can't sleep, so
+ * there a migration can still skew the result, and a negative one is clamped
+ * to 0.
+ */
+static __always_inline u64 pab_clock_start(int clock)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	if (clock != PAB_CLOCK_KTIME)
+		migrate_disable();
+#endif
+	return pab_clock_read(clock);
+}
+
+static __always_inline long pab_clock_end(int clock, u64 start)
+{
+	u64 delta = pab_clock_read(clock) - start;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	if (clock != PAB_CLOCK_KTIME)
+		migrate_enable();
+#endif
+	if ((s64)delta < 0)
+		return 0;
+	return pab_clock_ns(clock, delta);
+}
+
+/*
+ * Work out the cycle counter frequency against ktime, and the overhead of
+ * timing with each clock. The overhead is the minimum over many back-to-back
+ * reads, so subtracting it from a latency can't over-correct.
+ */
+static void pab_clock_calibrate(void)
+{
+	u64 ktime_start, cycles_start, elapsed;
+	int clock, i;
+
+	preempt_disable();
+	ktime_start = ktime_get_ns();
+	cycles_start = pab_clock_read(PAB_CLOCK_CYCLES);
+	do {
+		cpu_relax();
+		elapsed = ktime_get_ns() - ktime_start;
+	} while (elapsed < 10 * NSEC_PER_MSEC);
+	pab_cycles_per_ms = div64_u64((pab_clock_read(PAB_CLOCK_CYCLES) - cycles_start) *
+				      NSEC_PER_MSEC, elapsed);
+	/* If there's no cycle counter, this avoids dividing by zero. */
+	pab_cycles_per_ms = max_t(u64, pab_cycles_per_ms, 1);
+
+	for (clock = 0; clock < PAB_CLOCK_NR; clock++) {
+		long overhead = LONG_MAX;
+
+		for (i = 0; i < 10000; i++) {
+			u64 start = pab_clock_read(clock);
+
+			overhead = min(overhead, pab_clock_ns(clock, pab_clock_read(clock) - start));
+		}
+		pab_clock_overhead_ns[clock] = overhead;
+	}
+	preempt_enable();
+
+	pr_info(NAME ": clock overheads: ktime %ldns, local_clock %ldns, cycles %ldns (%llu cycles/ms)\n",
+		pab_clock_overhead_ns[PAB_CLOCK_KTIME], pab_clock_overhead_ns[PAB_CLOCK_LOCAL],
+		pab_clock_overhead_ns[PAB_CLOCK_CYCLES], pab_cycles_per_ms);
+}
+
+/*
+ * Allocate a page as specified by @args (which must have been checked), and
+ * record the latency, in a separate histogram if it fails. The page isn't
+ * tracked.
+ */
+static struct page *pab_alloc_timed(const struct pab_alloc_args *args, long *latency_ns)
+{
+	bool atomic = args->gfp == PAB_GFP_ATOMIC;
+	gfp_t gfp = pab_gfp(args);
+	struct page *page = NULL;
+	int clock = READ_ONCE(pab_clock);
+	u64 start;
+
+	if (atomic)
+		local_bh_disable();
+	start = pab_clock_start(clock);
+	switch (args->api) {
+	case PAB_API_ALLOC_PAGES:
+		page = alloc_pages(gfp, args->order);
+		break;
+	case PAB_API_ALLOC_PAGES_NODE:
+		page = alloc_pages_node(args->nid, gfp, args->order);
+		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	case PAB_API_FOLIO_ALLOC: {
+		struct folio *folio = folio_alloc(gfp, args->order);
+
+		if (folio)
+			page = &folio->page;
+		break;
+	}
+#endif
+	}
+	*latency_ns = pab_clock_end(clock, start);
+	if (atomic)
+		local_bh_enable();
+
+	pab_hist_record(page ? PAB_HIST_ALLOC : PAB_HIST_ALLOC_FAIL, args->order, *latency_ns);
+	return page;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+#define kmap_local_page kmap_atomic
+#define kunmap_local kunmap_atomic
+#endif
+
+/*
+ * Touch the memory according to @args->touch and record the latency. Sets
+ * *latency_ns to 0 if there was nothing to do.
+ */
+static void pab_touch_timed(struct page *page, const struct pab_alloc_args *args,
+			    long *latency_ns)
+{
+	int clock = READ_ONCE(pab_clock);
+	u64 start;
+	int i, j;
+
+	*latency_ns = 0;
+	if (args->touch == PAB_TOUCH_NONE || args->touch == PAB_TOUCH_ZERO)
+		return;
+
+	start = pab_clock_start(clock);
+	for (i = 0; i < (1 << args->order); i++) {
+		unsigned long *addr = kmap_local_page(nth_page(page, i));
+
+		switch (args->touch) {
+		case PAB_TOUCH_CACHELINE:
+			WRITE_ONCE(*addr, 0);
+			break;
+		case PAB_TOUCH_WRITE:
+			memset(addr, 0x5a, PAGE_SIZE);
+			break;
+		case PAB_TOUCH_READ:
+			for (j = 0; j < PAGE_SIZE / sizeof(*addr); j++)
+				(void)READ_ONCE(addr[j]);
+			break;
+		}
+		kunmap_local(addr);
+		if (args->touch == PAB_TOUCH_CACHELINE)
+			break;
+	}
+	*latency_ns = pab_clock_end(clock, start);
+
+	pab_hist_record(PAB_HIST_TOUCH, args->order, *latency_ns);
+}
+
+/* Counterpart of pab_alloc_timed(). */
+static void pab_free_timed(struct page *page, int order, int api, long *latency_ns)
+{
+	int clock = READ_ONCE(pab_clock);
+	u64 start;
+
+	start = pab_clock_start(clock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (api == PAB_API_FOLIO_ALLOC)
+		folio_put(page_folio(page));
+	else
+#endif
+		__free_pages(page, order);
+	*latency_ns = pab_clock_end(clock, start);
+
+	pab_hist_record(PAB_HIST_FREE, order, *latency_ns);
+}
+
+/* @args must have been checked. */
+static int pab_alloc_page(const struct pab_alloc_args *args, struct pab_page *result)
+{
+	struct page *page;
+	unsigned long id;
+
+	page = pab_alloc_timed(args, &result->latency_ns);
+	if (!page)
+		return -ENOMEM;
+	pab_touch_timed(page, args, &result->touch_latency_ns);
+
+	id = pab_slot_store(page, false, args->order, args->api);
+	if (!id) {
+		long latency_ns;
+
+		pab_free_timed(page, args->order, args->api, &latency_ns);
+		return -ENOSPC;
+	}
+
+	result->id = id;
+	result->nid = page_to_nid(page);
+	result->pfn = page_to_pfn(page);
+	return 0;
+}
+
+static int pab_free_page(unsigned long id, long *latency_ns)
+{
+	struct page *page;
+	int order, api;
+
+	page = pab_slot_remove(id, false, &order, &api);
+	if (!page) {
+		pr_err_ratelimited(NAME ": bad page ID 0x%lx\n", id);
+		return -EINVAL;
+	}
+
+	pab_free_timed(page, order, api, latency_ns);
+	return 0;
+}
+
+/*
+ * The private slab cache. Allocations get it with pab_slab_cache_get(), which
+ * counts the object before it looks at pab_slab_cache, so that destroying the
+ * cache can hide it and then check that there are no objects, without taking
+ * a lock in the allocation path.
+ */
+static DEFINE_MUTEX(pab_slab_cache_lock);
+static struct kmem_cache *pab_slab_cache; /* NULL while it can't be used. */
+static struct kmem_cache *pab_slab_cache_created; /* For freeing objects. */
+static unsigned int pab_slab_cache_size;
+static int pab_slab_cache_ctor;
+static atomic_long_t pab_slab_cache_nr_objs;
+
+static struct kmem_cache *pab_slab_cache_get(void)
+{
+	struct kmem_cache *cache;
+
+	atomic_long_inc(&pab_slab_cache_nr_objs);
+	/* Pairs with the smp_mb() in pab_slab_cache_destroy(). */
+	smp_mb__after_atomic();
+	cache = READ_ONCE(pab_slab_cache);
+	if (!cache)
+		atomic_long_dec(&pab_slab_cache_nr_objs);
+	return cache;
+}
+
+static void pab_slab_cache_put(void)
+{
+	atomic_long_dec(&pab_slab_cache_nr_objs);
+}
+
+static void pab_slab_ctor(void *obj)
+{
+	memset(obj, pab_slab_cache_ctor == PAB_SLAB_CTOR_PATTERN ? 0x5a : 0,
+	       pab_slab_cache_size);
+}
+
+static long pab_slab_cache_create(const struct pab_ioctl_slab_cache_create *ioctl)
+{
+	slab_flags_t flags = 0;
+	struct kmem_cache *cache;
+	long ret = 0;
+
+	if (ioctl->args.size == 0 || ioctl->args.size > PAB_SLAB_MAX_SIZE ||
+	    (ioctl->args.align && !is_power_of_2(ioctl->args.align)) ||
+	    ioctl->args.align > PAGE_SIZE ||
+	    ioctl->args.ctor < 0 || ioctl->args.ctor >= PAB_SLAB_CTOR_NR ||
+	    (ioctl->args.flags & ~PAB_SLAB_ALL_FLAGS))
+		return -EINVAL;
+	if (ioctl->args.flags & PAB_SLAB_HWCACHE_ALIGN)
+		flags |= SLAB_HWCACHE_ALIGN;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	/*
+	 * Otherwise a cache without a ctor can be merged into a kmalloc or
+	 * other compatible cache, and share its slabs with the rest of the
+	 * kernel. Older kernels need slab_nomerge on the command line for that.
+	 */
+	flags |= SLAB_NO_MERGE;
+#endif
+
+	mutex_lock(&pab_slab_cache_lock);
+	if (pab_slab_cache_created) {
+		ret = -EEXIST;
+		goto out;
+	}
+	/* The ctor reads these, set them before it can run. */
+	pab_slab_cache_size = ioctl->args.size;
+	pab_slab_cache_ctor = ioctl->args.ctor;
+	cache = kmem_cache_create(NAME, ioctl->args.size, ioctl->args.align, flags,
+				  ioctl->args.ctor == PAB_SLAB_CTOR_NONE ? NULL : pab_slab_ctor);
+	if (!cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	pab_slab_cache_created = cache;
+	WRITE_ONCE(pab_slab_cache, cache);
+out:
+	mutex_unlock(&pab_slab_cache_lock);
+	return ret;
+}
+
+static long pab_slab_cache_destroy(void)
+{
+	struct kmem_cache *cache;
+	long ret = 0;
+
+	mutex_lock(&pab_slab_cache_lock);
+	cache = pab_slab_cache_created;
+	if (!cache) {
+		ret = -ENOENT;
+		goto out;
+	}
+	WRITE_ONCE(pab_slab_cache, NULL);
+	/* Pairs with pab_slab_cache_get(). */
+	smp_mb();
+	if (atomic_long_read(&pab_slab_cache_nr_objs)) {
+		WRITE_ONCE(pab_slab_cache, cache);
+		ret = -EBUSY;
+		goto out;
+	}
+	kmem_cache_destroy(cache);
+	pab_slab_cache_created = NULL;
+out:
+	mutex_unlock(&pab_slab_cache_lock);
+	return ret;
+}
+
+static int pab_slab_args_check(const struct pab_slab_args *args)
+{
+	u64 total_weight = 0;
+	int i;
+
+	/* kmalloc() doesn't take highmem. */
+	if (args->api < 0 || args->api >= PAB_SLAB_NR ||
+	    args->gfp < 0 || args->gfp >= PAB_GFP_NR_PRESETS ||
+	    args->gfp == PAB_GFP_HIGHUSER_MOVABLE ||
+	    (args->gfp_flags & ~PAB_GFP_ALL_FLAGS))
+		return -EINVAL;
+	if (args->api == PAB_SLAB_CACHE)
+		return READ_ONCE(pab_slab_cache) ? 0 : -ENOENT;
+
+	if (args->nr_sizes <= 0 || args->nr_sizes > PAB_SLAB_MAX_SIZES)
+		return -EINVAL;
+	for (i = 0; i < args->nr_sizes; i++) {
+		if (args->sizes[i] == 0 || args->sizes[i] > PAB_SLAB_MAX_SIZE)
+			return -EINVAL;
+		total_weight += args->weights[i];
+	}
+	if (total_weight == 0 || total_weight > U32_MAX)
+		return -EINVAL;
+	return 0;
+}
+
+static int pab_slab_size_class(unsigned int size)
+{
+	int class = order_base_2(size) - PAB_SLAB_SIZE_CLASS_SHIFT;
+
+	return clamp(class, 0, PAB_HIST_NR_ORDERS - 1);
+}
+
+/* Pick a kmalloc() size from the distribution in @args. */
+static unsigned int pab_slab_pick_size(const struct pab_slab_args *args,
+				       struct rnd_state *rnd)
+{
+	u32 total_weight = 0, r;
+	int i;
+
+	if (args->nr_sizes == 1)
+		return args->sizes[0];
+	for (i = 0; i < args->nr_sizes; i++)
+		total_weight += args->weights[i];
+	r = prandom_u32_state(rnd) % total_weight;
+	for (i = 0; i < args->nr_sizes - 1; i++) {
+		if (r < args->weights[i])
+			break;
+		r -= args->weights[i];
+	}
+	return args->sizes[i];
+}
+
+/*
+ * Slab version of pab_alloc_timed(), @args must have been checked. Sets
+ * *class to the size class of the object.
+ */
+static void *pab_slab_alloc_timed(const struct pab_slab_args *args, struct rnd_state *rnd,
+				  int *class, long *latency_ns)
+{
+	bool atomic = args->gfp == PAB_GFP_ATOMIC;
+	gfp_t gfp = pab_gfp_preset(args->gfp, args->gfp_flags);
+	struct kmem_cache *cache = NULL;
+	int clock = READ_ONCE(pab_clock);
+	unsigned int size;
+	void *obj;
+	u64 start;
+
+	if (args->api == PAB_SLAB_CACHE) {
+		/* Userspace destroyed it since we checked the args. */
+		cache = pab_slab_cache_get();
+		if (!cache)
+			return NULL;
+		size = pab_slab_cache_size;
+	} else {
+		size = pab_slab_pick_size(args, rnd);
+	}
+	*class = pab_slab_size_class(size);
+
+	if (atomic)
+		local_bh_disable();
+	start = pab_clock_start(clock);
+	if (cache)
+		obj = kmem_cache_alloc(cache, gfp);
+	else
+		obj = kmalloc(size, gfp);
+	*latency_ns = pab_clock_end(clock, start);
+	if (atomic)
+		local_bh_enable();
+
+	if (obj)
+		pab_hist_record(PAB_HIST_SLAB_ALLOC, *class, *latency_ns);
+	else if (cache)
+		pab_slab_cache_put();
+	return obj;
+}
+
+/* Counterpart of pab_slab_alloc_timed(). */
+static void pab_slab_free_timed(void *obj, int class, int api, long *latency_ns)
+{
+	int clock = READ_ONCE(pab_clock);
+	u64 start;
+
+	start = pab_clock_start(clock);
+	if (api == PAB_SLAB_CACHE)
+		kmem_cache_free(READ_ONCE(pab_slab_cache_created), obj);
+	else
+		kfree(obj);
+	*latency_ns = pab_clock_end(clock, start);
+	if (api == PAB_SLAB_CACHE)
+		pab_slab_cache_put();
+
+	pab_hist_record(PAB_HIST_SLAB_FREE, class, *latency_ns);
+}
+
+static int pab_slab_nid(void *obj)
+{
+	return page_to_nid(virt_to_page(obj));
+}
+
+/* @args must have been checked. */
+static int pab_alloc_obj(const struct pab_slab_args *args, struct rnd_state *rnd,
+			 struct pab_page *result)
+{
+	unsigned long id;
+	int class;
+	void *obj;
+
+	obj = pab_slab_alloc_timed(args, rnd, &class, &result->latency_ns);
+	if (!obj)
+		return -ENOMEM;
+
+	id = pab_slot_store(obj, true, class, args->api);
+	if (!id) {
+		long latency_ns;
+
+		pab_slab_free_timed(obj, class, args->api, &latency_ns);
+		return -ENOSPC;
+	}
+
+	result->id = id;
+	result->nid = pab_slab_nid(obj);
+	result->touch_latency_ns = 0;
+	result->pfn = 0;
+	return 0;
+}
+
+static int pab_free_obj(unsigned long id, long *latency_ns)
 {
-	spin_lock(&ap->aps->lock);
-	list_del(&ap->node);
-	spin_unlock(&ap->aps->lock);
+	int class, api;
+	void *obj;
+
+	obj = pab_slot_remove(id, true, &class, &api);
+	if (!obj) {
+		pr_err_ratelimited(NAME ": bad slab object ID 0x%lx\n", id);
+		return -EINVAL;
+	}
+
+	pab_slab_free_timed(obj, class, api, latency_ns);
+	return 0;
 }
 
-static void alloced_pages_free_all(void)
+/* Free all the tracked pages and objects, and the slot tables. */
+static void pab_slot_tables_free(void)
 {
 	int cpu;
 
+	if (!pab_slot_tables)
+		return;
+
 	for_each_possible_cpu(cpu) {
-		struct alloced_pages *aps = per_cpu_ptr(&alloced_pages, cpu);
-		struct alloced_page *ap, *tmp;
+		struct pab_slot_table *table = pab_slot_tables[cpu];
+		int c, i;
 
-		/* Contention should be impossible at this point, and isn't handled. */
-		WARN_ON(spin_is_locked(&aps->lock));
+		if (!table)
+			continue;
+		for (c = 0; c < table->nr_chunks; c++) {
+			struct pab_slot *chunk = table->chunks[c];
 
-		list_for_each_entry_safe(ap, tmp, &aps->pages, node) {
-			WARN_ON(ap->aps != aps);
-			list_del(&ap->node);
-			__free_page(virt_to_page(ap));
+			for (i = 0; i < PAB_SLOT_CHUNK_SIZE; i++) {
+				long latency_ns;
 
+				if (!chunk[i].ptr)
+					continue;
+				if (chunk[i].slab)
+					pab_slab_free_timed(chunk[i].ptr, chunk[i].order,
+							    chunk[i].api, &latency_ns);
+				else
+					pab_free_timed(chunk[i].ptr, chunk[i].order,
+						       chunk[i].api, &latency_ns);
+			}
+			kvfree(chunk);
 			cond_resched();
 		}
+		kvfree(table);
+	}
+	kfree(pab_slot_tables);
+}
+
+static long pab_ioctl_alloc_pages(struct pab_ioctl_alloc_pages __user *uioctl)
+{
+	struct pab_ioctl_alloc_pages ioctl;
+	int err = 0;
+	int i;
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (ioctl.args.nr_pages < 0 || ioctl.args.nr_pages > PAB_MAX_BATCH)
+		return -EINVAL;
+	err = pab_alloc_args_check(&ioctl.args.alloc);
+	if (err)
+		return err;
+
+	for (i = 0; i < ioctl.args.nr_pages; i++) {
+		struct pab_page result;
+
+		err = pab_alloc_page(&ioctl.args.alloc, &result);
+		if (err)
+			break;
+		if (copy_to_user(&ioctl.args.pages[i], &result, sizeof(result))) {
+			long latency_ns;
+
+			pab_free_page(result.id, &latency_ns);
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	ioctl.result.nr_alloced = i;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return err;
+}
+
+static long pab_ioctl_free_pages(struct pab_ioctl_free_pages __user *uioctl)
+{
+	struct pab_ioctl_free_pages ioctl;
+	int err = 0;
+	int i;
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (ioctl.args.nr_pages < 0 || ioctl.args.nr_pages > PAB_MAX_BATCH)
+		return -EINVAL;
+
+	for (i = 0; i < ioctl.args.nr_pages; i++) {
+		struct pab_page __user *upage = &ioctl.args.pages[i];
+		unsigned long id;
+		long latency_ns;
+
+		if (get_user(id, &upage->id)) {
+			err = -EFAULT;
+			break;
+		}
+		err = pab_free_page(id, &latency_ns);
+		if (err)
+			break;
+		if (put_user(latency_ns, &upage->latency_ns)) {
+			/* The page is gone anyway, count it as freed. */
+			i++;
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	ioctl.result.nr_freed = i;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return err;
+}
+
+static long pab_ioctl_slab_alloc(struct pab_ioctl_slab_alloc __user *uioctl)
+{
+	struct pab_ioctl_slab_alloc ioctl;
+	struct rnd_state rnd;
+	int err = 0;
+	int i;
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (ioctl.args.nr_objs < 0 || ioctl.args.nr_objs > PAB_MAX_BATCH)
+		return -EINVAL;
+	err = pab_slab_args_check(&ioctl.args.alloc);
+	if (err)
+		return err;
+
+	prandom_seed_state(&rnd, get_random_u64());
+	for (i = 0; i < ioctl.args.nr_objs; i++) {
+		struct pab_page result;
+
+		err = pab_alloc_obj(&ioctl.args.alloc, &rnd, &result);
+		if (err)
+			break;
+		if (copy_to_user(&ioctl.args.objs[i], &result, sizeof(result))) {
+			long latency_ns;
+
+			pab_free_obj(result.id, &latency_ns);
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	ioctl.result.nr_alloced = i;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return err;
+}
+
+static long pab_ioctl_slab_free(struct pab_ioctl_slab_free __user *uioctl)
+{
+	struct pab_ioctl_slab_free ioctl;
+	int err = 0;
+	int i;
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (ioctl.args.nr_objs < 0 || ioctl.args.nr_objs > PAB_MAX_BATCH)
+		return -EINVAL;
+
+	for (i = 0; i < ioctl.args.nr_objs; i++) {
+		struct pab_page __user *uobj = &ioctl.args.objs[i];
+		unsigned long id;
+		long latency_ns;
+
+		if (get_user(id, &uobj->id)) {
+			err = -EFAULT;
+			break;
+		}
+		err = pab_free_obj(id, &latency_ns);
+		if (err)
+			break;
+		if (put_user(latency_ns, &uobj->latency_ns)) {
+			i++;
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	ioctl.result.nr_freed = i;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return err;
+}
+
+/*
+ * State for the in-kernel antagonist. Each thread only touches its own
+ * struct, except for the stats which are read racily by the STATS ioctl.
+ */
+struct pab_kthread_obj {
+	void *ptr; /* struct page or slab object. */
+	int order; /* Or size class. */
+};
+
+struct pab_kthread {
+	struct task_struct *task;
+	int cpu;
+	/* FIFO of held allocations, a ring buffer of capacity middle + range. */
+	struct pab_kthread_obj *objs;
+	int head;
+	int nr_objs;
+	bool steady;
+	struct pab_kthread_stats stats;
+} ____cacheline_aligned;
+
+/* Protects everything below. */
+static DEFINE_MUTEX(pab_kthreads_lock);
+/* Indexed by CPU, NULL when the threads have never been started. */
+static struct pab_kthread *pab_kthreads;
+static bool pab_kthreads_running;
+static int pab_kthreads_nr_threads;
+static atomic_t pab_kthreads_nr_steady;
+static struct pab_ioctl_kthreads_start pab_kthreads_config;
+
+static void pab_kthread_push(struct pab_kthread *kt, void *ptr, int order, int capacity)
+{
+	struct pab_kthread_obj *obj = &kt->objs[(kt->head + kt->nr_objs) % capacity];
+
+	obj->ptr = ptr;
+	obj->order = order;
+	kt->nr_objs++;
+}
+
+static struct pab_kthread_obj *pab_kthread_pop(struct pab_kthread *kt, int capacity)
+{
+	struct pab_kthread_obj *obj = &kt->objs[kt->head];
+
+	kt->head = (kt->head + 1) % capacity;
+	kt->nr_objs--;
+	return obj;
+}
+
+/* Allocate whatever the threads were configured to, and touch pages. */
+static void *pab_kthread_alloc(struct rnd_state *rnd, int *order, int *nid)
+{
+	const struct pab_ioctl_kthreads_start *config = &pab_kthreads_config;
+	struct page *page;
+	long latency_ns;
+
+	if (config->args.use_slab) {
+		void *obj = pab_slab_alloc_timed(&config->args.slab, rnd, order, &latency_ns);
+
+		if (obj)
+			*nid = pab_slab_nid(obj);
+		return obj;
 	}
+
+	page = pab_alloc_timed(&config->args.alloc, &latency_ns);
+	if (!page)
+		return NULL;
+	pab_touch_timed(page, &config->args.alloc, &latency_ns);
+	*order = config->args.alloc.order;
+	*nid = page_to_nid(page);
+	return page;
+}
+
+static void pab_kthread_free(struct pab_kthread *kt, int capacity)
+{
+	const struct pab_ioctl_kthreads_start *config = &pab_kthreads_config;
+	struct pab_kthread_obj *obj = pab_kthread_pop(kt, capacity);
+	long latency_ns;
+
+	if (config->args.use_slab)
+		pab_slab_free_timed(obj->ptr, obj->order, config->args.slab.api, &latency_ns);
+	else
+		pab_free_timed(obj->ptr, obj->order, config->args.alloc.api, &latency_ns);
+	WRITE_ONCE(kt->stats.pages_freed, kt->stats.pages_freed + 1);
+}
+
+static int pab_kthread_fn(void *data)
+{
+	struct pab_kthread *kt = data;
+	int middle = pab_kthreads_config.args.middle;
+	int range = pab_kthreads_config.args.range;
+	int capacity = middle + range;
+	struct rnd_state rnd;
+
+	/* Same idea as the userspace version: stable per-CPU pattern. */
+	prandom_seed_state(&rnd, kt->cpu);
+
+	while (!kthread_should_stop()) {
+		/* Exponential backoff in case of allocation failures. */
+		unsigned int backoff_ms = 500;
+		int target = middle;
+
+		if (range) {
+			if (prandom_u32_state(&rnd) % 2 == 0)
+				target += prandom_u32_state(&rnd) % range;
+			else
+				target -= prandom_u32_state(&rnd) % range;
+		}
+
+		while (kt->nr_objs < target && !kthread_should_stop()) {
+			int order, nid;
+			void *ptr = pab_kthread_alloc(&rnd, &order, &nid);
+
+			if (!ptr) {
+				WRITE_ONCE(kt->stats.alloc_failures, kt->stats.alloc_failures + 1);
+				/* kthread_stop() wakes us up. */
+				schedule_timeout_interruptible(msecs_to_jiffies(backoff_ms));
+				backoff_ms += backoff_ms / 2;
+				continue;
+			}
+			backoff_ms = 500;
+
+			pab_kthread_push(kt, ptr, order, capacity);
+			WRITE_ONCE(kt->stats.pages_allocated, kt->stats.pages_allocated + 1);
+			if (nid != cpu_to_node(kt->cpu))
+				WRITE_ONCE(kt->stats.numa_remote_allocations,
+					   kt->stats.numa_remote_allocations + 1);
+
+			if (kt->nr_objs >= middle && !kt->steady) {
+				atomic_inc(&pab_kthreads_nr_steady);
+				kt->steady = true;
+			}
+			cond_resched();
+		}
+
+		while (kt->nr_objs > target) {
+			pab_kthread_free(kt, capacity);
+			cond_resched();
+		}
+	}
+
+	while (kt->nr_objs) {
+		pab_kthread_free(kt, capacity);
+		cond_resched();
+	}
+	return 0;
+}
+
+static void pab_kthreads_stop(void)
+{
+	int cpu;
+
+	lockdep_assert_held(&pab_kthreads_lock);
+
+	if (!pab_kthreads_running)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct pab_kthread *kt = &pab_kthreads[cpu];
+
+		if (!kt->task)
+			continue;
+		kthread_stop(kt->task);
+		put_task_struct(kt->task);
+		kt->task = NULL;
+		kvfree(kt->objs);
+		kt->objs = NULL;
+	}
+	pab_kthreads_running = false;
+}
+
+static long pab_kthreads_start(const struct pab_ioctl_kthreads_start *config)
+{
+	int capacity, cpu, err;
+
+	lockdep_assert_held(&pab_kthreads_lock);
+
+	if (pab_kthreads_running)
+		return -EBUSY;
+	if (config->args.middle <= 0 || config->args.middle > PAB_KTHREADS_MAX_MIDDLE ||
+	    config->args.range < 0 || config->args.range > config->args.middle)
+		return -EINVAL;
+	/* Ruled out by the bound above, but keep the sum checked. */
+	if (check_add_overflow(config->args.middle, config->args.range, &capacity))
+		return -EINVAL;
+	if (config->args.use_slab)
+		err = pab_slab_args_check(&config->args.slab);
+	else
+		err = pab_alloc_args_check(&config->args.alloc);
+	if (err)
+		return err;
+
+	if (!pab_kthreads) {
+		pab_kthreads = kvcalloc(nr_cpu_ids, sizeof(*pab_kthreads), GFP_KERNEL);
+		if (!pab_kthreads)
+			return -ENOMEM;
+	}
+	memset(pab_kthreads, 0, nr_cpu_ids * sizeof(*pab_kthreads));
+	pab_kthreads_config = *config;
+	pab_kthreads_nr_threads = 0;
+	atomic_set(&pab_kthreads_nr_steady, 0);
+	/* From here on pab_kthreads_stop() knows how to clean up. */
+	pab_kthreads_running = true;
+
+	for_each_online_cpu(cpu) {
+		struct pab_kthread *kt = &pab_kthreads[cpu];
+		struct task_struct *task;
+
+		kt->cpu = cpu;
+		kt->objs = kvmalloc_node(array_size(capacity, sizeof(*kt->objs)),
+					 GFP_KERNEL, cpu_to_node(cpu));
+		if (!kt->objs)
+			goto err;
+
+		task = kthread_create_on_node(pab_kthread_fn, kt, cpu_to_node(cpu),
+					      "pab/%d", cpu);
+		if (IS_ERR(task)) {
+			kvfree(kt->objs);
+			kt->objs = NULL;
+			goto err;
+		}
+		kthread_bind(task, cpu);
+		/* Keep the task_struct around even if the thread exits early. */
+		get_task_struct(task);
+		kt->task = task;
+		pab_kthreads_nr_threads++;
+	}
+
+	for_each_possible_cpu(cpu) {
+		if (pab_kthreads[cpu].task)
+			wake_up_process(pab_kthreads[cpu].task);
+	}
+	return 0;
+err:
+	pab_kthreads_stop();
+	return -ENOMEM;
+}
+
+static long pab_ioctl_kthreads_stats(struct pab_ioctl_kthreads_stats __user *uioctl)
+{
+	struct pab_ioctl_kthreads_stats ioctl;
+	int cpu;
+
+	lockdep_assert_held(&pab_kthreads_lock);
+
+	if (copy_from_user(&ioctl, uioctl, sizeof(ioctl)))
+		return -EFAULT;
+	if (!pab_kthreads)
+		return -ENODEV;
+
+	for (cpu = 0; cpu < min_t(int, ioctl.args.nr_cpus, nr_cpu_ids); cpu++) {
+		struct pab_kthread_stats *kstats = &pab_kthreads[cpu].stats;
+		struct pab_kthread_stats stats = {
+			.pages_allocated = READ_ONCE(kstats->pages_allocated),
+			.pages_freed = READ_ONCE(kstats->pages_freed),
+			.alloc_failures = READ_ONCE(kstats->alloc_failures),
+			.numa_remote_allocations = READ_ONCE(kstats->numa_remote_allocations),
+		};
+
+		if (copy_to_user(&ioctl.args.stats[cpu], &stats, sizeof(stats)))
+			return -EFAULT;
+	}
+
+	ioctl.result.nr_threads = pab_kthreads_nr_threads;
+	ioctl.result.nr_steady = atomic_read(&pab_kthreads_nr_steady);
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return 0;
+}
+
+static long pab_ioctl_kthreads(unsigned int cmd, unsigned long arg)
+{
+	long ret = 0;
+
+	mutex_lock(&pab_kthreads_lock);
+	switch (cmd) {
+	case PAB_IOCTL_KTHREADS_START: {
+		struct pab_ioctl_kthreads_start config;
+
+		if (copy_from_user(&config, (void __user *)arg, sizeof(config))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = pab_kthreads_start(&config);
+		break;
+	}
+	case PAB_IOCTL_KTHREADS_STOP:
+		pab_kthreads_stop();
+		break;
+	case PAB_IOCTL_KTHREADS_STATS:
+		ret = pab_ioctl_kthreads_stats((void __user *)arg);
+		break;
+	}
+	mutex_unlock(&pab_kthreads_lock);
+	return ret;
+}
+
+static long pab_ioctl_clock(struct pab_ioctl_clock __user *uioctl)
+{
+	struct pab_ioctl_clock ioctl;
+	int clock;
+
+	if (copy_from_user(&ioctl.args, &uioctl->args, sizeof(ioctl.args)))
+		return -EFAULT;
+	if (ioctl.args.clock < -1 || ioctl.args.clock >= PAB_CLOCK_NR)
+		return -EINVAL;
+
+	if (ioctl.args.clock >= 0) {
+		/* The kthreads' latencies would be a mixture of clocks. */
+		mutex_lock(&pab_kthreads_lock);
+		if (pab_kthreads_running) {
+			mutex_unlock(&pab_kthreads_lock);
+			return -EBUSY;
+		}
+		WRITE_ONCE(pab_clock, ioctl.args.clock);
+		mutex_unlock(&pab_kthreads_lock);
+	}
+
+	memset(&ioctl.result, 0, sizeof(ioctl.result));
+	ioctl.result.clock = READ_ONCE(pab_clock);
+	for (clock = 0; clock < PAB_CLOCK_NR; clock++)
+		ioctl.result.overhead_ns[clock] = pab_clock_overhead_ns[clock];
+	ioctl.result.cycles_per_ms = pab_cycles_per_ms;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return 0;
+}
+
+static long pab_ioctl_zone_locks(struct pab_ioctl_zone_locks __user *uioctl)
+{
+	struct pab_ioctl_zone_locks ioctl;
+	int nid, z;
+	int i = 0;
+
+	if (copy_from_user(&ioctl.args, &uioctl->args, sizeof(ioctl.args)))
+		return -EFAULT;
+
+	/* Not for_each_populated_zone(), first_online_pgdat() isn't exported. */
+	for_each_online_node(nid) {
+		for (z = 0; z < MAX_NR_ZONES; z++) {
+			struct zone *zone = &NODE_DATA(nid)->node_zones[z];
+			struct pab_zone_lock zl = {
+				.nid = nid,
+				.lock_addr = (unsigned long)&zone->lock,
+			};
+
+			if (!populated_zone(zone))
+				continue;
+			if (i < ioctl.args.nr_zones) {
+				strscpy(zl.name, zone->name, sizeof(zl.name));
+				if (copy_to_user(&ioctl.args.zones[i], &zl, sizeof(zl)))
+					return -EFAULT;
+			}
+			i++;
+		}
+	}
+
+	ioctl.result.nr_zones = i;
+	if (copy_to_user(&uioctl->result, &ioctl.result, sizeof(ioctl.result)))
+		return -EFAULT;
+	return 0;
 }
 
 static long pab_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -114,55 +1454,69 @@ static long pab_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		switch (cmd) {
 		case PAB_IOCTL_ALLOC_PAGE: {
 			struct pab_ioctl_alloc_page ioctl;
-			struct page *page;
 			int err;
-			ktime_t start;
 
 			err = copy_from_user(&ioctl, (void *)arg, sizeof(ioctl));
+			if (err)
+				return err;
+			err = pab_alloc_args_check(&ioctl.args);
 			if (err)
 				return err;
 
-			start = ktime_get();
-			page = alloc_pages(GFP_KERNEL, ioctl.args.order);
-			if (!page)
-				return -ENOMEM;
-			ioctl.result.latency_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
-
-			alloced_page_store(page, ioctl.args.order);
+			err = pab_alloc_page(&ioctl.args, &ioctl.result);
+			if (err)
+				return err;
 
-			ioctl.result.id = (unsigned long)page;
-			ioctl.result.nid = page_to_nid(page);
 			return copy_to_user(&((struct pab_ioctl_alloc_page *)arg)->result,
 					    &ioctl.result, sizeof(ioctl.result));
 		}
 		case PAB_IOCTL_FREE_PAGE: {
 			struct pab_ioctl_free_page ioctl;
-			struct alloced_page *ap;
-			struct page *page;
-			ktime_t start;
+			long latency_ns;
 			int err;
 
 			err = copy_from_user(&ioctl, (void *)arg, sizeof(ioctl));
 			if (err)
 				return err;
 
-			page = (struct page *)ioctl.args.id;
-			if (WARN(!pfn_valid(page_to_pfn(page)), "Bad PFN %lu (page %px)",
-					page_to_pfn(page), page))
-				return -EINVAL;
-
-			ap = alloced_page_get(page);
-			alloced_page_remove(ap);
-
-			start = ktime_get();
-			__free_pages(page, ap->order);
-			ioctl.result.latency_ns = (ktime_sub(ktime_get(), start)) + 123;
+			err = pab_free_page(ioctl.args.id, &latency_ns);
+			if (err)
+				return err;
+			ioctl.result.latency_ns = latency_ns;
 
 			return copy_to_user(&((struct pab_ioctl_free_page *)arg)->result,
 					    &ioctl.result, sizeof(ioctl.result));
-
+		}
+		case PAB_IOCTL_ALLOC_PAGES:
+			return pab_ioctl_alloc_pages((void __user *)arg);
+		case PAB_IOCTL_FREE_PAGES:
+			return pab_ioctl_free_pages((void __user *)arg);
+		case PAB_IOCTL_KTHREADS_START:
+		case PAB_IOCTL_KTHREADS_STOP:
+		case PAB_IOCTL_KTHREADS_STATS:
+			return pab_ioctl_kthreads(cmd, arg);
+		case PAB_IOCTL_HIST_READ:
+			return pab_ioctl_hist_read((void __user *)arg);
+		case PAB_IOCTL_HIST_RESET:
+			pab_hists_reset();
 			return 0;
+		case PAB_IOCTL_CLOCK:
+			return pab_ioctl_clock((void __user *)arg);
+		case PAB_IOCTL_SLAB_CACHE_CREATE: {
+			struct pab_ioctl_slab_cache_create ioctl;
+
+			if (copy_from_user(&ioctl, (void __user *)arg, sizeof(ioctl)))
+				return -EFAULT;
+			return pab_slab_cache_create(&ioctl);
 		}
+		case PAB_IOCTL_SLAB_CACHE_DESTROY:
+			return pab_slab_cache_destroy();
+		case PAB_IOCTL_SLAB_ALLOC:
+			return pab_ioctl_slab_alloc((void __user *)arg);
+		case PAB_IOCTL_SLAB_FREE:
+			return pab_ioctl_slab_free((void __user *)arg);
+		case PAB_IOCTL_ZONE_LOCKS:
+			return pab_ioctl_zone_locks((void __user *)arg);
 		default: {
 			pr_err("Invalid page_alloc_bench ioctl 0x%x - "
 			 	"dir 0x%x type 0x%x nr 0x%x size 0x%x "
@@ -186,11 +1540,23 @@ static struct proc_dir_entry *procfs_file;
 
 static int __init pab_init(void)
 {
-	alloced_pages_init();
+	int err;
+
+	err = pab_slot_tables_init();
+	if (err)
+		goto err;
+	err = pab_hists_init();
+	if (err)
+		goto err;
+	pab_clock_calibrate();
 
 	procfs_file = proc_create(NAME, 0, NULL, &proc_ops);
 
 	return 0;
+err:
+	pab_hists_free();
+	pab_slot_tables_free();
+	return err;
 }
 module_init(pab_init);
 
@@ -198,7 +1564,15 @@ static void __exit pab_exit(void)
 {
 	proc_remove(procfs_file);
 
-	alloced_pages_free_all();
+	mutex_lock(&pab_kthreads_lock);
+	pab_kthreads_stop();
+	mutex_unlock(&pab_kthreads_lock);
+	kvfree(pab_kthreads);
+
+	/* Frees the cache's objects, so it can be destroyed. */
+	pab_slot_tables_free();
+	pab_slab_cache_destroy();
+	pab_hists_free();
 }
 module_exit(pab_exit);
 
@@ -21,15 +21,69 @@
 
 #define PAB_IOCTL_BASE			0x12
 
+/* Upper bound on nr_pages for the batched ioctls. */
+#define PAB_MAX_BATCH			1024
+
+struct pab_page {
+	unsigned long id; /* Opaque ID for the allocated page, used to free. */
+	int nid; /* NUMA node ID, or -1. */
+	long latency_ns;
+	long touch_latency_ns; /* See enum pab_touch. */
+	unsigned long pfn; /* Of the first page. 0 for slab objects. */
+};
+
+/*
+ * GFP presets. The kernel's GFP bits aren't ABI so we have our own
+ * enumeration.
+ */
+enum pab_gfp_preset {
+	PAB_GFP_KERNEL,
+	PAB_GFP_ATOMIC, /* Also disables BHs around the call, like softirq context. */
+	PAB_GFP_HIGHUSER_MOVABLE,
+	PAB_GFP_NR_PRESETS,
+};
+
+/* Modifiers that can be ORed into pab_alloc_args.gfp_flags. */
+#define PAB_GFP_THISNODE		(1 << 0)
+#define PAB_GFP_NORETRY			(1 << 1)
+#define PAB_GFP_NOWARN			(1 << 2)
+#define PAB_GFP_RETRY_MAYFAIL		(1 << 3)
+#define PAB_GFP_ALL_FLAGS		((1 << 4) - 1)
+
+enum pab_alloc_api {
+	PAB_API_ALLOC_PAGES,
+	PAB_API_ALLOC_PAGES_NODE,
+	PAB_API_FOLIO_ALLOC,
+	PAB_API_NR,
+};
+
+/*
+ * What to do with the memory after allocating it, to model a real consumer.
+ * This is timed separately from the allocation, except for PAB_TOUCH_ZERO where
+ * the allocator does the zeroing so it's part of the allocation latency.
+ */
+enum pab_touch {
+	PAB_TOUCH_NONE,
+	PAB_TOUCH_CACHELINE, /* Write the first cacheline of the allocation. */
+	PAB_TOUCH_WRITE, /* Write every byte. */
+	PAB_TOUCH_ZERO, /* Allocate with __GFP_ZERO. */
+	PAB_TOUCH_READ, /* Read every byte. */
+	PAB_TOUCH_NR,
+};
+
+/* How to allocate pages. */
+struct pab_alloc_args {
+	int order; /* Less than PAB_HIST_NR_ORDERS. */
+	int gfp; /* enum pab_gfp_preset */
+	unsigned int gfp_flags;
+	int api; /* enum pab_alloc_api */
+	int nid; /* For PAB_API_ALLOC_PAGES_NODE. -1 means the local node. */
+	int touch; /* enum pab_touch */
+};
+
 struct pab_ioctl_alloc_page {
-	struct {
-		int order;
-	} args;
-	struct {
-		unsigned long id; /* Opaque ID for the allocated page, used to free. */
-		int nid; /* NUMA node ID, or -1. */
-		long latency_ns;
-	} result;
+	struct pab_alloc_args args;
+	struct pab_page result;
 };
 #define PAB_IOCTL_ALLOC_PAGE _IOWR(PAB_IOCTL_BASE, 1, struct pab_ioctl_alloc_page)
 
@@ -45,3 +99,256 @@ struct pab_ioctl_free_page {
 	} result;
 };
 #define PAB_IOCTL_FREE_PAGE _IOWR(PAB_IOCTL_BASE, 3, struct pab_ioctl_free_page)
+
+/*
+ * Batched versions of the above. The result is written even if the ioctl
+ * fails, the return value is the error from the first page that couldn't be
+ * allocated/freed. Pages before that one were processed normally.
+ */
+struct pab_ioctl_alloc_pages {
+	struct {
+		struct pab_alloc_args alloc;
+		int nr_pages;
+		struct pab_page *pages; /* Output array of length nr_pages. */
+	} args;
+	struct {
+		int nr_alloced;
+	} result;
+};
+#define PAB_IOCTL_ALLOC_PAGES _IOWR(PAB_IOCTL_BASE, 4, struct pab_ioctl_alloc_pages)
+
+struct pab_ioctl_free_pages {
+	struct {
+		int nr_pages;
+		struct pab_page *pages; /* Reads id, writes latency_ns. */
+	} args;
+	struct {
+		int nr_freed;
+	} result;
+};
+#define PAB_IOCTL_FREE_PAGES _IOWR(PAB_IOCTL_BASE, 5, struct pab_ioctl_free_pages)
+
+/*
+ * Slab allocations. Objects are tracked like pages, and struct pab_page is
+ * reused to refer to them (touch_latency_ns is always 0). Instead of an order,
+ * objects have a size class: class 0 is up to 8 bytes and each class after
+ * that doubles the maximum size, the last one takes everything bigger.
+ */
+#define PAB_SLAB_SIZE_CLASS_SHIFT	3
+#define PAB_SLAB_MAX_SIZES		8
+
+enum pab_slab_api {
+	PAB_SLAB_KMALLOC,
+	PAB_SLAB_CACHE, /* The cache from PAB_IOCTL_SLAB_CACHE_CREATE. */
+	PAB_SLAB_NR,
+};
+
+/* How to allocate slab objects. */
+struct pab_slab_args {
+	int api; /* enum pab_slab_api */
+	int gfp; /* enum pab_gfp_preset */
+	unsigned int gfp_flags;
+	/*
+	 * For PAB_SLAB_KMALLOC, each object's size is picked at random from
+	 * sizes[i], with relative probability weights[i]. Sizes are limited to
+	 * PAB_SLAB_MAX_SIZE, so they're always served by the slab allocator.
+	 */
+	int nr_sizes;
+	unsigned int sizes[PAB_SLAB_MAX_SIZES];
+	unsigned int weights[PAB_SLAB_MAX_SIZES];
+};
+#define PAB_SLAB_MAX_SIZE		8192
+
+/* What the private cache's constructor does to each new object. */
+enum pab_slab_ctor {
+	PAB_SLAB_CTOR_NONE,
+	PAB_SLAB_CTOR_ZERO,
+	PAB_SLAB_CTOR_PATTERN, /* Fill with 0x5a, like PAB_TOUCH_WRITE. */
+	PAB_SLAB_CTOR_NR,
+};
+
+/* Modifiers for pab_ioctl_slab_cache_create.args.flags. */
+#define PAB_SLAB_HWCACHE_ALIGN		(1 << 0)
+#define PAB_SLAB_ALL_FLAGS		((1 << 1) - 1)
+
+/*
+ * There's a single private cache, this fails with EEXIST if it already exists.
+ * Destroying it fails with EBUSY while it has objects allocated.
+ */
+struct pab_ioctl_slab_cache_create {
+	struct {
+		unsigned int size; /* Up to PAB_SLAB_MAX_SIZE. */
+		unsigned int align; /* 0 or a power of two. */
+		int ctor; /* enum pab_slab_ctor */
+		unsigned int flags;
+	} args;
+};
+#define PAB_IOCTL_SLAB_CACHE_CREATE _IOW(PAB_IOCTL_BASE, 12, struct pab_ioctl_slab_cache_create)
+#define PAB_IOCTL_SLAB_CACHE_DESTROY _IO(PAB_IOCTL_BASE, 13)
+
+/* Like PAB_IOCTL_ALLOC_PAGES and PAB_IOCTL_FREE_PAGES. */
+struct pab_ioctl_slab_alloc {
+	struct {
+		struct pab_slab_args alloc;
+		int nr_objs;
+		struct pab_page *objs; /* Output array of length nr_objs. */
+	} args;
+	struct {
+		int nr_alloced;
+	} result;
+};
+#define PAB_IOCTL_SLAB_ALLOC _IOWR(PAB_IOCTL_BASE, 14, struct pab_ioctl_slab_alloc)
+
+struct pab_ioctl_slab_free {
+	struct {
+		int nr_objs;
+		struct pab_page *objs; /* Reads id, writes latency_ns. */
+	} args;
+	struct {
+		int nr_freed;
+	} result;
+};
+#define PAB_IOCTL_SLAB_FREE _IOWR(PAB_IOCTL_BASE, 15, struct pab_ioctl_slab_free)
+
+/*
+ * In-kernel version of the kallocfree workload. A thread is bound to each
+ * online CPU, they each repeatedly pick a target in [middle-range,
+ * middle+range) then allocate or free (oldest first) pages until they're
+ * holding that many. middle can be at most PAB_KTHREADS_MAX_MIDDLE, the same
+ * number of pages a CPU's slot table can track.
+ */
+#define PAB_KTHREADS_MAX_MIDDLE		(1 << 24)
+struct pab_ioctl_kthreads_start {
+	struct {
+		struct pab_alloc_args alloc;
+		int middle;
+		int range; /* Must be <= middle. */
+		/* If set, allocate slab objects as per @slab instead of pages. */
+		int use_slab;
+		struct pab_slab_args slab;
+	} args;
+};
+#define PAB_IOCTL_KTHREADS_START _IOW(PAB_IOCTL_BASE, 6, struct pab_ioctl_kthreads_start)
+
+/* Stops the threads and frees their pages. Stats remain readable afterwards. */
+#define PAB_IOCTL_KTHREADS_STOP _IO(PAB_IOCTL_BASE, 7)
+
+/* With use_slab, the page counts are actually object counts. */
+struct pab_kthread_stats {
+	unsigned long pages_allocated;
+	unsigned long pages_freed;
+	unsigned long alloc_failures;
+	unsigned long numa_remote_allocations;
+};
+
+struct pab_ioctl_kthreads_stats {
+	struct {
+		int nr_cpus;
+		/* Output array of length nr_cpus, indexed by CPU. */
+		struct pab_kthread_stats *stats;
+	} args;
+	struct {
+		int nr_threads;
+		int nr_steady; /* Threads that have reached the middle once. */
+	} result;
+};
+#define PAB_IOCTL_KTHREADS_STATS _IOWR(PAB_IOCTL_BASE, 8, struct pab_ioctl_kthreads_stats)
+
+/*
+ * Latency histograms, kept per CPU for each kind of operation and each order.
+ * The buckets are log-linear, like HdrHistogram: values below
+ * 2^PAB_HIST_SUB_BITS ns get a bucket each, above that each power of two is
+ * split into 2^PAB_HIST_SUB_BITS buckets. So the bucket width is at most 1/8 of
+ * the value. Values of 2^PAB_HIST_MAX_SHIFT ns or more go in the last bucket.
+ */
+#define PAB_HIST_SUB_BITS		3
+#define PAB_HIST_MAX_SHIFT		32
+#define PAB_HIST_NR_BUCKETS		((PAB_HIST_MAX_SHIFT - PAB_HIST_SUB_BITS + 1) << PAB_HIST_SUB_BITS)
+#define PAB_HIST_NR_ORDERS		11
+
+enum pab_hist_kind {
+	PAB_HIST_ALLOC,
+	PAB_HIST_FREE,
+	PAB_HIST_TOUCH, /* Not recorded for PAB_TOUCH_NONE or PAB_TOUCH_ZERO. */
+	/* Indexed by size class instead of order, see PAB_SLAB_SIZE_CLASS_SHIFT. */
+	PAB_HIST_SLAB_ALLOC,
+	PAB_HIST_SLAB_FREE,
+	PAB_HIST_ALLOC_FAIL, /* Like PAB_HIST_ALLOC, for allocations that failed. */
+	PAB_HIST_NR_KINDS,
+};
+
+struct pab_hist {
+	unsigned long count;
+	unsigned long sum_ns;
+	unsigned long max_ns;
+	unsigned long buckets[PAB_HIST_NR_BUCKETS];
+};
+
+/*
+ * Read a histogram, optionally zeroing it. This isn't synchronized with the
+ * CPUs updating the histograms so if the workload is running, the snapshot
+ * can be slightly inconsistent and the reset can lose a few samples.
+ */
+struct pab_ioctl_hist_read {
+	struct {
+		int kind; /* enum pab_hist_kind */
+		int order;
+		int cpu; /* -1 for the sum over all CPUs. */
+		int reset;
+		struct pab_hist *hist; /* Output. */
+	} args;
+};
+#define PAB_IOCTL_HIST_READ _IOW(PAB_IOCTL_BASE, 9, struct pab_ioctl_hist_read)
+
+/* Zero all the histograms. Same caveat as for the reset flag above. */
+#define PAB_IOCTL_HIST_RESET _IO(PAB_IOCTL_BASE, 10)
+
+/*
+ * Clock used for all the latencies above. The overhead of reading each clock
+ * is measured at load, userspace can subtract it from the latencies.
+ */
+enum pab_clock {
+	PAB_CLOCK_KTIME, /* ktime_get_ns(), the default. */
+	PAB_CLOCK_LOCAL, /* local_clock(). Cheaper, not comparable across CPUs. */
+	PAB_CLOCK_CYCLES, /* Serialized TSC or arch cycle counter, converted to ns. */
+	PAB_CLOCK_NR,
+};
+
+/*
+ * Select the clock, or pass -1 to leave it alone. Fails with EBUSY if the
+ * kthreads are running.
+ */
+struct pab_ioctl_clock {
+	struct {
+		int clock;
+	} args;
+	struct {
+		int clock; /* The one now in use. */
+		long overhead_ns[PAB_CLOCK_NR];
+		unsigned long cycles_per_ms;
+	} result;
+};
+#define PAB_IOCTL_CLOCK _IOWR(PAB_IOCTL_BASE, 11, struct pab_ioctl_clock)
+
+/*
+ * Addresses of the populated zones' zone->lock, so that userspace can filter
+ * the lock contention tracepoints for them.
+ */
+#define PAB_ZONE_NAME_LEN		16
+
+struct pab_zone_lock {
+	int nid;
+	char name[PAB_ZONE_NAME_LEN]; /* e.g. "Normal", always NUL-terminated. */
+	unsigned long lock_addr;
+};
+
+struct pab_ioctl_zone_locks {
+	struct {
+		int nr_zones;
+		struct pab_zone_lock *zones; /* Output array of length nr_zones. */
+	} args;
+	struct {
+		int nr_zones; /* Total number, can be more than args.nr_zones. */
+	} result;
+};
+#define PAB_IOCTL_ZONE_LOCKS _IOWR(PAB_IOCTL_BASE, 16, struct pab_ioctl_zone_locks)
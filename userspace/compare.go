@@ -0,0 +1,217 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"math/rand"
+	"os"
+	"slices"
+	"strings"
+
+	"github.com/google/page_alloc_bench/results"
+	"github.com/google/page_alloc_bench/stats"
+)
+
+// Which way a metric should move for the change to count as an improvement: 1
+// for up, -1 for down, 0 if we don't know.
+func metricDirection(name string) int {
+	for _, s := range []string{"latenc", "failures", "duration_ms", "allocstall", "unmatched", "drift"} {
+		if strings.Contains(name, s) {
+			return -1
+		}
+	}
+	for _, s := range []string{"available_bytes", "thp_bytes", "page_allocs"} {
+		if strings.Contains(name, s) && !strings.Contains(name, "remote") {
+			return 1
+		}
+	}
+	return 0
+}
+
+// Sorts metric names so that the ones for the same run (same suffix, e.g.
+// _order0) are together.
+func compareMetricNames(a, b string) int {
+	runSuffix := func(name string) string {
+		if i := strings.LastIndex(name, "_order"); i >= 0 {
+			return name[i:]
+		}
+		if strings.HasSuffix(name, "_mix") {
+			return "_mix"
+		}
+		return ""
+	}
+	if c := strings.Compare(runSuffix(a), runSuffix(b)); c != 0 {
+		return c
+	}
+	return strings.Compare(a, b)
+}
+
+func readResult(path string) (map[string][]int64, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	if results.IsResultsFile(data) {
+		f, err := results.Read(bytes.NewReader(data))
+		if err != nil {
+			return nil, fmt.Errorf("reading %s: %v", path, err)
+		}
+		for name, samples := range f.Samples {
+			vals := make([]int64, len(samples))
+			for i, s := range samples {
+				vals[i] = s.Value
+			}
+			f.Metrics[name] = vals
+		}
+		return f.Metrics, nil
+	}
+	var result map[string][]int64
+	if err := json.Unmarshal(data, &result); err != nil {
+		return nil, fmt.Errorf("parsing %s: %v", path, err)
+	}
+	return result, nil
+}
+
+type compareOptions struct {
+	thresholdPct float64
+	alpha        float64
+	confidence   float64
+	resamples    int
+	// Judge metrics with a single value on either side by the size of the
+	// change alone, without any statistics.
+	singleValues bool
+}
+
+// Returns 100*(b-a)/a, or 0 if a is 0.
+func deltaPct(a, b float64) float64 {
+	if a == 0 {
+		return 0
+	}
+	return 100 * (b - a) / a
+}
+
+// compareResults prints the comparison of each metric in the candidate against
+// the baseline, and returns the number of metrics that regressed.
+func compareResults(baseline, candidate map[string][]int64, opts *compareOptions) int {
+	var names, missing []string
+	for name := range baseline {
+		if _, ok := candidate[name]; ok {
+			names = append(names, name)
+		} else {
+			missing = append(missing, name)
+		}
+	}
+	for name := range candidate {
+		if _, ok := baseline[name]; !ok {
+			missing = append(missing, name)
+		}
+	}
+	slices.SortFunc(names, compareMetricNames)
+	slices.Sort(missing)
+
+	random := rand.New(rand.NewSource(0))
+	regressions := 0
+	fmt.Printf("%-60s %14s %14s %9s %9s %22s %8s\n",
+		"metric", "base median", "new median", "delta", "p90 delta",
+		fmt.Sprintf("median %v%% CI", 100*opts.confidence), "p-value")
+	for _, name := range names {
+		a, b := stats.Sorted(baseline[name]), stats.Sorted(candidate[name])
+		if len(a) == 0 || len(b) == 0 {
+			continue
+		}
+		medA, medB := stats.Quantile(a, 0.5), stats.Quantile(b, 0.5)
+		delta := deltaPct(medA, medB)
+		p90Delta := deltaPct(stats.Quantile(a, 0.9), stats.Quantile(b, 0.9))
+		ci, pValue := "n/a", "n/a"
+		significant := opts.singleValues
+		if len(a) >= 2 && len(b) >= 2 {
+			// Bootstrapping the raw latency samples is expensive,
+			// use fewer resamples for them.
+			resamples := max(100, min(opts.resamples, 20_000_000/(len(a)+len(b))))
+			lo, hi := stats.BootstrapQuantileDiff(a, b, 0.5, opts.confidence, resamples, random)
+			ci = fmt.Sprintf("[%+.1f%%, %+.1f%%]", deltaPct(medA, medA+lo), deltaPct(medA, medA+hi))
+			p := stats.MannWhitneyU(a, b)
+			pValue = fmt.Sprintf("%.3g", p)
+			significant = p < opts.alpha
+		}
+		verdict := ""
+		if dir := metricDirection(name); dir != 0 && significant && delta != 0 {
+			if float64(dir)*delta < 0 {
+				verdict = "worse"
+				if opts.thresholdPct > 0 && -float64(dir)*delta > opts.thresholdPct {
+					verdict = "REGRESSION"
+					regressions++
+				}
+			} else {
+				verdict = "better"
+			}
+		}
+		fmt.Printf("%-60s %14.0f %14.0f %+8.1f%% %+8.1f%% %22s %8s %s\n",
+			name, medA, medB, delta, p90Delta, ci, pValue, verdict)
+	}
+	for _, name := range missing {
+		fmt.Printf("%-60s only in one result\n", name)
+	}
+	return regressions
+}
+
+// compareMain compares one or more result files against a baseline.
+func compareMain(args []string) error {
+	flags := flag.NewFlagSet("compare", flag.ExitOnError)
+	flags.Usage = func() {
+		fmt.Fprintf(flags.Output(), "Usage: page_alloc_bench compare [flags] BASELINE CANDIDATE...\n")
+		flags.PrintDefaults()
+	}
+	thresholdPct := flags.Float64("regression-threshold-pct", 0, "Fail if a metric gets significantly worse by more than this percentage. 0 to never fail.")
+	alpha := flags.Float64("alpha", 0.05, "Mann-Whitney p-value below which a change counts as significant")
+	confidence := flags.Float64("confidence", 0.95, "Confidence level of the bootstrap intervals")
+	resamples := flags.Int("resamples", 10000, "Number of bootstrap resamples")
+	singleValues := flags.Bool("judge-single-values", false, "Mark metrics with only one value on either side better, worse or regressed by the change alone. Otherwise they need at least two values on each side to be judged.")
+	flags.Parse(args)
+	if flags.NArg() < 2 {
+		flags.Usage()
+		return fmt.Errorf("need a baseline and at least one candidate result file")
+	}
+	opts := &compareOptions{
+		thresholdPct: *thresholdPct,
+		alpha:        *alpha,
+		confidence:   *confidence,
+		resamples:    *resamples,
+		singleValues: *singleValues,
+	}
+
+	baseline, err := readResult(flags.Arg(0))
+	if err != nil {
+		return err
+	}
+	regressions := 0
+	for _, path := range flags.Args()[1:] {
+		candidate, err := readResult(path)
+		if err != nil {
+			return err
+		}
+		fmt.Printf("\n%s vs %s:\n", path, flags.Arg(0))
+		regressions += compareResults(baseline, candidate, opts)
+	}
+	if regressions != 0 {
+		return fmt.Errorf("%d metrics regressed by more than %v%%", regressions, *thresholdPct)
+	}
+	return nil
+}
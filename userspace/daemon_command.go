@@ -0,0 +1,310 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+package main
+
+import (
+	"context"
+	"errors"
+	"flag"
+	"fmt"
+	"net"
+	"net/http"
+	"os"
+	"os/signal"
+	"slices"
+	"strconv"
+	"sync"
+	"syscall"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/mmstat"
+	"github.com/google/page_alloc_bench/openmetrics"
+	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/workload/kallocfree"
+	"golang.org/x/sync/errgroup"
+)
+
+// Smallest rate scale the CPU budget can push the workload down to. It keeps
+// running a little so that the metrics keep coming and it can speed up again.
+const minRateScale = 1.0 / 1024
+
+// daemon holds the state of the daemon subcommand. Everything apart from
+// families is only touched by the kallocfree sampler goroutine, in update.
+type daemon struct {
+	workload  *kallocfree.Workload
+	cancel    context.CancelCauseFunc
+	info      []string // Label pairs for page_alloc_bench_info.
+	budgetPct float64
+
+	pagesAllocated, pagesFreed, allocFailures uint64
+	prevUser, prevSystem                      time.Duration
+	rateScale                                 float64
+	overBudget                                uint64
+
+	mu       sync.Mutex
+	families []*openmetrics.Family // Rebuilt each interval, served as is.
+}
+
+// throttle adjusts the workload's rate so that the whole process stays under
+// the CPU budget. Most of the CPU time goes on the allocations, so it's taken
+// to be proportional to the rate. It slows down straight to a bit under the
+// budget, but only speeds up by 2x per interval so it doesn't overshoot much.
+func (d *daemon) throttle(usedPct float64) {
+	if d.budgetPct == 0 {
+		return
+	}
+	if usedPct > d.budgetPct {
+		d.overBudget++
+	}
+	target := 0.9 * d.budgetPct
+	d.rateScale = min(1, max(minRateScale, d.rateScale*target/max(usedPct, target/2)))
+	d.workload.SetRateScale(d.rateScale)
+}
+
+func latencyFamily(name, help string, h *hist.Histogram) *openmetrics.Family {
+	f := &openmetrics.Family{Name: name, Type: openmetrics.Gauge, Help: help}
+	for _, q := range []float64{0.5, 0.99, 0.999} {
+		f.Add(float64(h.Quantile(q))/1e9, "quantile", strconv.FormatFloat(q, 'g', -1, 64))
+	}
+	f.Add(float64(h.Max)/1e9, "quantile", "1")
+	return f
+}
+
+func sortedKeys[V any](m map[string]V) []string {
+	var keys []string
+	for k := range m {
+		keys = append(keys, k)
+	}
+	slices.Sort(keys)
+	return keys
+}
+
+// Family for a map of per-order counts from mmstat.
+func ordersFamily(name, help, label string, counts map[string][]int64) *openmetrics.Family {
+	f := &openmetrics.Family{Name: name, Type: openmetrics.Gauge, Help: help}
+	for _, k := range sortedKeys(counts) {
+		for order, n := range counts[k] {
+			f.Add(float64(n), label, k, "order", strconv.Itoa(order))
+		}
+	}
+	return f
+}
+
+// update is the kallocfree OnInterval callback. It does all the work, so that
+// scrapes just copy out the last interval's metrics.
+func (d *daemon) update(interval *kallocfree.Interval) {
+	snapshot, err := mmstat.Take()
+	if err != nil {
+		d.cancel(fmt.Errorf("taking mmstat snapshot: %v", err))
+		return
+	}
+	user, system, err := linux.ProcessCPUTime()
+	if err != nil {
+		d.cancel(err)
+		return
+	}
+	seconds := interval.Duration.Seconds()
+	usedPct := (user + system - d.prevUser - d.prevSystem).Seconds() / seconds * 100
+	d.prevUser, d.prevSystem = user, system
+	d.throttle(usedPct)
+	d.pagesAllocated += interval.PagesAllocated
+	d.pagesFreed += interval.PagesFreed
+	d.allocFailures += interval.AllocFailures
+
+	info := &openmetrics.Family{Name: "page_alloc_bench_info", Type: openmetrics.Gauge,
+		Help: "Configuration of the kernel allocation antagonist, the value is always 1"}
+	info.Add(1, d.info...)
+	counter := func(name, help string, value float64) *openmetrics.Family {
+		f := &openmetrics.Family{Name: name, Type: openmetrics.Counter, Help: help}
+		f.Add(value)
+		return f
+	}
+	gauge := func(name, help string, value float64) *openmetrics.Family {
+		f := &openmetrics.Family{Name: name, Type: openmetrics.Gauge, Help: help}
+		f.Add(value)
+		return f
+	}
+	cpuSeconds := &openmetrics.Family{Name: "page_alloc_bench_cpu_seconds", Type: openmetrics.Counter,
+		Help: "CPU time used by the whole daemon"}
+	cpuSeconds.Add(user.Seconds(), "mode", "user")
+	cpuSeconds.Add(system.Seconds(), "mode", "system")
+	pcpPages := &openmetrics.Family{Name: "page_alloc_bench_pcp_pages", Type: openmetrics.Gauge,
+		Help: "Pages in the per-CPU lists of each zone, summed over CPUs"}
+	for _, zone := range sortedKeys(snapshot.PCPPages) {
+		pcpPages.Add(float64(snapshot.PCPPages[zone]), "zone", zone)
+	}
+	vmstat := &openmetrics.Family{Name: "page_alloc_bench_vmstat", Type: openmetrics.Counter,
+		Help: "Selected /proc/vmstat counters"}
+	for _, name := range sortedKeys(snapshot.Vmstat) {
+		vmstat.Add(float64(snapshot.Vmstat[name]), "counter", name)
+	}
+
+	families := []*openmetrics.Family{
+		info,
+		counter("page_alloc_bench_pages_allocated", "Pages allocated by the antagonist", float64(d.pagesAllocated)),
+		counter("page_alloc_bench_pages_freed", "Pages freed by the antagonist", float64(d.pagesFreed)),
+		counter("page_alloc_bench_alloc_failures", "Failed allocation attempts by the antagonist", float64(d.allocFailures)),
+		gauge("page_alloc_bench_interval_seconds", "Length of the interval the page_alloc_bench_interval_* metrics cover", seconds),
+		gauge("page_alloc_bench_interval_allocs_per_second", "Pages allocated per second during the interval", float64(interval.PagesAllocated)/seconds),
+		gauge("page_alloc_bench_interval_failures_per_second", "Failed allocation attempts per second during the interval", float64(interval.AllocFailures)/seconds),
+		latencyFamily("page_alloc_bench_interval_alloc_latency_seconds",
+			"Allocation latency quantiles during the interval, 1 is the estimated maximum", interval.AllocLatencyHist),
+		latencyFamily("page_alloc_bench_interval_free_latency_seconds",
+			"Free latency quantiles during the interval, 1 is the estimated maximum", interval.FreeLatencyHist),
+		ordersFamily("page_alloc_bench_free_blocks", "Free blocks per zone and order, from /proc/buddyinfo",
+			"zone", snapshot.FreeBlocks),
+		ordersFamily("page_alloc_bench_free_blocks_by_type", "Free blocks per migratetype and order, from /proc/pagetypeinfo",
+			"migratetype", snapshot.FreeBlocksByType),
+		pcpPages,
+		vmstat,
+		cpuSeconds,
+		gauge("page_alloc_bench_interval_cpu_ratio", "CPU time used by the daemon during the interval, as a fraction of one CPU", usedPct/100),
+		gauge("page_alloc_bench_cpu_budget_ratio", "CPU budget, as a fraction of one CPU. 0 means no limit.", d.budgetPct/100),
+		gauge("page_alloc_bench_rate_scale", "Factor the CPU budget has scaled the allocation rate by", d.rateScale),
+		counter("page_alloc_bench_over_budget_intervals", "Intervals in which the daemon used more CPU than its budget", float64(d.overBudget)),
+	}
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	d.families = families
+}
+
+func (d *daemon) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	d.mu.Lock()
+	families := d.families
+	d.mu.Unlock()
+	w.Header().Set("Content-Type", openmetrics.ContentType)
+	if err := openmetrics.Write(w, families); err != nil {
+		fmt.Fprintf(os.Stderr, "Writing metrics: %v\n", err)
+	}
+}
+
+func daemonMain(args []string) error {
+	flags := flag.NewFlagSet("daemon", flag.ExitOnError)
+	listenAddr := flags.String("listen-addr", "localhost:9464", "Address to serve OpenMetrics on, at /metrics")
+	intervalS := flags.Int("interval-s", 10, "Interval that the exported latency percentiles and rates cover")
+	cpusStr := flags.String("cpus", "0", "CPUs to run the kernel allocation workers on, e.g. 0-3,8")
+	order := flags.Int("order", 0, "Allocation order")
+	gfpStr := flags.String("gfp", "kernel", "GFP flags for the allocations, as in --gfp without the daemon subcommand")
+	clockStr := flags.String("clock", "ktime", "Clock the kernel module times operations with: ktime, local_clock or cycles")
+	patternStr := flags.String("pattern", "steady-rate:rate=1000", "Allocation pattern for each CPU: steady-rate or poisson, with their rate parameter")
+	memoryMB := flags.Int("kernel-memory-mb", 64, "Average MiB held by the allocations across all the CPUs")
+	batchSize := flags.Int("batch-size", 16, "Max number of pages the workers alloc/free per ioctl")
+	budgetPct := flags.Float64("cpu-budget-pct", 1, "CPU time the whole daemon may use, as a percentage of one CPU. The allocation rate is scaled down to stay under it. 0 for no limit.")
+	flags.Parse(args)
+
+	if *intervalS <= 0 {
+		return fmt.Errorf("--interval-s must be positive")
+	}
+	if *memoryMB <= 0 {
+		return fmt.Errorf("--kernel-memory-mb must be positive")
+	}
+	if *budgetPct < 0 {
+		return fmt.Errorf("--cpu-budget-pct can't be negative")
+	}
+	if *order < 0 || *order >= kmod.HistNumOrders {
+		return fmt.Errorf("Bad --order: %d not in [0, %d)", *order, kmod.HistNumOrders)
+	}
+	cpuMask, err := linux.CPUMaskFromString(*cpusStr)
+	if err != nil {
+		return fmt.Errorf("Bad --cpus: %v", err)
+	}
+	var cpus []int
+	for _, cpu := range cpuMask {
+		cpus = append(cpus, int(cpu))
+	}
+	gfp, err := kmod.ParseGFP(*gfpStr)
+	if err != nil {
+		return fmt.Errorf("Bad --gfp: %v", err)
+	}
+	clock, err := kmod.ParseClockSource(*clockStr)
+	if err != nil {
+		return fmt.Errorf("Bad --clock: %v", err)
+	}
+	pattern, err := kallocfree.ParsePattern(*patternStr)
+	if err != nil {
+		return fmt.Errorf("Bad --pattern: %v", err)
+	}
+	if pattern.Name != "steady-rate" && pattern.Name != "poisson" {
+		// The others aren't rate-limited.
+		return fmt.Errorf("Bad --pattern: only steady-rate and poisson are supported")
+	}
+
+	ctx, stop := signal.NotifyContext(context.Background(), os.Interrupt, syscall.SIGTERM)
+	defer stop()
+	ctx, cancel := context.WithCancelCause(ctx)
+	defer cancel(nil)
+	d := &daemon{
+		cancel:    cancel,
+		info:      []string{"order", strconv.Itoa(*order), "gfp", *gfpStr, "pattern", pattern.String(), "clock", *clockStr},
+		budgetPct: *budgetPct,
+		rateScale: 1,
+	}
+	d.workload, err = kallocfree.New(ctx, &kallocfree.Options{
+		TotalMemory:    pab.ByteSize(*memoryMB) * pab.Megabyte,
+		Order:          *order,
+		GFP:            gfp,
+		Clock:          clock,
+		BatchSize:      *batchSize,
+		Pattern:        pattern,
+		CPUs:           cpus,
+		SampleInterval: time.Duration(*intervalS) * time.Second,
+		OnInterval:     d.update,
+	})
+	if err != nil {
+		return fmt.Errorf("setting up kallocfree workload: %v", err)
+	}
+	defer d.workload.Close()
+	if d.prevUser, d.prevSystem, err = linux.ProcessCPUTime(); err != nil {
+		return err
+	}
+	listener, err := net.Listen("tcp", *listenAddr)
+	if err != nil {
+		return fmt.Errorf("listening on %s: %v", *listenAddr, err)
+	}
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", d)
+	server := &http.Server{Handler: mux}
+	fmt.Printf("Serving metrics on http://%s/metrics\n", listener.Addr())
+
+	eg, egCtx := errgroup.WithContext(ctx)
+	eg.Go(func() error {
+		if err := server.Serve(listener); !errors.Is(err, http.ErrServerClosed) {
+			return fmt.Errorf("serving metrics: %v", err)
+		}
+		return nil
+	})
+	eg.Go(func() error {
+		<-egCtx.Done()
+		return server.Close()
+	})
+	eg.Go(func() error {
+		r, err := d.workload.Run(egCtx)
+		if err != nil {
+			return fmt.Errorf("running kallocfree workload: %v", err)
+		}
+		fmt.Printf("Allocated %d pages, freed %d, %d failures\n", r.PagesAllocated, r.PagesFreed, r.AllocFailures)
+		return nil
+	})
+	if err := eg.Wait(); err != nil {
+		return err
+	}
+	if err := context.Cause(ctx); !errors.Is(err, context.Canceled) {
+		return err
+	}
+	return nil
+}
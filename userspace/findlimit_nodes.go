@@ -0,0 +1,81 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"context"
+	"fmt"
+
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/workload/findlimit"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
+)
+
+// nodeMetrics runs the --findlimit-per-node iterations and accumulates their
+// per-node results.
+type nodeMetrics struct {
+	nodes     []int
+	available [][]int64 // Indexed like nodes, then by iteration.
+}
+
+// newNodeMetrics returns nil, which is fine to use, without
+// --findlimit-per-node.
+func newNodeMetrics() (*nodeMetrics, error) {
+	if !*perNodeFlag {
+		return nil, nil
+	}
+	nodes, err := linux.NodesWithMemory()
+	if err != nil {
+		return nil, fmt.Errorf("finding NUMA nodes with memory: %v", err)
+	}
+	return &nodeMetrics{nodes: nodes, available: make([][]int64, len(nodes))}, nil
+}
+
+// run does one iteration: a findlimit child bound to each node in turn, with
+// MPOL_BIND so that it can't fall back to the others. It returns the overall
+// result, where the byte counts and durations are sums over the nodes.
+func (m *nodeMetrics) run(ctx context.Context, base *findlimit.Options) (*findlimit.Result, error) {
+	total := &findlimit.Result{FaultLatencyHists: &progress.FaultHists{}}
+	for i, nid := range m.nodes {
+		opts := *base
+		opts.Mempolicy = &linux.Mempolicy{Mode: linux.MPOL_BIND, Nodes: []int{nid}}
+		if base.Cgroup != nil {
+			cgroupOpts := *base.Cgroup
+			cgroupOpts.Nodes = []int{nid}
+			opts.Cgroup = &cgroupOpts
+		}
+		r, err := findlimit.Run(ctx, &opts)
+		if err != nil {
+			return nil, fmt.Errorf("on node %d: %v", nid, err)
+		}
+		m.available[i] = append(m.available[i], r.Allocated.Bytes())
+		addFindlimitResult(total, r)
+		total.Duration += r.Duration
+		if r.StopReason != "" {
+			total.StopReason = fmt.Sprintf("%s on node %d", r.StopReason, nid)
+		}
+	}
+	return total, nil
+}
+
+func (m *nodeMetrics) addTo(result map[string][]int64, prefix string) {
+	if m == nil {
+		return
+	}
+	for i, available := range m.available {
+		result[fmt.Sprintf("%s%d_available_bytes", prefix, m.nodes[i])] = available
+	}
+}
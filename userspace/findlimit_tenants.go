@@ -0,0 +1,133 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"fmt"
+	"math"
+	"slices"
+	"strings"
+
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/perf"
+	"github.com/google/page_alloc_bench/workload/findlimit"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
+)
+
+// findlimitTenantsOptions builds the options for multi-tenant findlimit runs
+// from the flags, on top of the single-child options.
+func findlimitTenantsOptions(base *findlimit.Options) (*findlimit.TenantsOptions, error) {
+	var policies []*linux.Mempolicy
+	if *tenantPoliciesFlag != "" {
+		for _, s := range strings.Split(*tenantPoliciesFlag, ";") {
+			policy, err := linux.ParseMempolicy(s)
+			if err != nil {
+				return nil, fmt.Errorf("Bad value %q in --findlimit-tenant-mempolicies: %v", s, err)
+			}
+			policies = append(policies, policy)
+		}
+	}
+	opts := &findlimit.TenantsOptions{Options: *base}
+	for i := 0; i < *tenantsFlag; i++ {
+		tenant := findlimit.TenantOptions{
+			FaultRate: pab.ByteSize(*tenantFaultRateFlag) * pab.Megabyte,
+		}
+		if len(policies) != 0 {
+			tenant.Mempolicy = policies[i%len(policies)]
+		}
+		opts.Tenants = append(opts.Tenants, tenant)
+	}
+	return opts, nil
+}
+
+// addFindlimitResult adds the byte counts, fault latencies and perf counts of
+// one child's result to a total. total.FaultLatencyHists must be non-nil.
+func addFindlimitResult(total, r *findlimit.Result) {
+	total.Allocated += r.Allocated
+	total.THPAllocated += r.THPAllocated
+	for band := range total.FaultLatencyHists {
+		total.FaultLatencyHists[band].Merge(&r.FaultLatencyHists[band])
+	}
+	if r.Perf != nil {
+		if total.Perf == nil {
+			total.Perf = make(perf.Counts)
+		}
+		total.Perf.Add(r.Perf)
+	}
+}
+
+// tenantMetrics accumulates the per-tenant results over findlimit iterations.
+type tenantMetrics struct {
+	available [][]int64 // Indexed by tenant then iteration.
+	// Per iteration, Jain's fairness index of the tenants' byte counts
+	// (from 1/n when one tenant got everything to 1 when they all got the
+	// same) in thousandths, and (max-min)/mean as a percentage.
+	fairness, spread []int64
+}
+
+// newTenantMetrics returns nil, which is fine to use, if there's only one
+// tenant.
+func newTenantMetrics(numTenants int) *tenantMetrics {
+	if numTenants <= 1 {
+		return nil
+	}
+	return &tenantMetrics{available: make([][]int64, numTenants)}
+}
+
+// add records the outcome of an iteration and returns the overall result,
+// where the byte counts are the sums over the tenants.
+func (m *tenantMetrics) add(r *findlimit.TenantsResult) *findlimit.Result {
+	total := &findlimit.Result{
+		Duration:          r.Duration,
+		FaultLatencyHists: &progress.FaultHists{},
+	}
+	var bytes []float64
+	for i, tenant := range r.Tenants {
+		m.available[i] = append(m.available[i], tenant.Allocated.Bytes())
+		bytes = append(bytes, float64(tenant.Allocated.Bytes()))
+		addFindlimitResult(total, tenant)
+		if tenant.StopReason != "" {
+			total.StopReason = fmt.Sprintf("%s in tenant %d", tenant.StopReason, i)
+		}
+	}
+
+	var sum, sumSquares float64
+	for _, b := range bytes {
+		sum += b
+		sumSquares += b * b
+	}
+	var jain, spread float64
+	if sum > 0 {
+		n := float64(len(bytes))
+		jain = sum * sum / (n * sumSquares)
+		spread = (slices.Max(bytes) - slices.Min(bytes)) / (sum / n)
+	}
+	m.fairness = append(m.fairness, int64(math.Round(jain*1000)))
+	m.spread = append(m.spread, int64(math.Round(spread*100)))
+	return total
+}
+
+func (m *tenantMetrics) addTo(result map[string][]int64, prefix string) {
+	if m == nil {
+		return
+	}
+	for i, available := range m.available {
+		result[fmt.Sprintf("%s%d_available_bytes", prefix, i)] = available
+	}
+	result[prefix+"_fairness_permille"] = m.fairness
+	result[prefix+"_spread_pct"] = m.spread
+}
@@ -0,0 +1,109 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"context"
+	"flag"
+	"fmt"
+	"os"
+	"os/signal"
+	"strconv"
+	"strings"
+
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/workload/highorder"
+)
+
+func highorderMain(args []string) error {
+	flags := flag.NewFlagSet("highorder", flag.ExitOnError)
+	fillPercent := flags.Int("fill-percent", 80, "Percentage of MemAvailable to fill with order-0 pages before fragmenting it")
+	keepOrder := flags.Int("keep-order", 1, "Keep one fill page per aligned block of 2^N pages and free the rest. 1 frees every other page.")
+	fillGFP := flags.String("fill-gfp", "kernel", "GFP flags for the fill, this decides the migratetype of the pages that stay pinned")
+	ordersStr := flags.String("orders", "2,4,9", "Comma-separated orders to attempt")
+	modesStr := flags.String("modes", "noretry,compact", "Comma-separated attempt modes: noretry (__GFP_NORETRY) and compact (__GFP_RETRY_MAYFAIL)")
+	attempts := flags.Int("attempts", 256, "Attempts per order and mode. Successes are held until the batch is done.")
+	outputPath := flags.String("output-path", "", "File to write JSON results to")
+	flags.Parse(args)
+
+	if *fillPercent <= 0 || *fillPercent > 100 {
+		return fmt.Errorf("--fill-percent must be in (0, 100]")
+	}
+	if *keepOrder < 1 || *keepOrder >= kmod.HistNumOrders {
+		return fmt.Errorf("--keep-order must be in [1, %d)", kmod.HistNumOrders)
+	}
+	if *attempts <= 0 {
+		return fmt.Errorf("--attempts must be positive")
+	}
+	gfp, err := kmod.ParseGFP(*fillGFP)
+	if err != nil {
+		return fmt.Errorf("Bad --fill-gfp: %v", err)
+	}
+	var orders []int
+	for _, s := range strings.Split(*ordersStr, ",") {
+		order, err := strconv.Atoi(s)
+		if err != nil {
+			return fmt.Errorf("Bad --orders: %v", err)
+		}
+		if order < 1 || order >= kmod.HistNumOrders {
+			return fmt.Errorf("Bad --orders: %d not in [1, %d)", order, kmod.HistNumOrders)
+		}
+		orders = append(orders, order)
+	}
+	modes, err := highorder.ParseModes(*modesStr)
+	if err != nil {
+		return fmt.Errorf("Bad --modes: %v", err)
+	}
+
+	ctx, cancel := signal.NotifyContext(context.Background(), os.Interrupt)
+	defer cancel()
+	workload, err := highorder.New(&highorder.Options{
+		FillPercent: *fillPercent,
+		KeepOrder:   *keepOrder,
+		FillGFP:     gfp,
+		Orders:      orders,
+		Modes:       modes,
+		Attempts:    *attempts,
+	})
+	if err != nil {
+		return fmt.Errorf("setting up highorder workload: %v", err)
+	}
+	r, err := workload.Run(ctx)
+	if err != nil {
+		return fmt.Errorf("running highorder workload: %v", err)
+	}
+
+	result := map[string][]int64{
+		"highorder_fill_pages": {int64(r.FillPages)},
+		"highorder_kept_pages": {int64(r.KeptPages)},
+	}
+	r.Fragmented.AddMetrics(result, "highorder_fragmented")
+	for _, b := range r.Batches {
+		prefix := fmt.Sprintf("highorder_%s_order%d", b.Mode, b.Order)
+		result[prefix+"_successes"] = []int64{int64(b.Successes)}
+		result[prefix+"_failures"] = []int64{int64(b.Failures)}
+		result[prefix+"_success_permille"] = []int64{int64(b.Successes * 1000 / max(1, b.Successes+b.Failures))}
+		result[prefix+"_duration_ms"] = []int64{b.Duration.Milliseconds()}
+		addHistMetrics(result, prefix+"_success_latency", b.SuccessLatency)
+		addHistMetrics(result, prefix+"_failure_latency", b.FailureLatency)
+		b.After.AddDeltaMetrics(result, prefix, b.Before)
+	}
+	printResult(result)
+	if *outputPath != "" {
+		return writeOutput(*outputPath, result)
+	}
+	return nil
+}
@@ -0,0 +1,146 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package hist implements log-linear histograms, with the same bucket layout as
+// the ones in the kernel module (see page_alloc_bench.h).
+package hist
+
+import (
+	"math"
+	"math/bits"
+)
+
+const (
+	// SubBits is log2 of the number of buckets each power of two is split
+	// into.
+	SubBits = 3
+	// Values >= 1<<MaxShift go in the last bucket.
+	MaxShift   = 32
+	NumBuckets = (MaxShift - SubBits + 1) << SubBits
+)
+
+// Histogram counts values (usually nanoseconds) into buckets whose width is at
+// most 1/(1<<SubBits) of their value. The zero value is an empty histogram.
+type Histogram struct {
+	Count   uint64
+	Sum     uint64
+	Max     uint64
+	Buckets [NumBuckets]uint64
+}
+
+// Bucket returns the index of the bucket that counts v.
+func Bucket(v uint64) int {
+	if v < 1<<SubBits {
+		return int(v)
+	}
+	if v >= 1<<MaxShift {
+		return NumBuckets - 1
+	}
+	shift := 63 - bits.LeadingZeros64(v) - SubBits
+	return (shift+1)<<SubBits + int((v>>shift)&(1<<SubBits-1))
+}
+
+// BucketBounds returns the lowest value and one more than the highest value
+// that would be counted in the given bucket. The last bucket holds its normal
+// range and everything above it, its upper bound is reported as
+// math.MaxUint64.
+func BucketBounds(i int) (uint64, uint64) {
+	if i < 1<<SubBits {
+		return uint64(i), uint64(i) + 1
+	}
+	shift := i>>SubBits - 1
+	low := uint64(1<<SubBits|i&(1<<SubBits-1)) << shift
+	if i == NumBuckets-1 {
+		return low, math.MaxUint64
+	}
+	return low, low + 1<<shift
+}
+
+// Record adds a value to the histogram.
+func (h *Histogram) Record(v uint64) {
+	h.Count++
+	h.Sum += v
+	h.Max = max(h.Max, v)
+	h.Buckets[Bucket(v)]++
+}
+
+// Merge adds the contents of another histogram into this one.
+func (h *Histogram) Merge(o *Histogram) {
+	h.Count += o.Count
+	h.Sum += o.Sum
+	h.Max = max(h.Max, o.Max)
+	for i := range h.Buckets {
+		h.Buckets[i] += o.Buckets[i]
+	}
+}
+
+// Since returns a histogram of the values recorded after the earlier snapshot
+// prev of the same histogram was taken. The max of those values isn't known, so
+// it's estimated as the upper bound of the highest non-empty bucket (but no
+// more than the overall Max).
+func (h *Histogram) Since(prev *Histogram) *Histogram {
+	var d Histogram
+	// Unsynchronized snapshots can be slightly inconsistent, don't let that
+	// wrap around.
+	sub := func(a, b uint64) uint64 {
+		if b > a {
+			return 0
+		}
+		return a - b
+	}
+	d.Count = sub(h.Count, prev.Count)
+	d.Sum = sub(h.Sum, prev.Sum)
+	for i := range d.Buckets {
+		d.Buckets[i] = sub(h.Buckets[i], prev.Buckets[i])
+		if d.Buckets[i] != 0 {
+			_, high := BucketBounds(i)
+			d.Max = min(high-1, h.Max)
+		}
+	}
+	return &d
+}
+
+// Mean returns the exact mean of the recorded values, or 0 if empty.
+func (h *Histogram) Mean() float64 {
+	if h.Count == 0 {
+		return 0
+	}
+	return float64(h.Sum) / float64(h.Count)
+}
+
+// Quantile returns an estimate of the value below which the fraction q of the
+// recorded values fall. The estimate is the midpoint of the bucket containing
+// that value, so its error is within the bucket width, except in the unbounded
+// last bucket where it's just Max. It never exceeds Max, which is exact.
+// Returns 0 if the histogram is empty.
+func (h *Histogram) Quantile(q float64) uint64 {
+	if h.Count == 0 {
+		return 0
+	}
+	// Rank of the value we want, counting from 1.
+	rank := uint64(math.Ceil(q * float64(h.Count)))
+	rank = min(max(rank, 1), h.Count)
+	var seen uint64
+	for i, n := range h.Buckets {
+		seen += n
+		if seen >= rank {
+			low, high := BucketBounds(i)
+			return min(low+(high-low)/2, h.Max)
+		}
+	}
+	// Buckets didn't add up to Count, i.e. it was snapshotted while being
+	// updated.
+	return h.Max
+}
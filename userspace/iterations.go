@@ -0,0 +1,103 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"math/rand"
+	"time"
+
+	"github.com/google/page_alloc_bench/stats"
+)
+
+// Confidence level of the intervals that --target-ci-pct applies to, and the
+// number of bootstrap resamples used to estimate them. The samples are
+// findlimit iterations so there are never many, the resampling is cheap.
+const (
+	iterationCIConfidence = 0.95
+	iterationCIResamples  = 2000
+)
+
+// iterationPolicy decides how many findlimit iterations a phase runs. With a
+// targetCIPct it keeps going until the confidence interval of the median
+// available bytes is narrow enough, otherwise it runs exactly max.
+type iterationPolicy struct {
+	min, max    int
+	targetCIPct float64       // Full width of the CI as a percentage of the median, 0 to disable.
+	budget      time.Duration // Per phase, 0 means no limit.
+}
+
+// Builds the policy from the flags.
+func flagIterationPolicy() *iterationPolicy {
+	if *targetCIPctFlag == 0 {
+		return &iterationPolicy{min: *iterationsFlag, max: *iterationsFlag}
+	}
+	return &iterationPolicy{
+		min:         *minIterationsFlag,
+		max:         *maxIterationsFlag,
+		targetCIPct: *targetCIPctFlag,
+		budget:      time.Duration(*iterationBudgetSFlag) * time.Second,
+	}
+}
+
+// availableCI is the confidence interval of the median of the available byte
+// counts measured so far.
+type availableCI struct {
+	median, lo, hi float64
+}
+
+// widthPct returns the full width of the interval as a percentage of the
+// median.
+func (ci *availableCI) widthPct() float64 {
+	if ci.median == 0 {
+		return 0
+	}
+	return 100 * (ci.hi - ci.lo) / ci.median
+}
+
+// Returns nil with fewer than 2 samples.
+func medianCI(vals []int64) *availableCI {
+	if len(vals) < 2 {
+		return nil
+	}
+	sorted := stats.Sorted(vals)
+	// Seeded so the decision to stop is reproducible given the samples.
+	random := rand.New(rand.NewSource(0))
+	lo, hi := stats.BootstrapQuantileCI(sorted, 0.5, iterationCIConfidence, iterationCIResamples, random)
+	return &availableCI{median: stats.Quantile(sorted, 0.5), lo: lo, hi: hi}
+}
+
+// done returns whether to stop after the iterations so far, given the
+// available bytes they measured and how long the phase has taken. It also
+// returns why, for the log.
+func (p *iterationPolicy) done(available []int64, elapsed time.Duration) (bool, string) {
+	n := len(available)
+	if n >= p.max {
+		return true, "reached max iterations"
+	}
+	if n < p.min {
+		return false, ""
+	}
+	if p.targetCIPct != 0 {
+		if ci := medianCI(available); ci != nil && ci.widthPct() <= p.targetCIPct {
+			return true, "converged"
+		}
+	}
+	// Don't start an iteration that's likely to go over budget.
+	if p.budget != 0 && n != 0 && elapsed+elapsed/time.Duration(n) > p.budget {
+		return true, "out of time budget"
+	}
+	return false, ""
+}
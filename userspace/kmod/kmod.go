@@ -18,10 +18,16 @@ package kmod
 
 import (
 	"flag"
+	"fmt"
+	"math/bits"
 	"os"
+	"strconv"
+	"strings"
+	"syscall"
 	"time"
 	"unsafe"
 
+	"github.com/google/page_alloc_bench/hist"
 	"github.com/google/page_alloc_bench/linux"
 )
 
@@ -33,9 +39,29 @@ import (
 const uintptr_t pab_ioctl_alloc_page = PAB_IOCTL_ALLOC_PAGE;
 const uintptr_t pab_ioctl_free_page_legacy = PAB_IOCTL_FREE_PAGE_LEGACY;
 const uintptr_t pab_ioctl_free_page = PAB_IOCTL_FREE_PAGE;
+const uintptr_t pab_ioctl_alloc_pages = PAB_IOCTL_ALLOC_PAGES;
+const uintptr_t pab_ioctl_free_pages = PAB_IOCTL_FREE_PAGES;
+const uintptr_t pab_ioctl_kthreads_start = PAB_IOCTL_KTHREADS_START;
+const uintptr_t pab_ioctl_kthreads_stop = PAB_IOCTL_KTHREADS_STOP;
+const uintptr_t pab_ioctl_kthreads_stats = PAB_IOCTL_KTHREADS_STATS;
+const uintptr_t pab_ioctl_hist_read = PAB_IOCTL_HIST_READ;
+const uintptr_t pab_ioctl_hist_reset = PAB_IOCTL_HIST_RESET;
+const uintptr_t pab_ioctl_clock = PAB_IOCTL_CLOCK;
+const uintptr_t pab_ioctl_slab_cache_create = PAB_IOCTL_SLAB_CACHE_CREATE;
+const uintptr_t pab_ioctl_slab_cache_destroy = PAB_IOCTL_SLAB_CACHE_DESTROY;
+const uintptr_t pab_ioctl_slab_alloc = PAB_IOCTL_SLAB_ALLOC;
+const uintptr_t pab_ioctl_slab_free = PAB_IOCTL_SLAB_FREE;
+const uintptr_t pab_ioctl_zone_locks = PAB_IOCTL_ZONE_LOCKS;
 */
 import "C"
 
+func init() {
+	if C.PAB_HIST_NR_BUCKETS != hist.NumBuckets {
+		panic(fmt.Sprintf("page_alloc_bench.h has %d histogram buckets, package hist has %d",
+			C.PAB_HIST_NR_BUCKETS, hist.NumBuckets))
+	}
+}
+
 var legacyFreePageInterface = flag.Bool("kmod-legacy-free-page", false,
 	"[Google hack] kmod is out of date, uses FREE_PAGE interface")
 
@@ -44,27 +70,222 @@ type Connection struct {
 	*os.File
 }
 
-// Page represents a page allocated by the kernel module.
+// GFPPreset selects the base GFP flags for an allocation.
+type GFPPreset int
+
+const (
+	GFPKernel          GFPPreset = C.PAB_GFP_KERNEL
+	GFPAtomic          GFPPreset = C.PAB_GFP_ATOMIC // Also disables BHs in the kernel.
+	GFPHighuserMovable GFPPreset = C.PAB_GFP_HIGHUSER_MOVABLE
+)
+
+var gfpPresetNames = map[GFPPreset]string{
+	GFPKernel:          "kernel",
+	GFPAtomic:          "atomic",
+	GFPHighuserMovable: "highuser_movable",
+}
+
+// GFPFlags are modifiers added to a GFPPreset.
+type GFPFlags uint
+
+const (
+	GFPThisNode GFPFlags = C.PAB_GFP_THISNODE
+	GFPNoRetry  GFPFlags = C.PAB_GFP_NORETRY
+	GFPNoWarn   GFPFlags = C.PAB_GFP_NOWARN
+	// Reclaim and compact as hard as it takes, but fail instead of OOM
+	// killing.
+	GFPRetryMayFail GFPFlags = C.PAB_GFP_RETRY_MAYFAIL
+)
+
+var gfpFlagNames = []struct {
+	flag GFPFlags
+	name string
+}{
+	{GFPThisNode, "thisnode"},
+	{GFPNoRetry, "noretry"},
+	{GFPNoWarn, "nowarn"},
+	{GFPRetryMayFail, "retrymayfail"},
+}
+
+// GFP describes the GFP flags for an allocation.
+type GFP struct {
+	Preset GFPPreset
+	Flags  GFPFlags
+}
+
+// ParseGFP parses a preset optionally followed by modifiers, separated by '+',
+// for example "kernel+thisnode+noretry". This is the format returned by
+// GFP.String.
+func ParseGFP(s string) (GFP, error) {
+	parts := strings.Split(s, "+")
+	var gfp GFP
+	found := false
+	for preset, name := range gfpPresetNames {
+		if parts[0] == name {
+			gfp.Preset = preset
+			found = true
+		}
+	}
+	if !found {
+		return GFP{}, fmt.Errorf("unknown GFP preset %q", parts[0])
+	}
+parts:
+	for _, part := range parts[1:] {
+		for _, f := range gfpFlagNames {
+			if part == f.name {
+				gfp.Flags |= f.flag
+				continue parts
+			}
+		}
+		return GFP{}, fmt.Errorf("unknown GFP modifier %q", part)
+	}
+	return gfp, nil
+}
+
+func (g GFP) String() string {
+	s := gfpPresetNames[g.Preset]
+	for _, f := range gfpFlagNames {
+		if g.Flags&f.flag != 0 {
+			s += "+" + f.name
+		}
+	}
+	return s
+}
+
+// AllocAPI is the kernel function used to allocate pages.
+type AllocAPI int
+
+const (
+	APIAllocPages     AllocAPI = C.PAB_API_ALLOC_PAGES
+	APIAllocPagesNode AllocAPI = C.PAB_API_ALLOC_PAGES_NODE
+	APIFolioAlloc     AllocAPI = C.PAB_API_FOLIO_ALLOC
+)
+
+var allocAPINames = map[AllocAPI]string{
+	APIAllocPages:     "alloc_pages",
+	APIAllocPagesNode: "alloc_pages_node",
+	APIFolioAlloc:     "folio_alloc",
+}
+
+// ParseAllocAPI parses the name of the kernel function, e.g. "folio_alloc".
+func ParseAllocAPI(s string) (AllocAPI, error) {
+	for api, name := range allocAPINames {
+		if s == name {
+			return api, nil
+		}
+	}
+	return 0, fmt.Errorf("unknown allocation API %q", s)
+}
+
+func (a AllocAPI) String() string {
+	return allocAPINames[a]
+}
+
+// TouchPolicy is what the kmod does with memory after allocating it.
+type TouchPolicy int
+
+const (
+	TouchNone      TouchPolicy = C.PAB_TOUCH_NONE
+	TouchCacheline TouchPolicy = C.PAB_TOUCH_CACHELINE // First cacheline of the allocation.
+	TouchWrite     TouchPolicy = C.PAB_TOUCH_WRITE
+	TouchZero      TouchPolicy = C.PAB_TOUCH_ZERO // __GFP_ZERO, counted in the allocation latency.
+	TouchRead      TouchPolicy = C.PAB_TOUCH_READ
+)
+
+var touchPolicyNames = map[TouchPolicy]string{
+	TouchNone:      "none",
+	TouchCacheline: "cacheline",
+	TouchWrite:     "write",
+	TouchZero:      "zero",
+	TouchRead:      "read",
+}
+
+// ParseTouchPolicy parses the name of a touch policy, e.g. "write".
+func ParseTouchPolicy(s string) (TouchPolicy, error) {
+	for t, name := range touchPolicyNames {
+		if s == name {
+			return t, nil
+		}
+	}
+	return 0, fmt.Errorf("unknown touch policy %q", s)
+}
+
+func (t TouchPolicy) String() string {
+	return touchPolicyNames[t]
+}
+
+// AllocArgs describes how the kmod should allocate pages.
+type AllocArgs struct {
+	Order int
+	GFP   GFP
+	API   AllocAPI
+	NID   int // Only used for APIAllocPagesNode, -1 means the local node.
+	Touch TouchPolicy
+}
+
+func (a *AllocArgs) toC() C.struct_pab_alloc_args {
+	return C.struct_pab_alloc_args{
+		order:     C.int(a.Order),
+		gfp:       C.int(a.GFP.Preset),
+		gfp_flags: C.uint(a.GFP.Flags),
+		api:       C.int(a.API),
+		nid:       C.int(a.NID),
+		touch:     C.int(a.Touch),
+	}
+}
+
+// Page represents a page allocated by the kernel module, or a slab object from
+// AllocObjects.
 type Page struct {
-	NID     int           // NUMA node ID
-	Latency time.Duration // Excluding syscall/userspace overhead.
-	id      C.ulong       // Opaque ID (spoiler: struct page *) used to free it.
+	NID          int           // NUMA node ID
+	Latency      time.Duration // Excluding syscall/userspace overhead.
+	TouchLatency time.Duration // Time spent applying the TouchPolicy, 0 if none.
+	PFN          uint64        // Of the first page, 0 for slab objects.
+	id           C.ulong       // Opaque ID used to free it.
 }
 
 // AllocPage allocates a page. Returned errors will wrap a syscall.Errno where
 // possible.
-func (k *Connection) AllocPage(order int) (*Page, error) {
+func (k *Connection) AllocPage(args *AllocArgs) (*Page, error) {
 	var ioctl C.struct_pab_ioctl_alloc_page
-	ioctl.args.order = C.int(order)
+	ioctl.args = args.toC()
 	err := linux.Ioctl(k.File, C.pab_ioctl_alloc_page, uintptr(unsafe.Pointer(&ioctl)))
 	if err != nil {
 		return nil, err
 	}
-	return &Page{
-		id:      ioctl.result.id,
-		Latency: time.Duration(ioctl.result.latency_ns) * time.Nanosecond,
-		NID:     int(ioctl.result.nid),
-	}, err
+	page := pageFromC(&ioctl.result)
+	return &page, err
+}
+
+func pageFromC(p *C.struct_pab_page) Page {
+	return Page{
+		id:           p.id,
+		Latency:      time.Duration(p.latency_ns) * time.Nanosecond,
+		TouchLatency: time.Duration(p.touch_latency_ns) * time.Nanosecond,
+		NID:          int(p.nid),
+		PFN:          uint64(p.pfn),
+	}
+}
+
+// MaxBatch is the maximum number of pages for AllocPages and FreePages.
+const MaxBatch = C.PAB_MAX_BATCH
+
+// AllocPages allocates n pages with a single ioctl. If the
+// kernel runs out of memory part-way through, it returns the pages that were
+// allocated along with an error wrapping syscall.ENOMEM. The caller owns those
+// pages and must free them.
+func (k *Connection) AllocPages(args *AllocArgs, n int) ([]Page, error) {
+	buf := make([]C.struct_pab_page, n)
+	var ioctl C.struct_pab_ioctl_alloc_pages
+	ioctl.args.alloc = args.toC()
+	ioctl.args.nr_pages = C.int(n)
+	ioctl.args.pages = unsafe.SliceData(buf)
+	err := linux.Ioctl(k.File, C.pab_ioctl_alloc_pages, uintptr(unsafe.Pointer(&ioctl)))
+	pages := make([]Page, ioctl.result.nr_alloced)
+	for i := range pages {
+		pages[i] = pageFromC(&buf[i])
+	}
+	return pages, err
 }
 
 // FreePage frees a page. Returns the latency, if the kmods supports it.
@@ -83,3 +304,449 @@ func (k *Connection) FreePage(page *Page) (*time.Duration, error) {
 	d := time.Duration(ioctl.result.latency_ns) * time.Nanosecond
 	return &d, nil
 }
+
+// FreePages frees pages with a single ioctl, returning the latency for each
+// one, if the kmod supports it. On error, some prefix of the pages may have
+// been freed anyway.
+func (k *Connection) FreePages(pages []Page) ([]time.Duration, error) {
+	if *legacyFreePageInterface {
+		for i := range pages {
+			if _, err := k.FreePage(&pages[i]); err != nil {
+				return nil, err
+			}
+		}
+		return nil, nil
+	}
+
+	buf := make([]C.struct_pab_page, len(pages))
+	for i, page := range pages {
+		buf[i].id = page.id
+	}
+	var ioctl C.struct_pab_ioctl_free_pages
+	ioctl.args.nr_pages = C.int(len(pages))
+	ioctl.args.pages = unsafe.SliceData(buf)
+	err := linux.Ioctl(k.File, C.pab_ioctl_free_pages, uintptr(unsafe.Pointer(&ioctl)))
+	if err == nil && int(ioctl.result.nr_freed) != len(pages) {
+		// Shouldn't happen, the kmod should tell us why it stopped.
+		err = fmt.Errorf("freed only %d/%d pages: %w", ioctl.result.nr_freed, len(pages), syscall.EINVAL)
+	}
+	latencies := make([]time.Duration, ioctl.result.nr_freed)
+	for i := range latencies {
+		latencies[i] = time.Duration(buf[i].latency_ns) * time.Nanosecond
+	}
+	return latencies, err
+}
+
+// SlabAPI is how the kmod allocates slab objects.
+type SlabAPI int
+
+const (
+	SlabKmalloc SlabAPI = C.PAB_SLAB_KMALLOC
+	SlabCache   SlabAPI = C.PAB_SLAB_CACHE // The cache from CreateSlabCache.
+)
+
+var slabAPINames = map[SlabAPI]string{
+	SlabKmalloc: "kmalloc",
+	SlabCache:   "cache",
+}
+
+// ParseSlabAPI parses the name of a slab API, e.g. "kmalloc".
+func ParseSlabAPI(s string) (SlabAPI, error) {
+	for api, name := range slabAPINames {
+		if s == name {
+			return api, nil
+		}
+	}
+	return 0, fmt.Errorf("unknown slab API %q", s)
+}
+
+func (a SlabAPI) String() string {
+	return slabAPINames[a]
+}
+
+// SlabSize is one element of a distribution of kmalloc sizes.
+type SlabSize struct {
+	Size   int // Bytes.
+	Weight int // Relative to the other elements.
+}
+
+// MaxSlabSizes is the maximum length of SlabArgs.Sizes, and MaxSlabSize is
+// the largest size for kmalloc or a slab cache.
+const (
+	MaxSlabSizes = C.PAB_SLAB_MAX_SIZES
+	MaxSlabSize  = C.PAB_SLAB_MAX_SIZE
+)
+
+// ParseSlabSizes parses a comma-separated list of size:weight pairs, e.g.
+// "64:4,256:1". The weight can be omitted, it defaults to 1.
+func ParseSlabSizes(s string) ([]SlabSize, error) {
+	var sizes []SlabSize
+	for _, elem := range strings.Split(s, ",") {
+		sizeStr, weightStr, hasWeight := strings.Cut(elem, ":")
+		size, err := strconv.Atoi(sizeStr)
+		if err != nil || size <= 0 || size > MaxSlabSize {
+			return nil, fmt.Errorf("bad size in %q (must be 1-%d)", elem, MaxSlabSize)
+		}
+		weight := 1
+		if hasWeight {
+			weight, err = strconv.Atoi(weightStr)
+			if err != nil || weight <= 0 {
+				return nil, fmt.Errorf("bad weight in %q (must be a positive integer)", elem)
+			}
+		}
+		sizes = append(sizes, SlabSize{size, weight})
+	}
+	if len(sizes) > MaxSlabSizes {
+		return nil, fmt.Errorf("too many sizes (max %d)", MaxSlabSizes)
+	}
+	return sizes, nil
+}
+
+// SlabSizeClass returns the size class the kmod records latencies for objects
+// of the given size under, in place of the order. Class 0 is up to 8 bytes,
+// each class after that doubles the maximum size.
+func SlabSizeClass(size int) int {
+	class := bits.Len(uint(max(size, 1)-1)) - C.PAB_SLAB_SIZE_CLASS_SHIFT
+	return min(max(class, 0), HistNumOrders-1)
+}
+
+// SlabArgs describes how the kmod should allocate slab objects.
+type SlabArgs struct {
+	API SlabAPI
+	GFP GFP // GFPHighuserMovable isn't allowed.
+	// For SlabKmalloc, the kmod picks each object's size from this
+	// distribution.
+	Sizes []SlabSize
+}
+
+func (a *SlabArgs) toC() C.struct_pab_slab_args {
+	args := C.struct_pab_slab_args{
+		api:       C.int(a.API),
+		gfp:       C.int(a.GFP.Preset),
+		gfp_flags: C.uint(a.GFP.Flags),
+		// If there are too many sizes the kmod will reject this.
+		nr_sizes: C.int(len(a.Sizes)),
+	}
+	for i, s := range a.Sizes[:min(len(a.Sizes), MaxSlabSizes)] {
+		args.sizes[i] = C.uint(s.Size)
+		args.weights[i] = C.uint(s.Weight)
+	}
+	return args
+}
+
+// SlabCtor is what the private slab cache's constructor does to new objects.
+type SlabCtor int
+
+const (
+	SlabCtorNone    SlabCtor = C.PAB_SLAB_CTOR_NONE
+	SlabCtorZero    SlabCtor = C.PAB_SLAB_CTOR_ZERO
+	SlabCtorPattern SlabCtor = C.PAB_SLAB_CTOR_PATTERN
+)
+
+var slabCtorNames = map[SlabCtor]string{
+	SlabCtorNone:    "none",
+	SlabCtorZero:    "zero",
+	SlabCtorPattern: "pattern",
+}
+
+// ParseSlabCtor parses the name of a constructor, e.g. "zero".
+func ParseSlabCtor(s string) (SlabCtor, error) {
+	for c, name := range slabCtorNames {
+		if s == name {
+			return c, nil
+		}
+	}
+	return 0, fmt.Errorf("unknown slab constructor %q", s)
+}
+
+func (c SlabCtor) String() string {
+	return slabCtorNames[c]
+}
+
+// SlabCacheConfig describes the kmod's private slab cache.
+type SlabCacheConfig struct {
+	Size         int // Object size in bytes, up to MaxSlabSize.
+	Align        int // 0 or a power of two.
+	Ctor         SlabCtor
+	HWCacheAlign bool // SLAB_HWCACHE_ALIGN.
+}
+
+// CreateSlabCache creates the private cache used by SlabCache. There's only
+// one, so this fails with an error wrapping EEXIST if it already exists.
+func (k *Connection) CreateSlabCache(config *SlabCacheConfig) error {
+	var ioctl C.struct_pab_ioctl_slab_cache_create
+	ioctl.args.size = C.uint(config.Size)
+	ioctl.args.align = C.uint(config.Align)
+	ioctl.args.ctor = C.int(config.Ctor)
+	if config.HWCacheAlign {
+		ioctl.args.flags |= C.PAB_SLAB_HWCACHE_ALIGN
+	}
+	return linux.Ioctl(k.File, C.pab_ioctl_slab_cache_create, uintptr(unsafe.Pointer(&ioctl)))
+}
+
+// DestroySlabCache destroys the private cache. It fails with an error wrapping
+// EBUSY if any objects are still allocated from it, or ENOENT if there's no
+// cache.
+func (k *Connection) DestroySlabCache() error {
+	return linux.Ioctl(k.File, C.pab_ioctl_slab_cache_destroy, 0)
+}
+
+// AllocObjects is the slab equivalent of AllocPages. The objects must be
+// freed with FreeObjects.
+func (k *Connection) AllocObjects(args *SlabArgs, n int) ([]Page, error) {
+	buf := make([]C.struct_pab_page, n)
+	var ioctl C.struct_pab_ioctl_slab_alloc
+	ioctl.args.alloc = args.toC()
+	ioctl.args.nr_objs = C.int(n)
+	ioctl.args.objs = unsafe.SliceData(buf)
+	err := linux.Ioctl(k.File, C.pab_ioctl_slab_alloc, uintptr(unsafe.Pointer(&ioctl)))
+	objs := make([]Page, ioctl.result.nr_alloced)
+	for i := range objs {
+		objs[i] = pageFromC(&buf[i])
+	}
+	return objs, err
+}
+
+// FreeObjects is the slab equivalent of FreePages.
+func (k *Connection) FreeObjects(objs []Page) ([]time.Duration, error) {
+	buf := make([]C.struct_pab_page, len(objs))
+	for i, obj := range objs {
+		buf[i].id = obj.id
+	}
+	var ioctl C.struct_pab_ioctl_slab_free
+	ioctl.args.nr_objs = C.int(len(objs))
+	ioctl.args.objs = unsafe.SliceData(buf)
+	err := linux.Ioctl(k.File, C.pab_ioctl_slab_free, uintptr(unsafe.Pointer(&ioctl)))
+	if err == nil && int(ioctl.result.nr_freed) != len(objs) {
+		err = fmt.Errorf("freed only %d/%d objects: %w", ioctl.result.nr_freed, len(objs), syscall.EINVAL)
+	}
+	latencies := make([]time.Duration, ioctl.result.nr_freed)
+	for i := range latencies {
+		latencies[i] = time.Duration(buf[i].latency_ns) * time.Nanosecond
+	}
+	return latencies, err
+}
+
+// KthreadsConfig configures the in-kernel kallocfree antagonist. Each thread
+// keeps the number of pages it holds bouncing around in [Middle-Range,
+// Middle+Range).
+type KthreadsConfig struct {
+	Alloc  AllocArgs
+	Slab   *SlabArgs // If set, allocate slab objects instead of pages.
+	Middle int
+	Range  int
+}
+
+// StartKthreads starts one antagonist thread bound to each online CPU.
+func (k *Connection) StartKthreads(config *KthreadsConfig) error {
+	var ioctl C.struct_pab_ioctl_kthreads_start
+	ioctl.args.alloc = config.Alloc.toC()
+	ioctl.args.middle = C.int(config.Middle)
+	ioctl.args._range = C.int(config.Range)
+	if config.Slab != nil {
+		ioctl.args.use_slab = 1
+		ioctl.args.slab = config.Slab.toC()
+	}
+	return linux.Ioctl(k.File, C.pab_ioctl_kthreads_start, uintptr(unsafe.Pointer(&ioctl)))
+}
+
+// StopKthreads stops the threads started by StartKthreads, once this returns
+// they have freed all their pages. Their stats can still be read.
+func (k *Connection) StopKthreads() error {
+	return linux.Ioctl(k.File, C.pab_ioctl_kthreads_stop, 0)
+}
+
+// KthreadStats are the counters for a single antagonist thread.
+type KthreadStats struct {
+	PagesAllocated        uint64
+	PagesFreed            uint64
+	AllocFailures         uint64
+	NUMARemoteAllocations uint64
+}
+
+// KthreadsStatus describes the state of the in-kernel antagonist.
+type KthreadsStatus struct {
+	NumThreads int
+	NumSteady  int            // Threads that have reached their middle value.
+	PerCPU     []KthreadStats // Indexed by CPU.
+}
+
+// KthreadsStatus reads the current stats of the in-kernel antagonist.
+func (k *Connection) KthreadsStatus(numCPUs int) (*KthreadsStatus, error) {
+	buf := make([]C.struct_pab_kthread_stats, numCPUs)
+	var ioctl C.struct_pab_ioctl_kthreads_stats
+	ioctl.args.nr_cpus = C.int(numCPUs)
+	ioctl.args.stats = unsafe.SliceData(buf)
+	err := linux.Ioctl(k.File, C.pab_ioctl_kthreads_stats, uintptr(unsafe.Pointer(&ioctl)))
+	if err != nil {
+		return nil, err
+	}
+	status := &KthreadsStatus{
+		NumThreads: int(ioctl.result.nr_threads),
+		NumSteady:  int(ioctl.result.nr_steady),
+		PerCPU:     make([]KthreadStats, numCPUs),
+	}
+	for i, s := range buf {
+		status.PerCPU[i] = KthreadStats{
+			PagesAllocated:        uint64(s.pages_allocated),
+			PagesFreed:            uint64(s.pages_freed),
+			AllocFailures:         uint64(s.alloc_failures),
+			NUMARemoteAllocations: uint64(s.numa_remote_allocations),
+		}
+	}
+	return status, nil
+}
+
+// HistKind identifies a set of latency histograms in the kmod.
+type HistKind int
+
+const (
+	HistAlloc HistKind = C.PAB_HIST_ALLOC
+	HistFree  HistKind = C.PAB_HIST_FREE
+	HistTouch HistKind = C.PAB_HIST_TOUCH
+	// Indexed by SlabSizeClass instead of order.
+	HistSlabAlloc HistKind = C.PAB_HIST_SLAB_ALLOC
+	HistSlabFree  HistKind = C.PAB_HIST_SLAB_FREE
+	// Like HistAlloc, for allocations that failed.
+	HistAllocFail HistKind = C.PAB_HIST_ALLOC_FAIL
+)
+
+// HistNumOrders is the number of orders (or slab size classes) for which the
+// kmod keeps histograms.
+const HistNumOrders = C.PAB_HIST_NR_ORDERS
+
+// AllCPUs can be passed to ReadHistogram to get the sum over all CPUs.
+const AllCPUs = -1
+
+// ReadHistogram snapshots one of the kmod's latency histograms (in
+// nanoseconds), optionally resetting it.
+func (k *Connection) ReadHistogram(kind HistKind, order int, cpu int, reset bool) (*hist.Histogram, error) {
+	var chist C.struct_pab_hist
+	var ioctl C.struct_pab_ioctl_hist_read
+	ioctl.args.kind = C.int(kind)
+	ioctl.args.order = C.int(order)
+	ioctl.args.cpu = C.int(cpu)
+	if reset {
+		ioctl.args.reset = 1
+	}
+	ioctl.args.hist = &chist
+	err := linux.Ioctl(k.File, C.pab_ioctl_hist_read, uintptr(unsafe.Pointer(&ioctl)))
+	if err != nil {
+		return nil, err
+	}
+	h := &hist.Histogram{
+		Count: uint64(chist.count),
+		Sum:   uint64(chist.sum_ns),
+		Max:   uint64(chist.max_ns),
+	}
+	for i, n := range chist.buckets {
+		h.Buckets[i] = uint64(n)
+	}
+	return h, nil
+}
+
+// ResetHistograms zeroes all the kmod's latency histograms.
+func (k *Connection) ResetHistograms() error {
+	return linux.Ioctl(k.File, C.pab_ioctl_hist_reset, 0)
+}
+
+// ZoneLock identifies a populated zone's zone->lock.
+type ZoneLock struct {
+	NID      int
+	Zone     string // e.g. "Normal".
+	LockAddr uint64 // Kernel address, as in the lock tracepoints' lock_addr.
+}
+
+// ZoneLocks returns the zone locks of all the populated zones.
+func (k *Connection) ZoneLocks() ([]ZoneLock, error) {
+	buf := make([]C.struct_pab_zone_lock, 16)
+	for {
+		var ioctl C.struct_pab_ioctl_zone_locks
+		ioctl.args.nr_zones = C.int(len(buf))
+		ioctl.args.zones = unsafe.SliceData(buf)
+		if err := linux.Ioctl(k.File, C.pab_ioctl_zone_locks, uintptr(unsafe.Pointer(&ioctl))); err != nil {
+			return nil, err
+		}
+		if n := int(ioctl.result.nr_zones); n > len(buf) {
+			// More zones than we had room for, try again.
+			buf = make([]C.struct_pab_zone_lock, n)
+			continue
+		}
+		locks := make([]ZoneLock, ioctl.result.nr_zones)
+		for i := range locks {
+			locks[i] = ZoneLock{
+				NID:      int(buf[i].nid),
+				Zone:     C.GoString(&buf[i].name[0]),
+				LockAddr: uint64(buf[i].lock_addr),
+			}
+		}
+		return locks, nil
+	}
+}
+
+// ClockSource is the clock the kmod times operations with.
+type ClockSource int
+
+const (
+	ClockKtime  ClockSource = C.PAB_CLOCK_KTIME
+	ClockLocal  ClockSource = C.PAB_CLOCK_LOCAL  // local_clock().
+	ClockCycles ClockSource = C.PAB_CLOCK_CYCLES // Serialized cycle counter.
+)
+
+var clockSourceNames = map[ClockSource]string{
+	ClockKtime:  "ktime",
+	ClockLocal:  "local_clock",
+	ClockCycles: "cycles",
+}
+
+// ParseClockSource parses the name of a clock source, e.g. "cycles".
+func ParseClockSource(s string) (ClockSource, error) {
+	for c, name := range clockSourceNames {
+		if s == name {
+			return c, nil
+		}
+	}
+	return 0, fmt.Errorf("unknown clock source %q", s)
+}
+
+func (c ClockSource) String() string {
+	return clockSourceNames[c]
+}
+
+// ClockInfo describes the kmod's timing.
+type ClockInfo struct {
+	Clock ClockSource // The one in use.
+	// Minimum cost of timing an operation with each clock, measured when
+	// the kmod was loaded. This is included in all the latencies.
+	Overhead    map[ClockSource]time.Duration
+	CyclesPerMS uint64
+}
+
+// SetClock selects the clock for all latency measurements. It fails with an
+// error wrapping EBUSY if the kthreads are running.
+func (k *Connection) SetClock(clock ClockSource) (*ClockInfo, error) {
+	return k.clock(C.int(clock))
+}
+
+// Clock reports the kmod's current clock and calibration.
+func (k *Connection) Clock() (*ClockInfo, error) {
+	return k.clock(-1)
+}
+
+func (k *Connection) clock(clock C.int) (*ClockInfo, error) {
+	var ioctl C.struct_pab_ioctl_clock
+	ioctl.args.clock = clock
+	err := linux.Ioctl(k.File, C.pab_ioctl_clock, uintptr(unsafe.Pointer(&ioctl)))
+	if err != nil {
+		return nil, err
+	}
+	info := &ClockInfo{
+		Clock:       ClockSource(ioctl.result.clock),
+		Overhead:    make(map[ClockSource]time.Duration),
+		CyclesPerMS: uint64(ioctl.result.cycles_per_ms),
+	}
+	for c := range clockSourceNames {
+		info.Overhead[c] = time.Duration(ioctl.result.overhead_ns[c])
+	}
+	return info, nil
+}
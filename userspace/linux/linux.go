@@ -25,6 +25,7 @@ import (
 	"strconv"
 	"strings"
 	"syscall"
+	"time"
 	"unsafe"
 )
 
@@ -37,7 +38,7 @@ type CPUMask []uint64
 func NewCPUMask(cpus ...int) CPUMask {
 	maxCPU := slices.Max(cpus)
 	mask := make([]uint64, (maxCPU/64)+1)
-	for cpu, _ := range cpus {
+	for _, cpu := range cpus {
 		mask[cpu/64] |= 1 << (cpu % 64)
 	}
 	return mask
@@ -139,3 +140,352 @@ func NUMANodes() (map[int]CPUMask, error) {
 	}
 	return ret, nil
 }
+
+// NodesWithMemory returns the IDs of the NUMA nodes that have memory, in
+// ascending order.
+func NodesWithMemory() ([]int, error) {
+	data, err := os.ReadFile("/sys/devices/system/node/has_memory")
+	if err != nil {
+		return nil, err
+	}
+	list, err := CPUMaskFromString(string(data))
+	if err != nil {
+		return nil, fmt.Errorf("parsing has_memory: %v", err)
+	}
+	var nodes []int
+	for _, nid := range list {
+		nodes = append(nodes, int(nid))
+	}
+	return nodes, nil
+}
+
+// CPUTopology describes where a CPU sits in the system. CPUs are identified by
+// the lowest-numbered CPU in the group they share.
+type CPUTopology struct {
+	Core int // CPUs sharing a core (i.e. SMT siblings).
+	LLC  int // CPUs sharing a last-level cache.
+	Node int // NUMA node.
+}
+
+func lowestCPU(path string) (int, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return -1, err
+	}
+	cpus, err := CPUMaskFromString(string(data))
+	if err != nil {
+		return -1, fmt.Errorf("parsing %s: %v", path, err)
+	}
+	return int(slices.Min(cpus)), nil
+}
+
+// CPUTopologies scans sysfs to find the topology of the given number of CPUs,
+// the result is indexed by CPU.
+func CPUTopologies(numCPUs int) ([]CPUTopology, error) {
+	nodes, err := NUMANodes()
+	if err != nil {
+		return nil, err
+	}
+	ret := make([]CPUTopology, numCPUs)
+	for i := range ret {
+		ret[i].Node = -1
+	}
+	for nid, cpus := range nodes {
+		for _, cpu := range cpus {
+			if int(cpu) < numCPUs {
+				ret[cpu].Node = nid
+			}
+		}
+	}
+
+	for cpu := range ret {
+		cpuDir := fmt.Sprintf("/sys/devices/system/cpu/cpu%d/", cpu)
+		ret[cpu].Core, err = lowestCPU(cpuDir + "topology/thread_siblings_list")
+		if err != nil {
+			return nil, fmt.Errorf("reading core siblings: %v", err)
+		}
+
+		// The LLC is the highest-level cache listed.
+		cacheDirs, err := os.ReadDir(cpuDir + "cache")
+		if err != nil {
+			return nil, fmt.Errorf("reading cache info: %v", err)
+		}
+		maxLevel := -1
+		ret[cpu].LLC = cpu
+		for _, dir := range cacheDirs {
+			if !strings.HasPrefix(dir.Name(), "index") {
+				continue
+			}
+			indexDir := cpuDir + "cache/" + dir.Name() + "/"
+			levelStr, err := os.ReadFile(indexDir + "level")
+			if err != nil {
+				return nil, fmt.Errorf("reading cache level: %v", err)
+			}
+			level, err := strconv.Atoi(strings.TrimSpace(string(levelStr)))
+			if err != nil {
+				return nil, fmt.Errorf("parsing %s/level: %v", indexDir, err)
+			}
+			if level <= maxLevel {
+				continue
+			}
+			maxLevel = level
+			ret[cpu].LLC, err = lowestCPU(indexDir + "shared_cpu_list")
+			if err != nil {
+				return nil, fmt.Errorf("reading LLC siblings: %v", err)
+			}
+		}
+	}
+	return ret, nil
+}
+
+// Not in the syscall package.
+const (
+	MADV_POPULATE_WRITE = 23 // Since Linux 5.14.
+)
+
+// Meminfo parses /proc/meminfo, the result maps field names to values in bytes
+// (or plain counts for the fields that don't have a unit).
+func Meminfo() (map[string]int64, error) {
+	return parseMeminfo("/proc/meminfo", "")
+}
+
+// NodeMeminfo is like Meminfo for one NUMA node, from its meminfo file in
+// sysfs. That has fewer fields, notably no MemAvailable.
+func NodeMeminfo(nid int) (map[string]int64, error) {
+	return parseMeminfo(fmt.Sprintf("/sys/devices/system/node/node%d/meminfo", nid), fmt.Sprintf("Node %d ", nid))
+}
+
+// NodesAvailable estimates the memory available on the given NUMA nodes, for
+// memory bound to them. The nodes don't report MemAvailable, so this is their
+// MemFree plus Inactive(file).
+func NodesAvailable(nids []int) (int64, error) {
+	var avail int64
+	for _, nid := range nids {
+		meminfo, err := NodeMeminfo(nid)
+		if err != nil {
+			return 0, err
+		}
+		avail += meminfo["MemFree"] + meminfo["Inactive(file)"]
+	}
+	return avail, nil
+}
+
+// parseMeminfo parses a meminfo file whose lines all start with prefix.
+func parseMeminfo(path, prefix string) (map[string]int64, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	ret := make(map[string]int64)
+	for _, line := range strings.Split(strings.TrimSpace(string(data)), "\n") {
+		name, rest, ok := strings.Cut(strings.TrimPrefix(line, prefix), ":")
+		if !ok {
+			return nil, fmt.Errorf("malformed %s line %q", path, line)
+		}
+		fields := strings.Fields(rest)
+		if len(fields) == 0 {
+			return nil, fmt.Errorf("malformed %s line %q", path, line)
+		}
+		val, err := strconv.ParseInt(fields[0], 10, 64)
+		if err != nil {
+			return nil, fmt.Errorf("parsing %s line %q: %v", path, line, err)
+		}
+		if len(fields) > 1 && fields[1] == "kB" {
+			val *= 1024
+		}
+		ret[name] = val
+	}
+	return ret, nil
+}
+
+// MemfdCreate creates an anonymous memory-backed file, with close-on-exec set.
+// SYS_MEMFD_CREATE isn't in the syscall package either, so this is amd64-only
+// too.
+func MemfdCreate(name string) (*os.File, error) {
+	namePtr, err := syscall.BytePtrFromString(name)
+	if err != nil {
+		return nil, err
+	}
+	const mfdCloexec = 1
+	fd, _, errno := syscall.Syscall(319, uintptr(unsafe.Pointer(namePtr)), mfdCloexec, 0)
+	if errno != 0 {
+		return nil, fmt.Errorf("memfd_create: %w", errno)
+	}
+	return os.NewFile(fd, name), nil
+}
+
+// PSILine is one line of a pressure stall information file.
+type PSILine struct {
+	Avg10, Avg60, Avg300 float64 // Percentages.
+	Total                time.Duration
+}
+
+// PSI is the content of a PSI file like /proc/pressure/memory or a cgroup's
+// memory.pressure. Full is zero for files that don't have it.
+type PSI struct {
+	Some, Full PSILine
+}
+
+// ReadPSI parses a PSI file.
+func ReadPSI(path string) (*PSI, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	var psi PSI
+	for _, line := range strings.Split(strings.TrimSpace(string(data)), "\n") {
+		var kind string
+		var l PSILine
+		var totalUS int64
+		_, err := fmt.Sscanf(line, "%s avg10=%f avg60=%f avg300=%f total=%d",
+			&kind, &l.Avg10, &l.Avg60, &l.Avg300, &totalUS)
+		if err != nil {
+			return nil, fmt.Errorf("parsing %s line %q: %v", path, line, err)
+		}
+		l.Total = time.Duration(totalUS) * time.Microsecond
+		switch kind {
+		case "some":
+			psi.Some = l
+		case "full":
+			psi.Full = l
+		}
+	}
+	return &psi, nil
+}
+
+// Uname returns the kernel release (e.g. "6.8.0") and version (the build
+// string) from uname(2).
+func Uname() (release, version string, err error) {
+	var uts syscall.Utsname
+	if err := syscall.Uname(&uts); err != nil {
+		return "", "", fmt.Errorf("uname: %v", err)
+	}
+	str := func(field []int8) string {
+		b := make([]byte, 0, len(field))
+		for _, c := range field {
+			if c == 0 {
+				break
+			}
+			b = append(b, byte(c))
+		}
+		return string(b)
+	}
+	return str(uts.Release[:]), str(uts.Version[:]), nil
+}
+
+// Advice for Fadvise.
+const (
+	POSIX_FADV_DONTNEED = 4
+)
+
+// Fadvise wraps posix_fadvise(2).
+func Fadvise(file *os.File, offset, length int64, advice int) error {
+	_, _, err := syscall.Syscall6(syscall.SYS_FADVISE64, file.Fd(), uintptr(offset), uintptr(length), uintptr(advice), 0, 0)
+	if err != 0 {
+		return fmt.Errorf("fadvise(%s, %d, %d, %d): %w", file.Name(), offset, length, advice, err)
+	}
+	return nil
+}
+
+// Flags for SyncFileRange.
+const (
+	SYNC_FILE_RANGE_WRITE = 2
+)
+
+// SyncFileRange wraps sync_file_range(2).
+func SyncFileRange(file *os.File, offset, length int64, flags int) error {
+	_, _, err := syscall.Syscall6(syscall.SYS_SYNC_FILE_RANGE, file.Fd(), uintptr(offset), uintptr(length), uintptr(flags), 0, 0)
+	if err != 0 {
+		return fmt.Errorf("sync_file_range(%s, %d, %d, %d): %w", file.Name(), offset, length, flags, err)
+	}
+	return nil
+}
+
+// ThreadMajorFaults returns the number of major page faults the calling thread
+// has taken.
+func ThreadMajorFaults() (int64, error) {
+	const RUSAGE_THREAD = 1
+	var rusage syscall.Rusage
+	if err := syscall.Getrusage(RUSAGE_THREAD, &rusage); err != nil {
+		return 0, fmt.Errorf("getrusage(RUSAGE_THREAD): %v", err)
+	}
+	return rusage.Majflt, nil
+}
+
+// ProcessCPUTime returns the user and system CPU time used by all the threads
+// of the calling process so far.
+func ProcessCPUTime() (user, system time.Duration, err error) {
+	var rusage syscall.Rusage
+	if err := syscall.Getrusage(syscall.RUSAGE_SELF, &rusage); err != nil {
+		return 0, 0, fmt.Errorf("getrusage(RUSAGE_SELF): %v", err)
+	}
+	return time.Duration(rusage.Utime.Nano()), time.Duration(rusage.Stime.Nano()), nil
+}
+
+// NUMA memory policy modes, for Mempolicy.
+const (
+	MPOL_PREFERRED  = 1
+	MPOL_BIND       = 2
+	MPOL_INTERLEAVE = 3
+)
+
+var mempolicyModeNames = map[int]string{
+	MPOL_PREFERRED:  "preferred",
+	MPOL_BIND:       "bind",
+	MPOL_INTERLEAVE: "interleave",
+}
+
+// Mempolicy is a NUMA memory policy for a range of memory.
+type Mempolicy struct {
+	Mode  int
+	Nodes []int
+}
+
+// ParseMempolicy parses a mode followed by a node list in the usual kernel
+// format, e.g. "bind:0" or "interleave:0-3". This is the format returned by
+// Mempolicy.String.
+func ParseMempolicy(s string) (*Mempolicy, error) {
+	modeStr, nodesStr, ok := strings.Cut(s, ":")
+	if !ok {
+		return nil, fmt.Errorf("malformed memory policy %q, want mode:nodes", s)
+	}
+	policy := &Mempolicy{Mode: -1}
+	for mode, name := range mempolicyModeNames {
+		if modeStr == name {
+			policy.Mode = mode
+		}
+	}
+	if policy.Mode < 0 {
+		return nil, fmt.Errorf("unknown memory policy mode %q", modeStr)
+	}
+	nodes, err := CPUMaskFromString(nodesStr)
+	if err != nil {
+		return nil, fmt.Errorf("parsing node list %q: %v", nodesStr, err)
+	}
+	for _, node := range nodes {
+		policy.Nodes = append(policy.Nodes, int(node))
+	}
+	return policy, nil
+}
+
+func (p *Mempolicy) String() string {
+	var nodes []string
+	for _, node := range p.Nodes {
+		nodes = append(nodes, strconv.Itoa(node))
+	}
+	return mempolicyModeNames[p.Mode] + ":" + strings.Join(nodes, ",")
+}
+
+// Mbind wraps mbind(2), applying the policy to all of data.
+func (p *Mempolicy) Mbind(data []byte) error {
+	nodemask := NewCPUMask(p.Nodes...)
+	// The kernel ignores the last bit of maxnode.
+	maxnode := len(nodemask)*64 + 1
+	_, _, err := syscall.Syscall6(syscall.SYS_MBIND, uintptr(unsafe.Pointer(unsafe.SliceData(data))),
+		uintptr(len(data)), uintptr(p.Mode), uintptr(unsafe.Pointer(unsafe.SliceData(nodemask))),
+		uintptr(maxnode), 0)
+	if err != 0 {
+		return fmt.Errorf("mbind(%v): %w", p, err)
+	}
+	return nil
+}
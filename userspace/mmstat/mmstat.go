@@ -0,0 +1,208 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package mmstat takes snapshots of the kernel's memory management state from
+// procfs, to help explain changes in the other metrics.
+package mmstat
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"strconv"
+	"strings"
+)
+
+// VmstatPrefixes selects the /proc/vmstat counters that are captured.
+var VmstatPrefixes = []string{"compact_", "allocstall_", "pgscan_", "pgsteal_", "numa_", "pgmigrate_"}
+
+// Snapshot of the allocator state. Zones are identified as "node0_normal" and
+// migratetypes by their lower-cased name.
+type Snapshot struct {
+	// From /proc/buddyinfo: number of free blocks per zone, indexed by order.
+	FreeBlocks map[string][]int64
+	// From /proc/pagetypeinfo: number of free blocks per migratetype,
+	// summed over all zones, indexed by order.
+	FreeBlocksByType map[string][]int64
+	// From /proc/zoneinfo: pages in the per-CPU lists of each zone, summed
+	// over CPUs.
+	PCPPages map[string]int64
+	// Selected /proc/vmstat counters, see VmstatPrefixes.
+	Vmstat map[string]int64
+}
+
+// Take takes a snapshot. Needs root, for /proc/pagetypeinfo.
+func Take() (*Snapshot, error) {
+	var s Snapshot
+	var err error
+	if s.FreeBlocks, err = readBuddyinfo(); err != nil {
+		return nil, fmt.Errorf("reading /proc/buddyinfo: %v", err)
+	}
+	if s.FreeBlocksByType, err = readPagetypeinfo(); err != nil {
+		return nil, fmt.Errorf("reading /proc/pagetypeinfo: %v", err)
+	}
+	if s.PCPPages, err = readZoneinfo(); err != nil {
+		return nil, fmt.Errorf("reading /proc/zoneinfo: %v", err)
+	}
+	if s.Vmstat, err = readVmstat(); err != nil {
+		return nil, fmt.Errorf("reading /proc/vmstat: %v", err)
+	}
+	return &s, nil
+}
+
+func zoneName(node, zone string) string {
+	return "node" + strings.TrimSuffix(node, ",") + "_" + strings.ToLower(strings.TrimSuffix(zone, ","))
+}
+
+func parseCounts(fields []string) ([]int64, error) {
+	counts := make([]int64, len(fields))
+	for i, f := range fields {
+		var err error
+		if counts[i], err = strconv.ParseInt(f, 10, 64); err != nil {
+			return nil, err
+		}
+	}
+	return counts, nil
+}
+
+// Calls fn for each line of the file. Stops at the first error.
+func forEachLine(path string, fn func(line string) error) error {
+	f, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		if err := fn(scanner.Text()); err != nil {
+			return fmt.Errorf("line %q: %v", scanner.Text(), err)
+		}
+	}
+	return scanner.Err()
+}
+
+// Lines look like "Node 0, zone   Normal   1   2 ...".
+func readBuddyinfo() (map[string][]int64, error) {
+	ret := make(map[string][]int64)
+	err := forEachLine("/proc/buddyinfo", func(line string) error {
+		fields := strings.Fields(line)
+		if len(fields) < 4 || fields[0] != "Node" || fields[2] != "zone" {
+			return fmt.Errorf("unexpected format")
+		}
+		counts, err := parseCounts(fields[4:])
+		if err != nil {
+			return err
+		}
+		ret[zoneName(fields[1], fields[3])] = counts
+		return nil
+	})
+	return ret, err
+}
+
+// We only care about the first section, where lines look like
+// "Node    0, zone   Normal, type    Movable   2983    849 ...".
+func readPagetypeinfo() (map[string][]int64, error) {
+	ret := make(map[string][]int64)
+	err := forEachLine("/proc/pagetypeinfo", func(line string) error {
+		fields := strings.Fields(line)
+		if len(fields) < 6 || fields[0] != "Node" || fields[4] != "type" {
+			return nil
+		}
+		counts, err := parseCounts(fields[6:])
+		if err != nil {
+			return err
+		}
+		mt := strings.ToLower(fields[5])
+		if ret[mt] == nil {
+			ret[mt] = make([]int64, len(counts))
+		}
+		for i := range counts {
+			ret[mt][i] += counts[i]
+		}
+		return nil
+	})
+	return ret, err
+}
+
+// Zones start with "Node 0, zone   Normal", the pagesets section has a
+// "count: N" line for each CPU.
+func readZoneinfo() (map[string]int64, error) {
+	ret := make(map[string]int64)
+	zone := ""
+	err := forEachLine("/proc/zoneinfo", func(line string) error {
+		fields := strings.Fields(line)
+		if len(fields) == 4 && fields[0] == "Node" && fields[2] == "zone" {
+			zone = zoneName(fields[1], fields[3])
+			ret[zone] = 0
+			return nil
+		}
+		if len(fields) == 2 && fields[0] == "count:" && zone != "" {
+			count, err := strconv.ParseInt(fields[1], 10, 64)
+			if err != nil {
+				return err
+			}
+			ret[zone] += count
+		}
+		return nil
+	})
+	return ret, err
+}
+
+func readVmstat() (map[string]int64, error) {
+	ret := make(map[string]int64)
+	err := forEachLine("/proc/vmstat", func(line string) error {
+		name, val, ok := strings.Cut(line, " ")
+		if !ok {
+			return fmt.Errorf("unexpected format")
+		}
+		for _, prefix := range VmstatPrefixes {
+			if strings.HasPrefix(name, prefix) {
+				n, err := strconv.ParseInt(val, 10, 64)
+				if err != nil {
+					return err
+				}
+				ret[name] = n
+				break
+			}
+		}
+		return nil
+	})
+	return ret, err
+}
+
+// AddMetrics adds the snapshot to a benchmark result, with metric names
+// starting with prefix.
+func (s *Snapshot) AddMetrics(result map[string][]int64, prefix string) {
+	for zone, counts := range s.FreeBlocks {
+		result[prefix+"_free_blocks_"+zone] = counts
+	}
+	for mt, counts := range s.FreeBlocksByType {
+		result[prefix+"_free_blocks_type_"+mt] = counts
+	}
+	var totalPCP int64
+	for zone, pages := range s.PCPPages {
+		result[prefix+"_pcp_pages_"+zone] = []int64{pages}
+		totalPCP += pages
+	}
+	result[prefix+"_pcp_pages"] = []int64{totalPCP}
+}
+
+// AddDeltaMetrics adds the change in the vmstat counters since prev to a
+// benchmark result, with metric names starting with prefix.
+func (s *Snapshot) AddDeltaMetrics(result map[string][]int64, prefix string, prev *Snapshot) {
+	for name, val := range s.Vmstat {
+		result[prefix+"_"+name] = []int64{val - prev.Vmstat[name]}
+	}
+}
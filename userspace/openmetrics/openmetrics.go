@@ -0,0 +1,92 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package openmetrics formats metrics in the OpenMetrics text format, which is
+// what Prometheus scrapes.
+package openmetrics
+
+import (
+	"fmt"
+	"io"
+	"strconv"
+	"strings"
+)
+
+// ContentType is the HTTP Content-Type of the output of Write.
+const ContentType = "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// Metric types.
+const (
+	Gauge   = "gauge"
+	Counter = "counter"
+)
+
+// Family is a set of metrics with the same name, type and help text. For a
+// Counter, the samples are named with a _total suffix.
+type Family struct {
+	Name, Type, Help string
+	Samples          []Sample
+}
+
+// Sample is one metric in a family, with label names and values in pairs.
+type Sample struct {
+	Labels []string
+	Value  float64
+}
+
+// Add adds a sample with the given label name and value pairs.
+func (f *Family) Add(value float64, labels ...string) {
+	f.Samples = append(f.Samples, Sample{Labels: labels, Value: value})
+}
+
+var labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+func (f *Family) write(w io.Writer) error {
+	if _, err := fmt.Fprintf(w, "# TYPE %s %s\n# HELP %s %s\n", f.Name, f.Type, f.Name, f.Help); err != nil {
+		return err
+	}
+	name := f.Name
+	if f.Type == Counter {
+		name += "_total"
+	}
+	for _, s := range f.Samples {
+		if len(s.Labels)%2 != 0 {
+			return fmt.Errorf("metric %s has an odd number of label names and values", f.Name)
+		}
+		var labels []string
+		for i := 0; i < len(s.Labels); i += 2 {
+			labels = append(labels, fmt.Sprintf(`%s="%s"`, s.Labels[i], labelEscaper.Replace(s.Labels[i+1])))
+		}
+		line := name
+		if len(labels) != 0 {
+			line += "{" + strings.Join(labels, ",") + "}"
+		}
+		if _, err := fmt.Fprintf(w, "%s %s\n", line, strconv.FormatFloat(s.Value, 'g', -1, 64)); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Write writes the families in order, followed by the terminating "# EOF".
+func Write(w io.Writer, families []*Family) error {
+	for _, f := range families {
+		if err := f.write(w); err != nil {
+			return err
+		}
+	}
+	_, err := io.WriteString(w, "# EOF\n")
+	return err
+}
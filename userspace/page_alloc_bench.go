@@ -19,118 +19,748 @@ import (
 	"encoding/json"
 	"flag"
 	"fmt"
+	"maps"
 	"math"
 	"os"
+	"runtime"
 	"runtime/debug"
 	"slices"
 	"strconv"
 	"strings"
 	"time"
 
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/mmstat"
 	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/perf"
+	"github.com/google/page_alloc_bench/results"
+	"github.com/google/page_alloc_bench/timeseries"
+	"github.com/google/page_alloc_bench/tracehist"
 	"github.com/google/page_alloc_bench/workload/findlimit"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
 	"github.com/google/page_alloc_bench/workload/kallocfree"
+	"github.com/google/page_alloc_bench/workload/pagecache"
 	"golang.org/x/sync/errgroup"
 )
 
 var (
-	timeoutSFlag    = flag.Int("timeout-s", 0, "Timeout in seconds. Set 0 for no timeout (default)")
-	outputPathFlag  = flag.String("output-path", "", "File to write JSON results to. See README for specification.")
-	iterationsFlag  = flag.Int("iterations", 5, "Iterations")
-	allocOrdersFlag = flag.String("alloc-orders", "0,4", "Comma-separate list of page alloc orders to test")
-	latenciesFlag   = flag.Bool("latencies", true, "Gather allocation/free latency data. Can be large.")
+	timeoutSFlag          = flag.Int("timeout-s", 0, "Timeout in seconds. Set 0 for no timeout (default)")
+	outputPathFlag        = flag.String("output-path", "", "File to write JSON results to. See README for specification.")
+	outputFormatFlag      = flag.String("output-format", "json", "Format for --output-path: json or binary. See README.")
+	iterationsFlag        = flag.Int("iterations", 5, "Iterations")
+	targetCIPctFlag       = flag.Float64("target-ci-pct", 0, "If set, instead of --iterations, repeat each findlimit phase until the 95% confidence interval of the median available bytes is no wider than this percentage of the median. See README.")
+	minIterationsFlag     = flag.Int("min-iterations", 3, "With --target-ci-pct, the minimum iterations per findlimit phase")
+	maxIterationsFlag     = flag.Int("max-iterations", 30, "With --target-ci-pct, the maximum iterations per findlimit phase")
+	iterationBudgetSFlag  = flag.Int("iteration-budget-s", 0, "With --target-ci-pct, don't start another findlimit iteration that would likely take the phase over this many seconds. 0 for no limit.")
+	allocOrdersFlag       = flag.String("alloc-orders", "0,4", "Comma-separate list of page alloc orders to test")
+	orderWeightsFlag      = flag.String("alloc-order-weights", "", "Instead of --alloc-orders, run once with the kernel allocations mixing orders with these weights, e.g. 0:9,4:1. See README.")
+	latenciesFlag         = flag.Bool("latencies", false, "Gather raw samples of allocation/free latencies. Can be large.")
+	batchSizeFlag         = flag.Int("batch-size", 64, "Max number of pages the kernel workers alloc/free per ioctl")
+	gfpFlag               = flag.String("gfp", "kernel", "Comma-separated list of GFP flag sets for kernel allocations to test, e.g. kernel+thisnode+noretry. See README.")
+	allocAPIFlag          = flag.String("alloc-api", "alloc_pages", "Kernel allocation function: alloc_pages, alloc_pages_node or folio_alloc")
+	allocNIDFlag          = flag.Int("alloc-nid", -1, "NUMA node for --alloc-api=alloc_pages_node, -1 for the local node")
+	clockFlag             = flag.String("clock", "ktime", "Clock the kernel module times operations with: ktime, local_clock or cycles. See README.")
+	kthreadsFlag          = flag.Bool("kthreads", false, "Run the kernel allocation workers as kernel threads instead of from userspace. Latency samples aren't available.")
+	touchFlag             = flag.String("touch", "none", "Comma-separated list of what to do with kernel pages after allocating them: none, cacheline, write, zero or read. See README.")
+	faultModeFlag         = flag.String("findlimit-fault", "populate", "How the findlimit workload faults memory in: populate (MADV_POPULATE_WRITE) or touch")
+	thpFlag               = flag.Bool("findlimit-thp", false, "Have the findlimit workload request THP and report how much memory it got as THP")
+	faultSamplesFlag      = flag.Int("findlimit-fault-samples", 16, "Number of page faults the findlimit workload times per 16MiB it faults in, 0 to disable. See README.")
+	tenantsFlag           = flag.Int("findlimit-tenants", 0, "If more than 1, run this many findlimit children at once, each in its own cgroup. Needs --findlimit-mode=cgroup. See README.")
+	tenantPoliciesFlag    = flag.String("findlimit-tenant-mempolicies", "", "Semicolon-separated NUMA memory policies assigned to the tenants in turn, e.g. bind:0;bind:1. Empty means the default policy.")
+	perNodeFlag           = flag.Bool("findlimit-per-node", false, "Run each findlimit iteration once per NUMA node with memory, bound to that node, and report available bytes per node. See README.")
+	tenantFaultRateFlag   = flag.Int("findlimit-tenant-fault-rate-mb-s", 0, "MiB per second each tenant faults in, 0 for as fast as possible")
+	findlimitModeFlag     = flag.String("findlimit-mode", "oom", "How the findlimit workload decides it's done: oom (allocate until OOM-killed) or cgroup (stop at a memory pressure threshold, see README)")
+	findlimitPSIFlag      = flag.Float64("findlimit-psi-threshold", 10, "With --findlimit-mode=cgroup, stop when the cgroup's memory PSI some avg10 reaches this percentage. 0 to disable.")
+	findlimitMinAvailFlag = flag.Int("findlimit-min-available-mb", 256, "With --findlimit-mode=cgroup, stop when MemAvailable drops below this many MiB. 0 to disable.")
+	timeseriesPathFlag    = flag.String("timeseries-path", "", "File to stream JSON Lines timeseries data to while running. See README.")
+	sampleIntervalMSFlag  = flag.Int("sample-interval-ms", 1000, "Interval between records in the --timeseries-path output")
+	patternFlag           = flag.String("pattern", "bounce", "Allocation pattern for the antagonistic kernel allocations, e.g. bounce or steady-rate:rate=5000. See README.")
+	kernelMemoryMBFlag    = flag.Int("kernel-memory-mb", 0, "Average MiB held by the antagonistic kernel allocations across all CPUs. 0 means 1000 allocations per CPU.")
+	pagecacheDirFlag      = flag.String("pagecache-dir", "", "If set, run a page cache churn workload alongside the kernel allocations, on a file in this directory. See README.")
+	pagecacheSizeMBFlag   = flag.Int("pagecache-working-set-mb", 1024, "Size of the page cache workload's file")
+	pagecacheIOKBFlag     = flag.Int("pagecache-io-kb", 64, "Size of the page cache workload's reads, writes and drops")
+	pagecacheRatesFlag    = flag.String("pagecache-rates", "read=1000,write=100,fault=1000,drop=10", "Operations per second for each part of the page cache workload, 0 to disable")
+	slabFlag              = flag.String("slab", "", "If set, the antagonistic kernel allocations are slab objects instead of pages: kmalloc or cache. See README.")
+	slabSizesFlag         = flag.String("slab-sizes", "64:4,256:2,1024:1", "Distribution of object sizes for --slab=kmalloc, as size:weight pairs")
+	slabCacheSizeFlag     = flag.Int("slab-cache-size", 256, "Object size of the private cache for --slab=cache")
+	slabCacheAlignFlag    = flag.Int("slab-cache-align", 0, "Object alignment of the private cache for --slab=cache, 0 for the default")
+	slabCacheHWAlignFlag  = flag.Bool("slab-cache-hwcache-align", false, "Create the private cache for --slab=cache with SLAB_HWCACHE_ALIGN")
+	slabCacheCtorFlag     = flag.String("slab-cache-ctor", "none", "Constructor for the private cache for --slab=cache: none, zero or pattern")
+	perfCountersFlag      = flag.Bool("perf-counters", false, "Count perf events (cycles, instructions, LLC and dTLB misses, context switches) in the kernel allocation workers and findlimit children. See README.")
+	ftraceHistsFlag       = flag.Bool("ftrace-hists", false, "Count page allocator internals (PCP refills, zone->lock contention, fallbacks, direct reclaim) with ftrace hist triggers during each phase. See README.")
+	kernelCPUsFlag        = flag.String("kernel-cpus", "", "If set, only run the antagonistic kernel allocation workers on these CPUs, e.g. 0-3,8")
+	kernelNodesFlag       = flag.String("kernel-nodes", "", "If set, only run the antagonistic kernel allocation workers on the CPUs of these NUMA nodes, e.g. 1")
+	remoteFreeFlag        = flag.String("remote-free", "", "Comma-separated list of CPU relationships (same-core, same-llc, same-node, remote-node) for freeing kernel pages on a different CPU. Empty means free locally.")
 )
 
 var (
-	kernelAllocFailuresPrefix        = "kernel_alloc_failures"
-	idleAvailableBytesPrefix         = "idle_available_bytes"
-	antagonizedAvailableBytesPrefix  = "antagonized_available_bytes"
-	kernelPageAllocsPrefix           = "kernel_page_allocs"
-	kernelPageAllocsRemotePrefix     = "kernel_page_allocs_remote"
-	kernelPageAllocLatenciesNSPrefix = "kernel_page_alloc_latencies_ns"
-	kernelPageFreeLatenciesNSPrefix  = "kernel_page_free_latencies_ns"
+	kernelAllocFailuresPrefix            = "kernel_alloc_failures"
+	idleAvailableBytesPrefix             = "idle_available_bytes"
+	antagonizedAvailableBytesPrefix      = "antagonized_available_bytes"
+	idleTHPBytesPrefix                   = "idle_thp_bytes"
+	antagonizedTHPBytesPrefix            = "antagonized_thp_bytes"
+	idleFindlimitDurationMSPrefix        = "idle_findlimit_duration_ms"
+	antagonizedFindlimitDurationMSPrefix = "antagonized_findlimit_duration_ms"
+	idleFaultLatencyPrefix               = "idle_fault_latency"
+	antagonizedFaultLatencyPrefix        = "antagonized_fault_latency"
+	idleTenantPrefix                     = "idle_tenant"
+	antagonizedTenantPrefix              = "antagonized_tenant"
+	idleNodePrefix                       = "idle_node"
+	antagonizedNodePrefix                = "antagonized_node"
+	idleFindlimitPerfPrefix              = "idle_findlimit_perf"
+	antagonizedFindlimitPerfPrefix       = "antagonized_findlimit_perf"
+	idleFindlimitIterationsPrefix        = "idle_findlimit_iterations"
+	antagonizedFindlimitIterationsPrefix = "antagonized_findlimit_iterations"
+	idleAvailableCIPrefix                = "idle_available_ci"
+	antagonizedAvailableCIPrefix         = "antagonized_available_ci"
+	kernelPageAllocsPrefix               = "kernel_page_allocs"
+	kernelPageAllocsRemotePrefix         = "kernel_page_allocs_remote"
+	kernelPageAllocsByNodePrefix         = "kernel_page_allocs_by_node"
+	kernelPageAllocsRemoteByNodePrefix   = "kernel_page_allocs_remote_by_node"
+	kernelPageAllocLatenciesNSPrefix     = "kernel_page_alloc_latencies_ns"
+	kernelPageFreeLatenciesNSPrefix      = "kernel_page_free_latencies_ns"
+	kernelPageAllocLatencyPrefix         = "kernel_page_alloc_latency"
+	kernelPageFreeLatencyPrefix          = "kernel_page_free_latency"
+	kernelPageTouchLatencyPrefix         = "kernel_page_touch_latency"
+	kernelRemoteFreePairsPrefix          = "kernel_remote_free_pairs"
+	kernelClockSourcePrefix              = "kernel_clock_source"
+	pagecacheOpsPrefix                   = "pagecache_ops"
+	pagecacheMajorFaultsPrefix           = "pagecache_major_faults"
+	pagecacheLatencyPrefix               = "pagecache_latency"
+	kernelClockOverheadNSPrefix          = "kernel_clock_overhead_ns"
+	kernelPageRemoteFreeLatencyPrefix    = "kernel_page_remote_free_latency"
+	kernelPerfPrefix                     = "kernel_perf"
 )
 
-// Runs findlimit workload @iterations times, returns available byte counts.
-func repeatFindlimit(ctx context.Context, iterations int, desc string) ([]int64, error) {
-	var result []int64
-	for i := 1; i <= iterations; i++ {
+// Adds summary metrics for a nanosecond latency histogram.
+func addHistMetrics(result map[string][]int64, prefix string, h *hist.Histogram) {
+	result[prefix+"_p50_ns"] = []int64{int64(h.Quantile(0.5))}
+	result[prefix+"_p99_ns"] = []int64{int64(h.Quantile(0.99))}
+	result[prefix+"_p999_ns"] = []int64{int64(h.Quantile(0.999))}
+	result[prefix+"_max_ns"] = []int64{int64(h.Max)}
+}
+
+// Adds summary metrics for a nanosecond latency histogram with a constant
+// timing overhead subtracted, under prefix_corrected.
+func addCorrectedHistMetrics(result map[string][]int64, prefix string, h *hist.Histogram, overhead time.Duration) {
+	correct := func(v uint64) []int64 {
+		return []int64{max(0, int64(v)-overhead.Nanoseconds())}
+	}
+	prefix += "_corrected"
+	result[prefix+"_p50_ns"] = correct(h.Quantile(0.5))
+	result[prefix+"_p99_ns"] = correct(h.Quantile(0.99))
+	result[prefix+"_p999_ns"] = correct(h.Quantile(0.999))
+	result[prefix+"_max_ns"] = correct(h.Max)
+}
+
+// Nil if --timeseries-path isn't set, which is fine to use.
+var timeseriesWriter *timeseries.Writer
+
+// Nil unless --output-format=binary, which is fine to use. Latency samples are
+// streamed to this as each run finishes instead of going in the result map.
+var resultsWriter *results.Writer
+
+func resultSamples(ls []kallocfree.LatencySample) []results.Sample {
+	samples := make([]results.Sample, len(ls))
+	for i, l := range ls {
+		samples[i] = results.Sample{Time: l.Time, CPU: l.CPU, Value: l.Latency.Nanoseconds()}
+	}
+	return samples
+}
+
+// Names of the timeseries phase and the metrics for one phase of findlimit
+// runs.
+type findlimitMetrics struct {
+	phase, available, thp, durationMS, faultLatency, tenant, node, perf, iterations, availableCI string
+}
+
+var (
+	idleFindlimitMetrics = findlimitMetrics{"idle", idleAvailableBytesPrefix, idleTHPBytesPrefix,
+		idleFindlimitDurationMSPrefix, idleFaultLatencyPrefix, idleTenantPrefix, idleNodePrefix,
+		idleFindlimitPerfPrefix, idleFindlimitIterationsPrefix, idleAvailableCIPrefix}
+	antagonizedFindlimitMetrics = findlimitMetrics{"antagonized", antagonizedAvailableBytesPrefix, antagonizedTHPBytesPrefix,
+		antagonizedFindlimitDurationMSPrefix, antagonizedFaultLatencyPrefix, antagonizedTenantPrefix,
+		antagonizedNodePrefix, antagonizedFindlimitPerfPrefix, antagonizedFindlimitIterationsPrefix,
+		antagonizedAvailableCIPrefix}
+)
+
+// Adds the perf counts from the kallocfree CPU workers, per thousand
+// operations, for each phase. The _by_cpu metrics have an item per CPU, 0 for
+// the ones that did no operations in the phase.
+func addKernelPerfMetrics(result map[string][]int64, perfResults map[string][]kallocfree.PerfResult) {
+	for phase, cpus := range perfResults {
+		total := make(perf.Counts)
+		var totalOps uint64
+		byCPU := make(map[perf.Counter][]int64)
+		for _, r := range cpus {
+			total.Add(r.Counts)
+			totalOps += r.Ops
+			for c := perf.Counter(0); c < perf.NumCounters; c++ {
+				var perKOp int64
+				if val, ok := r.Counts[c]; ok && r.Ops != 0 {
+					perKOp = int64(val * 1000 / r.Ops)
+				}
+				byCPU[c] = append(byCPU[c], perKOp)
+			}
+		}
+		if totalOps == 0 {
+			continue
+		}
+		for c, val := range total {
+			prefix := fmt.Sprintf("%s_%s_%v_per_1k_ops", kernelPerfPrefix, phase, c)
+			result[prefix] = []int64{int64(val * 1000 / totalOps)}
+			result[prefix+"_by_cpu"] = byCPU[c]
+		}
+	}
+}
+
+// Runs findlimit workload as many times as the policy says, adds available
+// byte counts (and THP byte counts if enabled) and durations to the result, as
+// well as the fault latencies for each pressure band over all the iterations
+// and the confidence interval of the median available bytes. With
+// --findlimit-tenants, the counts are totals over the tenants and there are
+// per-tenant and fairness metrics too. Likewise for the nodes with
+// --findlimit-per-node.
+func repeatFindlimit(ctx context.Context, policy *iterationPolicy, desc string,
+	result map[string][]int64, metrics findlimitMetrics) error {
+	opts := &findlimit.Options{
+		FaultMode:    findlimit.FaultMode(*faultModeFlag),
+		THP:          *thpFlag,
+		FaultSamples: *faultSamplesFlag,
+		PerfCounters: *perfCountersFlag,
+	}
+	if *findlimitModeFlag == "cgroup" {
+		opts.Cgroup = &findlimit.CgroupOptions{
+			PSIThreshold: *findlimitPSIFlag,
+			MinAvailable: pab.ByteSize(*findlimitMinAvailFlag) * pab.Megabyte,
+		}
+	}
+	var tenantsOpts *findlimit.TenantsOptions
+	if *tenantsFlag > 1 {
+		var err error
+		tenantsOpts, err = findlimitTenantsOptions(opts)
+		if err != nil {
+			return err
+		}
+	}
+	var available, thp, durations []int64
+	var faultLatencies progress.FaultHists
+	perfPerKPage := make(map[perf.Counter][]int64)
+	tenantMetrics := newTenantMetrics(*tenantsFlag)
+	nodeMetrics, err := newNodeMetrics()
+	if err != nil {
+		return err
+	}
+	start := time.Now()
+	for i := 1; ; i++ {
 		if ctx.Err() != nil {
-			return nil, nil
+			return nil
+		}
+		if done, why := policy.done(available, time.Since(start)); done {
+			if policy.targetCIPct != 0 {
+				fmt.Printf("\tStopped after %d iterations: %s\n", i-1, why)
+			}
+			break
+		}
+		if err := timeseriesWriter.Phase(metrics.phase, i); err != nil {
+			return err
+		}
+		var findlimitResult *findlimit.Result
+		var err error
+		if tenantsOpts != nil {
+			var tenantsResult *findlimit.TenantsResult
+			tenantsResult, err = findlimit.RunTenants(ctx, tenantsOpts)
+			if err == nil {
+				findlimitResult = tenantMetrics.add(tenantsResult)
+			}
+		} else if nodeMetrics != nil {
+			findlimitResult, err = nodeMetrics.run(ctx, opts)
+		} else {
+			findlimitResult, err = findlimit.Run(ctx, opts)
 		}
-		findlimitResult, err := findlimit.Run(ctx, &findlimit.Options{})
 		if err != nil {
-			return nil, fmt.Errorf("%s findlimit run %d: %v", desc, i, err)
+			return fmt.Errorf("%s findlimit run %d: %v", desc, i, err)
+		}
+		stopped := ""
+		if findlimitResult.StopReason != "" {
+			stopped = fmt.Sprintf(", stopped by %s", findlimitResult.StopReason)
 		}
-		fmt.Printf("\tIteration %d/%d: %s available on %s system\n",
-			i, *iterationsFlag, findlimitResult.Allocated, desc)
-		result = append(result, findlimitResult.Allocated.Bytes())
+		fmt.Printf("\tIteration %d/%d: %s available on %s system (took %v%s)\n",
+			i, policy.max, findlimitResult.Allocated, desc,
+			findlimitResult.Duration.Round(time.Millisecond), stopped)
+		available = append(available, findlimitResult.Allocated.Bytes())
+		thp = append(thp, findlimitResult.THPAllocated.Bytes())
+		durations = append(durations, findlimitResult.Duration.Milliseconds())
+		for band := range faultLatencies {
+			faultLatencies[band].Merge(&findlimitResult.FaultLatencyHists[band])
+		}
+		if pages := findlimitResult.Allocated.Pages(); pages != 0 {
+			for c, val := range findlimitResult.Perf {
+				perfPerKPage[c] = append(perfPerKPage[c], int64(val*1000/uint64(pages)))
+			}
+		}
+	}
+	result[metrics.available] = available
+	result[metrics.iterations] = []int64{int64(len(available))}
+	if ci := medianCI(available); ci != nil {
+		result[metrics.availableCI+"_lo_bytes"] = []int64{int64(ci.lo)}
+		result[metrics.availableCI+"_hi_bytes"] = []int64{int64(ci.hi)}
+		result[metrics.availableCI+"_width_ppm"] = []int64{int64(ci.widthPct() * 1e4)}
 	}
-	return result, nil
+	if *thpFlag {
+		result[metrics.thp] = thp
+	}
+	result[metrics.durationMS] = durations
+	tenantMetrics.addTo(result, metrics.tenant)
+	nodeMetrics.addTo(result, metrics.node)
+	for c, vals := range perfPerKPage {
+		result[fmt.Sprintf("%s_%v_per_1k_pages", metrics.perf, c)] = vals
+	}
+	for band := range faultLatencies {
+		if faultLatencies[band].Count == 0 {
+			continue
+		}
+		prefix := fmt.Sprintf("%s_pressure%d", metrics.faultLatency, band*100/progress.NumPressureBands)
+		addHistMetrics(result, prefix, &faultLatencies[band])
+	}
+	return nil
 }
 
-// Returns map of metric names to values. Metrics with a single value are just a
-// slice with only one item.
-func run(ctx context.Context, allocOrder int) (map[string][]int64, error) {
-	result := make(map[string][]int64)
+// Sets up the --ftrace-hists triggers, nil if the flag isn't set.
+func startTracehist() (*tracehist.Session, error) {
+	if !*ftraceHistsFlag {
+		return nil, nil
+	}
+	file, err := os.Open("/proc/page_alloc_bench")
+	if err != nil {
+		return nil, fmt.Errorf("opening /proc/page_alloc_bench: %v", err)
+	}
+	conn := kmod.Connection{file}
+	defer conn.Close()
+	zoneLocks, err := conn.ZoneLocks()
+	if err != nil {
+		return nil, fmt.Errorf("getting zone lock addresses from kmod: %v", err)
+	}
+	opts := &tracehist.Options{}
+	for _, zl := range zoneLocks {
+		opts.ZoneLocks = append(opts.ZoneLocks, zl.LockAddr)
+	}
+	session, err := tracehist.Start(opts)
+	if err != nil {
+		return nil, fmt.Errorf("setting up ftrace hist triggers: %v", err)
+	}
+	return session, nil
+}
+
+// phaseSnapshots takes snapshots of the allocator state at the boundaries
+// between the phases of the benchmark.
+type phaseSnapshots struct {
+	tracehist     *tracehist.Session // nil without --ftrace-hists.
+	prev          *mmstat.Snapshot
+	prevTracehist *tracehist.Snapshot
+}
+
+// take adds the snapshot to the result as mm_$phase, and the vmstat and
+// --ftrace-hists deltas since the previous snapshot (which might have been for
+// another run) as vmstat_$prevPhase and ftrace_$prevPhase.
+func (p *phaseSnapshots) take(result map[string][]int64, phase, prevPhase string) error {
+	snapshot, err := mmstat.Take()
+	if err != nil {
+		return fmt.Errorf("taking %s allocator state snapshot: %v", phase, err)
+	}
+	traceSnapshot, err := p.tracehist.Snapshot()
+	if err != nil {
+		return fmt.Errorf("taking %s ftrace hist snapshot: %v", phase, err)
+	}
+	snapshot.AddMetrics(result, "mm_"+phase)
+	if p.prev != nil {
+		snapshot.AddDeltaMetrics(result, "vmstat_"+prevPhase, p.prev)
+		traceSnapshot.AddDeltaMetrics(result, "ftrace_"+prevPhase, p.prevTracehist, runtime.NumCPU())
+	}
+	p.prev = snapshot
+	p.prevTracehist = traceSnapshot
+	return nil
+}
+
+// idleBaseline is the idle phase of the benchmark. It only depends on the
+// system, not on how the kernel allocations are configured, so it's measured
+// once and its metrics are shared by all the runs.
+type idleBaseline struct {
+	result map[string][]int64 // nil until measured.
+}
+
+// get measures the baseline the first time it's called, then returns a copy of
+// the metrics.
+func (b *idleBaseline) get(ctx context.Context, snapshots *phaseSnapshots) (map[string][]int64, error) {
+	if b.result == nil {
+		result := make(map[string][]int64)
+		if err := snapshots.take(result, "start", ""); err != nil {
+			return nil, err
+		}
+		// Figure out how much memory the system appears to have when idle.
+		fmt.Printf("Assessing system memory availability...\n")
+		err := repeatFindlimit(ctx, flagIterationPolicy(), "initial", result, idleFindlimitMetrics)
+		if err != nil {
+			return nil, err
+		}
+		if err := snapshots.take(result, "idle", "idle"); err != nil {
+			return nil, err
+		}
+		b.result = result
+	}
+	return maps.Clone(b.result), nil
+}
+
+// Adds the metrics for what the kallocfree workload did during one run.
+func addKallocfreeMetrics(result map[string][]int64, kallocfreeResult *kallocfree.Result,
+	orderWeights []kallocfree.OrderWeight, touch kmod.TouchPolicy) error {
+	result[kernelAllocFailuresPrefix] = []int64{int64(kallocfreeResult.AllocFailures)}
+	result[kernelPageAllocsPrefix] = []int64{int64(kallocfreeResult.PagesAllocated)}
+	result[kernelPageAllocsRemotePrefix] = []int64{int64(kallocfreeResult.NUMARemoteAllocations)}
+	if kallocfreeResult.PagesAllocatedByNode != nil {
+		var byNode, remoteByNode []int64
+		for nid := range kallocfreeResult.PagesAllocatedByNode {
+			byNode = append(byNode, int64(kallocfreeResult.PagesAllocatedByNode[nid]))
+			remoteByNode = append(remoteByNode, int64(kallocfreeResult.NUMARemoteAllocationsByNode[nid]))
+		}
+		result[kernelPageAllocsByNodePrefix] = byNode
+		result[kernelPageAllocsRemoteByNodePrefix] = remoteByNode
+	}
+	if *latenciesFlag && resultsWriter != nil {
+		err := resultsWriter.WriteSamples(kernelPageAllocLatenciesNSPrefix,
+			resultSamples(kallocfreeResult.AllocLatencies))
+		if err != nil {
+			return err
+		}
+		err = resultsWriter.WriteSamples(kernelPageFreeLatenciesNSPrefix,
+			resultSamples(kallocfreeResult.FreeLatencies))
+		if err != nil {
+			return err
+		}
+	} else if *latenciesFlag {
+		ls := []int64{}
+		for _, l := range kallocfreeResult.AllocLatencies {
+			ls = append(ls, l.Latency.Nanoseconds())
+		}
+		result[kernelPageAllocLatenciesNSPrefix] = ls
+		ls = []int64{}
+		for _, l := range kallocfreeResult.FreeLatencies {
+			ls = append(ls, l.Latency.Nanoseconds())
+		}
+		result[kernelPageFreeLatenciesNSPrefix] = ls
+	}
+	addHistMetrics(result, kernelPageAllocLatencyPrefix, kallocfreeResult.AllocLatencyHist)
+	addHistMetrics(result, kernelPageFreeLatencyPrefix, kallocfreeResult.FreeLatencyHist)
+	overhead := kallocfreeResult.ClockOverhead
+	addCorrectedHistMetrics(result, kernelPageAllocLatencyPrefix, kallocfreeResult.AllocLatencyHist, overhead)
+	addCorrectedHistMetrics(result, kernelPageFreeLatencyPrefix, kallocfreeResult.FreeLatencyHist, overhead)
+	if touch != kmod.TouchNone && touch != kmod.TouchZero {
+		addHistMetrics(result, kernelPageTouchLatencyPrefix, kallocfreeResult.TouchLatencyHist)
+		addCorrectedHistMetrics(result, kernelPageTouchLatencyPrefix, kallocfreeResult.TouchLatencyHist, overhead)
+	}
+	result[kernelClockSourcePrefix] = []int64{int64(kallocfreeResult.Clock)}
+	result[kernelClockOverheadNSPrefix] = []int64{overhead.Nanoseconds()}
+	if len(orderWeights) != 0 {
+		for order, r := range kallocfreeResult.PerOrder {
+			suffix := fmt.Sprintf("_order%d", order)
+			result[kernelAllocFailuresPrefix+suffix] = []int64{int64(r.AllocFailures)}
+			result[kernelPageAllocsPrefix+suffix] = []int64{int64(r.PagesAllocated)}
+			result[kernelPageAllocsRemotePrefix+suffix] = []int64{int64(r.NUMARemoteAllocations)}
+			addHistMetrics(result, kernelPageAllocLatencyPrefix+suffix, r.AllocLatencyHist)
+			addHistMetrics(result, kernelPageFreeLatencyPrefix+suffix, r.FreeLatencyHist)
+			if touch != kmod.TouchNone && touch != kmod.TouchZero {
+				addHistMetrics(result, kernelPageTouchLatencyPrefix+suffix, r.TouchLatencyHist)
+			}
+		}
+	}
+	addKernelPerfMetrics(result, kallocfreeResult.Perf)
+	for class, r := range kallocfreeResult.RemoteFree {
+		className := strings.ReplaceAll(class.String(), "-", "_")
+		result[kernelRemoteFreePairsPrefix+"_"+className] = []int64{int64(r.NumPairs)}
+		addHistMetrics(result, kernelPageRemoteFreeLatencyPrefix+"_"+className, r.FreeLatencyHist)
+	}
+	return nil
+}
+
+// Sets up the --pagecache-dir workload, nil if the flag isn't set.
+func newPagecacheWorkload() (*pagecache.Workload, error) {
+	if *pagecacheDirFlag == "" {
+		return nil, nil
+	}
+	opts, err := pagecacheOptions()
+	if err != nil {
+		return nil, err
+	}
+	workload, err := pagecache.New(opts)
+	if err != nil {
+		return nil, fmt.Errorf("setting up page cache workload: %v", err)
+	}
+	return workload, nil
+}
+
+// antagonize is the part of a run after the kallocfree workload has started
+// with the run's order: it waits for kallocfree to reach steady state then
+// measures memory availability, with the page cache workload (if
+// pagecacheWorkload is non-nil) running alongside.
+func antagonize(ctx context.Context, kallocFree *kallocfree.Workload, pagecacheWorkload *pagecache.Workload,
+	snapshots *phaseSnapshots, result map[string][]int64) error {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+	eg, ctx := errgroup.WithContext(ctx)
+	var pagecacheResult *pagecache.Result
+	if pagecacheWorkload != nil {
+		eg.Go(func() error {
+			var err error
+			pagecacheResult, err = pagecacheWorkload.Run(ctx)
+			return err
+		})
+	}
+	eg.Go(func() error {
+		fmt.Printf("Waiting for kallocfree to reach steady state...\n")
+		kallocFree.AwaitSteadyState(ctx)
+		fmt.Printf("...Steady state reached.\n")
+		if err := timeseriesWriter.Phase("steady", -1); err != nil {
+			return err
+		}
+		if err := snapshots.take(result, "steady", "rampup"); err != nil {
+			return err
+		}
+		// See how much memory seems to be in the system now.
+		err := repeatFindlimit(ctx, flagIterationPolicy(), "antagonized", result, antagonizedFindlimitMetrics)
+		if err != nil {
+			return err
+		}
+		// Before kallocfree frees everything.
+		if err := snapshots.take(result, "end", "antagonized"); err != nil {
+			return err
+		}
+		if err := timeseriesWriter.Phase("end", -1); err != nil {
+			return err
+		}
+		cancel() // Done.
+		return nil
+	})
+	if err := eg.Wait(); err != nil {
+		return err
+	}
+	if r := pagecacheResult; r != nil {
+		for op, n := range map[string]uint64{"read": r.Reads, "write": r.Writes, "fault": r.Faults, "drop": r.Drops} {
+			result[pagecacheOpsPrefix+"_"+op] = []int64{int64(n)}
+		}
+		result[pagecacheMajorFaultsPrefix] = []int64{int64(r.MajorFaults)}
+		addHistMetrics(result, pagecacheLatencyPrefix+"_read", r.ReadLatencyHist)
+		addHistMetrics(result, pagecacheLatencyPrefix+"_write", r.WriteLatencyHist)
+		addHistMetrics(result, pagecacheLatencyPrefix+"_fault", r.FaultLatencyHist)
+	}
+	return nil
+}
+
+// Runs the benchmark for each of allocOrders, returning a map of metric names
+// to values for each one. Metrics with a single value are just a slice with
+// only one item. suffixes are the metric name suffixes of the runs, for the
+// timeseries and binary results.
+// The kallocfree workload keeps running between the runs, only switching
+// order, so with more than one order it must be a userspace page workload.
+// If orderWeights is non-empty it overrides allocOrder, and the kernel
+// allocation metrics are also broken down with _order$n suffixes. If slab is
+// non-nil it overrides both, and the kernel allocations are slab objects.
+func run(ctx context.Context, allocOrders []int, suffixes []string, orderWeights []kallocfree.OrderWeight,
+	slab *kmod.SlabArgs, slabCache *kmod.SlabCacheConfig,
+	gfp kmod.GFP, allocAPI kmod.AllocAPI, clock kmod.ClockSource, touch kmod.TouchPolicy,
+	remoteFree []kallocfree.TopologyClass, pattern *kallocfree.PatternSpec, cpus []int,
+	baseline *idleBaseline, snapshots *phaseSnapshots) ([]map[string][]int64, error) {
+	timeseriesWriter.SetRun(strings.TrimPrefix(suffixes[0], "_"))
+	resultsWriter.SetRun(suffixes[0])
 
 	// We're not running this just yet, btu set it upt now to fail fast.
-	kernelUsage := 128 * pab.Megabyte
 	kallocFree, err := kallocfree.New(ctx, &kallocfree.Options{
-		TotalMemory:      kernelUsage,
-		Order:            allocOrder,
+		TotalMemory:      pab.ByteSize(*kernelMemoryMBFlag) * pab.Megabyte,
+		Order:            allocOrders[0],
+		OrderWeights:     orderWeights,
+		Slab:             slab,
+		SlabCache:        slabCache,
+		GFP:              gfp,
+		API:              allocAPI,
+		NID:              *allocNIDFlag,
+		Touch:            touch,
+		Clock:            clock,
 		MeasureLatencies: *latenciesFlag,
+		BatchSize:        *batchSizeFlag,
+		InKernel:         *kthreadsFlag,
+		RemoteFree:       remoteFree,
+		Pattern:          pattern,
+		Timeseries:       timeseriesWriter,
+		SampleInterval:   time.Duration(*sampleIntervalMSFlag) * time.Millisecond,
+		PerfCounters:     *perfCountersFlag,
+		CPUs:             cpus,
 	})
 	if err != nil {
 		return nil, fmt.Errorf("setting up kallocfree workload: %v\n", err)
 	}
-
-	// Figure out how much memory the system appears to have when idle.
-	fmt.Printf("Assessing system memory availability...\n")
-	idleAvailableBytes, err := repeatFindlimit(ctx, *iterationsFlag, "initial")
+	// Run closes it too, this covers the errors before that.
+	defer kallocFree.Close()
+	pagecacheWorkload, err := newPagecacheWorkload()
 	if err != nil {
 		return nil, err
 	}
-	result[idleAvailableBytesPrefix] = idleAvailableBytes
+
+	results := make([]map[string][]int64, len(allocOrders))
+	for i := range results {
+		if results[i], err = baseline.get(ctx, snapshots); err != nil {
+			return nil, err
+		}
+	}
 
 	// Make the system busy with lots of background kernel allocations and frees.
+	if err := timeseriesWriter.Phase("rampup", -1); err != nil {
+		return nil, err
+	}
 	ctx, cancel := context.WithCancel(ctx)
 	defer cancel()
 	eg, ctx := errgroup.WithContext(ctx)
+	// Only added to the result at the end, since the other goroutine writes
+	// to it at the same time.
+	var kallocfreeResult *kallocfree.Result
 	eg.Go(func() error {
-		kallocfreeResult, err := kallocFree.Run(ctx)
+		var err error
+		kallocfreeResult, err = kallocFree.Run(ctx)
 		if err != nil {
 			return fmt.Errorf("kallocfree sub-workload: %v", err)
 		}
-		result[kernelAllocFailuresPrefix] = []int64{int64(kallocfreeResult.AllocFailures)}
-		result[kernelPageAllocsPrefix] = []int64{int64(kallocfreeResult.PagesAllocated)}
-		result[kernelPageAllocsRemotePrefix] = []int64{int64(kallocfreeResult.NUMARemoteAllocations)}
-		ls := []int64{}
-		for _, l := range kallocfreeResult.AllocLatencies {
-			ls = append(ls, l.Nanoseconds())
-		}
-		result[kernelPageAllocLatenciesNSPrefix] = ls
-		ls = []int64{}
-		for _, l := range kallocfreeResult.FreeLatencies {
-			ls = append(ls, l.Nanoseconds())
-		}
-		result[kernelPageFreeLatenciesNSPrefix] = ls
 		return nil
 	})
-	fmt.Printf("Waiting for kallocfree to reach steady state...\n")
-	kallocFree.AwaitSteadyState(ctx)
-	fmt.Printf("...Steady state reached.\n")
 	eg.Go(func() error {
-		// See how much memory seems to be in the system now.
-		antagonizedAvailableBytes, err := repeatFindlimit(ctx, *iterationsFlag, "antagonized")
-		if err != nil {
-			return err
+		for i, order := range allocOrders {
+			if i > 0 {
+				var err error
+				pagecacheWorkload, err = newPagecacheWorkload()
+				if err != nil {
+					return err
+				}
+				timeseriesWriter.SetRun(strings.TrimPrefix(suffixes[i], "_"))
+				if err := timeseriesWriter.Phase("rampup", -1); err != nil {
+					return err
+				}
+				prevResult, err := kallocFree.NextOrder(ctx, order)
+				if err != nil {
+					return fmt.Errorf("switching kallocfree to order %d: %v", order, err)
+				}
+				if err := addKallocfreeMetrics(results[i-1], prevResult, orderWeights, touch); err != nil {
+					return err
+				}
+				resultsWriter.SetRun(suffixes[i])
+			}
+			if err := antagonize(ctx, kallocFree, pagecacheWorkload, snapshots, results[i]); err != nil {
+				return err
+			}
 		}
-		result[antagonizedAvailableBytesPrefix] = antagonizedAvailableBytes
 		cancel() // Done.
 		return nil
 	})
-	return result, eg.Wait()
+	if err := eg.Wait(); err != nil {
+		return nil, err
+	}
+	if err := addKallocfreeMetrics(results[len(results)-1], kallocfreeResult, orderWeights, touch); err != nil {
+		return nil, err
+	}
+	return results, nil
+}
+
+// kernelCPUsFromFlags returns the CPUs for the kernel allocation workers from
+// --kernel-cpus or --kernel-nodes, nil for all of them.
+func kernelCPUsFromFlags() ([]int, error) {
+	if *kernelCPUsFlag != "" && *kernelNodesFlag != "" {
+		return nil, fmt.Errorf("--kernel-cpus and --kernel-nodes are mutually exclusive")
+	}
+	var cpus []int
+	if *kernelCPUsFlag != "" {
+		list, err := linux.CPUMaskFromString(*kernelCPUsFlag)
+		if err != nil {
+			return nil, fmt.Errorf("Bad --kernel-cpus: %v", err)
+		}
+		for _, cpu := range list {
+			cpus = append(cpus, int(cpu))
+		}
+	}
+	if *kernelNodesFlag != "" {
+		list, err := linux.CPUMaskFromString(*kernelNodesFlag)
+		if err != nil {
+			return nil, fmt.Errorf("Bad --kernel-nodes: %v", err)
+		}
+		nodes, err := linux.NUMANodes()
+		if err != nil {
+			return nil, fmt.Errorf("parsing NUMA nodes: %v", err)
+		}
+		for _, nid := range list {
+			nodeCPUs, ok := nodes[int(nid)]
+			if !ok {
+				return nil, fmt.Errorf("Bad --kernel-nodes: no node %d", nid)
+			}
+			for _, cpu := range nodeCPUs {
+				cpus = append(cpus, int(cpu))
+			}
+		}
+		if len(cpus) == 0 {
+			return nil, fmt.Errorf("Bad --kernel-nodes: no CPUs on nodes %s", *kernelNodesFlag)
+		}
+	}
+	return cpus, nil
+}
+
+// slabOptions builds the slab allocation settings from the flags, apart from
+// the GFP flags.
+func slabOptions() (*kmod.SlabArgs, *kmod.SlabCacheConfig, error) {
+	api, err := kmod.ParseSlabAPI(*slabFlag)
+	if err != nil {
+		return nil, nil, fmt.Errorf("Bad --slab: %v", err)
+	}
+	if api == kmod.SlabKmalloc {
+		sizes, err := kmod.ParseSlabSizes(*slabSizesFlag)
+		if err != nil {
+			return nil, nil, fmt.Errorf("Bad --slab-sizes: %v", err)
+		}
+		return &kmod.SlabArgs{API: api, Sizes: sizes}, nil, nil
+	}
+	ctor, err := kmod.ParseSlabCtor(*slabCacheCtorFlag)
+	if err != nil {
+		return nil, nil, fmt.Errorf("Bad --slab-cache-ctor: %v", err)
+	}
+	return &kmod.SlabArgs{API: api}, &kmod.SlabCacheConfig{
+		Size:         *slabCacheSizeFlag,
+		Align:        *slabCacheAlignFlag,
+		Ctor:         ctor,
+		HWCacheAlign: *slabCacheHWAlignFlag,
+	}, nil
+}
+
+// pagecacheOptions builds the page cache workload options from the flags.
+func pagecacheOptions() (*pagecache.Options, error) {
+	opts := &pagecache.Options{
+		Dir:        *pagecacheDirFlag,
+		WorkingSet: pab.ByteSize(*pagecacheSizeMBFlag) * pab.Megabyte,
+		IOSize:     pab.ByteSize(*pagecacheIOKBFlag) * pab.Kilobyte,
+	}
+	rates := map[string]*float64{
+		"read":  &opts.ReadRate,
+		"write": &opts.WriteRate,
+		"fault": &opts.FaultRate,
+		"drop":  &opts.DropRate,
+	}
+	for _, elem := range strings.Split(*pagecacheRatesFlag, ",") {
+		name, val, _ := strings.Cut(elem, "=")
+		rate, ok := rates[name]
+		if !ok {
+			return nil, fmt.Errorf("Bad --pagecache-rates: unknown operation %q", name)
+		}
+		var err error
+		*rate, err = strconv.ParseFloat(val, 64)
+		if err != nil || *rate < 0 {
+			return nil, fmt.Errorf("Bad --pagecache-rates: bad rate in %q", elem)
+		}
+	}
+	return opts, nil
 }
 
 func printAverages(name string, vals []int64) {
@@ -154,15 +784,28 @@ func printAverages(name string, vals []int64) {
 		sum += val
 	}
 
-	sorted := slices.Clone(vals)
-	slices.Sort(sorted)
 	mean := float64(sum) / float64(len(vals))
-	median := sorted[len(sorted)/2]
-	p95 := sorted[(len(sorted)*95)/100]
+	median, p95 := sketchQuantiles(vals, min, max)
 	fmt.Printf("%q:\n\tsamples: %d\n\tmean: %12.02f\n\tmed: %12d\n\tp95: %12d\n\tmax: %12d\n\tmin: %12d\n",
 		name, len(vals), mean, median, p95, max, min)
 }
 
+// Returns the median and 95th percentile. For big sets of values that fit in a
+// hist.Histogram this is an estimate accurate to the bucket width, to avoid
+// sorting them.
+func sketchQuantiles(vals []int64, min, max int64) (int64, int64) {
+	if len(vals) < 1000 || min < 0 || max >= 1<<hist.MaxShift {
+		sorted := slices.Clone(vals)
+		slices.Sort(sorted)
+		return sorted[len(sorted)/2], sorted[(len(sorted)*95)/100]
+	}
+	var h hist.Histogram
+	for _, val := range vals {
+		h.Record(uint64(val))
+	}
+	return int64(h.Quantile(0.5)), int64(h.Quantile(0.95))
+}
+
 func printResult(result map[string][]int64) {
 	// Print in order sorted by last character, so that all _orderN
 	// metrics for same N get printed together.
@@ -197,6 +840,33 @@ func writeOutput(path string, result map[string][]int64) error {
 	return os.WriteFile(path, output, 0644)
 }
 
+func resultsMetadata() (*results.Metadata, error) {
+	release, kernelVersion, err := linux.Uname()
+	if err != nil {
+		return nil, err
+	}
+	nodes, err := linux.NUMANodes()
+	if err != nil {
+		return nil, fmt.Errorf("parsing NUMA nodes: %v", err)
+	}
+	meta := &results.Metadata{
+		Time:          time.Now(),
+		KernelRelease: release,
+		KernelVersion: kernelVersion,
+		Revision:      version(),
+		NumCPUs:       runtime.NumCPU(),
+		Nodes:         make(map[int][]int),
+		Flags:         make(map[string]string),
+	}
+	for nid, cpus := range nodes {
+		for _, cpu := range cpus {
+			meta.Nodes[nid] = append(meta.Nodes[nid], int(cpu))
+		}
+	}
+	flag.VisitAll(func(f *flag.Flag) { meta.Flags[f.Name] = f.Value.String() })
+	return meta, nil
+}
+
 func version() string {
 	info, ok := debug.ReadBuildInfo()
 	if ok {
@@ -229,30 +899,226 @@ func doMain() error {
 		if err != nil {
 			return fmt.Errorf("Bad value %q in --alloc-orders: %v", orderStr, err)
 		}
+		if o < 0 || o >= kmod.HistNumOrders {
+			return fmt.Errorf("Bad value %q in --alloc-orders: not in [0, %d)", orderStr, kmod.HistNumOrders)
+		}
 		orders = append(orders, o)
 	}
 
-	result := make(map[string][]int64)
-	for _, order := range orders {
-		orderResult, err := run(ctx, order)
+	var orderWeights []kallocfree.OrderWeight
+	if *orderWeightsFlag != "" {
+		var err error
+		orderWeights, err = kallocfree.ParseOrderWeights(*orderWeightsFlag)
+		if err != nil {
+			return fmt.Errorf("Bad --alloc-order-weights: %v", err)
+		}
+		// One run with all of them at once.
+		orders = []int{0}
+	}
+
+	var slab *kmod.SlabArgs
+	var slabCache *kmod.SlabCacheConfig
+	if *slabFlag != "" {
+		var err error
+		slab, slabCache, err = slabOptions()
 		if err != nil {
 			return err
 		}
+		if *touchFlag != "none" || len(orderWeights) != 0 {
+			return fmt.Errorf("--touch and --alloc-order-weights don't apply to --slab")
+		}
+		orders = []int{0}
+	}
 
-		for key, val := range orderResult {
-			result[fmt.Sprintf("%s_order%d", key, order)] = val
+	var gfps []kmod.GFP
+	for _, gfpStr := range strings.Split(*gfpFlag, ",") {
+		gfp, err := kmod.ParseGFP(gfpStr)
+		if err != nil {
+			return fmt.Errorf("Bad value %q in --gfp: %v", gfpStr, err)
+		}
+		gfps = append(gfps, gfp)
+	}
+	allocAPI, err := kmod.ParseAllocAPI(*allocAPIFlag)
+	if err != nil {
+		return fmt.Errorf("Bad --alloc-api: %v", err)
+	}
+	clock, err := kmod.ParseClockSource(*clockFlag)
+	if err != nil {
+		return fmt.Errorf("Bad --clock: %v", err)
+	}
+	var touches []kmod.TouchPolicy
+	for _, touchStr := range strings.Split(*touchFlag, ",") {
+		touch, err := kmod.ParseTouchPolicy(touchStr)
+		if err != nil {
+			return fmt.Errorf("Bad value %q in --touch: %v", touchStr, err)
+		}
+		touches = append(touches, touch)
+	}
+	if *targetCIPctFlag < 0 {
+		return fmt.Errorf("Bad --target-ci-pct %v", *targetCIPctFlag)
+	}
+	if *targetCIPctFlag != 0 && (*minIterationsFlag < 2 || *maxIterationsFlag < *minIterationsFlag) {
+		return fmt.Errorf("--min-iterations must be at least 2 and no more than --max-iterations")
+	}
+	switch findlimit.FaultMode(*faultModeFlag) {
+	case findlimit.FaultPopulate, findlimit.FaultTouch:
+	default:
+		return fmt.Errorf("Bad --findlimit-fault %q", *faultModeFlag)
+	}
+	switch *findlimitModeFlag {
+	case "oom", "cgroup":
+	default:
+		return fmt.Errorf("Bad --findlimit-mode %q", *findlimitModeFlag)
+	}
+	if *tenantsFlag > 1 && *findlimitModeFlag != "cgroup" {
+		return fmt.Errorf("--findlimit-tenants needs --findlimit-mode=cgroup")
+	}
+	if *tenantsFlag > 1 && *perNodeFlag {
+		return fmt.Errorf("--findlimit-per-node doesn't work with --findlimit-tenants, use --findlimit-tenant-mempolicies")
+	}
+	pattern, err := kallocfree.ParsePattern(*patternFlag)
+	if err != nil {
+		return fmt.Errorf("Bad --pattern: %v", err)
+	}
+	var remoteFree []kallocfree.TopologyClass
+	if *remoteFreeFlag != "" {
+		remoteFree, err = kallocfree.ParseTopologyClasses(*remoteFreeFlag)
+		if err != nil {
+			return fmt.Errorf("Bad --remote-free: %v", err)
+		}
+	}
+	kernelCPUs, err := kernelCPUsFromFlags()
+	if err != nil {
+		return err
+	}
+
+	if *timeseriesPathFlag != "" {
+		var err error
+		timeseriesWriter, err = timeseries.Create(*timeseriesPathFlag)
+		if err != nil {
+			return err
+		}
+		defer timeseriesWriter.Close()
+	}
+	switch *outputFormatFlag {
+	case "json":
+	case "binary":
+		if *outputPathFlag == "" {
+			break
+		}
+		meta, err := resultsMetadata()
+		if err != nil {
+			return err
+		}
+		resultsWriter, err = results.Create(*outputPathFlag, meta)
+		if err != nil {
+			return err
+		}
+	default:
+		return fmt.Errorf("Bad --output-format %q", *outputFormatFlag)
+	}
+
+	tracehistSession, err := startTracehist()
+	if err != nil {
+		return err
+	}
+	defer func() {
+		if err := tracehistSession.Close(); err != nil {
+			fmt.Fprintf(os.Stderr, "Couldn't remove ftrace hist triggers: %v\n", err)
+		}
+	}()
+	snapshots := &phaseSnapshots{tracehist: tracehistSession}
+	baseline := &idleBaseline{}
+
+	// The kallocfree workload can switch order without restarting, so
+	// normally all the orders share one. The kthreads can't.
+	orderGroups := [][]int{orders}
+	if *kthreadsFlag {
+		orderGroups = nil
+		for _, order := range orders {
+			orderGroups = append(orderGroups, []int{order})
+		}
+	}
+
+	result := make(map[string][]int64)
+	for _, gfp := range gfps {
+		for _, touch := range touches {
+			for _, group := range orderGroups {
+				var suffixes []string
+				for _, order := range group {
+					// Only mention the GFP flags and touch
+					// policy if there's more than one, to keep
+					// metric names stable for the common case.
+					suffix := ""
+					if len(gfps) > 1 {
+						suffix += "_gfp_" + gfp.String()
+					}
+					if len(touches) > 1 {
+						suffix += "_touch_" + touch.String()
+					}
+					if slab != nil {
+						suffix += "_slab_" + slab.API.String()
+					} else if len(orderWeights) != 0 {
+						suffix += "_mix"
+					} else {
+						suffix += fmt.Sprintf("_order%d", order)
+					}
+					suffixes = append(suffixes, suffix)
+				}
+
+				var slabArgs *kmod.SlabArgs
+				if slab != nil {
+					slabArgs = &kmod.SlabArgs{API: slab.API, GFP: gfp, Sizes: slab.Sizes}
+				}
+				groupResults, err := run(ctx, group, suffixes, orderWeights, slabArgs, slabCache,
+					gfp, allocAPI, clock, touch, remoteFree, pattern, kernelCPUs, baseline, snapshots)
+				if err != nil {
+					return err
+				}
+				for i, orderResult := range groupResults {
+					for key, val := range orderResult {
+						result[key+suffixes[i]] = val
+					}
+				}
+			}
 		}
 	}
 
 	printResult(result)
 
+	if resultsWriter != nil {
+		fmt.Printf("Writing binary results to %s\n", *outputPathFlag)
+		if err := resultsWriter.WriteMetrics(result); err != nil {
+			return err
+		}
+		return resultsWriter.Close()
+	}
 	if *outputPathFlag != "" {
 		return writeOutput(*outputPathFlag, result)
 	}
 	return nil
 }
 
+// Subcommands, run as "page_alloc_bench <name> [flags]". Each one parses its
+// own flags from args.
+var subcommands = map[string]func(args []string) error{
+	"record-trace": recordTraceMain,
+	"replay-trace": replayTraceMain,
+	"compare":      compareMain,
+	"highorder":    highorderMain,
+	"daemon":       daemonMain,
+}
+
 func main() {
+	if len(os.Args) > 1 {
+		if subcommand, ok := subcommands[os.Args[1]]; ok {
+			if err := subcommand(os.Args[2:]); err != nil {
+				fmt.Fprintf(os.Stderr, "%v\n", err)
+				os.Exit(1)
+			}
+			return
+		}
+	}
 	flag.Parse()
 
 	if err := doMain(); err != nil {
@@ -0,0 +1,203 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package perf reads hardware and software performance counters for a thread
+// with perf_event_open, to help explain where the time in the other metrics
+// goes.
+package perf
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"syscall"
+	"unsafe"
+)
+
+// Counter is one of the events that are counted.
+type Counter int
+
+const (
+	Cycles Counter = iota
+	Instructions
+	LLCMisses
+	DTLBMisses // Load misses only.
+	ContextSwitches
+	NumCounters
+)
+
+var counterNames = []string{"cycles", "instructions", "llc_misses", "dtlb_misses", "context_switches"}
+
+func (c Counter) String() string {
+	return counterNames[c]
+}
+
+// From linux/perf_event.h.
+const (
+	perfTypeHardware = 0
+	perfTypeSoftware = 1
+	perfTypeHWCache  = 3
+
+	perfCountHWCPUCycles    = 0
+	perfCountHWInstructions = 1
+	perfCountHWCacheMisses  = 3 // Usually means the LLC.
+	perfCountSWCtxSwitches  = 3
+	// PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+	// PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+	perfCountHWCacheDTLBReadMiss = 3 | 0<<8 | 1<<16
+
+	perfFormatTotalTimeEnabled = 1 << 0
+	perfFormatTotalTimeRunning = 1 << 1
+
+	perfAttrFlagExcludeHV = 1 << 6
+
+	perfFlagFDCloexec = 1 << 3
+)
+
+var counterConfigs = [NumCounters]struct {
+	typ    uint32
+	config uint64
+}{
+	Cycles:          {perfTypeHardware, perfCountHWCPUCycles},
+	Instructions:    {perfTypeHardware, perfCountHWInstructions},
+	LLCMisses:       {perfTypeHardware, perfCountHWCacheMisses},
+	DTLBMisses:      {perfTypeHWCache, perfCountHWCacheDTLBReadMiss},
+	ContextSwitches: {perfTypeSoftware, perfCountSWCtxSwitches},
+}
+
+// The original (PERF_ATTR_SIZE_VER0) struct perf_event_attr, which is all we
+// need. The kernel zero-extends it.
+type eventAttr struct {
+	typ          uint32
+	size         uint32
+	config       uint64
+	samplePeriod uint64
+	sampleType   uint64
+	readFormat   uint64
+	flags        uint64 // The bitfield: disabled, inherit, pinned...
+	wakeupEvents uint32
+	bpType       uint32
+	config1      uint64
+}
+
+// Counts has a value for each counter that could be opened. Values are scaled
+// up to make up for time the counter wasn't scheduled, when there are more
+// events than hardware counters.
+type Counts map[Counter]uint64
+
+// Sub returns the change since prev.
+func (c Counts) Sub(prev Counts) Counts {
+	ret := make(Counts, len(c))
+	for counter, val := range c {
+		ret[counter] = val - min(val, prev[counter])
+	}
+	return ret
+}
+
+// Add adds other to c.
+func (c Counts) Add(other Counts) {
+	for counter, val := range other {
+		c[counter] += val
+	}
+}
+
+// Counters are the perf events for one thread.
+type Counters struct {
+	fds [NumCounters]int // -1 for the ones that couldn't be opened.
+}
+
+// Open starts counting for the calling thread, in both user and kernel mode.
+// The goroutine should be locked to its thread. Counters that the CPU or
+// kernel doesn't support (e.g. in a VM without a virtual PMU) are left out,
+// but it's an error if none of them can be opened.
+func Open() (*Counters, error) {
+	c := &Counters{}
+	for i := range c.fds {
+		c.fds[i] = -1
+	}
+	opened := false
+	var firstErr error
+	for counter, cfg := range counterConfigs {
+		attr := eventAttr{
+			typ:        cfg.typ,
+			size:       uint32(unsafe.Sizeof(eventAttr{})),
+			config:     cfg.config,
+			readFormat: perfFormatTotalTimeEnabled | perfFormatTotalTimeRunning,
+			flags:      perfAttrFlagExcludeHV,
+		}
+		// pid 0 and cpu -1 means this thread on any CPU.
+		fd, _, errno := syscall.Syscall6(syscall.SYS_PERF_EVENT_OPEN, uintptr(unsafe.Pointer(&attr)),
+			0, ^uintptr(0), ^uintptr(0), perfFlagFDCloexec, 0)
+		if errno != 0 {
+			if errors.Is(errno, syscall.EACCES) || errors.Is(errno, syscall.EPERM) {
+				c.Close()
+				return nil, fmt.Errorf("perf_event_open(%v): %v (check /proc/sys/kernel/perf_event_paranoid)",
+					Counter(counter), errno)
+			}
+			if firstErr == nil {
+				firstErr = fmt.Errorf("perf_event_open(%v): %v", Counter(counter), errno)
+			}
+			continue
+		}
+		c.fds[counter] = int(fd)
+		opened = true
+	}
+	if !opened {
+		return nil, firstErr
+	}
+	return c, nil
+}
+
+// Opened returns which counters are being counted.
+func (c *Counters) Opened() []Counter {
+	var ret []Counter
+	for counter, fd := range c.fds {
+		if fd >= 0 {
+			ret = append(ret, Counter(counter))
+		}
+	}
+	return ret
+}
+
+// Read returns the counts since Open.
+func (c *Counters) Read() (Counts, error) {
+	counts := make(Counts)
+	var buf [24]byte // value, time_enabled, time_running.
+	for counter, fd := range c.fds {
+		if fd < 0 {
+			continue
+		}
+		if _, err := syscall.Read(fd, buf[:]); err != nil {
+			return nil, fmt.Errorf("reading %v counter: %v", Counter(counter), err)
+		}
+		val := binary.NativeEndian.Uint64(buf[0:])
+		enabled := binary.NativeEndian.Uint64(buf[8:])
+		running := binary.NativeEndian.Uint64(buf[16:])
+		if running != 0 && running < enabled {
+			val = uint64(float64(val) * float64(enabled) / float64(running))
+		}
+		counts[Counter(counter)] = val
+	}
+	return counts, nil
+}
+
+func (c *Counters) Close() {
+	for i, fd := range c.fds {
+		if fd >= 0 {
+			syscall.Close(fd)
+		}
+		c.fds[i] = -1
+	}
+}
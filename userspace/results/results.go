@@ -0,0 +1,392 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package results implements the binary output format, an alternative to the
+// JSON one that is much more compact for the raw latency samples.
+//
+// The file starts with the magic "PABRESLT" and a uvarint format version. Then
+// there's a sequence of records, each a kind byte and a uvarint payload length
+// followed by the payload:
+//
+//   - 'H': The Metadata as JSON. Always the first record.
+//   - 'M': A metric: uvarint name length, name, uvarint count, then the values
+//     as zigzag varints.
+//   - 'S': A column of samples: uvarint name length, name, uvarint count, then
+//     three columns which are each a uvarint length followed by that many bytes
+//     of DEFLATE-compressed varints. The columns are the times (sorted),
+//     the CPUs and the values. The times and values are delta-encoded as
+//     zigzag varints.
+//   - 'E': End of file, empty. A file without it was truncated.
+package results
+
+import (
+	"bufio"
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"slices"
+	"time"
+)
+
+const (
+	Magic   = "PABRESLT"
+	Version = 1
+)
+
+const (
+	kindHeader  = 'H'
+	kindMetric  = 'M'
+	kindSamples = 'S'
+	kindEnd     = 'E'
+)
+
+// Metadata describes the run that produced the results.
+type Metadata struct {
+	Time          time.Time         `json:"time"`
+	KernelRelease string            `json:"kernel_release"`
+	KernelVersion string            `json:"kernel_version"`
+	Revision      string            `json:"revision"` // Of page_alloc_bench.
+	NumCPUs       int               `json:"num_cpus"`
+	Nodes         map[int][]int     `json:"nodes"` // NUMA node ID to CPUs.
+	Flags         map[string]string `json:"flags"` // All of them, including defaults.
+}
+
+// Sample is one measurement, usually a latency in nanoseconds.
+type Sample struct {
+	Time  time.Duration // Since some arbitrary, per-file point.
+	CPU   int
+	Value int64
+}
+
+// Writer streams results to a file. Metrics and samples are written as they
+// are passed in so they don't need to be kept in memory. A nil Writer does
+// nothing, so callers needn't check whether the output is enabled.
+type Writer struct {
+	file *os.File
+	w    *bufio.Writer
+	run  string
+	buf  []byte // Scratch space for record payloads.
+}
+
+// Create creates the file and writes the header.
+func Create(path string, meta *Metadata) (*Writer, error) {
+	file, err := os.Create(path)
+	if err != nil {
+		return nil, fmt.Errorf("creating results file: %v", err)
+	}
+	w := &Writer{file: file, w: bufio.NewWriter(file)}
+	w.w.WriteString(Magic)
+	w.w.Write(binary.AppendUvarint(nil, Version))
+	header, err := json.Marshal(meta)
+	if err != nil {
+		file.Close()
+		return nil, fmt.Errorf("marshalling results metadata: %v", err)
+	}
+	if err := w.writeRecord(kindHeader, header); err != nil {
+		file.Close()
+		return nil, err
+	}
+	return w, nil
+}
+
+// SetRun sets a suffix for the names of the samples written after this, which
+// should be the one the metric names for the current run have.
+func (w *Writer) SetRun(suffix string) {
+	if w != nil {
+		w.run = suffix
+	}
+}
+
+func (w *Writer) writeRecord(kind byte, payload []byte) error {
+	w.w.WriteByte(kind)
+	w.w.Write(binary.AppendUvarint(nil, uint64(len(payload))))
+	if _, err := w.w.Write(payload); err != nil {
+		return fmt.Errorf("writing results: %v", err)
+	}
+	return nil
+}
+
+func appendString(b []byte, s string) []byte {
+	b = binary.AppendUvarint(b, uint64(len(s)))
+	return append(b, s...)
+}
+
+// WriteMetrics writes metrics. The names are used as is, without the run
+// suffix.
+func (w *Writer) WriteMetrics(metrics map[string][]int64) error {
+	if w == nil {
+		return nil
+	}
+	names := make([]string, 0, len(metrics))
+	for name := range metrics {
+		names = append(names, name)
+	}
+	slices.Sort(names)
+	for _, name := range names {
+		b := appendString(w.buf[:0], name)
+		b = binary.AppendUvarint(b, uint64(len(metrics[name])))
+		for _, v := range metrics[name] {
+			b = binary.AppendVarint(b, v)
+		}
+		w.buf = b
+		if err := w.writeRecord(kindMetric, b); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func appendColumn(b []byte, count int, value func(i int) []byte) ([]byte, error) {
+	var compressed bytes.Buffer
+	fw, err := flate.NewWriter(&compressed, flate.DefaultCompression)
+	if err != nil {
+		return nil, err
+	}
+	for i := 0; i < count; i++ {
+		fw.Write(value(i))
+	}
+	if err := fw.Close(); err != nil {
+		return nil, err
+	}
+	b = binary.AppendUvarint(b, uint64(compressed.Len()))
+	return append(b, compressed.Bytes()...), nil
+}
+
+// WriteSamples writes a column of samples, named name plus the run suffix. The
+// samples are sorted in place by time.
+func (w *Writer) WriteSamples(name string, samples []Sample) error {
+	if w == nil {
+		return nil
+	}
+	slices.SortFunc(samples, func(a, b Sample) int { return int(a.Time - b.Time) })
+	b := appendString(w.buf[:0], name+w.run)
+	b = binary.AppendUvarint(b, uint64(len(samples)))
+	var scratch [binary.MaxVarintLen64]byte
+	delta := func(i int, get func(s *Sample) int64) []byte {
+		prev := int64(0)
+		if i > 0 {
+			prev = get(&samples[i-1])
+		}
+		return binary.AppendVarint(scratch[:0], get(&samples[i])-prev)
+	}
+	var err error
+	b, err = appendColumn(b, len(samples), func(i int) []byte {
+		return delta(i, func(s *Sample) int64 { return int64(s.Time) })
+	})
+	if err == nil {
+		b, err = appendColumn(b, len(samples), func(i int) []byte {
+			return binary.AppendUvarint(scratch[:0], uint64(samples[i].CPU))
+		})
+	}
+	if err == nil {
+		b, err = appendColumn(b, len(samples), func(i int) []byte {
+			return delta(i, func(s *Sample) int64 { return s.Value })
+		})
+	}
+	if err != nil {
+		return fmt.Errorf("compressing samples: %v", err)
+	}
+	w.buf = b
+	return w.writeRecord(kindSamples, b)
+}
+
+// Close writes the end marker and closes the file.
+func (w *Writer) Close() error {
+	if w == nil {
+		return nil
+	}
+	err := w.writeRecord(kindEnd, nil)
+	if err == nil {
+		err = w.w.Flush()
+	}
+	if cerr := w.file.Close(); err == nil {
+		err = cerr
+	}
+	return err
+}
+
+// File is the full contents of a results file.
+type File struct {
+	Metadata Metadata
+	Metrics  map[string][]int64
+	Samples  map[string][]Sample
+}
+
+// IsResultsFile returns whether data looks like the start of a binary results
+// file (as opposed to a JSON one).
+func IsResultsFile(data []byte) bool {
+	return bytes.HasPrefix(data, []byte(Magic))
+}
+
+var errCorrupt = errors.New("corrupt results file")
+
+// decoder reads varints from a payload, remembering the first error.
+type decoder struct {
+	r   *bytes.Reader
+	err error
+}
+
+func (d *decoder) uvarint() uint64 {
+	v, err := binary.ReadUvarint(d.r)
+	if err != nil && d.err == nil {
+		d.err = errCorrupt
+	}
+	return v
+}
+
+func (d *decoder) varint() int64 {
+	v, err := binary.ReadVarint(d.r)
+	if err != nil && d.err == nil {
+		d.err = errCorrupt
+	}
+	return v
+}
+
+func (d *decoder) bytes() []byte {
+	n := d.uvarint()
+	if d.err != nil || n > uint64(d.r.Len()) {
+		d.err = errCorrupt
+		return nil
+	}
+	b := make([]byte, n)
+	d.r.Read(b)
+	return b
+}
+
+// column decompresses a column into a decoder.
+func (d *decoder) column() *decoder {
+	compressed := d.bytes()
+	if d.err != nil {
+		return &decoder{err: d.err}
+	}
+	data, err := io.ReadAll(flate.NewReader(bytes.NewReader(compressed)))
+	if err != nil {
+		return &decoder{err: errCorrupt}
+	}
+	return &decoder{r: bytes.NewReader(data)}
+}
+
+func readSamples(payload []byte) (string, []Sample, error) {
+	d := &decoder{r: bytes.NewReader(payload)}
+	name := string(d.bytes())
+	count := d.uvarint()
+	if d.err != nil || count > uint64(len(payload))*8 {
+		return "", nil, errCorrupt
+	}
+	samples := make([]Sample, count)
+	times, cpus, values := d.column(), d.column(), d.column()
+	var t, v int64
+	for i := range samples {
+		t += times.varint()
+		v += values.varint()
+		samples[i] = Sample{Time: time.Duration(t), CPU: int(cpus.uvarint()), Value: v}
+	}
+	for _, c := range []*decoder{d, times, cpus, values} {
+		if c.err != nil {
+			return "", nil, c.err
+		}
+	}
+	return name, samples, nil
+}
+
+// Read parses a whole results file.
+func Read(r io.Reader) (*File, error) {
+	br := bufio.NewReader(r)
+	magic := make([]byte, len(Magic))
+	if _, err := io.ReadFull(br, magic); err != nil || string(magic) != Magic {
+		return nil, fmt.Errorf("not a results file")
+	}
+	version, err := binary.ReadUvarint(br)
+	if err != nil {
+		return nil, errCorrupt
+	}
+	if version != Version {
+		return nil, fmt.Errorf("unsupported results file version %d", version)
+	}
+
+	f := &File{Metrics: make(map[string][]int64), Samples: make(map[string][]Sample)}
+	for first := true; ; first = false {
+		kind, err := br.ReadByte()
+		if err == io.EOF {
+			return nil, fmt.Errorf("results file truncated")
+		}
+		if err != nil {
+			return nil, err
+		}
+		length, err := binary.ReadUvarint(br)
+		if err != nil {
+			return nil, errCorrupt
+		}
+		payload := make([]byte, length)
+		if _, err := io.ReadFull(br, payload); err != nil {
+			return nil, fmt.Errorf("results file truncated")
+		}
+		if first != (kind == kindHeader) {
+			return nil, errCorrupt
+		}
+
+		switch kind {
+		case kindHeader:
+			if err := json.Unmarshal(payload, &f.Metadata); err != nil {
+				return nil, fmt.Errorf("parsing results metadata: %v", err)
+			}
+		case kindMetric:
+			d := &decoder{r: bytes.NewReader(payload)}
+			name := string(d.bytes())
+			count := d.uvarint()
+			if d.err != nil || count > length {
+				return nil, errCorrupt
+			}
+			vals := make([]int64, count)
+			for i := range vals {
+				vals[i] = d.varint()
+			}
+			if d.err != nil {
+				return nil, d.err
+			}
+			f.Metrics[name] = vals
+		case kindSamples:
+			name, samples, err := readSamples(payload)
+			if err != nil {
+				return nil, err
+			}
+			f.Samples[name] = samples
+		case kindEnd:
+			return f, nil
+		default:
+			// Unknown records are skipped, so that newer minor
+			// additions don't need a new version.
+		}
+	}
+}
+
+// ReadFile reads a results file from disk.
+func ReadFile(path string) (*File, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	f, err := Read(file)
+	if err != nil {
+		return nil, fmt.Errorf("reading %s: %v", path, err)
+	}
+	return f, nil
+}
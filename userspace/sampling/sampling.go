@@ -44,5 +44,5 @@ func (r *Reservoir[T]) Add(datum T) {
 // Samples returns, at any given time, a random sample of the data passed to
 // Add. The result is read-only.
 func (r *Reservoir[T]) Samples() []T {
-	return r.outSamples[:r.numInSamples]
+	return r.outSamples[:min(r.numInSamples, len(r.outSamples))]
 }
@@ -0,0 +1,142 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package stats has the statistics for comparing sets of benchmark results, and
+// for deciding when there are enough of them.
+package stats
+
+import (
+	"math"
+	"math/rand"
+	"slices"
+)
+
+// Quantile returns the q-quantile of the values, interpolating between the
+// closest ranks. The values must be sorted and non-empty.
+func Quantile(sorted []float64, q float64) float64 {
+	pos := q * float64(len(sorted)-1)
+	lo := int(math.Floor(pos))
+	hi := int(math.Ceil(pos))
+	return sorted[lo] + (sorted[hi]-sorted[lo])*(pos-float64(lo))
+}
+
+// Sorted returns a sorted copy of the values as float64s.
+func Sorted(vals []int64) []float64 {
+	ret := make([]float64, len(vals))
+	for i, v := range vals {
+		ret[i] = float64(v)
+	}
+	slices.Sort(ret)
+	return ret
+}
+
+// resampleQuantile fills buf by drawing from vals with replacement, and returns
+// the q-quantile of the result.
+func resampleQuantile(buf, vals []float64, q float64, random *rand.Rand) float64 {
+	for i := range buf {
+		buf[i] = vals[random.Intn(len(vals))]
+	}
+	slices.Sort(buf)
+	return Quantile(buf, q)
+}
+
+// BootstrapQuantileCI estimates a confidence interval for the q-quantile of the
+// distribution the values came from, by resampling them with replacement.
+// level is the confidence level, e.g. 0.95. The values must be non-empty, they
+// needn't be sorted.
+func BootstrapQuantileCI(vals []float64, q, level float64, resamples int, random *rand.Rand) (lo, hi float64) {
+	quantiles := make([]float64, resamples)
+	buf := make([]float64, len(vals))
+	for i := range quantiles {
+		quantiles[i] = resampleQuantile(buf, vals, q, random)
+	}
+	slices.Sort(quantiles)
+	return Quantile(quantiles, (1-level)/2), Quantile(quantiles, (1+level)/2)
+}
+
+// BootstrapQuantileDiff estimates a confidence interval for the difference in
+// the q-quantile between b and a (i.e. b - a), by resampling each of them
+// with replacement. level is the confidence level, e.g. 0.95. The inputs must
+// be non-empty, they needn't be sorted.
+func BootstrapQuantileDiff(a, b []float64, q, level float64, resamples int, random *rand.Rand) (lo, hi float64) {
+	diffs := make([]float64, resamples)
+	bufA := make([]float64, len(a))
+	bufB := make([]float64, len(b))
+	for i := range diffs {
+		diffs[i] = resampleQuantile(bufB, b, q, random) - resampleQuantile(bufA, a, q, random)
+	}
+	slices.Sort(diffs)
+	return Quantile(diffs, (1-level)/2), Quantile(diffs, (1+level)/2)
+}
+
+// MannWhitneyU returns the two-sided p-value of the Mann-Whitney U test for the
+// two samples coming from the same distribution. It uses the normal
+// approximation with a tie correction, which is rough when both samples are
+// very small (less than about 5 each). Returns 1 if all the values are equal.
+func MannWhitneyU(a, b []float64) float64 {
+	type ranked struct {
+		val   float64
+		fromA bool
+	}
+	all := make([]ranked, 0, len(a)+len(b))
+	for _, v := range a {
+		all = append(all, ranked{v, true})
+	}
+	for _, v := range b {
+		all = append(all, ranked{v, false})
+	}
+	slices.SortFunc(all, func(x, y ranked) int {
+		switch {
+		case x.val < y.val:
+			return -1
+		case x.val > y.val:
+			return 1
+		}
+		return 0
+	})
+
+	// Sum of ranks of a, with tied values getting the mean of their ranks.
+	var rankSumA, tieTerm float64
+	for i := 0; i < len(all); {
+		j := i
+		for j < len(all) && all[j].val == all[i].val {
+			j++
+		}
+		rank := float64(i+j+1) / 2 // Ranks are 1-based.
+		for k := i; k < j; k++ {
+			if all[k].fromA {
+				rankSumA += rank
+			}
+		}
+		t := float64(j - i)
+		tieTerm += t*t*t - t
+		i = j
+	}
+
+	n1, n2 := float64(len(a)), float64(len(b))
+	n := n1 + n2
+	u := rankSumA - n1*(n1+1)/2
+	mean := n1 * n2 / 2
+	variance := n1 * n2 / 12 * ((n + 1) - tieTerm/(n*(n-1)))
+	if variance <= 0 {
+		return 1
+	}
+	// Continuity correction.
+	z := (math.Abs(u-mean) - 0.5) / math.Sqrt(variance)
+	if z < 0 {
+		z = 0
+	}
+	return math.Erfc(z / math.Sqrt2)
+}
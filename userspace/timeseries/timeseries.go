@@ -0,0 +1,101 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package timeseries streams benchmark measurements to a JSON Lines file while
+// the benchmark runs, so that changes over time can be seen.
+package timeseries
+
+import (
+	"encoding/json"
+	"fmt"
+	"os"
+	"sync"
+	"time"
+)
+
+// Writer writes records as JSON Lines. Each line is a JSON object with at
+// least "time" (RFC 3339 with nanoseconds), "type" and "run" fields. Methods
+// can be called concurrently. A nil *Writer discards everything, so callers
+// don't need to check whether the output is enabled.
+type Writer struct {
+	mu   sync.Mutex
+	file *os.File
+	run  string
+}
+
+// Create creates the file at path, truncating it if it exists.
+func Create(path string) (*Writer, error) {
+	file, err := os.Create(path)
+	if err != nil {
+		return nil, fmt.Errorf("creating timeseries file: %v", err)
+	}
+	return &Writer{file: file}, nil
+}
+
+// SetRun sets the label included in all subsequent records, to identify which
+// of the benchmark runs (e.g. which order) they belong to.
+func (w *Writer) SetRun(run string) {
+	if w == nil {
+		return
+	}
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	w.run = run
+}
+
+// Write writes a record with the given type. fields is merged into the line
+// and must marshal to a JSON object.
+func (w *Writer) Write(recordType string, fields map[string]any) error {
+	if w == nil {
+		return nil
+	}
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	line := map[string]any{
+		"time": time.Now().Format(time.RFC3339Nano),
+		"type": recordType,
+		"run":  w.run,
+	}
+	for k, v := range fields {
+		line[k] = v
+	}
+	data, err := json.Marshal(line)
+	if err != nil {
+		return fmt.Errorf("marshalling timeseries record: %v", err)
+	}
+	// Unbuffered on purpose, so the file is useful while the benchmark
+	// runs and nothing is lost if it crashes.
+	if _, err := w.file.Write(append(data, '\n')); err != nil {
+		return fmt.Errorf("writing timeseries record: %v", err)
+	}
+	return nil
+}
+
+// Phase writes a marker for the start of a benchmark phase. iteration is
+// omitted if negative.
+func (w *Writer) Phase(phase string, iteration int) error {
+	fields := map[string]any{"phase": phase}
+	if iteration >= 0 {
+		fields["iteration"] = iteration
+	}
+	return w.Write("phase", fields)
+}
+
+func (w *Writer) Close() error {
+	if w == nil {
+		return nil
+	}
+	return w.file.Close()
+}
@@ -0,0 +1,178 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package trace
+
+import (
+	"bufio"
+	"context"
+	"fmt"
+	"os"
+	"path/filepath"
+	"regexp"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/google/page_alloc_bench/kmod"
+)
+
+type CaptureOptions struct {
+	// Root of tracefs. Optional, defaults to /sys/kernel/tracing or
+	// /sys/kernel/debug/tracing, whichever exists.
+	TracefsPath string
+	// Size of the per-CPU trace buffers. Optional, 0 leaves the kernel's
+	// default.
+	BufferSizeKB int
+}
+
+type CaptureStats struct {
+	Records uint64
+	// Events we couldn't represent, e.g. because the order was too high.
+	Skipped uint64
+}
+
+var events = []string{"mm_page_alloc", "mm_page_free", "mm_page_free_batched"}
+
+// The part of a trace_pipe line before the event fields, e.g.
+// "  kworker/3:1-123  [003] d..1.  1234.567890: mm_page_alloc: ".
+var traceLineRegexp = regexp.MustCompile(`\[(\d+)\](?:\s+\S+)?\s+(\d+)\.(\d+): (mm_page_alloc|mm_page_free|mm_page_free_batched): `)
+
+// Capture records the page allocator tracepoints of the running system into w
+// until the context is cancelled. It sets up its own tracefs instance so it
+// doesn't disturb other users of tracing.
+func Capture(ctx context.Context, w *Writer, opts *CaptureOptions) (*CaptureStats, error) {
+	tracefs := opts.TracefsPath
+	if tracefs == "" {
+		tracefs = "/sys/kernel/tracing"
+		if _, err := os.Stat(filepath.Join(tracefs, "instances")); err != nil {
+			tracefs = "/sys/kernel/debug/tracing"
+		}
+	}
+	instance := filepath.Join(tracefs, "instances", fmt.Sprintf("page_alloc_bench.%d", os.Getpid()))
+	if err := os.Mkdir(instance, 0755); err != nil {
+		return nil, fmt.Errorf("creating tracefs instance: %v", err)
+	}
+	// Removing the instance disables its events.
+	defer os.Remove(instance)
+
+	if opts.BufferSizeKB != 0 {
+		err := os.WriteFile(filepath.Join(instance, "buffer_size_kb"), []byte(strconv.Itoa(opts.BufferSizeKB)), 0)
+		if err != nil {
+			return nil, fmt.Errorf("setting trace buffer size: %v", err)
+		}
+	}
+	for _, event := range events {
+		err := os.WriteFile(filepath.Join(instance, "events", "kmem", event, "enable"), []byte("1"), 0)
+		if err != nil {
+			return nil, fmt.Errorf("enabling %s tracepoint: %v", event, err)
+		}
+	}
+
+	pipe, err := os.Open(filepath.Join(instance, "trace_pipe"))
+	if err != nil {
+		return nil, fmt.Errorf("opening trace_pipe: %v", err)
+	}
+	defer pipe.Close()
+
+	var stats CaptureStats
+	var start time.Duration = -1
+	scanner := bufio.NewScanner(pipe)
+	for ctx.Err() == nil && scanner.Scan() {
+		r, ok := parseLine(scanner.Text())
+		if !ok {
+			stats.Skipped++
+			continue
+		}
+		if start < 0 {
+			start = r.Time
+		}
+		r.Time -= start
+		if err := w.Write(r); err != nil {
+			return nil, err
+		}
+		stats.Records++
+	}
+	if ctx.Err() == nil {
+		return nil, fmt.Errorf("reading trace_pipe: %v", scanner.Err())
+	}
+	for _, event := range events {
+		os.WriteFile(filepath.Join(instance, "events", "kmem", event, "enable"), []byte("0"), 0)
+	}
+	return &stats, w.Flush()
+}
+
+// The trace only has the kernel's GFP flags as a string, this is a rough
+// mapping to our presets.
+func gfpPreset(flags string) kmod.GFPPreset {
+	switch {
+	case strings.Contains(flags, "GFP_HIGHUSER_MOVABLE"):
+		return kmod.GFPHighuserMovable
+	case strings.Contains(flags, "GFP_ATOMIC"), strings.Contains(flags, "GFP_NOWAIT"):
+		return kmod.GFPAtomic
+	}
+	return kmod.GFPKernel
+}
+
+func parseLine(line string) (*Record, bool) {
+	m := traceLineRegexp.FindStringSubmatchIndex(line)
+	if m == nil {
+		return nil, false
+	}
+	sub := func(i int) string { return line[m[2*i]:m[2*i+1]] }
+	cpu, err := strconv.Atoi(sub(1))
+	if err != nil {
+		return nil, false
+	}
+	secs, err := strconv.ParseInt(sub(2), 10, 64)
+	if err != nil {
+		return nil, false
+	}
+	frac := sub(3)
+	fracNS, err := strconv.ParseInt((frac + "000000000")[:9], 10, 64)
+	if err != nil {
+		return nil, false
+	}
+	r := &Record{
+		Time: time.Duration(secs)*time.Second + time.Duration(fracNS),
+		CPU:  cpu,
+		Op:   OpFree,
+	}
+	if sub(4) == "mm_page_alloc" {
+		r.Op = OpAlloc
+	}
+
+	var havePFN bool
+	for _, field := range strings.Fields(line[m[1]:]) {
+		key, val, ok := strings.Cut(field, "=")
+		if !ok {
+			continue
+		}
+		switch key {
+		case "pfn":
+			r.PFN, err = strconv.ParseUint(val, 0, 64)
+			havePFN = err == nil
+		case "order":
+			r.Order, err = strconv.Atoi(val)
+			if err != nil || r.Order < 0 || r.Order > maxOrder {
+				return nil, false
+			}
+		case "gfp_flags":
+			r.GFP = gfpPreset(val)
+		}
+	}
+	// Failed allocations are traced with a PFN of -1, skip them.
+	return r, havePFN && r.PFN != ^uint64(0)
+}
@@ -0,0 +1,176 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package trace implements a compact binary format for traces of page
+// allocator activity, to be replayed via the kernel module.
+//
+// A trace is the magic string "PABTRACE" followed by a uvarint format version,
+// then a sequence of records, in time order. Each record is:
+//
+//   - A byte with the operation in the top bit, the GFP preset in the next two
+//     and the order in the bottom five.
+//   - The CPU as a uvarint.
+//   - The time since the previous record, in nanoseconds, as a uvarint.
+//   - The PFN as a zigzag varint delta from the previous record's.
+package trace
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"time"
+
+	"github.com/google/page_alloc_bench/kmod"
+)
+
+const (
+	magic   = "PABTRACE"
+	version = 1
+
+	maxOrder = 1<<5 - 1
+)
+
+type Op uint8
+
+const (
+	OpAlloc Op = iota
+	OpFree
+)
+
+func (o Op) String() string {
+	if o == OpAlloc {
+		return "alloc"
+	}
+	return "free"
+}
+
+// Record is one allocation or free.
+type Record struct {
+	Time  time.Duration // Since the start of the trace.
+	CPU   int
+	Op    Op
+	Order int
+	GFP   kmod.GFPPreset // Only meaningful for OpAlloc.
+	// Identifies the page. The free of a page has the same PFN as its
+	// allocation.
+	PFN uint64
+}
+
+// Writer writes a trace. Call Flush when done.
+type Writer struct {
+	w        *bufio.Writer
+	buf      []byte
+	prevTime time.Duration
+	prevPFN  uint64
+}
+
+func NewWriter(w io.Writer) (*Writer, error) {
+	tw := &Writer{w: bufio.NewWriter(w)}
+	tw.buf = append(tw.buf, magic...)
+	tw.buf = binary.AppendUvarint(tw.buf, version)
+	if _, err := tw.w.Write(tw.buf); err != nil {
+		return nil, err
+	}
+	return tw, nil
+}
+
+// Write appends a record. Records must be in time order, ones that are slightly
+// out of order (which happens when merging per-CPU trace buffers) are given
+// the same time as the previous one.
+func (w *Writer) Write(r *Record) error {
+	if r.Order < 0 || r.Order > maxOrder || r.GFP < 0 || r.GFP > 3 || r.CPU < 0 {
+		return fmt.Errorf("can't encode record %+v", r)
+	}
+	delta := max(0, r.Time-w.prevTime)
+	w.buf = w.buf[:0]
+	w.buf = append(w.buf, byte(r.Op)<<7|byte(r.GFP)<<5|byte(r.Order))
+	w.buf = binary.AppendUvarint(w.buf, uint64(r.CPU))
+	w.buf = binary.AppendUvarint(w.buf, uint64(delta))
+	w.buf = binary.AppendVarint(w.buf, int64(r.PFN-w.prevPFN))
+	w.prevTime += delta
+	w.prevPFN = r.PFN
+	_, err := w.w.Write(w.buf)
+	return err
+}
+
+func (w *Writer) Flush() error {
+	return w.w.Flush()
+}
+
+// Reader reads a trace.
+type Reader struct {
+	r        *bufio.Reader
+	prevTime time.Duration
+	prevPFN  uint64
+}
+
+func NewReader(r io.Reader) (*Reader, error) {
+	tr := &Reader{r: bufio.NewReader(r)}
+	header := make([]byte, len(magic))
+	if _, err := io.ReadFull(tr.r, header); err != nil {
+		return nil, fmt.Errorf("reading trace header: %v", err)
+	}
+	if string(header) != magic {
+		return nil, fmt.Errorf("not a trace file (bad magic %q)", header)
+	}
+	v, err := binary.ReadUvarint(tr.r)
+	if err != nil {
+		return nil, fmt.Errorf("reading trace version: %v", err)
+	}
+	if v != version {
+		return nil, fmt.Errorf("unsupported trace version %d", v)
+	}
+	return tr, nil
+}
+
+// Next reads the next record. Returns io.EOF at the end of the trace.
+func (r *Reader) Next() (*Record, error) {
+	b, err := r.r.ReadByte()
+	if err != nil {
+		return nil, err // Including a clean io.EOF.
+	}
+	rec := &Record{
+		Op:    Op(b >> 7),
+		GFP:   kmod.GFPPreset(b >> 5 & 3),
+		Order: int(b & maxOrder),
+	}
+	cpu, err := binary.ReadUvarint(r.r)
+	if err != nil {
+		return nil, truncated(err)
+	}
+	delta, err := binary.ReadUvarint(r.r)
+	if err != nil {
+		return nil, truncated(err)
+	}
+	pfnDelta, err := binary.ReadVarint(r.r)
+	if err != nil {
+		return nil, truncated(err)
+	}
+	r.prevTime += time.Duration(delta)
+	r.prevPFN += uint64(pfnDelta)
+	rec.CPU = int(cpu)
+	rec.Time = r.prevTime
+	rec.PFN = r.prevPFN
+	return rec, nil
+}
+
+func truncated(err error) error {
+	if errors.Is(err, io.EOF) {
+		return io.ErrUnexpectedEOF
+	}
+	return err
+}
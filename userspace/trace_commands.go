@@ -0,0 +1,112 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package main
+
+import (
+	"context"
+	"flag"
+	"fmt"
+	"os"
+	"os/signal"
+	"time"
+
+	"github.com/google/page_alloc_bench/trace"
+	"github.com/google/page_alloc_bench/workload/replay"
+)
+
+func recordTraceMain(args []string) error {
+	flags := flag.NewFlagSet("record-trace", flag.ExitOnError)
+	outPath := flags.String("trace-path", "", "File to write the trace to (required)")
+	durationS := flags.Int("duration-s", 10, "How long to record for. 0 means until interrupted.")
+	bufferSizeKB := flags.Int("buffer-size-kb", 0, "Per-CPU tracing ring buffer size. 0 means leave the kernel default.")
+	flags.Parse(args)
+	if *outPath == "" {
+		return fmt.Errorf("--trace-path is required")
+	}
+
+	ctx, cancel := signal.NotifyContext(context.Background(), os.Interrupt)
+	defer cancel()
+	if *durationS != 0 {
+		ctx, cancel = context.WithTimeout(ctx, time.Duration(*durationS)*time.Second)
+		defer cancel()
+	}
+
+	file, err := os.Create(*outPath)
+	if err != nil {
+		return fmt.Errorf("creating trace file: %v", err)
+	}
+	defer file.Close()
+	w, err := trace.NewWriter(file)
+	if err != nil {
+		return err
+	}
+	stats, err := trace.Capture(ctx, w, &trace.CaptureOptions{BufferSizeKB: *bufferSizeKB})
+	if err != nil {
+		return err
+	}
+	if err := w.Flush(); err != nil {
+		return fmt.Errorf("writing trace: %v", err)
+	}
+	fmt.Printf("Recorded %d events to %s (%d unparseable lines skipped)\n",
+		stats.Records, *outPath, stats.Skipped)
+	return file.Close()
+}
+
+func replayTraceMain(args []string) error {
+	flags := flag.NewFlagSet("replay-trace", flag.ExitOnError)
+	tracePath := flags.String("trace-path", "", "Trace to replay, from record-trace (required)")
+	speed := flags.Float64("speed", 1, "Playback speed relative to the trace")
+	batchWindowUS := flags.Int("batch-window-us", 50, "Issue same-kind ops on a CPU due within this many microseconds of each other as one ioctl. 0 disables batching.")
+	outputPath := flags.String("output-path", "", "File to write JSON results to")
+	flags.Parse(args)
+	if *tracePath == "" {
+		return fmt.Errorf("--trace-path is required")
+	}
+	if *speed <= 0 {
+		return fmt.Errorf("--speed must be positive")
+	}
+
+	ctx, cancel := signal.NotifyContext(context.Background(), os.Interrupt)
+	defer cancel()
+	workload, err := replay.New(&replay.Options{
+		TracePath:   *tracePath,
+		Speed:       *speed,
+		BatchWindow: time.Duration(*batchWindowUS) * time.Microsecond,
+	})
+	if err != nil {
+		return fmt.Errorf("setting up replay: %v", err)
+	}
+	r, err := workload.Run(ctx)
+	if err != nil {
+		return fmt.Errorf("replaying trace: %v", err)
+	}
+
+	result := map[string][]int64{
+		"replay_allocs":          {int64(r.Allocs)},
+		"replay_frees":           {int64(r.Frees)},
+		"replay_alloc_failures":  {int64(r.AllocFailures)},
+		"replay_unmatched_frees": {int64(r.UnmatchedFrees)},
+		"replay_duration_ms":     {r.Duration.Milliseconds()},
+	}
+	addHistMetrics(result, "replay_drift", r.DriftHist)
+	addHistMetrics(result, kernelPageAllocLatencyPrefix, r.AllocLatencyHist)
+	addHistMetrics(result, kernelPageFreeLatencyPrefix, r.FreeLatencyHist)
+	printResult(result)
+	if *outputPath != "" {
+		return writeOutput(*outputPath, result)
+	}
+	return nil
+}
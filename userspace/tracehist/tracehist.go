@@ -0,0 +1,400 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package tracehist counts what the page allocator does internally during a
+// run: PCP refills and drains, allocations under zone->lock, migratetype
+// fallbacks, contention on zone->lock and direct reclaim. It uses ftrace hist
+// triggers, so the events are aggregated in the kernel instead of being
+// streamed to userspace.
+package tracehist
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+
+	"github.com/google/page_alloc_bench/hist"
+)
+
+type Options struct {
+	// Root of tracefs. Optional, defaults to /sys/kernel/tracing or
+	// /sys/kernel/debug/tracing, whichever exists.
+	TracefsPath string
+	// The zone->lock addresses to filter the lock contention tracepoints
+	// by, see kmod.Connection.ZoneLocks. The zone lock probes are skipped
+	// without them.
+	ZoneLocks []uint64
+}
+
+// Orders above this are counted as this one.
+const maxOrder = 10
+
+// Meaning of each key of a probe's histogram, in order.
+type keyRole int
+
+const (
+	keyCPU keyRole = iota
+	keyOrder
+	keyLog2 // A .log2 latency in ns.
+)
+
+// Entry is a bucket of a probe's histogram. Fields the probe isn't keyed by
+// are -1.
+type Entry struct {
+	CPU   int
+	Order int
+	Log2  int // The latency is in [2^Log2, 2^(Log2+1)) ns.
+}
+
+// A step of the setup, written to a tracefs file and undone by writing undo
+// to the same file.
+type step struct {
+	path, cmd, undo string
+}
+
+// A group of steps that only make sense together, and the probes that are
+// read from the result.
+type group struct {
+	name   string
+	steps  []step
+	probes []*probe
+}
+
+// A probe is a named hist trigger that gets read back.
+type probe struct {
+	name  string // For metrics.
+	event string // e.g. "kmem/mm_page_pcpu_drain".
+	hist  string // The trigger's name= in the kernel.
+	keys  []keyRole
+}
+
+type Session struct {
+	instance string
+	applied  []step // In the order they were applied.
+	probes   []*probe
+}
+
+// Snapshot of the probes' counts, by probe name.
+type Snapshot struct {
+	Counts map[string]map[Entry]uint64
+	// The probes whose keys include a latency.
+	latency map[string]bool
+}
+
+func triggerStep(instance, event, cmd string) step {
+	return step{
+		path: filepath.Join(instance, "events", event, "trigger"),
+		cmd:  cmd,
+		undo: "!" + cmd,
+	}
+}
+
+func countProbe(instance, name, event, keys, filter string, roles ...keyRole) group {
+	p := &probe{
+		name:  name,
+		event: event,
+		hist:  fmt.Sprintf("pab_%d_%s", os.Getpid(), name),
+		keys:  roles,
+	}
+	cmd := fmt.Sprintf("hist:name=%s:keys=%s:vals=hitcount", p.hist, keys)
+	if filter != "" {
+		cmd += " if " + filter
+	}
+	return group{name: name, steps: []step{triggerStep(instance, event, cmd)}, probes: []*probe{p}}
+}
+
+// latencyProbe times the interval between a begin and end event on the same
+// task with a synthetic event. vars are extra variables saved at the begin
+// event and passed on, with their synthetic event field declarations.
+func latencyProbe(tracefs, instance, name, begin, end, filter string, vars, fields []string,
+	keys string, roles ...keyRole) group {
+	synth := fmt.Sprintf("pab_%d_%s", os.Getpid(), name)
+	p := &probe{
+		name:  name + "_latency",
+		event: "synthetic/" + synth,
+		hist:  synth + "_hist",
+		keys:  roles,
+	}
+	ifFilter := ""
+	if filter != "" {
+		ifFilter = " if " + filter
+	}
+	beginCmd := "hist:keys=common_pid:pab_" + name + "_ts=common_timestamp"
+	params := "$pab_" + name + "_lat"
+	for _, v := range vars {
+		beginCmd += fmt.Sprintf(":pab_%s_%s=%s", name, v, v)
+		params += fmt.Sprintf(",$pab_%s_%s", name, v)
+	}
+	beginEvent := strings.Replace(begin, "/", ".", 1)
+	endCmd := fmt.Sprintf("hist:keys=common_pid:pab_%s_lat=common_timestamp-$pab_%s_ts:onmatch(%s).trace(%s,%s)",
+		name, name, beginEvent, synth, params)
+	return group{
+		name: name + "_latency",
+		steps: []step{
+			{
+				path: filepath.Join(tracefs, "synthetic_events"),
+				cmd:  strings.Join(append([]string{synth + " u64 lat"}, fields...), "; "),
+				undo: "!" + synth,
+			},
+			triggerStep(instance, begin, beginCmd+ifFilter),
+			triggerStep(instance, end, endCmd+ifFilter),
+			triggerStep(instance, p.event, fmt.Sprintf("hist:name=%s:keys=%s:vals=hitcount", p.hist, keys)),
+		},
+		probes: []*probe{p},
+	}
+}
+
+func groups(tracefs, instance string, zoneLocks []uint64) []group {
+	ret := []group{
+		// Pages taken from the buddy lists for a PCP refill, and for
+		// everything else (high orders, or PCP bypassed).
+		countProbe(instance, "pcp_refill", "kmem/mm_page_alloc_zone_locked",
+			"common_cpu,order", "percpu_refill == 1", keyCPU, keyOrder),
+		countProbe(instance, "zone_locked_alloc", "kmem/mm_page_alloc_zone_locked",
+			"common_cpu,order", "percpu_refill == 0", keyCPU, keyOrder),
+		countProbe(instance, "pcp_drain", "kmem/mm_page_pcpu_drain",
+			"common_cpu,order", "", keyCPU, keyOrder),
+		countProbe(instance, "extfrag", "kmem/mm_page_alloc_extfrag",
+			"common_cpu,alloc_order", "", keyCPU, keyOrder),
+		countProbe(instance, "direct_reclaim", "vmscan/mm_vmscan_direct_reclaim_begin",
+			"common_cpu,order", "", keyCPU, keyOrder),
+		latencyProbe(tracefs, instance, "direct_reclaim", "vmscan/mm_vmscan_direct_reclaim_begin",
+			"vmscan/mm_vmscan_direct_reclaim_end", "", []string{"order"}, []string{"int order"},
+			"common_cpu,order,lat.log2", keyCPU, keyOrder, keyLog2),
+	}
+	if len(zoneLocks) == 0 {
+		return ret
+	}
+	var preds []string
+	for _, addr := range zoneLocks {
+		preds = append(preds, fmt.Sprintf("lock_addr == 0x%x", addr))
+	}
+	filter := strings.Join(preds, " || ")
+	return append(ret,
+		countProbe(instance, "zone_lock_contention", "lock/contention_begin",
+			"common_cpu", filter, keyCPU),
+		latencyProbe(tracefs, instance, "zone_lock_wait", "lock/contention_begin",
+			"lock/contention_end", filter, nil, nil, "common_cpu,lat.log2", keyCPU, keyLog2))
+}
+
+// Appending matters for synthetic_events, truncating it deletes all of them.
+func writeCmd(path, cmd string) error {
+	f, err := os.OpenFile(path, os.O_WRONLY|os.O_APPEND, 0)
+	if err != nil {
+		return err
+	}
+	if _, err := f.WriteString(cmd); err != nil {
+		f.Close()
+		return err
+	}
+	return f.Close()
+}
+
+// Start sets up the hist triggers in a tracefs instance of its own. Probes that
+// the kernel doesn't support (e.g. lock:contention_begin is only in 5.19+) are
+// skipped with a warning.
+func Start(opts *Options) (*Session, error) {
+	tracefs := opts.TracefsPath
+	if tracefs == "" {
+		tracefs = "/sys/kernel/tracing"
+		if _, err := os.Stat(filepath.Join(tracefs, "instances")); err != nil {
+			tracefs = "/sys/kernel/debug/tracing"
+		}
+	}
+	instance := filepath.Join(tracefs, "instances", fmt.Sprintf("page_alloc_bench_hist.%d", os.Getpid()))
+	if err := os.Mkdir(instance, 0755); err != nil {
+		return nil, fmt.Errorf("creating tracefs instance: %v", err)
+	}
+	s := &Session{instance: instance}
+
+groups:
+	for _, g := range groups(tracefs, instance, opts.ZoneLocks) {
+		for i, st := range g.steps {
+			if err := writeCmd(st.path, st.cmd); err != nil {
+				fmt.Fprintf(os.Stderr, "Skipping %s trace probe, writing %q to %s: %v\n",
+					g.name, st.cmd, st.path, err)
+				for j := i - 1; j >= 0; j-- {
+					writeCmd(g.steps[j].path, g.steps[j].undo)
+				}
+				continue groups
+			}
+		}
+		s.applied = append(s.applied, g.steps...)
+		s.probes = append(s.probes, g.probes...)
+	}
+	return s, nil
+}
+
+// Close removes the triggers and the instance.
+func (s *Session) Close() error {
+	if s == nil {
+		return nil
+	}
+	var firstErr error
+	for i := len(s.applied) - 1; i >= 0; i-- {
+		st := s.applied[i]
+		if err := writeCmd(st.path, st.undo); err != nil && firstErr == nil {
+			firstErr = fmt.Errorf("writing %q to %s: %v", st.undo, st.path, err)
+		}
+	}
+	if err := os.Remove(s.instance); err != nil && firstErr == nil {
+		firstErr = fmt.Errorf("removing tracefs instance: %v", err)
+	}
+	return firstErr
+}
+
+// parseBucket parses a line like
+// "{ common_cpu:          3, order:          0 } hitcount:         42".
+func parseBucket(line string, roles []keyRole) (Entry, uint64, bool) {
+	keys, rest, ok := strings.Cut(strings.TrimPrefix(line, "{"), "}")
+	if !ok {
+		return Entry{}, 0, false
+	}
+	count, ok := strings.CutPrefix(strings.TrimSpace(rest), "hitcount:")
+	if !ok {
+		return Entry{}, 0, false
+	}
+	n, err := strconv.ParseUint(strings.TrimSpace(count), 10, 64)
+	if err != nil {
+		return Entry{}, 0, false
+	}
+	fields := strings.Split(keys, ",")
+	if len(fields) != len(roles) {
+		return Entry{}, 0, false
+	}
+	e := Entry{CPU: -1, Order: -1, Log2: -1}
+	for i, field := range fields {
+		_, val, ok := strings.Cut(field, ":")
+		if !ok {
+			return Entry{}, 0, false
+		}
+		// .log2 keys look like "~ 2^12".
+		val = strings.TrimPrefix(strings.TrimSpace(val), "~ 2^")
+		v, err := strconv.Atoi(strings.TrimSpace(val))
+		if err != nil {
+			return Entry{}, 0, false
+		}
+		switch roles[i] {
+		case keyCPU:
+			e.CPU = v
+		case keyOrder:
+			e.Order = min(v, maxOrder)
+		case keyLog2:
+			e.Log2 = v
+		}
+	}
+	return e, n, true
+}
+
+// read gets the named histogram out of the event's hist file, which has a
+// section for each hist trigger on the event.
+func (s *Session) read(p *probe) (map[Entry]uint64, error) {
+	f, err := os.Open(filepath.Join(s.instance, "events", p.event, "hist"))
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	counts := make(map[Entry]uint64)
+	inSection := false
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		line := scanner.Text()
+		if info, ok := strings.CutPrefix(line, "# trigger info: "); ok {
+			inSection = strings.HasPrefix(info, "hist:name="+p.hist+":")
+			continue
+		}
+		if !inSection || !strings.HasPrefix(line, "{") {
+			continue
+		}
+		e, n, ok := parseBucket(line, p.keys)
+		if !ok {
+			return nil, fmt.Errorf("unexpected line in %s hist: %q", p.event, line)
+		}
+		counts[e] += n
+	}
+	return counts, scanner.Err()
+}
+
+// Snapshot reads all the probes. Returns nil on a nil Session.
+func (s *Session) Snapshot() (*Snapshot, error) {
+	if s == nil {
+		return nil, nil
+	}
+	snap := &Snapshot{Counts: make(map[string]map[Entry]uint64), latency: make(map[string]bool)}
+	for _, p := range s.probes {
+		counts, err := s.read(p)
+		if err != nil {
+			return nil, fmt.Errorf("reading %s trace probe: %v", p.name, err)
+		}
+		snap.Counts[p.name] = counts
+		for _, role := range p.keys {
+			if role == keyLog2 {
+				snap.latency[p.name] = true
+			}
+		}
+	}
+	return snap, nil
+}
+
+// AddDeltaMetrics adds what the probes counted since prev to a benchmark
+// result, with metric names starting with prefix. numCPUs is the length of the
+// _by_cpu metrics. Does nothing on a nil Snapshot.
+func (s *Snapshot) AddDeltaMetrics(result map[string][]int64, prefix string, prev *Snapshot, numCPUs int) {
+	if s == nil {
+		return
+	}
+	for name, counts := range s.Counts {
+		var total int64
+		byCPU := make([]int64, numCPUs)
+		var byOrder []int64
+		var latency hist.Histogram
+		for e, n := range counts {
+			delta := int64(n - min(n, prev.Counts[name][e]))
+			total += delta
+			if e.CPU >= 0 && e.CPU < numCPUs {
+				byCPU[e.CPU] += delta
+			}
+			if e.Order >= 0 {
+				if byOrder == nil {
+					byOrder = make([]int64, maxOrder+1)
+				}
+				byOrder[e.Order] += delta
+			}
+			if e.Log2 >= 0 && delta > 0 {
+				// Only the bucket is known, use its lower bound.
+				v := uint64(1) << min(e.Log2, 63)
+				latency.Count += uint64(delta)
+				latency.Sum += v * uint64(delta)
+				latency.Max = max(latency.Max, v)
+				latency.Buckets[hist.Bucket(v)] += uint64(delta)
+			}
+		}
+		p := prefix + "_" + name
+		result[p] = []int64{total}
+		result[p+"_by_cpu"] = byCPU
+		if byOrder != nil {
+			result[p+"_by_order"] = byOrder
+		}
+		if s.latency[name] {
+			result[p+"_p50_ns"] = []int64{int64(latency.Quantile(0.5))}
+			result[p+"_p99_ns"] = []int64{int64(latency.Quantile(0.99))}
+			result[p+"_p999_ns"] = []int64{int64(latency.Quantile(0.999))}
+			result[p+"_max_ns"] = []int64{int64(latency.Max)}
+		}
+	}
+}
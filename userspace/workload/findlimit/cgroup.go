@@ -0,0 +1,150 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package findlimit
+
+import (
+	"fmt"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"syscall"
+
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/pab"
+)
+
+// CgroupOptions configures the mode where the child runs in its own cgroup v2
+// and gets stopped once memory pressure reaches a threshold, instead of
+// allocating until the global OOM killer gets it. The child is stopped when any
+// of the conditions is met.
+type CgroupOptions struct {
+	// Directory in the cgroup v2 hierarchy to create the cgroup under.
+	// Optional, defaults to the root.
+	Parent string
+	// Stop when the "some avg10" of the cgroup's memory.pressure reaches
+	// this percentage. 0 disables this condition.
+	PSIThreshold float64
+	// Stop when MemAvailable drops below this. 0 disables this condition.
+	MinAvailable pab.ByteSize
+	// If set, MinAvailable applies to these NUMA nodes instead of the whole
+	// system, for a child whose memory is bound to them. The nodes don't
+	// report MemAvailable, their MemFree plus Inactive(file) stands in.
+	Nodes []int
+	// Regardless of the above, the child is stopped as soon as its
+	// memory.events reports any max, oom or oom_kill events.
+}
+
+type cgroup struct {
+	path string
+	dir  *os.File // For SysProcAttr.CgroupFD.
+}
+
+// createCgroup creates a cgroup for a child, suffix distinguishes children
+// that run at the same time.
+func createCgroup(parent, suffix string) (*cgroup, error) {
+	if parent == "" {
+		parent = "/sys/fs/cgroup"
+	}
+	path := filepath.Join(parent, fmt.Sprintf("page_alloc_bench_findlimit.%d%s", os.Getpid(), suffix))
+	if err := os.Mkdir(path, 0755); err != nil {
+		return nil, fmt.Errorf("creating cgroup: %v", err)
+	}
+	dir, err := os.Open(path)
+	if err != nil {
+		os.Remove(path)
+		return nil, fmt.Errorf("opening cgroup: %v", err)
+	}
+	return &cgroup{path: path, dir: dir}, nil
+}
+
+// remove must only be called once the cgroup has no more processes.
+func (c *cgroup) remove() error {
+	c.dir.Close()
+	return os.Remove(c.path)
+}
+
+func (c *cgroup) sysProcAttr() *syscall.SysProcAttr {
+	return &syscall.SysProcAttr{UseCgroupFD: true, CgroupFD: int(c.dir.Fd())}
+}
+
+// badEvents returns the number of memory.events that mean the cgroup is out of
+// memory. Returns 0 if the memory controller isn't enabled.
+func (c *cgroup) badEvents() (int64, error) {
+	data, err := os.ReadFile(filepath.Join(c.path, "memory.events"))
+	if os.IsNotExist(err) {
+		return 0, nil
+	}
+	if err != nil {
+		return 0, err
+	}
+	var total int64
+	for _, line := range strings.Split(strings.TrimSpace(string(data)), "\n") {
+		name, val, ok := strings.Cut(line, " ")
+		if !ok {
+			return 0, fmt.Errorf("malformed memory.events line %q", line)
+		}
+		if name != "max" && name != "oom" && name != "oom_kill" {
+			continue
+		}
+		n, err := strconv.ParseInt(val, 10, 64)
+		if err != nil {
+			return 0, fmt.Errorf("parsing memory.events line %q: %v", line, err)
+		}
+		total += n
+	}
+	return total, nil
+}
+
+// shouldStop checks the stop conditions, it returns a description of the one
+// that was met or "" if none were.
+func (c *cgroup) shouldStop(opts *CgroupOptions) (string, error) {
+	events, err := c.badEvents()
+	if err != nil {
+		return "", err
+	}
+	if events != 0 {
+		return "memory.events", nil
+	}
+	if opts.PSIThreshold != 0 {
+		psi, err := linux.ReadPSI(filepath.Join(c.path, "memory.pressure"))
+		if err != nil {
+			return "", err
+		}
+		if psi.Some.Avg10 >= opts.PSIThreshold {
+			return fmt.Sprintf("memory.pressure some avg10=%.2f", psi.Some.Avg10), nil
+		}
+	}
+	if opts.MinAvailable != 0 && len(opts.Nodes) == 0 {
+		meminfo, err := linux.Meminfo()
+		if err != nil {
+			return "", err
+		}
+		if avail := meminfo["MemAvailable"]; avail < opts.MinAvailable.Bytes() {
+			return fmt.Sprintf("MemAvailable=%s", pab.ByteSize(avail)), nil
+		}
+	}
+	if opts.MinAvailable != 0 && len(opts.Nodes) != 0 {
+		avail, err := linux.NodesAvailable(opts.Nodes)
+		if err != nil {
+			return "", err
+		}
+		if avail < opts.MinAvailable.Bytes() {
+			return fmt.Sprintf("node MemFree+Inactive(file)=%s", pab.ByteSize(avail)), nil
+		}
+	}
+	return "", nil
+}
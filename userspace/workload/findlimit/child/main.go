@@ -14,28 +14,52 @@
 // along with this program; If not, see <http://www.gnu.org/licenses/>.
 
 // Command findlimit is what the findlimit workload executes as a subprocess. It
-// continuously allocates blocks of memory and prints how many bytes it's
-// successully allocated. Presumably it will eventually get OOM-killed. Then you
-// can check the last number it printed.
+// continuously allocates blocks of memory and reports how many bytes it's
+// successfully allocated (and with --thp, how many of those are THP-backed)
+// through the shared progress region, see the progress package. Presumably it
+// will eventually get OOM-killed, then the parent can read the final count from
+// the region. It also times a sample of its page faults, see --fault-samples,
+// and can count perf events, see --perf-counters.
 package main
 
 import (
+	"errors"
 	"flag"
 	"fmt"
 	"log"
-	"math/bits"
 	"os"
 	"runtime"
-	"sync"
-	"sync/atomic"
 	"syscall"
+	"time"
+	_ "unsafe" // For go:linkname.
 
+	"github.com/google/page_alloc_bench/linux"
 	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/perf"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
 )
 
 var (
 	initAllocSize = flag.Int("init-alloc-size", 0, "Size of initial up-front alloc. Optional.")
 	allocSize     = flag.Int("alloc-size", 0, "Size of subsequent individual allocs.")
+	faultMode     = flag.String("fault-mode", "populate", "How to fault memory in: populate (MADV_POPULATE_WRITE) or touch (write a byte per page)")
+	thp           = flag.Bool("thp", false, "madvise(MADV_HUGEPAGE) the memory and also report how much of it is backed by THP")
+	faultSamples  = flag.Int("fault-samples", 16, "Number of page faults to time individually per 16MiB faulted, 0 to disable")
+	mempolicy     = flag.String("mempolicy", "", "NUMA memory policy for the memory, e.g. bind:0. Empty means the default policy.")
+	faultRate     = flag.Int64("fault-rate", 0, "Bytes per second to fault in, over all threads. 0 means as fast as possible.")
+	perfCounters  = flag.Bool("perf-counters", false, "Count perf events in each thread and report them in the progress region")
+)
+
+const (
+	// Each thread mmaps a slice this big at a time. Make this bigger to
+	// reduce the number of syscalls. Make it smaller to make the benchmark
+	// work on teeny weeny leedle computers. Must be a multiple of the
+	// page size and of faultStep.
+	sliceSize = 1 * pab.Gigabyte
+	// Threads fault in this much at a time before updating their counter.
+	// Since the progress we report lags by up to this much per thread,
+	// this is a trade-off between precision and overhead.
+	faultStep = 16 * pab.Megabyte
 )
 
 func mmap(size int) ([]byte, error) {
@@ -44,6 +68,166 @@ func mmap(size int) ([]byte, error) {
 	return syscall.Mmap(-1, 0, size, prot, flags)
 }
 
+var pageSize = os.Getpagesize() // This is a syscall so just do it once.
+
+func touch(data []byte) {
+	for offset := 0; offset < len(data); offset += pageSize {
+		data[offset] = 0
+	}
+}
+
+func populate(data []byte) error {
+	for {
+		err := syscall.Madvise(data, linux.MADV_POPULATE_WRITE)
+		if !errors.Is(err, syscall.EINTR) {
+			return err
+		}
+	}
+}
+
+// The runtime's monotonic clock. Unlike time.Now() this doesn't also read the
+// wall clock.
+//
+//go:linkname nanotime runtime.nanotime
+func nanotime() int64
+
+const hugePageSize = 2 * pab.Megabyte
+
+// faultTimer times single page faults and records them according to how much
+// memory the whole process has faulted in so far.
+type faultTimer struct {
+	region    *progress.Region
+	hists     *progress.FaultHists
+	available int64 // Memory available to the process when it started.
+	stride    int64 // Distance between timed faults in each faultStep.
+}
+
+// timeFaults faults in a sample of the pages in step one at a time, timing each
+// fault. The rest of the step is left for the caller.
+func (t *faultTimer) timeFaults(step []byte) {
+	if t.stride == 0 {
+		return
+	}
+	// Not quite up to date since the other threads' counters lag, but
+	// close enough for banding.
+	band := int(t.region.Total() * progress.NumPressureBands / max(t.available, 1))
+	h := &t.hists[min(band, progress.NumPressureBands-1)]
+	for offset := int64(0); offset < int64(len(step)); offset += t.stride {
+		start := nanotime()
+		step[offset] = 0
+		h.Record(uint64(nanotime() - start))
+	}
+}
+
+// pacer limits the rate at which a thread faults memory in.
+type pacer struct {
+	stepTime time.Duration // Time budget for each faultStep, 0 for no limit.
+	deadline time.Time
+}
+
+func newPacer(bytesPerSecond float64) *pacer {
+	p := &pacer{deadline: time.Now()}
+	if bytesPerSecond > 0 {
+		p.stepTime = time.Duration(float64(faultStep.Bytes()) / bytesPerSecond * float64(time.Second))
+	}
+	return p
+}
+
+// wait sleeps until the thread is allowed to fault the next step.
+func (p *pacer) wait() {
+	if p.stepTime == 0 {
+		return
+	}
+	p.deadline = p.deadline.Add(p.stepTime)
+	now := time.Now()
+	if p.deadline.Before(now.Add(-time.Second)) {
+		// Way behind schedule, don't try to catch up.
+		p.deadline = now
+	}
+	time.Sleep(p.deadline.Sub(now))
+}
+
+// openPerf starts counting perf events for the calling thread, which must be
+// locked to it, and publishes which ones in the region.
+func openPerf(region *progress.Region) *perf.Counters {
+	counters, err := perf.Open()
+	if err != nil {
+		log.Fatalf("%v", err)
+	}
+	var mask uint64
+	for _, c := range counters.Opened() {
+		mask |= 1 << c
+	}
+	// Every thread gets the same set so it doesn't matter which one wins.
+	region.PerfOpened().Store(mask)
+	return counters
+}
+
+// faultForever keeps mapping and faulting in memory until the process gets
+// killed, adding the amount faulted to the counter. If perfCounts is non-nil,
+// it counts perf events and keeps those up to date too.
+func faultForever(region *progress.Region, allocedBytes *progress.Counter, perfCounts *progress.PerfCounts,
+	timer *faultTimer, pacer *pacer, policy *linux.Mempolicy, usePopulate bool) {
+	runtime.LockOSThread()
+	var counters *perf.Counters
+	if perfCounts != nil {
+		counters = openPerf(region)
+	}
+	for {
+		data, err := mmap(int(sliceSize.Bytes()))
+		if err != nil {
+			log.Fatalf("mmap(%s) failed. /proc/sys/vm/overcommit_memory set to 2? %v", sliceSize, err)
+		}
+		if policy != nil {
+			if err := policy.Mbind(data); err != nil {
+				log.Fatalf("%v", err)
+			}
+		}
+		if *thp {
+			if err := syscall.Madvise(data, syscall.MADV_HUGEPAGE); err != nil {
+				log.Fatalf("madvise(MADV_HUGEPAGE): %v", err)
+			}
+		}
+
+		for offset := int64(0); offset < sliceSize.Bytes(); offset += faultStep.Bytes() {
+			step := data[offset : offset+faultStep.Bytes()]
+			timer.timeFaults(step)
+			if usePopulate {
+				err := populate(step)
+				if errors.Is(err, syscall.EINVAL) {
+					// Kernel too old, just do it the slow way.
+					usePopulate = false
+				} else if err != nil {
+					log.Fatalf("madvise(MADV_POPULATE_WRITE): %v", err)
+				}
+			}
+			if !usePopulate {
+				touch(step)
+			}
+			allocedBytes.Add(faultStep.Bytes())
+			if counters != nil {
+				counts, err := counters.Read()
+				if err != nil {
+					log.Fatalf("%v", err)
+				}
+				for c, val := range counts {
+					perfCounts.Values[c].Store(val)
+				}
+			}
+			pacer.wait()
+		}
+	}
+}
+
+// readAnonHugePages returns the system-wide amount of anonymous THP.
+func readAnonHugePages() int64 {
+	meminfo, err := linux.Meminfo()
+	if err != nil {
+		log.Fatalf("reading meminfo: %v", err)
+	}
+	return meminfo["AnonHugePages"]
+}
+
 func doMain() error {
 	// Ensure that this process is always the one killed by the OOM killer
 	// (assuming nobody else in the system has this oom_score_adj). This lets us
@@ -53,53 +237,82 @@ func doMain() error {
 		return err
 	}
 
-	// Having the goroutines below contend for stdout is obviously (in
-	// retrospect, lol) not workable. The Go Way would be to have them all send
-	// down a channel and then have a reader goroutine add up the results and
-	// print them periodically. Experimentally, it seems tricky to make this
-	// fast; I'm not sure if that's just a tuning problem or if hundreds of
-	// goroutines contending to send on a channel is inherently slow. Anyway, it
-	// turns out the dumbest possible thing is really fast: they can all just
-	// contend on an atomic variable which we then print in a loop.
-	var allocedBytes atomic.Int64
-	go func() {
-		for {
-			fmt.Printf("%d\n", allocedBytes.Load())
+	var usePopulate bool
+	switch *faultMode {
+	case "populate":
+		usePopulate = true
+	case "touch":
+	default:
+		return fmt.Errorf("invalid --fault-mode %q", *faultMode)
+	}
+
+	region, err := progress.Open(os.NewFile(3, "progress"))
+	if err != nil {
+		return err
+	}
+
+	meminfo, err := linux.Meminfo()
+	if err != nil {
+		return fmt.Errorf("reading meminfo: %v", err)
+	}
+	var stride int64
+	if *faultSamples > 0 {
+		stride = faultStep.Bytes() / int64(*faultSamples)
+		if *thp {
+			// Only the first touch of each huge page faults.
+			stride = max(stride, hugePageSize.Bytes())
 		}
-	}()
+		stride = max(stride, int64(pageSize))
+	}
 
-	for {
-		// Make this bigger to reduce the number of syscalls and speed the benchmark
-		// up. Make it smaller to make the benchmark work on teeny weeny leedle
-		// computers. The code below assumes it's a multiple of the page size.
-		const mmapSize = 8 * pab.Gigabyte
-		data, err := mmap(int(mmapSize.Bytes()))
+	var policy *linux.Mempolicy
+	if *mempolicy != "" {
+		policy, err = linux.ParseMempolicy(*mempolicy)
 		if err != nil {
-			log.Fatalf("mmap(%s) failed. Computer too teeny? /proc/sys/vm/overcommit_memory set to 2? %v",
-				mmapSize, err)
+			return fmt.Errorf("invalid --mempolicy: %v", err)
 		}
+	}
 
-		// Touch pages to actually fault them into memory, this is where the
-		// real allocation happens. We'll do this in parallel for speed. We
-		// divide the mmaped region into equally sized chunks and run a
-		// goroutine per chunk, to make them equally sized we just divide them
-		// into a power of two. I can't do maths with other numbers sorry.
-		goros := 1 << (63 - bits.LeadingZeros64(uint64(runtime.NumCPU())))
-		chunkSize := mmapSize.Bytes() / int64(goros)
-		pageSize := int64(os.Getpagesize()) // This is a syscall so just do it once.
-		var wg sync.WaitGroup
-		for chunkStart := int64(0); chunkStart < mmapSize.Bytes(); chunkStart += chunkSize {
-			wg.Add(1)
-			go func() {
-				for offset := int64(0); offset < chunkSize; offset += pageSize {
-					data[chunkStart+offset] = 0
-					allocedBytes.Add(int64(pageSize))
-				}
-				wg.Done()
-			}()
+	// With a bind policy only the bound nodes' memory counts, or the child
+	// would only get through the first few pressure bands.
+	available := meminfo["MemAvailable"]
+	if policy != nil && policy.Mode == linux.MPOL_BIND {
+		if available, err = linux.NodesAvailable(policy.Nodes); err != nil {
+			return fmt.Errorf("reading node meminfo: %v", err)
 		}
+	}
+
+	counters := region.Counters()
+	faultHists := region.FaultHists()
+	perfCounts := region.PerfCounts()
+	for i := range counters {
+		timer := &faultTimer{
+			region:    region,
+			hists:     &faultHists[i],
+			available: available,
+			stride:    stride,
+		}
+		pacer := newPacer(float64(*faultRate) / float64(len(counters)))
+		var pc *progress.PerfCounts
+		if *perfCounters {
+			pc = &perfCounts[i]
+		}
+		go faultForever(region, &counters[i], pc, timer, pacer, policy, usePopulate)
+	}
 
-		wg.Wait()
+	// We can't tell which of our pages are THPs without walking our page
+	// tables, which is much too slow. So instead measure the system-wide
+	// growth while we run, assuming nothing else is using THP much.
+	var thpBaseline int64
+	if *thp {
+		thpBaseline = readAnonHugePages()
+	}
+	for {
+		if *thp {
+			region.THPBytes().Store(max(0, readAnonHugePages()-thpBaseline))
+		}
+		region.Tick()
+		time.Sleep(100 * time.Millisecond)
 	}
 }
 
@@ -18,86 +18,220 @@
 package findlimit
 
 import (
-	"bufio"
 	"context"
 	"fmt"
-	"io"
 	"os"
 	"os/exec"
 	"path/filepath"
-	"strconv"
-	"strings"
+	"runtime"
+	"time"
 
+	"github.com/google/page_alloc_bench/linux"
 	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/perf"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
+)
+
+// FaultMode is how the child process faults in memory.
+type FaultMode string
+
+const (
+	// One madvise(MADV_POPULATE_WRITE) per chunk, falls back to FaultTouch
+	// on kernels that don't support it.
+	FaultPopulate FaultMode = "populate"
+	// Write one byte to each page from userspace.
+	FaultTouch FaultMode = "touch"
 )
 
 type Options struct {
 	AllocSize pab.ByteSize // Optional.
+	FaultMode FaultMode    // Optional, defaults to FaultPopulate.
+	// Request THP for the memory and report how much of it got THP.
+	THP bool
+	// How many page faults to time per 16MiB faulted in. 0 disables it.
+	FaultSamples int
+	// Optional NUMA policy for the child's memory.
+	Mempolicy *linux.Mempolicy
+	// Bytes per second the child faults in, 0 means as fast as it can.
+	FaultRate pab.ByteSize
+	// Have the child's threads count perf events.
+	PerfCounters bool
+	// If set, run the child in a cgroup and stop it based on memory
+	// pressure, instead of waiting for the OOM killer.
+	Cgroup *CgroupOptions
 }
 
 type Result struct {
 	Allocated pab.ByteSize
+	// Only if Options.THP is set. This is measured system-wide so it's an
+	// approximation.
+	THPAllocated pab.ByteSize
+	// How long the child ran for.
+	Duration time.Duration
+	// In cgroup mode, the condition that caused the child to be stopped.
+	// Empty if it was killed instead.
+	StopReason string
+	// Latencies of the timed page faults, by how much of the memory that
+	// was available at the start had been allocated when they happened.
+	FaultLatencyHists *progress.FaultHists
+	// Only with Options.PerfCounters. Summed over the child's threads, and
+	// like Allocated, only updated every time a thread has faulted in a
+	// chunk of memory, so the two can be compared.
+	Perf perf.Counts
 }
 
-func readLastLine(r io.Reader) (string, error) {
-	scanner := bufio.NewScanner(r)
-	var line string
-	for scanner.Scan() {
-		line = scanner.Text()
-	}
-	if err := scanner.Err(); err != nil {
-		return "", err
-	}
-	return line, nil
-}
-
-func Run(ctx context.Context, opts *Options) (*Result, error) {
+// newChild sets up the command for the child process and its progress region,
+// which the caller must close.
+func newChild(ctx context.Context, opts *Options) (*exec.Cmd, *progress.Region, error) {
 	myPath, err := os.Executable()
 	if err != nil {
-		return nil, fmt.Errorf("getting executable path: %v\n", err)
+		return nil, nil, fmt.Errorf("getting executable path: %v\n", err)
 	}
 	path := filepath.Join(filepath.Dir(myPath), "workload", "findlimit", "child", "child")
 	size := opts.AllocSize
 	if size == pab.ByteSize(0) {
 		size = 128 * pab.Megabyte
 	}
-	cmd := exec.CommandContext(ctx, path, fmt.Sprintf("--alloc-size=%d", size.Bytes()))
-	cmd.Stderr = os.Stderr
-	stdout, err := cmd.StdoutPipe()
-	if err != nil {
-		return nil, fmt.Errorf("setting up stdout pipe: %v\n", err)
+	faultMode := opts.FaultMode
+	if faultMode == "" {
+		faultMode = FaultPopulate
 	}
-	if err := cmd.Start(); err != nil {
-		return nil, fmt.Errorf("starting workload subprocess: %v\n", err)
+	args := []string{fmt.Sprintf("--alloc-size=%d", size.Bytes()),
+		fmt.Sprintf("--fault-mode=%s", faultMode), fmt.Sprintf("--thp=%v", opts.THP),
+		fmt.Sprintf("--fault-samples=%d", opts.FaultSamples),
+		fmt.Sprintf("--fault-rate=%d", opts.FaultRate.Bytes()),
+		fmt.Sprintf("--perf-counters=%v", opts.PerfCounters)}
+	if opts.Mempolicy != nil {
+		args = append(args, "--mempolicy="+opts.Mempolicy.String())
 	}
-	lastLine, err := readLastLine(stdout)
+	cmd := exec.CommandContext(ctx, path, args...)
+	cmd.Stderr = os.Stderr
+	region, err := progress.Create(runtime.NumCPU())
 	if err != nil {
-		return nil, fmt.Errorf("reading workload subprocess output: %v\n", err)
+		return nil, nil, fmt.Errorf("setting up progress region: %v\n", err)
 	}
+	cmd.ExtraFiles = []*os.File{region.File()} // fd 3 in the child.
+	return cmd, region, nil
+}
+
+func Run(ctx context.Context, opts *Options) (*Result, error) {
+	cmd, region, err := newChild(ctx, opts)
 	if err != nil {
-		return nil, fmt.Errorf("workload subprocess failed: %v\n", err)
+		return nil, err
 	}
-	// We check the exit conditions of the child process before trying to parse
-	// the output as an int. Hopefully this will give us a more useful clue if
+	defer region.Close()
+	if opts.Cgroup != nil {
+		cg, err := createCgroup(opts.Cgroup.Parent, "")
+		if err != nil {
+			return nil, err
+		}
+		// Wait() returns after the child is reaped so the cgroup is
+		// empty by the time we get here.
+		defer cg.remove()
+		cmd.SysProcAttr = cg.sysProcAttr()
+		return runInCgroup(cmd, region, opts, cg)
+	}
+	start := time.Now()
+	if err := cmd.Start(); err != nil {
+		return nil, fmt.Errorf("starting workload subprocess: %v\n", err)
+	}
+	// We check the exit conditions of the child process before looking at the
+	// counters. Hopefully this will give us a more useful clue if
 	// something caused the workload to shut down immediately.
 	err = cmd.Wait()
+	duration := time.Since(start)
 	if err == nil {
 		return nil, fmt.Errorf("expected workload subprocess to get OOM-killed, but it succeeded")
 	}
+	if err := checkKilled(cmd, err); err != nil {
+		return nil, err
+	}
+	if region.Seq() == 0 {
+		return nil, fmt.Errorf("workload subprocess died before it started allocating")
+	}
+	return &Result{
+		Allocated:         pab.ByteSize(region.Total()),
+		THPAllocated:      pab.ByteSize(region.THPBytes().Load()),
+		Duration:          duration,
+		FaultLatencyHists: region.MergedFaultHists(),
+		Perf:              region.PerfTotal(),
+	}, nil
+}
+
+// checkKilled returns nil if the error from cmd.Wait() is the child getting
+// killed by a signal.
+func checkKilled(cmd *exec.Cmd, err error) error {
 	exitErr, ok := err.(*exec.ExitError)
 	if !ok {
-		return nil, fmt.Errorf("unexpected error waiting for workload subprocess: %v", err)
+		return fmt.Errorf("unexpected error waiting for workload subprocess: %v", err)
 	}
 	// Ideally we'd check that the signal was specifically SIGKILL here. But I
 	// dunno how to do that.
 	if cmd.ProcessState.Exited() {
-		return nil, fmt.Errorf("expected workload subprocessed to be killed by signal, but it exited (status %d)",
+		return fmt.Errorf("expected workload subprocessed to be killed by signal, but it exited (status %d)",
 			exitErr.ExitCode())
 	}
-	numBytes, err := strconv.ParseInt(strings.TrimSpace(lastLine), 10, 64)
-	if err != nil {
-		return nil, fmt.Errorf("parsing last line of workload subprocess output (%q) as int: %v\n",
-			lastLine, err)
+	return nil
+}
+
+// How often to check the stop conditions in cgroup mode.
+const pollInterval = 20 * time.Millisecond
+
+func runInCgroup(cmd *exec.Cmd, region *progress.Region, opts *Options, cg *cgroup) (*Result, error) {
+	start := time.Now()
+	if err := cmd.Start(); err != nil {
+		return nil, fmt.Errorf("starting workload subprocess in cgroup %s: %v\n", cg.path, err)
+	}
+	waitErr := make(chan error, 1)
+	go func() { waitErr <- cmd.Wait() }()
+
+	ticker := time.NewTicker(pollInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case err := <-waitErr:
+			// Got OOM-killed (or something went wrong) before hitting
+			// the threshold.
+			duration := time.Since(start)
+			if err == nil {
+				return nil, fmt.Errorf("workload subprocess exited before reaching the memory pressure threshold")
+			}
+			if err := checkKilled(cmd, err); err != nil {
+				return nil, err
+			}
+			if region.Seq() == 0 {
+				return nil, fmt.Errorf("workload subprocess died before it started allocating")
+			}
+			return &Result{
+				Allocated:         pab.ByteSize(region.Total()),
+				THPAllocated:      pab.ByteSize(region.THPBytes().Load()),
+				Duration:          duration,
+				FaultLatencyHists: region.MergedFaultHists(),
+				Perf:              region.PerfTotal(),
+			}, nil
+		case <-ticker.C:
+			reason, err := cg.shouldStop(opts.Cgroup)
+			if err == nil && reason == "" {
+				continue
+			}
+			// Snapshot before killing, the threads keep adding to
+			// the counters until they're dead.
+			result := &Result{
+				Allocated:    pab.ByteSize(region.Total()),
+				THPAllocated: pab.ByteSize(region.THPBytes().Load()),
+				Duration:     time.Since(start),
+				StopReason:   reason,
+				Perf:         region.PerfTotal(),
+			}
+			cmd.Process.Kill()
+			<-waitErr
+			if err != nil {
+				return nil, fmt.Errorf("checking stop conditions: %v", err)
+			}
+			// The histograms aren't synchronized, wait until the
+			// child is dead.
+			result.FaultLatencyHists = region.MergedFaultHists()
+			return result, nil
+		}
 	}
-	return &Result{pab.ByteSize(numBytes)}, nil
 }
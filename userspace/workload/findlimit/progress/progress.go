@@ -0,0 +1,244 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package progress is a shared-memory region that the findlimit child uses to
+// report how much memory it has allocated, how long its page faults took and
+// optionally its perf counters.
+// This way the counts survive the child getting OOM-killed, without it having
+// to keep printing them.
+package progress
+
+import (
+	"fmt"
+	"os"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/perf"
+)
+
+const magic = 0x70616270726f6703 // "pabprog" + version.
+
+type header struct {
+	magic       uint64
+	numCounters uint64
+	// Bumped periodically by the child, so you can tell whether it got as
+	// far as running at all.
+	seq      atomic.Uint64
+	thpBytes atomic.Int64
+	// Bitmask of the perf.Counters that the child's threads count.
+	perfOpened atomic.Uint64
+	_          [24]byte
+}
+
+// Counter is a per-thread count of bytes allocated. They each get their own
+// cacheline so the threads don't contend.
+type Counter struct {
+	atomic.Int64
+	_ [56]byte
+}
+
+// NumPressureBands is how many ranges of memory pressure the fault latencies
+// are split into. Band i is from i/NumPressureBands of the memory that was
+// available when the child started being allocated, the last band also takes
+// anything beyond that.
+const NumPressureBands = 10
+
+// FaultHists are a thread's fault latency histograms (in nanoseconds), indexed
+// by pressure band. Only the owning thread writes them, without
+// synchronization, they're meant to be read by the parent after the child is
+// dead.
+type FaultHists [NumPressureBands]hist.Histogram
+
+// PerfCounts are a thread's perf counter values, indexed by perf.Counter. The
+// thread updates them along with its Counter.
+type PerfCounts struct {
+	Values [perf.NumCounters]atomic.Uint64
+	_      [64 - perf.NumCounters*8%64]byte
+}
+
+// Region is the mapping of the shared memory.
+type Region struct {
+	file       *os.File
+	data       []byte
+	header     *header
+	counters   []Counter
+	faultHists []FaultHists
+	perfCounts []PerfCounts
+}
+
+func mapRegion(file *os.File, size int) (*Region, error) {
+	data, err := syscall.Mmap(int(file.Fd()), 0, size, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("mmapping progress region: %v", err)
+	}
+	return &Region{
+		file:   file,
+		data:   data,
+		header: (*header)(unsafe.Pointer(&data[0])),
+	}, nil
+}
+
+func regionSize(numCounters int) int {
+	return int(unsafe.Sizeof(header{})) +
+		numCounters*int(unsafe.Sizeof(Counter{})+unsafe.Sizeof(FaultHists{})+unsafe.Sizeof(PerfCounts{}))
+}
+
+func (r *Region) mapCounters() {
+	offset := unsafe.Sizeof(header{})
+	r.counters = unsafe.Slice((*Counter)(unsafe.Pointer(&r.data[offset])),
+		r.header.numCounters)
+	offset += uintptr(r.header.numCounters) * unsafe.Sizeof(Counter{})
+	r.faultHists = unsafe.Slice((*FaultHists)(unsafe.Pointer(&r.data[offset])),
+		r.header.numCounters)
+	offset += uintptr(r.header.numCounters) * unsafe.Sizeof(FaultHists{})
+	r.perfCounts = unsafe.Slice((*PerfCounts)(unsafe.Pointer(&r.data[offset])),
+		r.header.numCounters)
+}
+
+// Create sets up a region with the given number of per-thread counters.
+func Create(numCounters int) (*Region, error) {
+	file, err := linux.MemfdCreate("findlimit-progress")
+	if err != nil {
+		return nil, err
+	}
+	size := regionSize(numCounters)
+	if err := file.Truncate(int64(size)); err != nil {
+		file.Close()
+		return nil, fmt.Errorf("sizing progress region: %v", err)
+	}
+	r, err := mapRegion(file, size)
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	r.header.magic = magic
+	r.header.numCounters = uint64(numCounters)
+	r.mapCounters()
+	return r, nil
+}
+
+// Open maps a region set up by Create in another process.
+func Open(file *os.File) (*Region, error) {
+	info, err := file.Stat()
+	if err != nil {
+		return nil, fmt.Errorf("stat-ing progress region: %v", err)
+	}
+	if info.Size() < int64(regionSize(0)) {
+		return nil, fmt.Errorf("progress region too small (%d bytes)", info.Size())
+	}
+	r, err := mapRegion(file, int(info.Size()))
+	if err != nil {
+		return nil, err
+	}
+	if r.header.magic != magic || regionSize(int(r.header.numCounters)) > int(info.Size()) {
+		r.Close()
+		return nil, fmt.Errorf("bad progress region header")
+	}
+	r.mapCounters()
+	return r, nil
+}
+
+// File is the memfd backing the region, to be passed to the child.
+func (r *Region) File() *os.File {
+	return r.file
+}
+
+// Counters are the per-thread counters, the child should run this many
+// threads.
+func (r *Region) Counters() []Counter {
+	return r.counters
+}
+
+// FaultHists are the per-thread fault latency histograms, parallel to
+// Counters.
+func (r *Region) FaultHists() []FaultHists {
+	return r.faultHists
+}
+
+// MergedFaultHists sums the fault latency histograms over the threads.
+func (r *Region) MergedFaultHists() *FaultHists {
+	var merged FaultHists
+	for i := range r.faultHists {
+		for band := range merged {
+			merged[band].Merge(&r.faultHists[i][band])
+		}
+	}
+	return &merged
+}
+
+// PerfCounts are the per-thread perf counters, parallel to Counters.
+func (r *Region) PerfCounts() []PerfCounts {
+	return r.perfCounts
+}
+
+// PerfOpened is the bitmask of the perf.Counters in PerfCounts that are in
+// use, 0 if the child doesn't count them.
+func (r *Region) PerfOpened() *atomic.Uint64 {
+	return &r.header.perfOpened
+}
+
+// PerfTotal sums the perf counters over the threads, nil if the child doesn't
+// count them.
+func (r *Region) PerfTotal() perf.Counts {
+	opened := r.header.perfOpened.Load()
+	if opened == 0 {
+		return nil
+	}
+	total := make(perf.Counts)
+	for counter := perf.Counter(0); counter < perf.NumCounters; counter++ {
+		if opened&(1<<counter) == 0 {
+			continue
+		}
+		for i := range r.perfCounts {
+			total[counter] += r.perfCounts[i].Values[counter].Load()
+		}
+	}
+	return total
+}
+
+// Tick bumps the sequence number.
+func (r *Region) Tick() {
+	r.header.seq.Add(1)
+}
+
+// Seq returns the sequence number, 0 means the child never called Tick.
+func (r *Region) Seq() uint64 {
+	return r.header.seq.Load()
+}
+
+// THPBytes is how many of the allocated bytes are backed by THP.
+func (r *Region) THPBytes() *atomic.Int64 {
+	return &r.header.thpBytes
+}
+
+// Total sums the per-thread counters.
+func (r *Region) Total() int64 {
+	var total int64
+	for i := range r.counters {
+		total += r.counters[i].Load()
+	}
+	return total
+}
+
+func (r *Region) Close() error {
+	if err := syscall.Munmap(r.data); err != nil {
+		return err
+	}
+	return r.file.Close()
+}
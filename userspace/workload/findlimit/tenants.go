@@ -0,0 +1,184 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package findlimit
+
+import (
+	"context"
+	"fmt"
+	"os/exec"
+	"time"
+
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/pab"
+	"github.com/google/page_alloc_bench/workload/findlimit/progress"
+)
+
+// TenantOptions overrides parts of the base Options for one tenant.
+type TenantOptions struct {
+	Mempolicy *linux.Mempolicy // Optional.
+	FaultRate pab.ByteSize     // Per second, 0 means unlimited.
+}
+
+// TenantsOptions configures a multi-tenant run: several children allocating at
+// the same time, each in its own cgroup, like containers on a shared host.
+type TenantsOptions struct {
+	// Base options for all the tenants. Cgroup is required, its stop
+	// conditions are checked for each tenant's cgroup.
+	Options
+	Tenants []TenantOptions
+}
+
+// TenantsResult is the outcome of a multi-tenant run.
+type TenantsResult struct {
+	// Indexed like TenantsOptions.Tenants. The durations are all the same
+	// as the one below, only the tenant that got stopped (if any) has a
+	// StopReason.
+	Tenants []*Result
+	// Time until the first tenant hit a limit, at which point they were
+	// all stopped.
+	Duration time.Duration
+}
+
+type tenant struct {
+	cmd     *exec.Cmd
+	region  *progress.Region
+	cg      *cgroup
+	waitErr chan error
+	exited  bool
+}
+
+// RunTenants starts all the tenants at once, and stops them all as soon as one
+// of them meets one of the cgroup stop conditions or gets killed. Each tenant
+// reports how much it had allocated at that point. If the context is cancelled
+// first, they're all stopped and the result is what they had allocated by
+// then, like for Run.
+func RunTenants(ctx context.Context, opts *TenantsOptions) (*TenantsResult, error) {
+	if opts.Cgroup == nil {
+		return nil, fmt.Errorf("multi-tenant findlimit needs cgroup options")
+	}
+	tenants := make([]*tenant, len(opts.Tenants))
+	defer func() {
+		for _, t := range tenants {
+			if t == nil {
+				continue
+			}
+			if t.waitErr != nil && !t.exited {
+				t.cmd.Process.Kill()
+				<-t.waitErr
+			}
+			if t.cg != nil {
+				t.cg.remove()
+			}
+			t.region.Close()
+		}
+	}()
+	for i, tenantOpts := range opts.Tenants {
+		childOpts := opts.Options
+		childOpts.Mempolicy = tenantOpts.Mempolicy
+		childOpts.FaultRate = tenantOpts.FaultRate
+		cmd, region, err := newChild(ctx, &childOpts)
+		if err != nil {
+			return nil, err
+		}
+		t := &tenant{cmd: cmd, region: region}
+		tenants[i] = t
+		t.cg, err = createCgroup(opts.Cgroup.Parent, fmt.Sprintf(".tenant%d", i))
+		if err != nil {
+			return nil, err
+		}
+		cmd.SysProcAttr = t.cg.sysProcAttr()
+	}
+
+	start := time.Now()
+	for i, t := range tenants {
+		if err := t.cmd.Start(); err != nil {
+			return nil, fmt.Errorf("starting tenant %d in cgroup %s: %v", i, t.cg.path, err)
+		}
+		t.waitErr = make(chan error, 1)
+		go func() { t.waitErr <- t.cmd.Wait() }()
+	}
+
+	stopped, reason, err := waitForLimit(ctx, tenants, opts.Cgroup)
+	if err != nil {
+		return nil, err
+	}
+
+	// Snapshot before killing, like runInCgroup.
+	result := &TenantsResult{Duration: time.Since(start)}
+	for _, t := range tenants {
+		result.Tenants = append(result.Tenants, &Result{
+			Allocated:    pab.ByteSize(t.region.Total()),
+			THPAllocated: pab.ByteSize(t.region.THPBytes().Load()),
+			Duration:     result.Duration,
+			Perf:         t.region.PerfTotal(),
+		})
+	}
+	if stopped >= 0 {
+		result.Tenants[stopped].StopReason = reason
+	}
+	for i, t := range tenants {
+		if !t.exited {
+			t.cmd.Process.Kill()
+			<-t.waitErr
+			t.exited = true
+		}
+		result.Tenants[i].FaultLatencyHists = t.region.MergedFaultHists()
+	}
+	return result, nil
+}
+
+// waitForLimit polls the tenants until one of them is killed or meets a stop
+// condition. It returns which one and why, or -1 if the context was cancelled
+// first.
+func waitForLimit(ctx context.Context, tenants []*tenant, cgOpts *CgroupOptions) (int, string, error) {
+	ticker := time.NewTicker(pollInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return -1, "", nil
+		case <-ticker.C:
+		}
+		for i, t := range tenants {
+			select {
+			case err := <-t.waitErr:
+				t.exited = true
+				if ctx.Err() != nil {
+					// Killed by exec.CommandContext.
+					return -1, "", nil
+				}
+				if err == nil {
+					return 0, "", fmt.Errorf("tenant %d exited before reaching a limit", i)
+				}
+				if err := checkKilled(t.cmd, err); err != nil {
+					return 0, "", fmt.Errorf("tenant %d: %v", i, err)
+				}
+				if t.region.Seq() == 0 {
+					return 0, "", fmt.Errorf("tenant %d died before it started allocating", i)
+				}
+				return i, "killed", nil
+			default:
+			}
+			reason, err := t.cg.shouldStop(cgOpts)
+			if err != nil {
+				return 0, "", fmt.Errorf("checking stop conditions for tenant %d: %v", i, err)
+			}
+			if reason != "" {
+				return i, reason, nil
+			}
+		}
+	}
+}
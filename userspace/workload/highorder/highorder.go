@@ -0,0 +1,314 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package highorder measures how often, and how quickly, high-order page
+// allocations succeed once physical memory has been deliberately fragmented.
+package highorder
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"os"
+	"runtime"
+	"strings"
+	"syscall"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/mmstat"
+	"golang.org/x/sync/errgroup"
+)
+
+// Mode is how hard each high-order attempt is allowed to try.
+type Mode int
+
+const (
+	// __GFP_NORETRY: at most a light compaction pass before giving up.
+	NoRetry Mode = iota
+	// __GFP_RETRY_MAYFAIL: the allocator's full reclaim and compaction,
+	// but without the OOM killer.
+	Compact
+)
+
+var modeNames = []string{"noretry", "compact"}
+
+func (m Mode) String() string {
+	return modeNames[m]
+}
+
+// ParseModes parses a comma-separated list of mode names, e.g.
+// "noretry,compact".
+func ParseModes(s string) ([]Mode, error) {
+	var modes []Mode
+	for _, name := range strings.Split(s, ",") {
+		found := false
+		for m, n := range modeNames {
+			if name == n {
+				modes = append(modes, Mode(m))
+				found = true
+			}
+		}
+		if !found {
+			return nil, fmt.Errorf("unknown mode %q (valid: %s)",
+				name, strings.Join(modeNames, ", "))
+		}
+	}
+	return modes, nil
+}
+
+func (m Mode) gfp() kmod.GFP {
+	gfp := kmod.GFP{Preset: kmod.GFPKernel, Flags: kmod.GFPNoWarn}
+	switch m {
+	case NoRetry:
+		gfp.Flags |= kmod.GFPNoRetry
+	case Compact:
+		gfp.Flags |= kmod.GFPRetryMayFail
+	}
+	return gfp
+}
+
+type Options struct {
+	// Fill this percentage of MemAvailable with order-0 pages before
+	// freeing most of them again.
+	FillPercent int
+	// After the fill, keep one of its pages in each naturally aligned block
+	// of 2^KeepOrder pages and free the rest. So 1 frees every other page,
+	// leaving nothing above order 0 in the filled memory.
+	KeepOrder int
+	// How the fill allocates, which decides what migratetype its pageblocks
+	// get. The kept pages can't be migrated either way, as the kmod holds
+	// them, but movable ones pollute the blocks compaction targets.
+	FillGFP kmod.GFP
+	Orders  []int
+	// The attempts for each order are repeated for each mode, in order.
+	Modes []Mode
+	// Attempts per order and mode. Successful allocations are held until
+	// all the attempts of the batch are done, so a batch measures how many
+	// blocks of that order the allocator can produce, not just one.
+	Attempts int
+}
+
+// BatchResult is the outcome of the attempts for one order and mode.
+type BatchResult struct {
+	Order     int
+	Mode      Mode
+	Successes int
+	Failures  int
+	// In-kernel latency, in nanoseconds.
+	SuccessLatency *hist.Histogram
+	FailureLatency *hist.Histogram
+	Duration       time.Duration
+	// Around the attempts. The difference in Vmstat shows the compaction,
+	// migration and reclaim they triggered.
+	Before, After *mmstat.Snapshot
+}
+
+type Result struct {
+	FillPages int // Order-0 pages the fill got.
+	KeptPages int
+	// Taken after freeing the fill pages that weren't kept.
+	Fragmented *mmstat.Snapshot
+	Batches    []*BatchResult
+}
+
+type Workload struct {
+	kmod *kmod.Connection
+	opts Options
+}
+
+func New(opts *Options) (*Workload, error) {
+	file, err := os.Open("/proc/page_alloc_bench")
+	if err != nil {
+		return nil, fmt.Errorf("opening /proc/page_alloc_bench: %v", err)
+	}
+	return &Workload{
+		kmod: &kmod.Connection{file},
+		opts: *opts,
+	}, nil
+}
+
+func (w *Workload) free(pages []kmod.Page) error {
+	for len(pages) > 0 {
+		n := min(len(pages), kmod.MaxBatch)
+		if _, err := w.kmod.FreePages(pages[:n]); err != nil {
+			return fmt.Errorf("freeing pages: %v", err)
+		}
+		pages = pages[n:]
+	}
+	return nil
+}
+
+// fillCPU allocates up to n order-0 pages on the calling goroutine's CPU,
+// stopping early if the kernel refuses.
+func (w *Workload) fillCPU(ctx context.Context, args *kmod.AllocArgs, n int) ([]kmod.Page, error) {
+	var pages []kmod.Page
+	for len(pages) < n && ctx.Err() == nil {
+		batch, err := w.kmod.AllocPages(args, min(n-len(pages), kmod.MaxBatch))
+		pages = append(pages, batch...)
+		if errors.Is(err, syscall.ENOMEM) {
+			break
+		}
+		if err != nil {
+			return pages, fmt.Errorf("allocating fill pages: %v", err)
+		}
+	}
+	return pages, nil
+}
+
+// fill allocates order-0 pages until it has the target number or the kernel
+// refuses. The pages are spread over all the CPUs, each filling its share from
+// a pinned thread. That keeps each CPU's share of a big host's memory within
+// what the kmod can track per CPU, and leaves room there for the attempts.
+func (w *Workload) fill(ctx context.Context) ([]kmod.Page, error) {
+	meminfo, err := linux.Meminfo()
+	if err != nil {
+		return nil, fmt.Errorf("reading /proc/meminfo: %v", err)
+	}
+	target := int(meminfo["MemAvailable"] * int64(w.opts.FillPercent) / 100 / int64(os.Getpagesize()))
+	args := &kmod.AllocArgs{
+		GFP: w.opts.FillGFP,
+		API: kmod.APIAllocPages,
+		NID: -1,
+	}
+	// Don't let the fill itself push the system into reclaim storms.
+	args.GFP.Flags |= kmod.GFPNoRetry | kmod.GFPNoWarn
+
+	numCPUs := runtime.NumCPU()
+	perCPU := make([][]kmod.Page, numCPUs)
+	eg, ctx := errgroup.WithContext(ctx)
+	for cpu := 0; cpu < numCPUs; cpu++ {
+		n := target / numCPUs
+		if cpu < target%numCPUs {
+			n++
+		}
+		eg.Go(func() error {
+			runtime.LockOSThread()
+			cpuMask := linux.NewCPUMask(cpu)
+			if err := linux.SchedSetaffinity(linux.PIDCallingThread, cpuMask); err != nil {
+				return fmt.Errorf("SchedSetaffinity(%+v): %v", cpuMask, err)
+			}
+			var err error
+			perCPU[cpu], err = w.fillCPU(ctx, args, n)
+			return err
+		})
+	}
+	err = eg.Wait()
+	var pages []kmod.Page
+	for _, p := range perCPU {
+		pages = append(pages, p...)
+	}
+	return pages, err
+}
+
+// thin frees all but one of the pages in each 2^KeepOrder block, returning the
+// ones it kept.
+func (w *Workload) thin(pages []kmod.Page) ([]kmod.Page, error) {
+	blocks := make(map[uint64]bool)
+	var kept, freed []kmod.Page
+	for _, page := range pages {
+		block := page.PFN >> w.opts.KeepOrder
+		if blocks[block] {
+			freed = append(freed, page)
+		} else {
+			blocks[block] = true
+			kept = append(kept, page)
+		}
+	}
+	return kept, w.free(freed)
+}
+
+func (w *Workload) runBatch(ctx context.Context, order int, mode Mode) (*BatchResult, error) {
+	args := &kmod.AllocArgs{
+		Order: order,
+		GFP:   mode.gfp(),
+		API:   kmod.APIAllocPages,
+		NID:   -1,
+	}
+	result := &BatchResult{Order: order, Mode: mode}
+	if err := w.kmod.ResetHistograms(); err != nil {
+		return nil, fmt.Errorf("resetting histograms: %v", err)
+	}
+	var err error
+	if result.Before, err = mmstat.Take(); err != nil {
+		return nil, err
+	}
+
+	var held []kmod.Page
+	defer func() { w.free(held) }()
+	start := time.Now()
+	for i := 0; i < w.opts.Attempts && ctx.Err() == nil; i++ {
+		page, err := w.kmod.AllocPage(args)
+		if errors.Is(err, syscall.ENOMEM) {
+			result.Failures++
+			continue
+		}
+		if err != nil {
+			return nil, fmt.Errorf("allocating order-%d page: %v", order, err)
+		}
+		result.Successes++
+		held = append(held, *page)
+	}
+	result.Duration = time.Since(start)
+
+	if result.After, err = mmstat.Take(); err != nil {
+		return nil, err
+	}
+	if result.SuccessLatency, err = w.kmod.ReadHistogram(kmod.HistAlloc, order, kmod.AllCPUs, false); err != nil {
+		return nil, fmt.Errorf("reading histogram: %v", err)
+	}
+	if result.FailureLatency, err = w.kmod.ReadHistogram(kmod.HistAllocFail, order, kmod.AllCPUs, false); err != nil {
+		return nil, fmt.Errorf("reading histogram: %v", err)
+	}
+	return result, nil
+}
+
+// Run fragments memory, then makes the high-order attempts. Everything is
+// freed again before it returns.
+func (w *Workload) Run(ctx context.Context) (*Result, error) {
+	defer w.kmod.Close()
+
+	pages, err := w.fill(ctx)
+	if err != nil {
+		w.free(pages)
+		return nil, err
+	}
+	result := &Result{FillPages: len(pages)}
+	kept, err := w.thin(pages)
+	defer func() { w.free(kept) }()
+	if err != nil {
+		return nil, err
+	}
+	result.KeptPages = len(kept)
+	if result.Fragmented, err = mmstat.Take(); err != nil {
+		return nil, err
+	}
+
+	for _, mode := range w.opts.Modes {
+		for _, order := range w.opts.Orders {
+			if ctx.Err() != nil {
+				return result, nil
+			}
+			batch, err := w.runBatch(ctx, order, mode)
+			if err != nil {
+				return nil, err
+			}
+			result.Batches = append(result.Batches, batch)
+		}
+	}
+	return result, nil
+}
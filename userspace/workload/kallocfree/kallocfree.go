@@ -21,111 +21,280 @@ import (
 	"context"
 	"errors"
 	"fmt"
-	"io"
-	"math/rand"
+	"math"
 	"os"
 	"runtime"
+	"slices"
+	"sync"
 	"sync/atomic"
 	"syscall"
 	"time"
 
+	"github.com/google/page_alloc_bench/hist"
 	"github.com/google/page_alloc_bench/kmod"
 	"github.com/google/page_alloc_bench/linux"
 	"github.com/google/page_alloc_bench/pab"
 	"github.com/google/page_alloc_bench/sampling"
+	"github.com/google/page_alloc_bench/timeseries"
 	"golang.org/x/sync/errgroup"
 )
 
 type Options struct {
 	// See corresponding cmdline flags for explanation of fields.
+	// Average amount the workload holds across all CPUs. 0 means 1000
+	// allocations per CPU.
 	TotalMemory      pab.ByteSize
-	TestDataPath     string
 	Order            int // Allocation order (i.e. alloc_pages arg).
+	GFP              kmod.GFP
+	API              kmod.AllocAPI
+	NID              int // Only for kmod.APIAllocPagesNode.
+	Touch            kmod.TouchPolicy
+	Clock            kmod.ClockSource
 	MeasureLatencies bool
+	BatchSize        int // Max pages per alloc/free ioctl. 0 means kmod.MaxBatch.
+	// Run the workload in kernel threads instead of from userspace. Only the
+	// latency histograms are available in this mode.
+	InKernel bool
+	// If non-empty, pair up CPUs so that one allocates pages and the other
+	// frees them, with the given relationships between the CPUs in each
+	// pair. Not supported with InKernel.
+	RemoteFree []TopologyClass
+	// If non-empty, each batch of allocations picks its order from this
+	// distribution instead of using Order. Not supported with InKernel.
+	OrderWeights []OrderWeight
+	// If set, allocate slab objects instead of pages, and ignore the
+	// page-specific options above. With kmod.SlabCache, the workload
+	// creates the cache described by SlabCache and destroys it at the end.
+	Slab      *kmod.SlabArgs
+	SlabCache *kmod.SlabCacheConfig
+	Pattern   *PatternSpec // Optional, defaults to bounce.
+	// If set, stream per-interval rates and latencies here while running.
+	Timeseries     *timeseries.Writer
+	SampleInterval time.Duration // 0 means 1s.
+	// If set, called with the totals for each sample interval while
+	// running, from the same goroutine that writes Timeseries.
+	OnInterval func(*Interval)
+	// Count perf events in each CPU worker, see PerfPhases. Not supported
+	// with InKernel.
+	PerfCounters bool
+	// CPUs to run workers on, nil means all of them. TotalMemory is still
+	// the total over all the workers. Not supported with InKernel.
+	CPUs []int
 }
 
 type stats struct {
+	// Per CPU worker. The totals are only summed up when they're read, so
+	// the workers don't bounce cachelines between each other. These count
+	// from the start of Run, see segment for how they're split up.
+	perCPU []cpuCounters
+}
+
+// Counters for one CPU. Each one is only written by the CPU worker that owns
+// it, but they're atomic so they can be read while it runs.
+type cpuCounters struct {
 	pagesAllocated        atomic.Uint64
 	pagesFreed            atomic.Uint64
 	allocFailures         atomic.Uint64
 	numaRemoteAllocations atomic.Uint64
-	allocLatencies        []*sampling.Reservoir[time.Duration] // Per CPU worker.
-	freeLatencies         []*sampling.Reservoir[time.Duration] // Per CPU worker.
+	perOrder              [kmod.HistNumOrders]orderCounters
+	allocsByNode          [maxNUMANodes]atomic.Uint64 // Indexed by the node the pages came from.
+	// Round up to a multiple of the cacheline size.
+	_ [64 - (4+3*kmod.HistNumOrders+maxNUMANodes)*8%64]byte
+}
+
+// Pages from nodes with higher IDs than this are left out of the per-node
+// counts, but still count towards the rest.
+const maxNUMANodes = 64
+
+type orderCounters struct {
+	pagesAllocated        atomic.Uint64
+	allocFailures         atomic.Uint64
+	numaRemoteAllocations atomic.Uint64
+}
+
+// inc adds to a counter that only the calling goroutine writes. This avoids the
+// locked instruction of atomic.Uint64.Add.
+func inc(c *atomic.Uint64, n uint64) {
+	c.Store(c.Load() + n)
+}
+
+// total sums a counter over all CPUs.
+func (s *stats) total(counter func(c *cpuCounters) *atomic.Uint64) uint64 {
+	var sum uint64
+	for i := range s.perCPU {
+		sum += counter(&s.perCPU[i]).Load()
+	}
+	return sum
 }
 
 type Result struct {
 	AllocFailures         uint64
 	PagesAllocated        uint64 // Only incremented; subtract pagesFreed to count leaks.
 	PagesFreed            uint64
-	NUMARemoteAllocations uint64          // Number of pages where page NID didn't match CPU's NID.
-	AllocLatencies        []time.Duration // Excludes userspace/syscall overhead. We only capture the last N allocations.
-	FreeLatencies         []time.Duration
+	NUMARemoteAllocations uint64 // Number of pages where page NID didn't match CPU's NID.
+	// The above two broken down by the node the pages came from, indexed
+	// by node ID. Not available for the in-kernel workload.
+	PagesAllocatedByNode        []uint64
+	NUMARemoteAllocationsByNode []uint64
+	AllocLatencies              []LatencySample // Excludes userspace/syscall overhead. Uniformly sampled.
+	FreeLatencies               []LatencySample
+	// Histograms of all alloc/free latencies in nanoseconds, from the kmod.
+	AllocLatencyHist *hist.Histogram
+	FreeLatencyHist  *hist.Histogram
+	// Time spent touching the pages after allocating them, empty for
+	// kmod.TouchNone and kmod.TouchZero.
+	TouchLatencyHist *hist.Histogram
+	// Only in remote-free mode. Frees done by consumer CPUs are included in
+	// the totals above too.
+	RemoteFree map[TopologyClass]*RemoteFreeResult
+	// Breakdown of the above by allocation order, for each order the
+	// workload used. In slab mode it's by size class (see
+	// kmod.SlabSizeClass) instead, and only the histograms are set.
+	PerOrder map[int]*OrderResult
+	// The clock the kmod timed everything with, and the overhead of doing
+	// that which is included in all the latencies.
+	Clock         kmod.ClockSource
+	ClockOverhead time.Duration
+	// Only with Options.PerfCounters. Indexed by the names in PerfPhases,
+	// then by CPU. The counts include the workers' userspace and syscall
+	// overhead as well as the time in the allocator.
+	Perf map[string][]PerfResult
+}
+
+type OrderResult struct {
+	AllocFailures         uint64
+	PagesAllocated        uint64
+	NUMARemoteAllocations uint64
+	AllocLatencyHist      *hist.Histogram
+	FreeLatencyHist       *hist.Histogram
+	TouchLatencyHist      *hist.Histogram
+}
+
+// LatencySample is one of the recorded alloc or free latencies.
+type LatencySample struct {
+	Time    time.Duration // When the ioctl returned, since the workload started.
+	CPU     int
+	Latency time.Duration
+}
+
+type RemoteFreeResult struct {
+	NumPairs        int
+	FreeLatencyHist *hist.Histogram // Only frees done by consumer CPUs.
 }
 
 func (s *stats) String() string {
-	return fmt.Sprintf("pagesAllocated=%d pagesFreed=%d ", s.pagesAllocated.Load(), s.pagesFreed.Load())
+	return fmt.Sprintf("pagesAllocated=%d pagesFreed=%d ",
+		s.total(func(c *cpuCounters) *atomic.Uint64 { return &c.pagesAllocated }),
+		s.total(func(c *cpuCounters) *atomic.Uint64 { return &c.pagesFreed }))
 }
 
 type Workload struct {
-	kmod               *kmod.Connection
-	stats              *stats
-	testDataPath       string // Path to a file with some data in it. Optional.
-	pagesPerCPU        int64
-	numThreads         int
-	steadyStateThreads atomic.Int32
-	steadyStateReached chan struct{} // Will be closed when stateStateThreads reaches numThreads
-	cpuToNode          map[int]int
-	order              int
-	measureLatencies   bool
+	kmod             *kmod.Connection
+	stats            *stats
+	numThreads       int   // Number of CPU workers.
+	cpus             []int // The ones that run the workers.
+	numNodes         int   // Highest NUMA node ID plus one.
+	pattern          *PatternSpec
+	totalMemory      pab.ByteSize
+	mixedOrders      bool                      // Options.OrderWeights was set.
+	segment          atomic.Pointer[segment]   // The one the workers should be running.
+	adopted          []atomic.Pointer[segment] // Indexed by CPU, the one each worker is running.
+	workersDone      chan struct{}             // Closed when all the workers have exited.
+	cpuToNode        []int                     // Indexed by CPU.
+	allocArgs        kmod.AllocArgs
+	slab             *kmod.SlabArgs // nil for pages.
+	allocHist        kmod.HistKind  // Depends on whether it's pages or slab.
+	freeHist         kmod.HistKind
+	measureLatencies bool
+	batchSize        int // Max pages per alloc/free ioctl.
+	inKernel         bool
+	remoteFreePairs  []*remoteFreePair
+	timeseries       *timeseries.Writer
+	onInterval       func(*Interval)
+	sampleInterval   time.Duration
+	rateScale        atomic.Uint64 // math.Float64bits, see SetRateScale.
+	start            time.Time     // When Run was called.
+	clock            *kmod.ClockInfo
+	perf             []*cpuPerf // Indexed by CPU, nil without Options.PerfCounters.
+	closeOnce        sync.Once
 }
 
-// Run once on the system before each iteration of the workload.
-func (w *Workload) setup(ctx context.Context) error {
-	if w.testDataPath == "" {
-		return nil
-	}
-	// Read some data to populate the page cache a bit.
-	f, err := os.Open(w.testDataPath)
-	if err != nil {
-		return fmt.Errorf("opening data to fill page cache: %v", err)
+// Pages held per CPU when Options.TotalMemory is 0.
+const defaultFootprint = 1000
+
+// pageFootprint returns the allocations per CPU for a page workload with the
+// given orders.
+func (w *Workload) pageFootprint(orders []OrderWeight) int {
+	if w.totalMemory == 0 {
+		return defaultFootprint
 	}
-	fmt.Printf("Reading %v\n", w.testDataPath)
-	_, err = io.Copy(io.Discard, f)
-	fmt.Printf("Done reading %v\n", w.testDataPath)
-	return err
+	held := float64(w.totalMemory.Pages()) / meanPages(orders)
+	return max(1, int(held)/w.numThreads)
 }
 
 // per-CPU element of a workload. Assumes that the calling goroutine is already
-// pinned to an appropriate CPU.
-func (w *Workload) runCPU(ctx context.Context, cpu int) error {
-	var pages []*kmod.Page
+// pinned to an appropriate CPU. If ring is non-nil, pages are handed off there
+// to be freed by another CPU instead of being freed locally.
+func (w *Workload) runCPU(ctx context.Context, cpu int, ring *pageRing) error {
+	var pages []kmod.Page
+	var seg *segment
+	freeAll := func() {
+		for len(pages) > 0 {
+			n := min(len(pages), w.batchSize)
+			w.freePagesOnCPU(cpu, seg, pages[:n])
+			pages = pages[n:]
+		}
+	}
 
 	defer func() {
-		for _, page := range pages {
-			w.freePageOnCPU(cpu, page)
+		freeAll()
+		if ring != nil {
+			ring.closed.Store(true)
 		}
 	}()
 
-	// Give each CPU its own pattern of behaviour, but keep the pattern
-	// stable between runs (at least for the same build)..
-	random := rand.New(rand.NewSource(int64(cpu)))
+	var pattern Pattern
+	var orders *orderPicker
 	steady := false
+	deadline := time.Now()
 
 	for ctx.Err() == nil {
-		// Pattern is to allocate and free in alternate bursts while
-		// keeping the overall number of allocated pages bouncing around
-		// a roughly stable "middle" value.
-		middle := 1000
-		var target int
-		if random.Uint32()%2 == 0 {
-			target = middle + (int(random.Uint64() % 1000))
-		} else {
-			target = middle - (int(random.Uint64() % 1000))
+		if s := w.segment.Load(); s != seg {
+			// Start over as if the workload had just been
+			// started with the new segment's configuration.
+			freeAll()
+			seg = s
+			pattern = w.pattern.newPattern(cpu, seg.footprint, w.batchSize)
+			orders = newOrderPicker(cpu, seg.orders)
+			steady = false
+			deadline = time.Now()
+			if err := w.adopt(cpu, seg); err != nil {
+				return err
+			}
 		}
 
-		// Allocate up to target.
-		for len(pages) < target {
-			page, err := w.allocPageOnCPU(ctx, w.order, cpu)
+		step := pattern.Next(len(pages))
+
+		if step.Delay != 0 {
+			scale := math.Float64frombits(w.rateScale.Load())
+			deadline = deadline.Add(time.Duration(float64(step.Delay) / scale))
+			now := time.Now()
+			if deadline.Before(now.Add(-time.Second)) {
+				// Way behind schedule, don't try to catch up.
+				deadline = now
+			}
+			select {
+			case <-time.After(deadline.Sub(now)):
+			case <-ctx.Done():
+				return nil
+			}
+		}
+
+		if step.Pages > 0 {
+			n := min(step.Pages, w.batchSize)
+			// In slab mode the kmod picks the sizes.
+			newPages, err := w.allocPagesOnCPU(ctx, cpu, seg, orders.pick(), n)
+			pages = append(pages, newPages...)
 			if err != nil {
 				if ctx.Err() != nil {
 					// Don't care about this error, and it's
@@ -134,41 +303,76 @@ func (w *Workload) runCPU(ctx context.Context, cpu int) error {
 				}
 				return err
 			}
-			pages = append(pages, page)
-
-			// We are steady once we hit the middle at least once.
-			// Note it might take a few iterations before we hit
-			// this point, that's fine.
-			if len(pages) == middle && !steady {
-				if w.steadyStateThreads.Add(1) >= int32(w.numThreads) {
-					close(w.steadyStateReached)
-				}
+
+			// We are steady once we hit the pattern's threshold
+			// at least once. Note it might take a few iterations
+			// before we hit this point, that's fine.
+			if len(pages) >= pattern.SteadyAt() && !steady {
+				seg.markSteady(w.numThreads)
 				steady = true
+				if err := w.endPerfPhase(cpu); err != nil {
+					return fmt.Errorf("reading perf counters: %v", err)
+				}
 			}
-		}
-
-		// Free down to target.
-		for len(pages) > target {
-			if err := w.freePageOnCPU(cpu, pages[0]); err != nil {
-				return fmt.Errorf("freeing page: %v", err)
+		} else if step.Pages < 0 {
+			n := min(-step.Pages, len(pages), w.batchSize)
+			toFree := pages[:n]
+			if step.FreeNewest {
+				toFree = pages[len(pages)-n:]
+			}
+			var done int
+			if ring != nil {
+				done = n - len(ring.handOff(ctx, toFree))
+			} else {
+				freed, err := w.freePagesOnCPU(cpu, seg, toFree)
+				if err != nil {
+					return fmt.Errorf("freeing pages: %v", err)
+				}
+				done = freed
+			}
+			if step.FreeNewest {
+				pages = pages[:len(pages)-done]
+			} else {
+				pages = pages[done:]
 			}
-			pages = pages[1:]
 		}
 	}
 
 	return nil
 }
 
-// Allocate a page, update stats. Caller must be running on the stated CPU.
-func (w *Workload) allocPageOnCPU(ctx context.Context, order int, cpu int) (*kmod.Page, error) {
+// Allocate up to n pages of the given order (or slab objects), update stats.
+// Caller must be running on the stated CPU, with the given segment adopted.
+// Might return fewer pages than requested if the kernel ran out of memory part
+// way through. If an error is returned, the returned pages are still valid.
+func (w *Workload) allocPagesOnCPU(ctx context.Context, cpu int, seg *segment, order int, n int) ([]kmod.Page, error) {
+	args := w.allocArgs
+	args.Order = order
+	counters := &w.stats.perCPU[cpu]
+	// The size classes of slab objects aren't reported, so those don't
+	// get a breakdown.
+	oc := &orderCounters{}
+	if w.slab == nil {
+		oc = &counters.perOrder[order]
+	}
 	// Exponential backoff in case of allocation failures.
 	backoff := 500 * time.Millisecond
-	var page *kmod.Page
+	var pages []kmod.Page
 	var err error
 	for {
-		page, err = w.kmod.AllocPage(order)
+		if w.slab != nil {
+			pages, err = w.kmod.AllocObjects(w.slab, n)
+		} else {
+			pages, err = w.kmod.AllocPages(&args, n)
+		}
 		if errors.Is(err, syscall.ENOMEM) {
-			w.stats.allocFailures.Add(1)
+			inc(&counters.allocFailures, 1)
+			inc(&oc.allocFailures, 1)
+			if len(pages) != 0 {
+				// Made some progress, let the caller retry.
+				err = nil
+				break
+			}
 			select {
 			case <-time.After(backoff):
 				backoff += backoff / 2
@@ -179,36 +383,60 @@ func (w *Workload) allocPageOnCPU(ctx context.Context, order int, cpu int) (*kmo
 		}
 		break
 	}
-	if err != nil {
-		return nil, fmt.Errorf("allocating page: %v", err)
-	}
 
-	w.stats.pagesAllocated.Add(1)
-	if page.NID != w.cpuToNode[cpu] {
-		w.stats.numaRemoteAllocations.Add(1)
-	}
+	var now time.Duration
 	if w.measureLatencies {
-		w.stats.allocLatencies[cpu].Add(page.Latency)
+		now = time.Since(w.start)
 	}
-	return page, nil
+	inc(&counters.pagesAllocated, uint64(len(pages)))
+	inc(&oc.pagesAllocated, uint64(len(pages)))
+	nid := w.cpuToNode[cpu]
+	var remote uint64
+	for _, page := range pages {
+		if page.NID != nid {
+			remote++
+		}
+		if page.NID >= 0 && page.NID < maxNUMANodes {
+			inc(&counters.allocsByNode[page.NID], 1)
+		}
+		if w.measureLatencies {
+			seg.allocLatencies[cpu].Add(LatencySample{now, cpu, page.Latency})
+		}
+	}
+	inc(&counters.numaRemoteAllocations, remote)
+	inc(&oc.numaRemoteAllocations, remote)
+	if err != nil {
+		return pages, fmt.Errorf("allocating pages: %v", err)
+	}
+	return pages, nil
 }
 
 var freeErrorLogged = false
 
-// Free a page, update stats. Caller must be running on the stated CPU.
-func (w *Workload) freePageOnCPU(cpu int, page *kmod.Page) error {
-	latency, err := w.kmod.FreePage(page)
+// Free some pages, update stats, return how many were freed. Caller must be
+// running on the stated CPU, with the given segment adopted.
+func (w *Workload) freePagesOnCPU(cpu int, seg *segment, pages []kmod.Page) (int, error) {
+	var latencies []time.Duration
+	var err error
+	if w.slab != nil {
+		latencies, err = w.kmod.FreeObjects(pages)
+	} else {
+		latencies, err = w.kmod.FreePages(pages)
+	}
 	if err != nil && !freeErrorLogged {
 		// The kmod also frees on rmmod so it might be OK.
 		fmt.Fprintf(os.Stderr, "Couldn't free one or more kernel pages, consider rebooting: %v\n", err)
 		freeErrorLogged = true
-		return err
+		return len(latencies), err
 	}
-	w.stats.pagesFreed.Add(1)
-	if w.measureLatencies && latency != nil {
-		w.stats.freeLatencies[cpu].Add(*latency)
+	inc(&w.stats.perCPU[cpu].pagesFreed, uint64(len(pages)))
+	if w.measureLatencies {
+		now := time.Since(w.start)
+		for _, latency := range latencies {
+			seg.freeLatencies[cpu].Add(LatencySample{now, cpu, latency})
+		}
 	}
-	return nil
+	return len(pages), nil
 }
 
 // samples concatenates all the output samples from the given reservoirs.
@@ -220,18 +448,143 @@ func samples[T any](rs []*sampling.Reservoir[T]) []T {
 	return ret
 }
 
+// runKthreads is the equivalent of the body of Run, for when the workload runs
+// in the kernel.
+func (w *Workload) runKthreads(ctx context.Context) (*Result, error) {
+	seg := w.segment.Load()
+	err := w.kmod.StartKthreads(&kmod.KthreadsConfig{
+		Alloc:  w.allocArgs,
+		Slab:   w.slab,
+		Middle: seg.footprint,
+		Range:  seg.footprint,
+	})
+	if err != nil {
+		return nil, fmt.Errorf("starting kthreads: %v", err)
+	}
+	fmt.Printf("Started kernel threads, each holding around %d allocations\n", seg.footprint)
+
+	// The kthreads don't tell us when they're steady, poll for it.
+	steady := false
+	ticker := time.NewTicker(100 * time.Millisecond)
+	defer ticker.Stop()
+	for ctx.Err() == nil && !steady {
+		select {
+		case <-ctx.Done():
+		case <-ticker.C:
+			status, err := w.kmod.KthreadsStatus(w.numThreads)
+			if err != nil {
+				w.kmod.StopKthreads()
+				return nil, fmt.Errorf("reading kthread status: %v", err)
+			}
+			if status.NumSteady >= status.NumThreads {
+				close(seg.steadyStateReached)
+				steady = true
+			}
+		}
+	}
+	<-ctx.Done()
+
+	if err := w.kmod.StopKthreads(); err != nil {
+		return nil, fmt.Errorf("stopping kthreads: %v", err)
+	}
+	status, err := w.kmod.KthreadsStatus(w.numThreads)
+	if err != nil {
+		return nil, fmt.Errorf("reading kthread status: %v", err)
+	}
+	endHists, err := w.readHistSnapshot(seg.orders)
+	if err != nil {
+		return nil, err
+	}
+	// Only the histograms come from the kmod's point of view, the rest is
+	// all from the kthread status.
+	r := w.segmentResult(seg, w.counterValues(), endHists)
+	r.AllocFailures, r.PagesAllocated, r.PagesFreed, r.NUMARemoteAllocations = 0, 0, 0, 0
+	r.PagesAllocatedByNode, r.NUMARemoteAllocationsByNode = nil, nil
+	for _, s := range status.PerCPU {
+		r.AllocFailures += s.AllocFailures
+		r.PagesAllocated += s.PagesAllocated
+		r.PagesFreed += s.PagesFreed
+		r.NUMARemoteAllocations += s.NUMARemoteAllocations
+	}
+	if w.slab == nil {
+		// The kthreads only do one order.
+		o := r.PerOrder[w.allocArgs.Order]
+		o.AllocFailures = r.AllocFailures
+		o.PagesAllocated = r.PagesAllocated
+		o.NUMARemoteAllocations = r.NUMARemoteAllocations
+	}
+	return r, nil
+}
+
+func (w *Workload) setClockResult(r *Result) {
+	r.Clock = w.clock.Clock
+	r.ClockOverhead = w.clock.Overhead[w.clock.Clock]
+}
+
 // Run runs the workload. This workload runs continuously until cancellation,
-// then returns nil. You may only call this merthod once.
+// then returns nil. You may only call this merthod once. If NextOrder was
+// called, the result only covers the time since the last call.
 func (w *Workload) Run(ctx context.Context) (*Result, error) {
-	defer w.kmod.Close()
+	// Only once all the objects have been freed.
+	defer w.Close()
+	w.start = time.Now()
 
-	fmt.Printf("Running global workload setup\n")
-	w.setup(ctx)
+	if err := w.kmod.ResetHistograms(); err != nil {
+		return nil, fmt.Errorf("resetting kmod histograms: %v", err)
+	}
+	// The workers haven't started yet, so nothing else looks at it.
+	seg := w.segment.Load()
+	var err error
+	if seg.startHists, err = w.readHistSnapshot(seg.orders); err != nil {
+		return nil, err
+	}
 
-	fmt.Printf("Started %d threads, each allocating %d pages\n", runtime.NumCPU(), w.pagesPerCPU)
+	if w.timeseries == nil && w.onInterval == nil {
+		return w.run(ctx)
+	}
+	samplerCtx, cancelSampler := context.WithCancel(ctx)
+	samplerErr := make(chan error, 1)
+	go func() { samplerErr <- w.runSampler(samplerCtx) }()
+	r, err := w.run(ctx)
+	cancelSampler()
+	if sErr := <-samplerErr; sErr != nil && err == nil {
+		return nil, fmt.Errorf("timeseries sampler: %v", sErr)
+	}
+	return r, err
+}
+
+// Close destroys the private slab cache, if there is one, and closes the kmod
+// connection. Run does this when it returns, so this is only needed if the
+// workload was set up but might not get run. It can be called more than once.
+func (w *Workload) Close() {
+	w.closeOnce.Do(func() {
+		if w.slab != nil && w.slab.API == kmod.SlabCache {
+			if err := w.kmod.DestroySlabCache(); err != nil {
+				fmt.Fprintf(os.Stderr, "Couldn't destroy kmod slab cache: %v\n", err)
+			}
+		}
+		w.kmod.Close()
+	})
+}
+
+func (w *Workload) run(ctx context.Context) (*Result, error) {
+	if w.inKernel {
+		return w.runKthreads(ctx)
+	}
+
+	fmt.Printf("Started %d threads, each holding around %d allocations with pattern %v\n",
+		w.numThreads, w.segment.Load().footprint, w.pattern)
+
+	// In remote-free mode, figure out what each CPU is doing.
+	producerRings := make(map[int]*pageRing)
+	consumerRings := make(map[int]*pageRing)
+	for _, pair := range w.remoteFreePairs {
+		producerRings[pair.producer] = pair.ring
+		consumerRings[pair.consumer] = pair.ring
+	}
 
 	eg, ctx := errgroup.WithContext(ctx)
-	for cpu := 0; cpu < w.numThreads; cpu++ {
+	for _, cpu := range w.cpus {
 		eg.Go(func() error {
 			// This means that the goroutine gets the thread to
 			// itself and the thread never gets migrated between
@@ -244,7 +597,19 @@ func (w *Workload) Run(ctx context.Context) (*Result, error) {
 				return fmt.Errorf("SchedSetaffinity(%+v): %c", cpuMask, err)
 			}
 
-			err = w.runCPU(ctx, cpu)
+			if err := w.startPerf(cpu); err != nil {
+				return fmt.Errorf("opening perf counters on CPU %d: %v", cpu, err)
+			}
+			if ring, ok := consumerRings[cpu]; ok {
+				// Doesn't take the context, it stops when the
+				// producer does.
+				err = w.runConsumer(cpu, ring)
+			} else {
+				err = w.runCPU(ctx, cpu, producerRings[cpu])
+			}
+			if perfErr := w.stopPerf(cpu); err == nil && perfErr != nil {
+				err = fmt.Errorf("reading perf counters: %v", perfErr)
+			}
 			if err != nil {
 				return fmt.Errorf("workload failed on CPU %d: %v", cpu, err)
 			}
@@ -252,72 +617,216 @@ func (w *Workload) Run(ctx context.Context) (*Result, error) {
 		})
 	}
 
-	if err := eg.Wait(); err != nil {
+	err := eg.Wait()
+	close(w.workersDone)
+	if err != nil {
 		return nil, err
 	}
-	r := Result{
-		AllocFailures:         w.stats.allocFailures.Load(),
-		PagesAllocated:        w.stats.pagesAllocated.Load(),
-		PagesFreed:            w.stats.pagesFreed.Load(),
-		NUMARemoteAllocations: w.stats.numaRemoteAllocations.Load(),
-		AllocLatencies:        samples(w.stats.allocLatencies),
-		FreeLatencies:         samples(w.stats.freeLatencies),
+	seg := w.segment.Load()
+	endHists, err := w.readHistSnapshot(seg.orders)
+	if err != nil {
+		return nil, err
 	}
-	return &r, nil
+	return w.segmentResult(seg, w.counterValues(), endHists), nil
 }
 
 // AwaitSteadyState blocks until the workload can be expected to be allocating
-// and freeing pages at the same rate.
+// and freeing pages at the same rate. After NextOrder, that's with the new
+// order.
 func (w *Workload) AwaitSteadyState(ctx context.Context) {
 	select {
 	case <-ctx.Done():
-	case <-w.steadyStateReached:
+	case <-w.segment.Load().steadyStateReached:
 	}
 }
 
-func reservoirPerCPU(size int) []*sampling.Reservoir[time.Duration] {
-	r := make([]*sampling.Reservoir[time.Duration], runtime.NumCPU())
+func reservoirPerCPU(size int) []*sampling.Reservoir[LatencySample] {
+	r := make([]*sampling.Reservoir[LatencySample], runtime.NumCPU())
 	for i := 0; i < len(r); i++ {
-		r[i] = sampling.NewReservoir[time.Duration](size)
+		r[i] = sampling.NewReservoir[LatencySample](size)
 	}
 	return r
 }
 
 func New(ctx context.Context, opts *Options) (*Workload, error) {
-	file, err := os.Open("/proc/page_alloc_bench")
-	if err != nil {
-		return nil, fmt.Errorf("opening /proc/page_alloc_bench: %v", err)
+	batchSize := opts.BatchSize
+	if batchSize == 0 {
+		batchSize = kmod.MaxBatch
+	}
+	if batchSize < 0 || batchSize > kmod.MaxBatch {
+		return nil, fmt.Errorf("batch size %d out of range (max %d)", batchSize, kmod.MaxBatch)
+	}
+
+	pattern := opts.Pattern
+	if pattern == nil {
+		pattern = &PatternSpec{Name: "bounce"}
+	}
+	if opts.InKernel && pattern.Name != "bounce" {
+		return nil, fmt.Errorf("only the bounce pattern is supported for the in-kernel workload")
+	}
+	orders := opts.OrderWeights
+	if len(orders) == 0 {
+		orders = []OrderWeight{{opts.Order, 1}}
+	} else if opts.InKernel {
+		return nil, fmt.Errorf("mixed orders aren't supported for the in-kernel workload")
+	}
+	allocHist, freeHist := kmod.HistAlloc, kmod.HistFree
+	var meanObjSize float64
+	if opts.Slab != nil {
+		if len(opts.OrderWeights) != 0 {
+			return nil, fmt.Errorf("mixed orders don't apply to slab allocations")
+		}
+		if opts.Slab.API == kmod.SlabCache && opts.SlabCache == nil {
+			return nil, fmt.Errorf("no slab cache configured")
+		}
+		allocHist, freeHist = kmod.HistSlabAlloc, kmod.HistSlabFree
+		orders, meanObjSize = slabSizeClasses(opts.Slab, opts.SlabCache)
+	}
+
+	sampleInterval := opts.SampleInterval
+	if sampleInterval == 0 {
+		sampleInterval = time.Second
 	}
-	kmod := kmod.Connection{file}
 
 	nodes, err := linux.NUMANodes()
 	if err != nil {
 		return nil, fmt.Errorf("parsing NUMA nodes: %v", err)
 	}
-	cpuToNode := make(map[int]int)
+	cpuToNode := make([]int, runtime.NumCPU())
+	for cpu := range cpuToNode {
+		cpuToNode[cpu] = -1
+	}
+	numNodes := 0
 	for nid, mask := range nodes {
+		numNodes = max(numNodes, nid+1)
 		for _, cpu := range mask {
-			cpuToNode[int(cpu)] = nid
+			if int(cpu) < len(cpuToNode) {
+				cpuToNode[cpu] = nid
+			}
 		}
 	}
-	for cpu := 0; cpu < runtime.NumCPU(); cpu++ {
-		if _, ok := cpuToNode[cpu]; !ok {
+	for cpu := range cpuToNode {
+		if cpuToNode[cpu] < 0 {
 			return nil, fmt.Errorf("found no NUMA node for CPU %d (nodes: %+v)", cpu, nodes)
 		}
 	}
 
-	return &Workload{
-		kmod: &kmod,
+	cpus := opts.CPUs
+	if cpus == nil {
+		for cpu := 0; cpu < runtime.NumCPU(); cpu++ {
+			cpus = append(cpus, cpu)
+		}
+	} else if opts.InKernel {
+		return nil, fmt.Errorf("restricting the CPUs isn't supported for the in-kernel workload")
+	} else {
+		cpus = slices.Clone(cpus)
+		slices.Sort(cpus)
+		cpus = slices.Compact(cpus)
+		if len(cpus) == 0 || cpus[0] < 0 || cpus[len(cpus)-1] >= runtime.NumCPU() {
+			return nil, fmt.Errorf("CPUs %v out of range (have %d)", opts.CPUs, runtime.NumCPU())
+		}
+	}
+
+	var cpuPerfs []*cpuPerf
+	if opts.PerfCounters {
+		if opts.InKernel {
+			return nil, fmt.Errorf("perf counters aren't supported for the in-kernel workload")
+		}
+		cpuPerfs = make([]*cpuPerf, runtime.NumCPU())
+	}
+
+	var remoteFreePairs []*remoteFreePair
+	if len(opts.RemoteFree) != 0 {
+		if opts.InKernel {
+			return nil, fmt.Errorf("remote-free mode isn't supported for the in-kernel workload")
+		}
+		topo, err := linux.CPUTopologies(runtime.NumCPU())
+		if err != nil {
+			return nil, fmt.Errorf("reading CPU topology: %v", err)
+		}
+		remoteFreePairs = pairCPUs(topo, cpus, opts.RemoteFree, 4*batchSize)
+		fmt.Printf("Remote-free mode:")
+		for _, pair := range remoteFreePairs {
+			fmt.Printf(" %d->%d (%v)", pair.producer, pair.consumer, pair.class)
+		}
+		fmt.Printf("\n")
+	}
+
+	// Only talk to the kmod once the options have been checked, so the
+	// errors above don't need any cleanup.
+	file, err := os.Open("/proc/page_alloc_bench")
+	if err != nil {
+		return nil, fmt.Errorf("opening /proc/page_alloc_bench: %v", err)
+	}
+	conn := kmod.Connection{file}
+	clock, err := conn.SetClock(opts.Clock)
+	if err != nil {
+		conn.Close()
+		return nil, fmt.Errorf("setting kmod clock to %v: %v", opts.Clock, err)
+	}
+	if opts.Slab != nil && opts.Slab.API == kmod.SlabCache {
+		err := conn.CreateSlabCache(opts.SlabCache)
+		if errors.Is(err, syscall.EEXIST) {
+			// Left over from a run that crashed. If that left
+			// objects behind too this fails, reloading the kmod
+			// frees them.
+			if err = conn.DestroySlabCache(); err == nil {
+				err = conn.CreateSlabCache(opts.SlabCache)
+			}
+		}
+		if err != nil {
+			conn.Close()
+			return nil, fmt.Errorf("creating kmod slab cache: %v", err)
+		}
+	}
+
+	w := &Workload{
+		kmod: &conn,
 		stats: &stats{
-			allocLatencies: reservoirPerCPU(50000),
-			freeLatencies:  reservoirPerCPU(50000),
+			perCPU: make([]cpuCounters, runtime.NumCPU()),
+		},
+		pattern:     pattern,
+		totalMemory: opts.TotalMemory,
+		mixedOrders: len(opts.OrderWeights) != 0,
+		adopted:     make([]atomic.Pointer[segment], runtime.NumCPU()),
+		workersDone: make(chan struct{}),
+		numThreads:  len(cpus),
+		cpus:        cpus,
+		numNodes:    numNodes,
+		cpuToNode:   cpuToNode,
+		allocArgs: kmod.AllocArgs{
+			Order: orders[0].Order,
+			GFP:   opts.GFP,
+			API:   opts.API,
+			NID:   opts.NID,
+			Touch: opts.Touch,
 		},
-		pagesPerCPU:        opts.TotalMemory.Pages() / int64(runtime.NumCPU()),
-		testDataPath:       opts.TestDataPath,
-		steadyStateReached: make(chan struct{}),
-		numThreads:         runtime.NumCPU(),
-		cpuToNode:          cpuToNode,
-		order:              opts.Order,
-		measureLatencies:   opts.MeasureLatencies,
-	}, nil
+		slab:             opts.Slab,
+		allocHist:        allocHist,
+		freeHist:         freeHist,
+		measureLatencies: opts.MeasureLatencies,
+		batchSize:        batchSize,
+		inKernel:         opts.InKernel,
+		remoteFreePairs:  remoteFreePairs,
+		timeseries:       opts.Timeseries,
+		onInterval:       opts.OnInterval,
+		sampleInterval:   sampleInterval,
+		clock:            clock,
+		perf:             cpuPerfs,
+	}
+	footprint := w.pageFootprint(orders)
+	if opts.Slab != nil && opts.TotalMemory != 0 {
+		footprint = max(1, int(float64(opts.TotalMemory.Bytes())/meanObjSize)/w.numThreads)
+	}
+	w.segment.Store(w.newSegment(orders, footprint))
+	w.SetRateScale(1)
+	return w, nil
+}
+
+// SetRateScale multiplies the rate of the patterns that pace themselves
+// (steady-rate and poisson) by scale, which must be positive. It can be called
+// at any time, the workers pick it up with their next delay. The other
+// patterns run as fast as they can regardless.
+func (w *Workload) SetRateScale(scale float64) {
+	w.rateScale.Store(math.Float64bits(scale))
 }
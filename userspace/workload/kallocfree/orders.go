@@ -0,0 +1,128 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"fmt"
+	"math/rand"
+	"strconv"
+	"strings"
+
+	"github.com/google/page_alloc_bench/kmod"
+)
+
+// OrderWeight is one element of a distribution of allocation orders.
+type OrderWeight struct {
+	Order  int
+	Weight float64 // Relative to the other elements.
+}
+
+// ParseOrderWeights parses a comma-separated list of order:weight pairs, e.g.
+// "0:9,4:1" for 90% order-0 and 10% order-4 allocations.
+func ParseOrderWeights(s string) ([]OrderWeight, error) {
+	var weights []OrderWeight
+	for _, elem := range strings.Split(s, ",") {
+		orderStr, weightStr, ok := strings.Cut(elem, ":")
+		if !ok {
+			return nil, fmt.Errorf("malformed order weight %q, want order:weight", elem)
+		}
+		order, err := strconv.Atoi(orderStr)
+		if err != nil || order < 0 || order >= kmod.HistNumOrders {
+			return nil, fmt.Errorf("bad order in %q (must be 0-%d)", elem, kmod.HistNumOrders-1)
+		}
+		weight, err := strconv.ParseFloat(weightStr, 64)
+		if err != nil || weight <= 0 {
+			return nil, fmt.Errorf("bad weight in %q (must be positive)", elem)
+		}
+		for _, w := range weights {
+			if w.Order == order {
+				return nil, fmt.Errorf("order %d appears twice", order)
+			}
+		}
+		weights = append(weights, OrderWeight{order, weight})
+	}
+	return weights, nil
+}
+
+// meanPages returns the average size in pages of an allocation drawn from the
+// distribution.
+func meanPages(weights []OrderWeight) float64 {
+	var total, pages float64
+	for _, w := range weights {
+		total += w.Weight
+		pages += w.Weight * float64(int(1)<<w.Order)
+	}
+	return pages / total
+}
+
+// orderPicker draws orders from a distribution.
+type orderPicker struct {
+	weights []OrderWeight
+	total   float64
+	random  *rand.Rand
+}
+
+func newOrderPicker(cpu int, weights []OrderWeight) *orderPicker {
+	p := &orderPicker{
+		weights: weights,
+		// Seeded differently from the pattern so the two aren't
+		// correlated.
+		random: rand.New(rand.NewSource(int64(cpu) + 1<<32)),
+	}
+	for _, w := range weights {
+		p.total += w.Weight
+	}
+	return p
+}
+
+func (p *orderPicker) pick() int {
+	if len(p.weights) == 1 {
+		return p.weights[0].Order
+	}
+	x := p.random.Float64() * p.total
+	for _, w := range p.weights {
+		x -= w.Weight
+		if x < 0 {
+			return w.Order
+		}
+	}
+	return p.weights[len(p.weights)-1].Order
+}
+
+// slabSizeClasses returns the distribution of size classes for slab
+// allocations, which stands in for the orders, and the mean object size in
+// bytes. cache is only used for kmod.SlabCache.
+func slabSizeClasses(args *kmod.SlabArgs, cache *kmod.SlabCacheConfig) ([]OrderWeight, float64) {
+	if args.API == kmod.SlabCache {
+		return []OrderWeight{{kmod.SlabSizeClass(cache.Size), 1}}, float64(cache.Size)
+	}
+	var classes []OrderWeight
+	var total, bytes float64
+classes:
+	for _, s := range args.Sizes {
+		total += float64(s.Weight)
+		bytes += float64(s.Weight) * float64(s.Size)
+		class := kmod.SlabSizeClass(s.Size)
+		for i := range classes {
+			if classes[i].Order == class {
+				classes[i].Weight += float64(s.Weight)
+				continue classes
+			}
+		}
+		classes = append(classes, OrderWeight{class, float64(s.Weight)})
+	}
+	return classes, bytes / total
+}
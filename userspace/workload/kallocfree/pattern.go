@@ -0,0 +1,217 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"fmt"
+	"math/rand"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// Step is what a Pattern wants a CPU to do next.
+type Step struct {
+	// How long after the previous step this one should start. The workload
+	// keeps to the schedule on average, so if one step overruns the next
+	// ones will start sooner.
+	Delay time.Duration
+	// Positive to allocate this many pages, negative to free. The workload
+	// might do fewer than this at once.
+	Pages int
+	// Free the most recently allocated pages instead of the oldest.
+	FreeNewest bool
+}
+
+// Pattern decides how one CPU allocates and frees pages over time. "Pages" here
+// means allocations of the workload's order.
+type Pattern interface {
+	// Next is called with the number of pages currently held.
+	Next(held int) Step
+	// The CPU counts as having reached steady state once it has held at
+	// least this many pages.
+	SteadyAt() int
+}
+
+// PatternSpec describes a pattern and its parameters. The String form is
+// "name" or "name:param=value,...".
+type PatternSpec struct {
+	Name string
+	// Target alloc+free operations per second per CPU, for steady-rate and
+	// poisson.
+	Rate float64
+	// Fraction of the footprint that is long-lived, for mix.
+	LongFraction float64
+}
+
+var patternNames = []string{"bounce", "steady-rate", "sawtooth", "poisson", "mix"}
+
+// ParsePattern parses a PatternSpec, e.g. "steady-rate:rate=5000".
+func ParsePattern(s string) (*PatternSpec, error) {
+	name, params, _ := strings.Cut(s, ":")
+	spec := &PatternSpec{Name: name, Rate: 10000, LongFraction: 0.5}
+	valid := false
+	for _, n := range patternNames {
+		valid = valid || n == name
+	}
+	if !valid {
+		return nil, fmt.Errorf("unknown pattern %q (valid: %s)", name, strings.Join(patternNames, ", "))
+	}
+	if params == "" {
+		return spec, nil
+	}
+	for _, param := range strings.Split(params, ",") {
+		key, val, ok := strings.Cut(param, "=")
+		if !ok {
+			return nil, fmt.Errorf("malformed pattern parameter %q", param)
+		}
+		f, err := strconv.ParseFloat(val, 64)
+		if err != nil {
+			return nil, fmt.Errorf("parsing pattern parameter %q: %v", param, err)
+		}
+		switch {
+		case key == "rate" && (name == "steady-rate" || name == "poisson") && f > 0:
+			spec.Rate = f
+		case key == "long" && name == "mix" && f >= 0 && f <= 1:
+			spec.LongFraction = f
+		default:
+			return nil, fmt.Errorf("invalid parameter %q for pattern %q", param, name)
+		}
+	}
+	return spec, nil
+}
+
+func (s *PatternSpec) String() string {
+	switch s.Name {
+	case "steady-rate", "poisson":
+		return fmt.Sprintf("%s:rate=%v", s.Name, s.Rate)
+	case "mix":
+		return fmt.Sprintf("%s:long=%v", s.Name, s.LongFraction)
+	}
+	return s.Name
+}
+
+// newPattern creates the pattern for one CPU, where footprint is the number of
+// pages it should hold on average.
+func (s *PatternSpec) newPattern(cpu int, footprint int, batchSize int) Pattern {
+	// Give each CPU its own pattern of behaviour, but keep the pattern
+	// stable between runs (at least for the same build).
+	random := rand.New(rand.NewSource(int64(cpu)))
+	switch s.Name {
+	case "steady-rate":
+		return &steadyRatePattern{footprint: footprint, batchSize: batchSize, rate: s.Rate}
+	case "sawtooth":
+		return &sawtoothPattern{footprint: footprint}
+	case "poisson":
+		return &poissonPattern{footprint: footprint, rate: s.Rate, random: random}
+	case "mix":
+		long := int(float64(footprint) * s.LongFraction)
+		return &bouncePattern{base: long, middle: footprint - long, random: random, freeNewest: true}
+	}
+	return &bouncePattern{middle: footprint, random: random}
+}
+
+// bouncePattern allocates and frees in alternate bursts while keeping the
+// number of held pages bouncing randomly around a middle value, between 0 and
+// twice that. Above base, which is 0 except for the mix pattern.
+type bouncePattern struct {
+	base, middle int
+	target       int
+	random       *rand.Rand
+	// In the mix pattern the first base pages are long-lived, so the churn
+	// is freed newest-first to leave them alone.
+	freeNewest bool
+}
+
+func (p *bouncePattern) Next(held int) Step {
+	if held == p.target {
+		p.target = p.base + p.middle
+		if p.middle > 0 {
+			if p.random.Uint32()%2 == 0 {
+				p.target += int(p.random.Uint64() % uint64(p.middle))
+			} else {
+				p.target -= int(p.random.Uint64() % uint64(p.middle))
+			}
+		}
+	}
+	return Step{Pages: p.target - held, FreeNewest: p.freeNewest}
+}
+
+func (p *bouncePattern) SteadyAt() int { return p.base + p.middle }
+
+// steadyRatePattern fills up to the footprint, then replaces pages oldest-first
+// at a constant rate.
+type steadyRatePattern struct {
+	footprint, batchSize int
+	rate                 float64
+	allocNext            bool
+}
+
+func (p *steadyRatePattern) Next(held int) Step {
+	if held < p.footprint && !p.allocNext {
+		return Step{Pages: p.footprint - held}
+	}
+	// Alternate allocating a batch and freeing it, so that each batch is
+	// batchSize operations.
+	p.allocNext = !p.allocNext
+	delay := time.Duration(float64(p.batchSize) / p.rate * float64(time.Second))
+	if p.allocNext {
+		return Step{Delay: delay, Pages: p.batchSize}
+	}
+	return Step{Delay: delay, Pages: -p.batchSize}
+}
+
+func (p *steadyRatePattern) SteadyAt() int { return p.footprint }
+
+// sawtoothPattern fills up to twice the footprint then drains completely, over
+// and over.
+type sawtoothPattern struct {
+	footprint int
+	draining  bool
+}
+
+func (p *sawtoothPattern) Next(held int) Step {
+	if held >= 2*p.footprint {
+		p.draining = true
+	} else if held == 0 {
+		p.draining = false
+	}
+	if p.draining {
+		return Step{Pages: -held}
+	}
+	return Step{Pages: 2*p.footprint - held}
+}
+
+func (p *sawtoothPattern) SteadyAt() int { return p.footprint }
+
+// poissonPattern does single-page operations with exponentially distributed
+// gaps between them. Each is an allocation with probability
+// footprint/(footprint+held), so the number held hovers around the footprint.
+type poissonPattern struct {
+	footprint int
+	rate      float64
+	random    *rand.Rand
+}
+
+func (p *poissonPattern) Next(held int) Step {
+	delay := time.Duration(p.random.ExpFloat64() / p.rate * float64(time.Second))
+	if p.random.Float64()*float64(p.footprint+held) < float64(p.footprint) {
+		return Step{Delay: delay, Pages: 1}
+	}
+	return Step{Delay: delay, Pages: -1}
+}
+
+func (p *poissonPattern) SteadyAt() int { return p.footprint }
@@ -0,0 +1,133 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"github.com/google/page_alloc_bench/perf"
+)
+
+// PerfPhases are the phases of each CPU worker that perf counts are reported
+// for: until it first holds the pattern's steady-state amount, then the rest.
+// Consumer CPUs in remote-free mode are steady from the start. They start over
+// with each order, see Workload.NextOrder.
+var PerfPhases = []string{"rampup", "steady"}
+
+// PerfResult is what one CPU worker did over one phase.
+type PerfResult struct {
+	Counts perf.Counts // nil if the CPU didn't run a worker.
+	Ops    uint64      // Pages (or slab objects) allocated plus freed.
+}
+
+// cpuPerf holds the perf counters of one CPU worker. Only the worker touches
+// it until it's done.
+type cpuPerf struct {
+	counters     *perf.Counters
+	phase        int
+	phaseCounts  perf.Counts // At the start of the current phase.
+	phaseOps     uint64
+	phaseResults []PerfResult // The current segment's, indexed like PerfPhases.
+}
+
+func (w *Workload) cpuOps(cpu int) uint64 {
+	c := &w.stats.perCPU[cpu]
+	return c.pagesAllocated.Load() + c.pagesFreed.Load()
+}
+
+// startPerf opens the perf counters for the calling thread, which must be the
+// one pinned to the CPU. No-op unless Options.PerfCounters is set.
+func (w *Workload) startPerf(cpu int) error {
+	if w.perf == nil {
+		return nil
+	}
+	counters, err := perf.Open()
+	if err != nil {
+		return err
+	}
+	p := &cpuPerf{counters: counters}
+	if p.phaseCounts, err = counters.Read(); err != nil {
+		counters.Close()
+		return err
+	}
+	p.phaseOps = w.cpuOps(cpu)
+	w.perf[cpu] = p
+	return nil
+}
+
+// startPerfSegment records the current phase of the CPU worker's previous
+// segment, if any, and starts the first phase of the new one.
+func (w *Workload) startPerfSegment(cpu int, seg *segment) error {
+	if w.perf == nil {
+		return nil
+	}
+	p := w.perf[cpu]
+	counts, err := p.counters.Read()
+	if err != nil {
+		return err
+	}
+	ops := w.cpuOps(cpu)
+	if p.phaseResults != nil && p.phase < len(PerfPhases) {
+		p.phaseResults[p.phase] = PerfResult{Counts: counts.Sub(p.phaseCounts), Ops: ops - p.phaseOps}
+	}
+	p.phase, p.phaseResults = 0, seg.perf[cpu]
+	p.phaseCounts, p.phaseOps = counts, ops
+	return nil
+}
+
+// endPerfPhase records the phase that the CPU worker just finished and starts
+// the next one.
+func (w *Workload) endPerfPhase(cpu int) error {
+	if w.perf == nil {
+		return nil
+	}
+	p := w.perf[cpu]
+	if p.phaseResults == nil || p.phase >= len(PerfPhases) {
+		return nil
+	}
+	counts, err := p.counters.Read()
+	if err != nil {
+		return err
+	}
+	ops := w.cpuOps(cpu)
+	p.phaseResults[p.phase] = PerfResult{Counts: counts.Sub(p.phaseCounts), Ops: ops - p.phaseOps}
+	p.phase++
+	p.phaseCounts, p.phaseOps = counts, ops
+	return nil
+}
+
+// stopPerf records the last phase and closes the counters.
+func (w *Workload) stopPerf(cpu int) error {
+	if w.perf == nil || w.perf[cpu] == nil {
+		return nil
+	}
+	defer w.perf[cpu].counters.Close()
+	return w.endPerfPhase(cpu)
+}
+
+// perfResults returns the segment's results by phase name then CPU, nil unless
+// Options.PerfCounters is set.
+func (w *Workload) perfResults(seg *segment) map[string][]PerfResult {
+	if w.perf == nil {
+		return nil
+	}
+	ret := make(map[string][]PerfResult)
+	for phase, name := range PerfPhases {
+		ret[name] = make([]PerfResult, len(seg.perf))
+		for cpu, results := range seg.perf {
+			ret[name][cpu] = results[phase]
+		}
+	}
+	return ret
+}
@@ -0,0 +1,220 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"context"
+	"fmt"
+	"runtime"
+	"strings"
+	"sync/atomic"
+
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/linux"
+)
+
+// TopologyClass describes the relationship between a CPU that allocates pages
+// and the one that frees them, in remote-free mode.
+type TopologyClass int
+
+const (
+	SameCore   TopologyClass = iota // SMT siblings.
+	SameLLC                         // Different cores sharing a last-level cache.
+	SameNode                        // Different LLCs on the same node.
+	RemoteNode                      // Different NUMA nodes.
+)
+
+var topologyClassNames = []string{"same-core", "same-llc", "same-node", "remote-node"}
+
+func (c TopologyClass) String() string {
+	return topologyClassNames[c]
+}
+
+// ParseTopologyClasses parses a comma-separated list of topology class names,
+// e.g. "same-llc,remote-node".
+func ParseTopologyClasses(s string) ([]TopologyClass, error) {
+	var classes []TopologyClass
+	for _, name := range strings.Split(s, ",") {
+		found := false
+		for c, n := range topologyClassNames {
+			if name == n {
+				classes = append(classes, TopologyClass(c))
+				found = true
+			}
+		}
+		if !found {
+			return nil, fmt.Errorf("unknown topology class %q (valid: %s)",
+				name, strings.Join(topologyClassNames, ", "))
+		}
+	}
+	return classes, nil
+}
+
+func classify(a, b *linux.CPUTopology) TopologyClass {
+	switch {
+	case a.Node != b.Node:
+		return RemoteNode
+	case a.LLC != b.LLC:
+		return SameNode
+	case a.Core != b.Core:
+		return SameLLC
+	default:
+		return SameCore
+	}
+}
+
+// remoteFreePair is a CPU that allocates pages and hands them to another CPU
+// to free.
+type remoteFreePair struct {
+	producer, consumer int
+	class              TopologyClass
+	ring               *pageRing
+}
+
+// pairCPUs greedily pairs up the given CPUs, cycling through the requested
+// classes. CPUs for which no partner can be found don't appear in the result;
+// they run the normal local-free workload.
+func pairCPUs(topo []linux.CPUTopology, cpus []int, classes []TopologyClass, ringSize int) []*remoteFreePair {
+	paired := make([]bool, len(topo))
+	var pairs []*remoteFreePair
+	for _, producer := range cpus {
+		if paired[producer] {
+			continue
+		}
+		// Try the classes starting with the next one in the cycle, so
+		// that if a class can't be satisfied we still use the others.
+		for i := range classes {
+			class := classes[(len(pairs)+i)%len(classes)]
+			consumer := -1
+			for _, cpu := range cpus {
+				if cpu != producer && !paired[cpu] && classify(&topo[producer], &topo[cpu]) == class {
+					consumer = cpu
+					break
+				}
+			}
+			if consumer < 0 {
+				continue
+			}
+			paired[producer] = true
+			paired[consumer] = true
+			pairs = append(pairs, &remoteFreePair{
+				producer: producer,
+				consumer: consumer,
+				class:    class,
+				ring:     newPageRing(ringSize),
+			})
+			break
+		}
+	}
+	return pairs
+}
+
+// pageRing is a lock-free single-producer single-consumer queue of pages. The
+// indices only ever increase, they're reduced modulo the buffer size when
+// accessing it.
+type pageRing struct {
+	buf []kmod.Page
+	// Avoid the producer and consumer bouncing each other's cachelines
+	// more than necessary.
+	_      [64]byte
+	head   atomic.Uint64 // Next slot to pop, only written by the consumer.
+	_      [56]byte
+	tail   atomic.Uint64 // Next slot to push, only written by the producer.
+	_      [56]byte
+	closed atomic.Bool // Set by the producer after its last push.
+}
+
+func newPageRing(size int) *pageRing {
+	return &pageRing{buf: make([]kmod.Page, size)}
+}
+
+// push adds as many of the pages as fit and returns how many that was.
+func (r *pageRing) push(pages []kmod.Page) int {
+	head := r.head.Load()
+	tail := r.tail.Load()
+	n := min(len(pages), len(r.buf)-int(tail-head))
+	for i := 0; i < n; i++ {
+		r.buf[(tail+uint64(i))%uint64(len(r.buf))] = pages[i]
+	}
+	r.tail.Store(tail + uint64(n))
+	return n
+}
+
+// pop removes up to len(pages) pages into the given slice and returns how many
+// that was.
+func (r *pageRing) pop(pages []kmod.Page) int {
+	head := r.head.Load()
+	tail := r.tail.Load()
+	n := min(len(pages), int(tail-head))
+	for i := 0; i < n; i++ {
+		pages[i] = r.buf[(head+uint64(i))%uint64(len(r.buf))]
+	}
+	r.head.Store(head + uint64(n))
+	return n
+}
+
+// handOff pushes all the pages to the consumer, waiting for space if necessary.
+// If the context is cancelled while waiting, returns the pages that weren't
+// handed off.
+func (r *pageRing) handOff(ctx context.Context, pages []kmod.Page) []kmod.Page {
+	for len(pages) > 0 && ctx.Err() == nil {
+		n := r.push(pages)
+		pages = pages[n:]
+		if n == 0 {
+			runtime.Gosched()
+		}
+	}
+	return pages
+}
+
+// runConsumer is the per-CPU element of the workload for the CPU that frees
+// pages on behalf of another one in remote-free mode. Assumes that the calling
+// goroutine is already pinned to an appropriate CPU.
+func (w *Workload) runConsumer(cpu int, ring *pageRing) error {
+	var seg *segment
+	pages := make([]kmod.Page, w.batchSize)
+	for {
+		if s := w.segment.Load(); s != seg {
+			seg = s
+			if err := w.adopt(cpu, seg); err != nil {
+				return err
+			}
+			// Consumers have no rampup.
+			seg.markSteady(w.numThreads)
+			if err := w.endPerfPhase(cpu); err != nil {
+				return fmt.Errorf("reading perf counters: %v", err)
+			}
+		}
+		// Check this before popping, so that we can't miss pages pushed
+		// just before the close.
+		closed := ring.closed.Load()
+		n := ring.pop(pages)
+		if n == 0 {
+			if closed {
+				return nil
+			}
+			runtime.Gosched()
+			continue
+		}
+		for freed := 0; freed < n; {
+			f, err := w.freePagesOnCPU(cpu, seg, pages[freed:n])
+			freed += f
+			if err != nil {
+				return fmt.Errorf("freeing pages: %v", err)
+			}
+		}
+	}
+}
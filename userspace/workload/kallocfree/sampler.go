@@ -0,0 +1,169 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"context"
+	"fmt"
+	"runtime"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+)
+
+// Snapshot of a CPU's counters.
+type cpuCounts struct {
+	allocated, freed, failures uint64
+}
+
+func (w *Workload) readCPUCounts() ([]cpuCounts, error) {
+	counts := make([]cpuCounts, runtime.NumCPU())
+	if w.inKernel {
+		status, err := w.kmod.KthreadsStatus(w.numThreads)
+		if err != nil {
+			return nil, fmt.Errorf("reading kthread status: %v", err)
+		}
+		for cpu, s := range status.PerCPU {
+			counts[cpu] = cpuCounts{s.PagesAllocated, s.PagesFreed, s.AllocFailures}
+		}
+		return counts, nil
+	}
+	for cpu := range counts {
+		c := &w.stats.perCPU[cpu]
+		counts[cpu] = cpuCounts{c.pagesAllocated.Load(), c.pagesFreed.Load(), c.allocFailures.Load()}
+	}
+	return counts, nil
+}
+
+type sampleRates struct {
+	AllocsPerS   float64 `json:"allocs_per_s"`
+	FreesPerS    float64 `json:"frees_per_s"`
+	FailuresPerS float64 `json:"failures_per_s"`
+}
+
+func (r *sampleRates) add(prev, cur cpuCounts, seconds float64) {
+	r.AllocsPerS += float64(cur.allocated-prev.allocated) / seconds
+	r.FreesPerS += float64(cur.freed-prev.freed) / seconds
+	r.FailuresPerS += float64(cur.failures-prev.failures) / seconds
+}
+
+type samplePercentiles struct {
+	Count uint64 `json:"count"`
+	P50   uint64 `json:"p50"`
+	P99   uint64 `json:"p99"`
+	P999  uint64 `json:"p999"`
+	Max   uint64 `json:"max"` // Estimated, see hist.Histogram.Since.
+}
+
+func percentiles(h *hist.Histogram) samplePercentiles {
+	return samplePercentiles{
+		Count: h.Count,
+		P50:   h.Quantile(0.5),
+		P99:   h.Quantile(0.99),
+		P999:  h.Quantile(0.999),
+		Max:   h.Max,
+	}
+}
+
+// Interval is what the workload did during one sample interval, see
+// Options.OnInterval.
+type Interval struct {
+	Duration time.Duration
+	// Summed over all the CPUs.
+	PagesAllocated, PagesFreed, AllocFailures uint64
+	// Latencies recorded during the interval, as in Result. The maximum is
+	// estimated, see hist.Histogram.Since.
+	AllocLatencyHist *hist.Histogram
+	FreeLatencyHist  *hist.Histogram
+}
+
+// runSampler writes a "kallocfree" timeseries record every sampleInterval until
+// the context is cancelled. The record has the rates over the interval for
+// each CPU (in "cpus", indexed by CPU) and NUMA node ("nodes"), and the
+// percentiles of the latencies recorded during the interval. The same goes to
+// Options.OnInterval, summed over the CPUs.
+func (w *Workload) runSampler(ctx context.Context) error {
+	prevCounts, err := w.readCPUCounts()
+	if err != nil {
+		return err
+	}
+	prevSeg := w.segment.Load()
+	prevHists, err := w.readHistSnapshot(prevSeg.orders)
+	if err != nil {
+		return err
+	}
+	prevTime := time.Now()
+
+	ticker := time.NewTicker(w.sampleInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return nil
+		case <-ticker.C:
+		}
+
+		counts, err := w.readCPUCounts()
+		if err != nil {
+			return err
+		}
+		seg := w.segment.Load()
+		hists, err := w.readHistSnapshot(seg.orders)
+		if err != nil {
+			return err
+		}
+		if seg != prevSeg {
+			// Only count the latencies of the new order.
+			prevHists = seg.startHists
+		}
+		now := time.Now()
+		seconds := now.Sub(prevTime).Seconds()
+
+		interval := &Interval{
+			Duration:         now.Sub(prevTime),
+			AllocLatencyHist: hists.mergedSince(prevHists, w.allocHist, kmod.AllCPUs, seg.orders),
+			FreeLatencyHist:  hists.mergedSince(prevHists, w.freeHist, kmod.AllCPUs, seg.orders),
+		}
+		cpus := make([]sampleRates, len(counts))
+		nodes := make(map[int]*sampleRates)
+		for cpu := range counts {
+			interval.PagesAllocated += counts[cpu].allocated - prevCounts[cpu].allocated
+			interval.PagesFreed += counts[cpu].freed - prevCounts[cpu].freed
+			interval.AllocFailures += counts[cpu].failures - prevCounts[cpu].failures
+			cpus[cpu].add(prevCounts[cpu], counts[cpu], seconds)
+			nid := w.cpuToNode[cpu]
+			if nodes[nid] == nil {
+				nodes[nid] = &sampleRates{}
+			}
+			nodes[nid].add(prevCounts[cpu], counts[cpu], seconds)
+		}
+		err = w.timeseries.Write("kallocfree", map[string]any{
+			"interval_s":       seconds,
+			"cpus":             cpus,
+			"nodes":            nodes,
+			"alloc_latency_ns": percentiles(interval.AllocLatencyHist),
+			"free_latency_ns":  percentiles(interval.FreeLatencyHist),
+		})
+		if err != nil {
+			return err
+		}
+		if w.onInterval != nil {
+			w.onInterval(interval)
+		}
+		prevCounts, prevHists, prevSeg, prevTime = counts, hists, seg, now
+	}
+}
@@ -0,0 +1,328 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+package kallocfree
+
+import (
+	"context"
+	"fmt"
+	"runtime"
+	"slices"
+	"sync/atomic"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/sampling"
+)
+
+// segment is a stretch of the workload with one configuration, from Run (or
+// NextOrder) until the next NextOrder (or Run returning). Each CPU worker
+// adopts a new segment at the top of its loop, so the counters it had at that
+// point split the segments exactly.
+type segment struct {
+	orders         []OrderWeight
+	footprint      int                                  // Allocations per CPU.
+	allocLatencies []*sampling.Reservoir[LatencySample] // Per CPU worker.
+	freeLatencies  []*sampling.Reservoir[LatencySample] // Per CPU worker.
+	// Per CPU worker, its counters when it adopted the segment. Each one is
+	// only written by that worker, before it publishes the adoption.
+	startCounts []counterValues
+	// The kmod histograms from before any worker adopted the segment.
+	startHists         histSnapshot
+	perf               [][]PerfResult // By CPU then phase, nil without Options.PerfCounters.
+	steadyStateThreads atomic.Int32
+	steadyStateReached chan struct{} // Closed when steadyStateThreads reaches numThreads.
+}
+
+func (w *Workload) newSegment(orders []OrderWeight, footprint int) *segment {
+	s := &segment{
+		orders:             orders,
+		footprint:          footprint,
+		allocLatencies:     reservoirPerCPU(50000),
+		freeLatencies:      reservoirPerCPU(50000),
+		startCounts:        make([]counterValues, runtime.NumCPU()),
+		steadyStateReached: make(chan struct{}),
+	}
+	if w.perf != nil {
+		s.perf = make([][]PerfResult, runtime.NumCPU())
+		for cpu := range s.perf {
+			s.perf[cpu] = make([]PerfResult, len(PerfPhases))
+		}
+	}
+	return s
+}
+
+// markSteady records that one more CPU worker has reached steady state.
+func (s *segment) markSteady(numThreads int) {
+	if s.steadyStateThreads.Add(1) >= int32(numThreads) {
+		close(s.steadyStateReached)
+	}
+}
+
+// adopt switches a CPU worker over to the segment. Caller must be running on
+// the stated CPU.
+func (w *Workload) adopt(cpu int, s *segment) error {
+	s.startCounts[cpu] = w.stats.perCPU[cpu].values()
+	err := w.startPerfSegment(cpu, s)
+	w.adopted[cpu].Store(s)
+	if err != nil {
+		return fmt.Errorf("reading perf counters: %v", err)
+	}
+	return nil
+}
+
+func (w *Workload) allAdopted(s *segment) bool {
+	for _, cpu := range w.cpus {
+		if w.adopted[cpu].Load() != s {
+			return false
+		}
+	}
+	return true
+}
+
+// Plain copies of cpuCounters and orderCounters.
+type counterValues struct {
+	pagesAllocated        uint64
+	pagesFreed            uint64
+	allocFailures         uint64
+	numaRemoteAllocations uint64
+	perOrder              [kmod.HistNumOrders]orderCounterValues
+	allocsByNode          [maxNUMANodes]uint64
+}
+
+type orderCounterValues struct {
+	pagesAllocated        uint64
+	allocFailures         uint64
+	numaRemoteAllocations uint64
+}
+
+func (c *cpuCounters) values() counterValues {
+	v := counterValues{
+		pagesAllocated:        c.pagesAllocated.Load(),
+		pagesFreed:            c.pagesFreed.Load(),
+		allocFailures:         c.allocFailures.Load(),
+		numaRemoteAllocations: c.numaRemoteAllocations.Load(),
+	}
+	for i := range c.allocsByNode {
+		v.allocsByNode[i] = c.allocsByNode[i].Load()
+	}
+	for i := range c.perOrder {
+		o := &c.perOrder[i]
+		v.perOrder[i] = orderCounterValues{
+			pagesAllocated:        o.pagesAllocated.Load(),
+			allocFailures:         o.allocFailures.Load(),
+			numaRemoteAllocations: o.numaRemoteAllocations.Load(),
+		}
+	}
+	return v
+}
+
+// addDelta adds the difference between two snapshots of the same counters.
+func (v *counterValues) addDelta(cur, prev *counterValues) {
+	v.pagesAllocated += cur.pagesAllocated - prev.pagesAllocated
+	v.pagesFreed += cur.pagesFreed - prev.pagesFreed
+	v.allocFailures += cur.allocFailures - prev.allocFailures
+	v.numaRemoteAllocations += cur.numaRemoteAllocations - prev.numaRemoteAllocations
+	for i := range v.allocsByNode {
+		v.allocsByNode[i] += cur.allocsByNode[i] - prev.allocsByNode[i]
+	}
+	for i := range v.perOrder {
+		c, p := &cur.perOrder[i], &prev.perOrder[i]
+		v.perOrder[i].pagesAllocated += c.pagesAllocated - p.pagesAllocated
+		v.perOrder[i].allocFailures += c.allocFailures - p.allocFailures
+		v.perOrder[i].numaRemoteAllocations += c.numaRemoteAllocations - p.numaRemoteAllocations
+	}
+}
+
+// counterValues snapshots the counters of all the CPU workers.
+func (w *Workload) counterValues() []counterValues {
+	vals := make([]counterValues, len(w.stats.perCPU))
+	for cpu := range vals {
+		vals[cpu] = w.stats.perCPU[cpu].values()
+	}
+	return vals
+}
+
+type histKey struct {
+	kind  kmod.HistKind
+	order int // Or slab size class.
+	cpu   int
+}
+
+// histSnapshot holds the kmod histograms that a segment's results are derived
+// from, as read at one point in time.
+type histSnapshot map[histKey]*hist.Histogram
+
+// readHistSnapshot reads the alloc, free and touch histograms for all CPUs,
+// and the free histograms of the consumer CPUs in remote-free mode, for each
+// of the given orders.
+func (w *Workload) readHistSnapshot(orders []OrderWeight) (histSnapshot, error) {
+	s := make(histSnapshot)
+	read := func(kind kmod.HistKind, order, cpu int) error {
+		h, err := w.kmod.ReadHistogram(kind, order, cpu, false)
+		if err != nil {
+			return err
+		}
+		s[histKey{kind, order, cpu}] = h
+		return nil
+	}
+	for _, o := range orders {
+		if err := read(w.allocHist, o.Order, kmod.AllCPUs); err != nil {
+			return nil, fmt.Errorf("reading alloc latency histogram: %v", err)
+		}
+		if err := read(w.freeHist, o.Order, kmod.AllCPUs); err != nil {
+			return nil, fmt.Errorf("reading free latency histogram: %v", err)
+		}
+		if w.slab == nil {
+			if err := read(kmod.HistTouch, o.Order, kmod.AllCPUs); err != nil {
+				return nil, fmt.Errorf("reading touch latency histogram: %v", err)
+			}
+		}
+		for _, pair := range w.remoteFreePairs {
+			if err := read(w.freeHist, o.Order, pair.consumer); err != nil {
+				return nil, fmt.Errorf("reading free latency histogram for CPU %d: %v", pair.consumer, err)
+			}
+		}
+	}
+	return s, nil
+}
+
+// since returns what was recorded in one of the histograms after prev was
+// taken. If prev doesn't have it, that's everything ever recorded.
+func (s histSnapshot) since(prev histSnapshot, kind kmod.HistKind, order, cpu int) *hist.Histogram {
+	key := histKey{kind, order, cpu}
+	h, ok := s[key]
+	if !ok {
+		return &hist.Histogram{}
+	}
+	if p, ok := prev[key]; ok {
+		return h.Since(p)
+	}
+	return h
+}
+
+// mergedSince is like since, summed over the orders.
+func (s histSnapshot) mergedSince(prev histSnapshot, kind kmod.HistKind, cpu int, orders []OrderWeight) *hist.Histogram {
+	merged := &hist.Histogram{}
+	for _, o := range orders {
+		merged.Merge(s.since(prev, kind, o.Order, cpu))
+	}
+	return merged
+}
+
+// segmentResult builds the result of a segment, given the counters and
+// histograms at its end.
+func (w *Workload) segmentResult(s *segment, endCounts []counterValues, endHists histSnapshot) *Result {
+	var total counterValues
+	remoteByNode := make([]uint64, min(w.numNodes, maxNUMANodes))
+	for cpu := range endCounts {
+		var delta counterValues
+		delta.addDelta(&endCounts[cpu], &s.startCounts[cpu])
+		total.addDelta(&delta, &counterValues{})
+		for nid := range remoteByNode {
+			if nid != w.cpuToNode[cpu] {
+				remoteByNode[nid] += delta.allocsByNode[nid]
+			}
+		}
+	}
+	r := &Result{
+		AllocFailures:               total.allocFailures,
+		PagesAllocated:              total.pagesAllocated,
+		PagesFreed:                  total.pagesFreed,
+		NUMARemoteAllocations:       total.numaRemoteAllocations,
+		PagesAllocatedByNode:        slices.Clone(total.allocsByNode[:len(remoteByNode)]),
+		NUMARemoteAllocationsByNode: remoteByNode,
+		AllocLatencies:              samples(s.allocLatencies),
+		FreeLatencies:               samples(s.freeLatencies),
+		AllocLatencyHist:            &hist.Histogram{},
+		FreeLatencyHist:             &hist.Histogram{},
+		TouchLatencyHist:            &hist.Histogram{},
+		PerOrder:                    make(map[int]*OrderResult),
+		Perf:                        w.perfResults(s),
+	}
+	for _, o := range s.orders {
+		c := &total.perOrder[o.Order]
+		orderResult := &OrderResult{
+			AllocFailures:         c.allocFailures,
+			PagesAllocated:        c.pagesAllocated,
+			NUMARemoteAllocations: c.numaRemoteAllocations,
+			AllocLatencyHist:      endHists.since(s.startHists, w.allocHist, o.Order, kmod.AllCPUs),
+			FreeLatencyHist:       endHists.since(s.startHists, w.freeHist, o.Order, kmod.AllCPUs),
+			TouchLatencyHist:      &hist.Histogram{},
+		}
+		if w.slab == nil {
+			orderResult.TouchLatencyHist = endHists.since(s.startHists, kmod.HistTouch, o.Order, kmod.AllCPUs)
+		}
+		r.AllocLatencyHist.Merge(orderResult.AllocLatencyHist)
+		r.FreeLatencyHist.Merge(orderResult.FreeLatencyHist)
+		r.TouchLatencyHist.Merge(orderResult.TouchLatencyHist)
+		r.PerOrder[o.Order] = orderResult
+	}
+	if len(w.remoteFreePairs) != 0 {
+		r.RemoteFree = make(map[TopologyClass]*RemoteFreeResult)
+		for _, pair := range w.remoteFreePairs {
+			rf, ok := r.RemoteFree[pair.class]
+			if !ok {
+				rf = &RemoteFreeResult{FreeLatencyHist: &hist.Histogram{}}
+				r.RemoteFree[pair.class] = rf
+			}
+			rf.NumPairs++
+			rf.FreeLatencyHist.Merge(endHists.mergedSince(s.startHists, w.freeHist, pair.consumer, s.orders))
+		}
+	}
+	w.setClockResult(r)
+	return r
+}
+
+// NextOrder switches the running workload over to allocating pages of the
+// given order, and returns the result for what it did since Run (or the
+// previous NextOrder). The CPU workers free everything they hold and ramp up
+// again with the new order, so use AwaitSteadyState before measuring anything
+// against it. This saves reopening the kmod and re-pinning the workers for each
+// order. Only valid while Run is running, and not supported for the in-kernel,
+// slab or mixed-order workloads.
+func (w *Workload) NextOrder(ctx context.Context, order int) (*Result, error) {
+	if w.inKernel || w.slab != nil || w.mixedOrders {
+		return nil, fmt.Errorf("can only change the order of the userspace single-order page workload")
+	}
+	orders := []OrderWeight{{order, 1}}
+	next := w.newSegment(orders, w.pageFootprint(orders))
+	var err error
+	if next.startHists, err = w.readHistSnapshot(orders); err != nil {
+		return nil, err
+	}
+	prev := w.segment.Swap(next)
+
+	// Once they've all moved over, nothing touches prev any more.
+	ticker := time.NewTicker(10 * time.Millisecond)
+	defer ticker.Stop()
+	for !w.allAdopted(next) {
+		select {
+		case <-ctx.Done():
+			return nil, ctx.Err()
+		case <-w.workersDone:
+			return nil, fmt.Errorf("workload stopped before switching to order %d", order)
+		case <-ticker.C:
+		}
+	}
+	endHists, err := w.readHistSnapshot(prev.orders)
+	if err != nil {
+		return nil, err
+	}
+	fmt.Printf("Switched %d threads to order %d, each holding around %d allocations\n",
+		w.numThreads, order, next.footprint)
+	return w.segmentResult(prev, next.startCounts, endHists), nil
+}
@@ -0,0 +1,254 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package pagecache contains a workload that churns the page cache, to run
+// alongside the kernel allocation workload. It reads, dirties, maps and drops
+// pages of a file that it creates.
+package pagecache
+
+import (
+	"context"
+	"fmt"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"runtime"
+	"syscall"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/pab"
+	"golang.org/x/sync/errgroup"
+)
+
+type Options struct {
+	// Directory to create the file in. Whatever filesystem this is on is
+	// part of what's being tested.
+	Dir        string
+	WorkingSet pab.ByteSize // Size of the file.
+	IOSize     pab.ByteSize // For reads, writes and drops. 0 means 64KiB.
+	// Operations per second, 0 disables each one:
+	ReadRate  float64 // Buffered reads.
+	WriteRate float64 // Buffered writes, each followed by starting writeback.
+	FaultRate float64 // Faults on pages of a shared mapping of the file.
+	DropRate  float64 // fadvise(POSIX_FADV_DONTNEED) of clean pages.
+}
+
+type Result struct {
+	Reads, Writes, Faults, Drops uint64
+	// Of the faults, how many had to read the page from disk.
+	MajorFaults uint64
+	// In nanoseconds.
+	ReadLatencyHist, WriteLatencyHist, FaultLatencyHist *hist.Histogram
+	Duration                                            time.Duration
+}
+
+type Workload struct {
+	opts Options
+	file *os.File
+}
+
+// New creates and fills the file. The file's pages are dropped from the page
+// cache afterwards, so that they don't affect anything that runs before this
+// workload.
+func New(opts *Options) (*Workload, error) {
+	w := &Workload{opts: *opts}
+	if w.opts.IOSize == 0 {
+		w.opts.IOSize = 64 * pab.Kilobyte
+	}
+	if w.opts.WorkingSet < w.opts.IOSize {
+		return nil, fmt.Errorf("working set %v smaller than IO size %v", w.opts.WorkingSet, w.opts.IOSize)
+	}
+
+	path := filepath.Join(opts.Dir, fmt.Sprintf("page_alloc_bench_pagecache.%d", os.Getpid()))
+	file, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE|os.O_EXCL, 0600)
+	if err != nil {
+		return nil, fmt.Errorf("creating page cache workload file: %v", err)
+	}
+	// Unlink it straight away so it can't be left behind.
+	os.Remove(path)
+	w.file = file
+
+	fmt.Printf("Writing %v to %s for the page cache workload\n", w.opts.WorkingSet, path)
+	buf := make([]byte, w.opts.IOSize)
+	rand.Read(buf)
+	for off := int64(0); off < w.opts.WorkingSet.Bytes(); off += int64(len(buf)) {
+		if _, err := file.WriteAt(buf[:min(int64(len(buf)), w.opts.WorkingSet.Bytes()-off)], off); err != nil {
+			file.Close()
+			return nil, fmt.Errorf("filling page cache workload file: %v", err)
+		}
+	}
+	if err := file.Sync(); err != nil {
+		file.Close()
+		return nil, fmt.Errorf("syncing page cache workload file: %v", err)
+	}
+	if err := linux.Fadvise(file, 0, 0, linux.POSIX_FADV_DONTNEED); err != nil {
+		file.Close()
+		return nil, err
+	}
+	return w, nil
+}
+
+// pace calls fn rate times per second until the context is cancelled. Like
+// kallocfree it keeps to the schedule on average, unless it falls more than a
+// second behind.
+func pace(ctx context.Context, rate float64, fn func() error) error {
+	interval := time.Duration(float64(time.Second) / rate)
+	deadline := time.Now()
+	for ctx.Err() == nil {
+		if err := fn(); err != nil {
+			return err
+		}
+		deadline = deadline.Add(interval)
+		now := time.Now()
+		if deadline.Before(now.Add(-time.Second)) {
+			deadline = now
+		}
+		select {
+		case <-time.After(deadline.Sub(now)):
+		case <-ctx.Done():
+		}
+	}
+	return nil
+}
+
+// Random IO-size-aligned offset in the file.
+func (w *Workload) randomOffset(random *rand.Rand) int64 {
+	return random.Int63n(w.opts.WorkingSet.Bytes()/w.opts.IOSize.Bytes()) * w.opts.IOSize.Bytes()
+}
+
+func (w *Workload) runReads(ctx context.Context, r *Result) error {
+	random := rand.New(rand.NewSource(1))
+	buf := make([]byte, w.opts.IOSize)
+	return pace(ctx, w.opts.ReadRate, func() error {
+		start := time.Now()
+		if _, err := w.file.ReadAt(buf, w.randomOffset(random)); err != nil {
+			return fmt.Errorf("reading: %v", err)
+		}
+		r.ReadLatencyHist.Record(uint64(time.Since(start)))
+		r.Reads++
+		return nil
+	})
+}
+
+func (w *Workload) runWrites(ctx context.Context, r *Result) error {
+	random := rand.New(rand.NewSource(2))
+	buf := make([]byte, w.opts.IOSize)
+	random.Read(buf)
+	return pace(ctx, w.opts.WriteRate, func() error {
+		off := w.randomOffset(random)
+		start := time.Now()
+		if _, err := w.file.WriteAt(buf, off); err != nil {
+			return fmt.Errorf("writing: %v", err)
+		}
+		r.WriteLatencyHist.Record(uint64(time.Since(start)))
+		r.Writes++
+		// Don't wait for the dirty pages to age, keep them moving
+		// through writeback.
+		return linux.SyncFileRange(w.file, off, int64(len(buf)), linux.SYNC_FILE_RANGE_WRITE)
+	})
+}
+
+func (w *Workload) runFaults(ctx context.Context, r *Result) error {
+	// Major faults are counted per thread.
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	data, err := syscall.Mmap(int(w.file.Fd()), 0, int(w.opts.WorkingSet.Bytes()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return fmt.Errorf("mapping file: %v", err)
+	}
+	defer syscall.Munmap(data)
+	startMajor, err := linux.ThreadMajorFaults()
+	if err != nil {
+		return err
+	}
+
+	random := rand.New(rand.NewSource(3))
+	pageSize := os.Getpagesize()
+	numPages := len(data) / pageSize
+	var sink byte
+	err = pace(ctx, w.opts.FaultRate, func() error {
+		page := data[random.Intn(numPages)*pageSize:][:pageSize]
+		start := time.Now()
+		sink += page[0]
+		r.FaultLatencyHist.Record(uint64(time.Since(start)))
+		r.Faults++
+		// Unmap it again so that the next access to it faults too.
+		return syscall.Madvise(page, syscall.MADV_DONTNEED)
+	})
+	if err != nil {
+		return err
+	}
+	endMajor, err := linux.ThreadMajorFaults()
+	if err != nil {
+		return err
+	}
+	r.MajorFaults = uint64(endMajor - startMajor)
+	return nil
+}
+
+func (w *Workload) runDrops(ctx context.Context, r *Result) error {
+	random := rand.New(rand.NewSource(4))
+	return pace(ctx, w.opts.DropRate, func() error {
+		r.Drops++
+		return linux.Fadvise(w.file, w.randomOffset(random), w.opts.IOSize.Bytes(), linux.POSIX_FADV_DONTNEED)
+	})
+}
+
+// Run runs the workload until the context is cancelled. You may only call this
+// method once.
+func (w *Workload) Run(ctx context.Context) (*Result, error) {
+	defer w.file.Close()
+
+	// Each activity fills in its own part of the result.
+	var reads, writes, faults, drops Result
+	for _, r := range []*Result{&reads, &writes, &faults} {
+		r.ReadLatencyHist = &hist.Histogram{}
+		r.WriteLatencyHist = &hist.Histogram{}
+		r.FaultLatencyHist = &hist.Histogram{}
+	}
+	start := time.Now()
+	eg, ctx := errgroup.WithContext(ctx)
+	for _, a := range []struct {
+		rate float64
+		fn   func(context.Context, *Result) error
+		r    *Result
+	}{
+		{w.opts.ReadRate, w.runReads, &reads},
+		{w.opts.WriteRate, w.runWrites, &writes},
+		{w.opts.FaultRate, w.runFaults, &faults},
+		{w.opts.DropRate, w.runDrops, &drops},
+	} {
+		if a.rate > 0 {
+			eg.Go(func() error { return a.fn(ctx, a.r) })
+		}
+	}
+	if err := eg.Wait(); err != nil {
+		return nil, fmt.Errorf("page cache workload: %v", err)
+	}
+	return &Result{
+		Reads:            reads.Reads,
+		Writes:           writes.Writes,
+		Faults:           faults.Faults,
+		Drops:            drops.Drops,
+		MajorFaults:      faults.MajorFaults,
+		ReadLatencyHist:  reads.ReadLatencyHist,
+		WriteLatencyHist: writes.WriteLatencyHist,
+		FaultLatencyHist: faults.FaultLatencyHist,
+		Duration:         time.Since(start),
+	}, nil
+}
@@ -0,0 +1,350 @@
+// Copyright 2024 Google LLC
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; If not, see <http://www.gnu.org/licenses/>.
+
+// Package replay is a workload that replays a recorded trace of page
+// allocator activity (see the trace package) through the kernel module.
+package replay
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+
+	"github.com/google/page_alloc_bench/hist"
+	"github.com/google/page_alloc_bench/kmod"
+	"github.com/google/page_alloc_bench/linux"
+	"github.com/google/page_alloc_bench/trace"
+	"golang.org/x/sync/errgroup"
+)
+
+type Options struct {
+	TracePath string
+	// Playback speed relative to the trace, 0 means 1.
+	Speed float64
+	// Consecutive operations of the same kind on the same CPU that are due
+	// within this long of each other are issued as one batched ioctl. So
+	// ops can be issued up to this much early. 0 disables batching.
+	BatchWindow time.Duration
+}
+
+type Result struct {
+	Allocs, Frees  uint64
+	AllocFailures  uint64
+	UnmatchedFrees uint64 // Frees of pages allocated before the trace started.
+	// How late operations were issued compared to the trace, in
+	// nanoseconds.
+	DriftHist *hist.Histogram
+	// From the kmod, summed over all orders.
+	AllocLatencyHist, FreeLatencyHist *hist.Histogram
+	Duration                          time.Duration
+}
+
+// Maps the PFNs in the trace to the pages we allocated in their place. Sharded
+// since frees often happen on a different CPU from the allocation.
+type pageTable struct {
+	shards [64]struct {
+		sync.Mutex
+		pages map[uint64]kmod.Page
+		_     [48]byte
+	}
+}
+
+func newPageTable() *pageTable {
+	var t pageTable
+	for i := range t.shards {
+		t.shards[i].pages = make(map[uint64]kmod.Page)
+	}
+	return &t
+}
+
+// put returns the page previously stored for the PFN, if any (meaning the
+// trace lost its free).
+func (t *pageTable) put(pfn uint64, page kmod.Page) (kmod.Page, bool) {
+	s := &t.shards[pfn%uint64(len(t.shards))]
+	s.Lock()
+	defer s.Unlock()
+	old, ok := s.pages[pfn]
+	s.pages[pfn] = page
+	return old, ok
+}
+
+func (t *pageTable) take(pfn uint64) (kmod.Page, bool) {
+	s := &t.shards[pfn%uint64(len(t.shards))]
+	s.Lock()
+	defer s.Unlock()
+	page, ok := s.pages[pfn]
+	delete(s.pages, pfn)
+	return page, ok
+}
+
+func (t *pageTable) takeAll() []kmod.Page {
+	var ret []kmod.Page
+	for i := range t.shards {
+		for pfn, page := range t.shards[i].pages {
+			ret = append(ret, page)
+			delete(t.shards[i].pages, pfn)
+		}
+	}
+	return ret
+}
+
+type Workload struct {
+	kmod      *kmod.Connection
+	opts      Options
+	numCPUs   int
+	pages     *pageTable
+	start     time.Time
+	drift     []hist.Histogram // Per CPU.
+	allocs    atomic.Uint64
+	frees     atomic.Uint64
+	failures  atomic.Uint64
+	unmatched atomic.Uint64
+}
+
+func New(opts *Options) (*Workload, error) {
+	file, err := os.Open("/proc/page_alloc_bench")
+	if err != nil {
+		return nil, fmt.Errorf("opening /proc/page_alloc_bench: %v", err)
+	}
+	w := &Workload{
+		kmod:    &kmod.Connection{file},
+		opts:    *opts,
+		numCPUs: runtime.NumCPU(),
+		pages:   newPageTable(),
+	}
+	if w.opts.Speed == 0 {
+		w.opts.Speed = 1
+	}
+	w.drift = make([]hist.Histogram, w.numCPUs)
+	return w, nil
+}
+
+func (w *Workload) scheduled(r *trace.Record) time.Time {
+	return w.start.Add(time.Duration(float64(r.Time) / w.opts.Speed))
+}
+
+func sameKind(a, b *trace.Record) bool {
+	return a.Op == b.Op && (a.Op == trace.OpFree || (a.Order == b.Order && a.GFP == b.GFP))
+}
+
+func (w *Workload) alloc(batch []*trace.Record) error {
+	args := &kmod.AllocArgs{
+		Order: batch[0].Order,
+		GFP:   kmod.GFP{Preset: batch[0].GFP},
+		API:   kmod.APIAllocPages,
+		NID:   -1,
+	}
+	pages, err := w.kmod.AllocPages(args, len(batch))
+	if err != nil && !errors.Is(err, syscall.ENOMEM) {
+		return fmt.Errorf("allocating pages: %v", err)
+	}
+	w.allocs.Add(uint64(len(pages)))
+	w.failures.Add(uint64(len(batch) - len(pages)))
+	var lost []kmod.Page
+	for i, page := range pages {
+		if old, ok := w.pages.put(batch[i].PFN, page); ok {
+			lost = append(lost, old)
+		}
+	}
+	return w.free(lost)
+}
+
+func (w *Workload) free(pages []kmod.Page) error {
+	for len(pages) > 0 {
+		n := min(len(pages), kmod.MaxBatch)
+		if _, err := w.kmod.FreePages(pages[:n]); err != nil {
+			return fmt.Errorf("freeing pages: %v", err)
+		}
+		pages = pages[n:]
+	}
+	return nil
+}
+
+// Replays the records for one CPU, which must already be pinned to it.
+func (w *Workload) runCPU(ctx context.Context, cpu int, records <-chan *trace.Record) error {
+	var pending *trace.Record
+	batch := make([]*trace.Record, 0, kmod.MaxBatch)
+	var pages []kmod.Page
+	for {
+		rec := pending
+		pending = nil
+		if rec == nil {
+			var ok bool
+			select {
+			case rec, ok = <-records:
+				if !ok {
+					return nil
+				}
+			case <-ctx.Done():
+				return nil
+			}
+		}
+
+		due := w.scheduled(rec)
+		if wait := time.Until(due); wait > 0 {
+			select {
+			case <-time.After(wait):
+			case <-ctx.Done():
+				return nil
+			}
+		}
+
+		batch = append(batch[:0], rec)
+	gather:
+		for len(batch) < kmod.MaxBatch {
+			select {
+			case next, ok := <-records:
+				if !ok {
+					break gather
+				}
+				if !sameKind(rec, next) || w.scheduled(next).Sub(due) > w.opts.BatchWindow {
+					pending = next
+					break gather
+				}
+				batch = append(batch, next)
+			default:
+				break gather
+			}
+		}
+
+		now := time.Now()
+		for _, r := range batch {
+			w.drift[cpu].Record(uint64(max(0, now.Sub(w.scheduled(r)))))
+		}
+
+		if rec.Op == trace.OpAlloc {
+			if err := w.alloc(batch); err != nil {
+				return err
+			}
+			continue
+		}
+		pages = pages[:0]
+		for _, r := range batch {
+			if page, ok := w.pages.take(r.PFN); ok {
+				pages = append(pages, page)
+			} else {
+				w.unmatched.Add(1)
+			}
+		}
+		if err := w.free(pages); err != nil {
+			return err
+		}
+		w.frees.Add(uint64(len(pages)))
+	}
+}
+
+// Run replays the whole trace, or until the context is cancelled. Trace CPUs
+// beyond the ones this system has wrap around. You may only call this method
+// once.
+func (w *Workload) Run(ctx context.Context) (*Result, error) {
+	defer w.kmod.Close()
+
+	file, err := os.Open(w.opts.TracePath)
+	if err != nil {
+		return nil, fmt.Errorf("opening trace: %v", err)
+	}
+	defer file.Close()
+	reader, err := trace.NewReader(file)
+	if err != nil {
+		return nil, err
+	}
+	if err := w.kmod.ResetHistograms(); err != nil {
+		return nil, fmt.Errorf("resetting kmod histograms: %v", err)
+	}
+
+	chans := make([]chan *trace.Record, w.numCPUs)
+	for i := range chans {
+		chans[i] = make(chan *trace.Record, 4096)
+	}
+	w.start = time.Now()
+	eg, ctx := errgroup.WithContext(ctx)
+	eg.Go(func() error {
+		defer func() {
+			for _, c := range chans {
+				close(c)
+			}
+		}()
+		for ctx.Err() == nil {
+			rec, err := reader.Next()
+			if err == io.EOF {
+				return nil
+			}
+			if err != nil {
+				return fmt.Errorf("reading trace: %v", err)
+			}
+			select {
+			case chans[rec.CPU%w.numCPUs] <- rec:
+			case <-ctx.Done():
+			}
+		}
+		return nil
+	})
+	for cpu := 0; cpu < w.numCPUs; cpu++ {
+		eg.Go(func() error {
+			runtime.LockOSThread()
+			cpuMask := linux.NewCPUMask(cpu)
+			if err := linux.SchedSetaffinity(linux.PIDCallingThread, cpuMask); err != nil {
+				return fmt.Errorf("SchedSetaffinity(%+v): %v", cpuMask, err)
+			}
+			if err := w.runCPU(ctx, cpu, chans[cpu]); err != nil {
+				return fmt.Errorf("replay failed on CPU %d: %v", cpu, err)
+			}
+			return nil
+		})
+	}
+	err = eg.Wait()
+	duration := time.Since(w.start)
+	// Pages that were still allocated at the end of the trace.
+	if freeErr := w.free(w.pages.takeAll()); err == nil {
+		err = freeErr
+	}
+	if err != nil {
+		return nil, err
+	}
+
+	r := &Result{
+		Allocs:           w.allocs.Load(),
+		Frees:            w.frees.Load(),
+		AllocFailures:    w.failures.Load(),
+		UnmatchedFrees:   w.unmatched.Load(),
+		DriftHist:        &hist.Histogram{},
+		AllocLatencyHist: &hist.Histogram{},
+		FreeLatencyHist:  &hist.Histogram{},
+		Duration:         duration,
+	}
+	for i := range w.drift {
+		r.DriftHist.Merge(&w.drift[i])
+	}
+	for order := 0; order < kmod.HistNumOrders; order++ {
+		h, err := w.kmod.ReadHistogram(kmod.HistAlloc, order, kmod.AllCPUs, false)
+		if err != nil {
+			return nil, fmt.Errorf("reading alloc latency histogram: %v", err)
+		}
+		r.AllocLatencyHist.Merge(h)
+		h, err = w.kmod.ReadHistogram(kmod.HistFree, order, kmod.AllCPUs, false)
+		if err != nil {
+			return nil, fmt.Errorf("reading free latency histogram: %v", err)
+		}
+		r.FreeLatencyHist.Merge(h)
+	}
+	return r, nil
+}